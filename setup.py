@@ -32,7 +32,8 @@ from setuptools.extension import Extension
 EXTENSIONS = [
     Extension(
         "trafaretrecord.memoryslots",
-        ["trafaretrecord/memoryslots.c"]
+        ["trafaretrecord/memoryslots.c"],
+        depends=["trafaretrecord/memoryslots_api.h"],
     ),
 ]
 
@@ -62,10 +63,12 @@ setup(
     author_email='vovanbo@gmail.com',
     url='https://github.com/vovanbo/trafaretrecord',
     packages=['trafaretrecord'],
+    package_data={'trafaretrecord': ['memoryslots_api.h']},
     include_package_data=True,
     install_requires=REQUIREMENTS,
     license="MIT License",
     zip_safe=False,
+    python_requires='>=3.9',
     cmdclass={'build_ext': build_ext},
     ext_modules=EXTENSIONS,
     download_url='https://github.com/vovanbo/trafaretrecord',
@@ -78,7 +81,11 @@ setup(
         'License :: OSI Approved :: MIT License',
         'Natural Language :: English',
         'Programming Language :: Python :: 3',
-        'Programming Language :: Python :: 3.6',
+        'Programming Language :: Python :: 3.9',
+        'Programming Language :: Python :: 3.10',
+        'Programming Language :: Python :: 3.11',
+        'Programming Language :: Python :: 3.12',
+        'Programming Language :: Python :: 3.13',
         'Operating System :: OS Independent',
         'Topic :: Software Development :: Libraries :: Python Modules'
     ],
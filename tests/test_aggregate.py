@@ -0,0 +1,158 @@
+import os
+import random
+import warnings
+from collections import defaultdict
+
+import pytest
+
+from trafaretrecord import TrafaretRecord, trafaretrecord
+from trafaretrecord.aggregate import group_by
+from trafaretrecord.memoryslots import _extract_column, _group_aggregate
+from trafaretrecord.shared import SharedRecordArray
+
+
+class Trade(TrafaretRecord):
+    side: str
+    venue: int
+    size: int
+    price: float
+    filled: bool
+
+
+class Fill(TrafaretRecord):
+    venue: int
+    size: int
+    price: float
+
+
+def _trades(n):
+    rnd = random.Random(5)
+    return [Trade(rnd.choice('BS'), rnd.randrange(4), rnd.randrange(100),
+                  rnd.random(), rnd.random() < 0.5)
+            for _ in range(n)]
+
+
+def _check(result, records, key):
+    groups = defaultdict(list)
+    for record in records:
+        groups[key(record)].append(record)
+    assert list(result) == list(groups)
+    for group, members in groups.items():
+        totals = result[group]
+        assert totals.volume == sum(r.size for r in members)
+        assert totals.count == len(members)
+        assert totals.low == min(r.price for r in members)
+        assert totals.high == max(r.size for r in members)
+        assert totals.avg == pytest.approx(
+            sum(r.price for r in members) / len(members))
+
+
+AGGREGATES = dict(volume=('sum', 'size'), count='count',
+                  low=('min', 'price'), high=('max', 'size'),
+                  avg=('mean', 'price'))
+
+
+@pytest.mark.parametrize('threads', [1, 4])
+def test_group_by_records(threads):
+    trades = _trades(200000)
+    result = group_by(trades, ('side', 'venue'), threads=threads,
+                      **AGGREGATES)
+    _check(result, trades, lambda r: (r.side, r.venue))
+
+    filled = group_by(trades, 'filled', any=('max', 'filled'))
+    assert filled[True].any is True and filled[False].any is False
+
+
+def test_group_by_shared_array():
+    rnd = random.Random(1)
+    fills = [Fill(rnd.randrange(3), rnd.randrange(50), rnd.random())
+             for _ in range(1000)]
+    with SharedRecordArray.from_records(Fill, fills) as array:
+        try:
+            result = group_by(array, 'venue', **AGGREGATES)
+        finally:
+            array.unlink()
+    _check(result, fills, lambda r: r.venue)
+
+
+def test_group_by_untyped_and_empty():
+    Point = trafaretrecord('Point', 'x y')
+    result = group_by([Point('a', 1), Point('a', 2.5), Point('b', 3)], 'x',
+                      total=('sum', 'y'))
+    assert result == {'a': (3.5,), 'b': (3.0,)}
+    assert group_by([], 'x', n='count') == {}
+
+
+def test_group_by_bool_keys_and_reuse():
+    Point = trafaretrecord('Point', 'x y')
+    points = [Point(True, 1), Point(False, 2), Point(True, 3)]
+    first = group_by(points, 'x', total=('sum', 'y'))
+    assert first == {True: (4,), False: (2,)}
+    assert all(type(key) is bool for key in first)
+    again = group_by(points, 'x', total=('sum', 'y'))
+    assert type(again[True]) is type(first[True])
+
+
+def _thread_count():
+    return len(os.listdir('/proc/self/task'))
+
+
+@pytest.mark.skipif(not os.path.isdir('/proc/self/task'),
+                    reason='needs /proc to count threads')
+def test_group_by_keeps_its_threads():
+    trades = _trades(200000)
+    group_by(trades, 'venue', threads=4, n='count')
+    threads = _thread_count()
+    for _ in range(3):
+        group_by(trades, 'venue', threads=4, n='count')
+    assert _thread_count() == threads
+
+
+
+@pytest.mark.skipif(not hasattr(os, 'fork'), reason='needs fork')
+def test_group_by_after_fork():
+    trades = _trades(200000)
+    expected = group_by(trades, 'venue', threads=4, n='count')
+    with warnings.catch_warnings():
+        # the idle workers of the parent are still running
+        warnings.simplefilter('ignore', DeprecationWarning)
+        pid = os.fork()
+    if pid == 0:
+        try:
+            result = group_by(trades, 'venue', threads=4, n='count')
+            os._exit(0 if result == expected else 1)
+        finally:
+            os._exit(2)
+    assert os.waitpid(pid, 0)[1] == 0
+
+
+def test_group_by_errors():
+    trades = _trades(10)
+    with pytest.raises(ValueError):
+        group_by(trades, 'side', bad=('median', 'size'))
+    with pytest.raises(ValueError):
+        group_by(trades, 'side', bad='sum')
+    with pytest.raises(TypeError):
+        group_by(trades, 'venue', bad=('sum', 'side'))
+
+
+def test_extract_column_of_changing_records():
+    Point = trafaretrecord('Point', 'x y')
+    points = [Point(None, 0), Point(3, 0)]
+
+    class Evil(object):
+        def __index__(self):
+            del points[:]
+            return 5
+
+    points[0].x = Evil()
+    column = memoryview(_extract_column(points, 0, 'q')).cast('q')
+    assert column.tolist() == [5, 3]
+
+
+def test_sum_overflow():
+    big = memoryview(bytearray(16)).cast('q')
+    big[0] = big[1] = 2 ** 62
+    keys = memoryview(bytearray(16)).cast('q')
+    with pytest.raises(OverflowError):
+        _group_aggregate([keys], [('sum', big)], 1)
@@ -0,0 +1,142 @@
+import gc
+
+import pytest
+
+from trafaretrecord import TrafaretRecord, trafaretrecord
+from trafaretrecord.arrow import ArrowRecords, arrow_formats, from_arrow
+from trafaretrecord.memoryslots import _arrow_column
+from trafaretrecord.shared import SharedRecordArray
+
+
+class Trade(TrafaretRecord):
+    id: int
+    symbol: str
+    price: float
+    buy: bool
+    tag: bytes
+
+
+class Quote(TrafaretRecord):
+    price: float
+    size: int
+    active: bool
+
+
+TRADES = [
+    Trade(1, 'ACME', 10.5, True, b'a'),
+    Trade(-2 ** 63, 'é😀', -0.0, False, b''),
+    Trade(3, None, None, None, None),
+    Trade(2 ** 63 - 1, '', 1e300, True, b'\x00\xff'),
+]
+
+
+def test_formats():
+    assert arrow_formats(Trade) == ('l', 'u', 'g', 'b', 'z')
+    with pytest.raises(TypeError):
+        arrow_formats(trafaretrecord('Point', 'x y'))
+    with pytest.raises(TypeError):
+        Trade.to_arrow([trafaretrecord('Point', 'x y')(1, 2)])
+
+
+def test_column_buffers():
+    assert _arrow_column([1, None, 3], -1, 'l') == (
+        'l', 1, (bytearray(b'\x05'),
+                 bytearray((1).to_bytes(8, 'little') + bytes(8) +
+                           (3).to_bytes(8, 'little'))))
+    assert _arrow_column([True, False, True], -1, 'b') == \
+        ('b', 0, (None, bytearray(b'\x05')))
+    assert _arrow_column(['ab', 'c'], -1, 'u') == (
+        'u', 0, (None, bytearray(b'\x00\x00\x00\x00\x02\x00\x00\x00'
+                                 b'\x03\x00\x00\x00'), bytearray(b'abc')))
+    with pytest.raises(TypeError):
+        _arrow_column([b'x'], -1, 'u')
+    with pytest.raises(OverflowError):
+        _arrow_column([2 ** 64], -1, 'l')
+
+
+def test_column_of_changing_records():
+    Point = trafaretrecord('Point', 'x y')
+    points = [Point(None, 0), Point(None, 0), Point(7, 0)]
+
+    class Evil(object):
+        def __index__(self):
+            for point in points:
+                point.x = 'junk'
+            del points[:]
+            return 5
+
+    points[0].x = Evil()
+    assert _arrow_column(points, 0, 'l') == (
+        'l', 1, (bytearray(b'\x05'),
+                 bytearray((5).to_bytes(8, 'little') + bytes(8) +
+                           (7).to_bytes(8, 'little'))))
+
+
+def test_round_trip():
+    exported = Trade.to_arrow(TRADES)
+    assert len(exported) == 4
+    assert Trade.from_arrow(exported) == TRADES
+    assert Trade.from_arrow(exported.__arrow_c_array__()) == TRADES
+    assert Trade.from_arrow(Trade.to_arrow(iter(TRADES))) == TRADES
+    assert Trade.from_arrow(Trade.to_arrow([])) == []
+
+
+def test_import_checks_columns():
+    Other = trafaretrecord('Other', 'id symbol')
+    Other._field_types = {'id': int, 'symbol': str}
+    exported = Other.to_arrow([Other(1, 'x')])
+    with pytest.raises(TypeError):
+        Trade.from_arrow(exported)  # columns missing
+    Short = trafaretrecord('Short', 'id')
+    with pytest.raises(TypeError):
+        from_arrow(Short, exported)  # column without field
+
+
+def test_shared_array_is_not_copied():
+    records = [Quote(1.5, 10, True), Quote(2.5, 20, False)]
+    array = SharedRecordArray.from_records(Quote, records)
+    try:
+        exported = ArrowRecords(Quote, array)
+        assert exported._columns[0][1][1] is array.column('price')
+        assert exported._columns[1][1][1] is array.column('size')
+        assert Quote.from_arrow(exported) == records
+        del exported
+        gc.collect()
+    finally:
+        array.close()
+        array.unlink()
+
+
+def test_pyarrow():
+    pa = pytest.importorskip('pyarrow')
+    batch = pa.record_batch(Trade.to_arrow(TRADES))
+    assert batch.schema.types == [pa.int64(), pa.string(), pa.float64(),
+                                  pa.bool_(), pa.binary()]
+    assert batch.to_pylist() == [r._asdict() for r in TRADES]
+    assert Trade.from_arrow(batch) == TRADES
+
+    table = pa.concat_tables([pa.table(Trade.to_arrow(TRADES))] * 2)
+    assert Trade.from_arrow(table) == TRADES * 2
+    assert Trade.from_arrow(table.slice(3, 2)) == TRADES[3:] + TRADES[:1]
+
+    table = pa.table({
+        'price': pa.array([1.5, None], pa.float32()),
+        'size': pa.array([1, 2], pa.uint8()),
+        'active': [True, False],
+    })
+    assert Quote.from_arrow(table) == [Quote(1.5, 1, True),
+                                       Quote(None, 2, False)]
+
+
+def test_pyarrow_zero_copy():
+    pa = pytest.importorskip('pyarrow')
+    array = SharedRecordArray.from_records(Quote, [Quote(1.5, 10, True)])
+    try:
+        batch = pa.record_batch(Quote.to_arrow(array))
+        array.column('size')[0] = 42
+        assert batch.column(1).to_pylist() == [42]
+        del batch
+        gc.collect()
+    finally:
+        array.close()
+        array.unlink()
@@ -0,0 +1,125 @@
+"""The C API capsule, called through ctypes as an extension would."""
+
+import ctypes
+import os
+import sys
+
+import pytest
+
+import trafaretrecord
+from trafaretrecord import TrafaretRecord, computed, trafaretrecord as factory
+
+API = ctypes.pythonapi
+API.PyCapsule_GetPointer.restype = ctypes.c_void_p
+API.PyCapsule_GetPointer.argtypes = [ctypes.py_object, ctypes.c_char_p]
+API.Py_IncRef.argtypes = [ctypes.py_object]
+
+
+class CAPI(ctypes.Structure):
+    _fields_ = [
+        ('version', ctypes.c_int),
+        ('MemorySlotsType', ctypes.c_void_p),
+        ('New', ctypes.c_void_p),
+        ('FromArray', ctypes.PYFUNCTYPE(
+            ctypes.py_object, ctypes.py_object,
+            ctypes.POINTER(ctypes.py_object), ctypes.c_ssize_t)),
+        ('GetItem', ctypes.PYFUNCTYPE(
+            ctypes.c_void_p, ctypes.py_object, ctypes.c_ssize_t)),
+        ('SetItem', ctypes.PYFUNCTYPE(
+            ctypes.c_int, ctypes.py_object, ctypes.c_ssize_t,
+            ctypes.py_object)),
+        ('FieldCount', ctypes.PYFUNCTYPE(ctypes.c_ssize_t, ctypes.py_object)),
+        ('FieldIndex', ctypes.PYFUNCTYPE(
+            ctypes.c_ssize_t, ctypes.py_object, ctypes.c_char_p)),
+    ]
+
+
+@pytest.fixture(scope='module')
+def capi():
+    address = API.PyCapsule_GetPointer(trafaretrecord._C_API,
+                                       b'trafaretrecord._C_API')
+    return CAPI.from_address(address)
+
+
+class Trade(TrafaretRecord, track_dirty=True):
+    symbol: str
+    price: float
+    size: int = 1
+
+    @computed('price', 'size')
+    def value(self):
+        return self.price * self.size
+
+
+def from_array(capi, type, *values):
+    items = (ctypes.py_object * len(values))(*values)
+    for value in values:
+        API.Py_IncRef(value)  # FromArray steals the references
+    return capi.FromArray(type, items, len(values))
+
+
+def get_item(capi, record, i):
+    # GetItem returns a borrowed reference, that cast() takes a new one to
+    return ctypes.cast(capi.GetItem(record, i), ctypes.py_object).value
+
+
+def test_header_is_shipped(capi):
+    header = os.path.join(trafaretrecord.get_include(), 'memoryslots_api.h')
+    with open(header) as f:
+        source = f.read()
+    assert '#define PyMemorySlots_API_VERSION %d' % capi.version in source
+    assert capi.version >= 1
+    assert capi.MemorySlotsType == id(trafaretrecord.memoryslots)
+
+
+def test_fields(capi):
+    assert capi.FieldCount(Trade) == 3
+    assert capi.FieldIndex(Trade, b'size') == 2
+    assert capi.FieldCount(factory('Empty', '')) == 0
+    with pytest.raises(ValueError):
+        capi.FieldIndex(Trade, b'value')
+    with pytest.raises(TypeError):
+        capi.FieldCount(int)
+
+
+def test_from_array(capi):
+    symbol = 'ACME-%d' % id(capi)
+    trade = from_array(capi, Trade, symbol, 2.5, 4)
+    assert type(trade) is Trade
+    assert trade == Trade(symbol, 2.5, 4)
+    assert trade.value == 10.0
+    assert trade._dirty_fields() == ()
+    assert get_item(capi, trade, 0) is symbol
+
+
+def test_from_array_checks(capi):
+    value = object()
+    refs = sys.getrefcount(value)
+    with pytest.raises(ValueError, match='has 3 fields, not 2'):
+        from_array(capi, Trade, value, 2.5)
+    with pytest.raises(TypeError):
+        from_array(capi, tuple, value)
+    with pytest.raises(TypeError):
+        from_array(capi, trafaretrecord.itemgetset, value)
+    assert sys.getrefcount(value) == refs   # stolen, also on failure
+    new = ctypes.PYFUNCTYPE(ctypes.py_object, ctypes.py_object,
+                            ctypes.c_ssize_t)(capi.New)
+    with pytest.raises(ValueError):
+        new(Trade, 1)
+
+
+def test_get_set_item(capi):
+    trade = Trade('ACME', 2.0, 3)
+    assert trade.value == 6.0
+    assert get_item(capi, trade, 1) == 2.0
+    assert capi.SetItem(trade, 2, 5) == 0
+    assert trade.size == 5
+    assert trade.value == 10.0
+    assert trade._dirty_fields() == (2,)
+    with pytest.raises(IndexError):
+        capi.GetItem(trade, 3)
+    with pytest.raises(IndexError):
+        capi.SetItem(trade, -1, 0)
+    with pytest.raises(TypeError):
+        capi.GetItem((1, 2), 0)
+
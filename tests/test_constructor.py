@@ -210,6 +210,57 @@ def test_copy(copier):
     q = copier(p)
     assert p == q
     assert p._fields == q._fields
+    assert q is not p
+    assert type(q) is SomeClass
+    q.x = 11
+    assert p.x == 10
+
+
+def test_deepcopy_nested():
+    inner = SomeClass(x=[1, 2], y={'a': [3]}, z=(4, [5]))
+    outer = SomeClass(x=inner, y=[inner, inner], z='s')
+    q = copy.deepcopy(outer)
+    assert q == outer
+    assert type(q.x) is SomeClass
+    assert q.x is not inner
+    assert q.y[0] is q.y[1] is q.x  # memo keeps shared references shared
+    assert q.x.x is not inner.x
+    assert q.x.y['a'] is not inner.y['a']
+    assert q.x.z is not inner.z and q.x.z[1] is not inner.z[1]
+    assert q.z is outer.z
+
+    memo = {}
+    assert copy.deepcopy(inner, memo) is copy.deepcopy(inner, memo)
+
+
+def test_deepcopy_keeps_originals_alive_once():
+    inner = SomeClass(x=1, y=2, z=3)
+    outer = SomeClass(x=inner, y=[inner], z=None)
+    memo = {}
+    copy.deepcopy(outer, memo)
+    kept = memo[id(memo)]
+    for ob in (outer, inner, outer.y):
+        assert sum(1 for item in kept if item is ob) == 1
+
+
+def test_deepcopy_cycle():
+    p = SomeClass(x=None, y=[], z=None)
+    p.x = p
+    p.y.append(p)
+    q = copy.deepcopy(p)
+    assert q.x is q
+    assert q.y[0] is q
+
+
+def test_deepcopy_subclass_override():
+    class Custom(SomeClass):
+        __slots__ = ()
+
+        def __deepcopy__(self, memo):
+            return 'custom'
+
+    p = SomeClass(x=Custom(1, 2, 3), y=None, z=None)
+    assert copy.deepcopy(p).x == 'custom'
 
 
 def test_name_conflicts():
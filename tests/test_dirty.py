@@ -0,0 +1,103 @@
+import copy
+import pickle
+
+import pytest
+
+from trafaretrecord import TrafaretRecord, computed, trafaretrecord
+from trafaretrecord.memoryslots import slotlayout
+
+
+class Account(TrafaretRecord, track_dirty=True):
+    id: int
+    owner: str
+    balance: float = 0.0
+
+    @computed('balance')
+    def cents(self):
+        return round(self.balance * 100)
+
+
+Point = trafaretrecord('Point', 'x y')
+Tracked = trafaretrecord('Tracked', 'x y', track_dirty=True)
+
+
+def test_new_records_are_clean():
+    assert Account(1, 'ann')._dirty_fields() == ()
+    assert Account._make([1, 'ann', 5.0])._dirty_fields() == ()
+    assert Tracked(1, 2)._dirty_fields() == ()
+
+
+def test_set_marks_dirty():
+    account = Account(1, 'ann', 1.0)
+    assert account.cents == 100
+    account.balance = 2.5
+    assert account._dirty_fields() == (2,)
+    assert account.cents == 250  # computed fields are still reset
+    account[0] = 7
+    assert account._dirty_fields() == (0, 2)
+    account._clear_dirty()
+    assert account._dirty_fields() == ()
+    account[1:] = ['bob', 3.0]
+    assert account._dirty_fields() == (1, 2)
+    account._clear_dirty()
+    account._replace(owner='eve')
+    assert account._dirty_fields() == (1,)
+
+
+def test_many_fields():
+    names = ['f%d' % i for i in range(200)]
+    Wide = trafaretrecord('Wide', names, track_dirty=True)
+    record = Wide(*range(200))
+    for i in (199, 0, 64, 63, 128):
+        setattr(record, names[i], -i)
+    assert record._dirty_fields() == (0, 63, 64, 128, 199)
+
+
+def test_copies_start_clean():
+    account = Account(1, 'ann')
+    account.owner = 'bob'
+    for copied in (copy.copy(account), copy.deepcopy(account),
+                   pickle.loads(pickle.dumps(account))):
+        assert copied == account
+        assert copied._dirty_fields() == ()
+    assert account._dirty_fields() == (1,)
+
+
+def test_untracked():
+    with pytest.raises(TypeError):
+        Point(1, 2)._dirty_fields()
+    with pytest.raises(TypeError):
+        Point(1, 2)._clear_dirty()
+    assert Point.__slotlayout__.dirty_fields == 0
+    assert Tracked.__slotlayout__.dirty_fields == 2
+    assert Tracked(1, 2).__sizeof__() > Point(1, 2).__sizeof__()
+
+
+def test_layout_changes_are_seen():
+    Late = trafaretrecord('Late', 'x y')
+    Child = type('Child', (Late,), {'__slots__': ()})
+    assert Late(1, 2).__sizeof__() == Point(1, 2).__sizeof__()
+    assert Child(1, 2).__sizeof__() == Point(1, 2).__sizeof__()
+    Late.__slotlayout__ = slotlayout(2, (), 2)
+    for cls in (Late, Child):
+        record = cls(1, 2)
+        record.y = 3
+        assert record._dirty_fields() == (1,)
+    del Late.__slotlayout__
+    with pytest.raises(TypeError):
+        Child(1, 2)._dirty_fields()
+
+
+def test_diff():
+    saved = Account(1, 'ann', 10.0)
+    current = copy.copy(saved)
+    assert current._diff(saved) == ()
+    current.balance = 11.0
+    current.owner = 'ann'
+    assert current._diff(saved) == (2,)
+    assert current._diff((2, 'ann', 10.0)) == (0, 2)
+    assert Point(1, float('nan'))._diff(Point(1.0, float('nan'))) == (1,)
+    with pytest.raises(ValueError):
+        current._diff((1, 2))
+    with pytest.raises(TypeError):
+        current._diff([1, 'ann', 10.0])
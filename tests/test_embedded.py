@@ -0,0 +1,221 @@
+import copy
+import gc
+import pickle
+import sys
+
+import pytest
+
+from trafaretrecord import Embedded, TrafaretRecord, computed, trafaretrecord
+from trafaretrecord.memoryslots import embeddedgetset, embeddedview
+from trafaretrecord.table import RecordTable
+
+
+class Venue(TrafaretRecord):
+    code: str
+    tz: int = 0
+
+
+class Instrument(TrafaretRecord):
+    symbol: str
+    venue: Embedded[Venue]
+
+
+class Price(TrafaretRecord):
+    amount: float
+    currency: str
+
+    @computed('amount')
+    def cents(self):
+        return round(self.amount * 100)
+
+
+class Order(TrafaretRecord, track_dirty=True):
+    id: int
+    price: Embedded[Price]
+    instrument: Embedded[Instrument]
+    size: int = 1
+
+    @computed('price', 'size')
+    def total(self):
+        return self.price.amount * self.size
+
+
+def make_order():
+    return Order(1, Price(9.5, 'EUR'), Instrument('ACME', Venue('XNAS', 5)))
+
+
+def test_flat_fields():
+    order = make_order()
+    assert Order._fields == ('id', 'price_amount', 'price_currency',
+                             'instrument_symbol', 'instrument_venue_code',
+                             'instrument_venue_tz', 'size')
+    assert tuple(order) == (1, 9.5, 'EUR', 'ACME', 'XNAS', 5, 1)
+    assert Order._field_types['instrument_venue_tz'] is int
+    assert Order._embedded == {'price': (1, Price), 'instrument': (3, Instrument)}
+    assert Order._field_defaults == {'size': 1}
+    assert order.price_amount == 9.5
+    assert Order(id=1, price=(9.5, 'EUR'), instrument=('ACME', 'XNAS', 5)) \
+        == order
+
+
+def test_views():
+    order = make_order()
+    price = order.price
+    assert isinstance(price, embeddedview)
+    assert type(price).__name__ == 'PriceView'
+    assert price._record is order and price._offset == 1
+    assert price == Price(9.5, 'EUR') and Price(9.5, 'EUR') == price
+    assert price == (9.5, 'EUR')
+    assert price != (9.5, 'USD')
+    assert len(price) == 2 and list(price) == [9.5, 'EUR']
+    assert price[1] == 'EUR'
+    assert repr(price) == "Price(amount=9.5, currency='EUR')"
+    assert price._asdict() == {'amount': 9.5, 'currency': 'EUR'}
+    assert price.cents == 950
+
+    venue = order.instrument.venue
+    assert venue._offset == 4
+    assert venue.code == 'XNAS' and venue.tz == 5
+
+    detached = price._detach()
+    assert type(detached) is Price and detached == price
+    detached.amount = 1.0
+    assert order.price_amount == 9.5
+
+
+def test_writes_go_to_the_record():
+    order = make_order()
+    assert order.total == 9.5
+    price = order.price
+    price.amount = 10.0
+    assert order.price_amount == 10.0
+    assert order.total == 10.0  # computed from the embedded record
+    assert order._dirty_fields() == (1,)
+
+    order.price = Price(2.0, 'USD')
+    assert tuple(order)[1:3] == (2.0, 'USD')
+    assert price.currency == 'USD'
+    order.instrument.venue = ('XLON', 0)
+    assert order.instrument_venue_code == 'XLON'
+    order.price = order.price  # a view of the same fields
+    assert tuple(order)[1:3] == (2.0, 'USD')
+    order._replace(price=(3.0, 'GBP'))
+    assert order.price == (3.0, 'GBP')
+
+    with pytest.raises(TypeError):
+        order.price = (1.0,)
+    with pytest.raises(AttributeError):
+        del order.price
+    with pytest.raises(TypeError):
+        Order(1, (1.0,), ('ACME', 'XNAS', 5))
+
+
+def test_mappings_and_wrong_values():
+    order = Order(1, {'currency': 'EUR', 'amount': 9.5},
+                  {'symbol': 'ACME', 'venue': {'code': 'XNAS', 'tz': 5}})
+    assert order == make_order()
+    order.price = {'currency': 'USD', 'amount': 2.0}
+    assert order.price == (2.0, 'USD')
+    order.instrument.venue = {'code': 'XLON'}
+    assert order.instrument.venue == ('XLON', 0)  # default tz
+
+    for value in ({'amount': 1.0, 'other': 'EUR'}, 'ab', Venue('XNAS', 0)):
+        with pytest.raises(TypeError):
+            order.price = value
+        with pytest.raises(TypeError):
+            Order(1, value, make_order().instrument)
+    with pytest.raises(TypeError):
+        order.price = order.instrument.venue    # a view of another class
+    assert order.price == (2.0, 'USD')
+    with pytest.raises(TypeError):
+        embeddedview._values({'x': 1})
+
+
+def test_set_is_atomic():
+    orders = [make_order(), Order(2, Price(1.0, 'USD'),
+                                  Instrument('INIT', Venue('XNAS', 5)))]
+    table = RecordTable(Order, orders, unique='price_currency')
+    with pytest.raises(ValueError):
+        orders[0].price = Price(5.0, 'USD')
+    assert orders[0].price == (9.5, 'EUR')
+    assert table.get('price_currency', 'EUR') is orders[0]
+
+
+def test_copy_pickle_json():
+    order = make_order()
+    for copied in (copy.copy(order), copy.deepcopy(order),
+                   pickle.loads(pickle.dumps(order)),
+                   Order._from_json(order._to_json())):
+        assert type(copied) is Order
+        assert copied == order
+        assert copied.price is not order.price
+
+
+def test_nested_json():
+    order = make_order()
+    assert Order._from_json(
+        '{"id": 1, "price": {"amount": 9.5, "currency": "EUR"},'
+        ' "instrument": {"symbol": "ACME", "venue": {"code": "XNAS",'
+        ' "tz": 5}}}') == order
+    assert Order._from_json(
+        '{"id": 1, "price": [9.5, "EUR"], "instrument_symbol": "ACME",'
+        ' "instrument": {"symbol": "ACME", "venue": ["XNAS", 5]}}') == order
+    assert Order._from_json(
+        b'{"id": 1, "price": {"currency": "EUR", "amount": 9.5},'
+        b' "instrument": {"symbol": "ACME", "venue": {"code": "XNAS"}},'
+        b' "size": 2}') == order._replace(size=2, instrument_venue_tz=0)
+    for data in ('{"id": 1, "price": [9.5], "instrument": ["A", "B", 1]}',
+                 '{"id": 1, "price": "9.5", "instrument": ["A", "B", 1]}',
+                 '{"id": 1, "price": {"amount": 1, "currency": "",'
+                 ' "x": 1}, "instrument": ["A", "B", 1]}',
+                 '{"id": 1, "instrument": ["A", "B", 1]}',
+                 '{"id": 1, "cost": [1, ""], "instrument": ["A", "B", 1]}'):
+        with pytest.raises(TypeError):
+            Order._from_json(data)
+
+
+def test_view_keeps_record_alive():
+    order = make_order()
+    refs = sys.getrefcount(order)
+    venue = order.instrument.venue
+    assert sys.getrefcount(order) == refs + 1
+    del order
+    gc.collect()
+    assert venue.code == 'XNAS'
+    assert venue._record.id == 1
+    record = venue._record
+    del venue
+    assert sys.getrefcount(record) == refs
+
+
+def test_defaults_and_table():
+    class Quote(TrafaretRecord):
+        symbol: str
+        bid: Embedded[Price] = Price(0.0, 'USD')
+
+    quote = Quote('ACME')
+    assert quote.bid == (0.0, 'USD')
+    assert Quote._field_defaults == {'bid_amount': 0.0, 'bid_currency': 'USD'}
+
+    table = RecordTable(Quote, [quote], index='bid_currency')
+    quote.bid = Price(1.0, 'EUR')
+    assert table.find('bid_currency', 'EUR') == [quote]
+
+
+def test_functional_form_and_errors():
+    Line = TrafaretRecord('Line', [('name', str), ('price', Embedded[Price])])
+    assert Line('x', Price(1.0, 'EUR')).price.currency == 'EUR'
+
+    with pytest.raises(TypeError):
+        Embedded[trafaretrecord('Plain', 'x y')]
+    with pytest.raises(ValueError):
+        class Clash(TrafaretRecord):
+            price: Embedded[Price]
+            price_amount: int
+    with pytest.raises(TypeError):
+        embeddedgetset(0).__get__(make_order(), Order)
+    with pytest.raises(IndexError):
+        embeddedview(Price(1.0, 'EUR'), 3)
+    view = type(make_order().price)(Price(1.0, 'EUR'), 1)
+    with pytest.raises(IndexError):
+        view.currency
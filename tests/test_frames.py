@@ -0,0 +1,163 @@
+import asyncio
+import struct
+
+import pytest
+
+from trafaretrecord import TrafaretRecord, computed
+from trafaretrecord.frames import (FrameDecoder, encode_frames, frame_codes,
+                                   read_frames)
+from trafaretrecord.memoryslots import _decode_frames
+
+
+class Tick(TrafaretRecord):
+    symbol: str
+    price: float
+    size: int
+    buy: bool
+    raw: bytes = b''
+
+    @computed('price', 'size')
+    def value(self):
+        return self.price * self.size
+
+
+TICKS = [Tick('ACME', 10.5, 3, True, b'\x00\xff'),
+         Tick('€uro', -0.0, -2 ** 63, False),
+         Tick('', float('inf'), 2 ** 63 - 1, True, b'x' * 300)]
+
+
+def test_frame_layout():
+    assert frame_codes(Tick) == 'udq?z'
+    data = encode_frames(Tick, TICKS[:1])
+    assert data == (struct.pack('<I', 4 + 4 + 8 + 8 + 1 + 4 + 2) +
+                    struct.pack('<I4sdq?I2s', 4, b'ACME', 10.5, 3, True,
+                                2, b'\x00\xff'))
+
+
+def test_round_trip():
+    decoder = FrameDecoder(Tick)
+    decoder.feed(encode_frames(Tick, TICKS))
+    records = decoder.decode()
+    assert records == TICKS
+    assert all(type(record) is Tick for record in records)
+    assert records[0].value == 31.5
+    assert decoder.pending == 0
+    decoder.close()
+
+
+def test_chunks():
+    data = encode_frames(Tick, TICKS * 20)
+    decoder = FrameDecoder(Tick)
+    records = []
+    for i in range(0, len(data), 7):
+        decoder.feed(data[i:i + 7])
+        records.extend(decoder.decode())
+    assert records == TICKS * 20
+
+
+def test_bounded_batches():
+    decoder = FrameDecoder(Tick)
+    decoder.feed(encode_frames(Tick, TICKS * 3))
+    assert decoder.decode(4) == TICKS + TICKS[:1]
+    assert decoder.decode(4) == TICKS[1:] + TICKS[:2]
+    assert decoder.decode(4) == TICKS[2:]
+    assert decoder.decode(4) == []
+
+
+def test_partial_frame():
+    data = encode_frames(Tick, TICKS)
+    decoder = FrameDecoder(Tick)
+    decoder.feed(data[:-1])
+    assert decoder.decode() == TICKS[:2]
+    assert 'pending=' in repr(decoder)
+    with pytest.raises(ValueError):
+        decoder.close()
+    decoder.feed(data[-1:])
+    assert decoder.decode() == TICKS[2:]
+
+
+def test_corrupt_frames():
+    frame = encode_frames(Tick, TICKS[:1])
+    decoder = FrameDecoder(Tick)
+    decoder.feed(struct.pack('<I', len(frame) - 5) + frame[4:-1])
+    with pytest.raises(ValueError):
+        decoder.decode()
+
+    decoder = FrameDecoder(Tick)
+    decoder.feed(struct.pack('<I', len(frame) - 3) + frame[4:] + b'!')
+    with pytest.raises(ValueError):
+        decoder.decode()
+
+    decoder = FrameDecoder(Tick, max_frame_size=16)
+    decoder.feed(frame[:4])
+    with pytest.raises(ValueError):
+        decoder.decode()
+
+    decoder = FrameDecoder(Tick)
+    decoder.feed(frame.replace(b'ACME', b'AC\xffE'))
+    with pytest.raises(UnicodeDecodeError):
+        decoder.decode()
+
+
+def test_encode_errors():
+    with pytest.raises(TypeError):
+        encode_frames(Tick, [Tick(1, 10.5, 3, True)])
+    with pytest.raises(OverflowError):
+        encode_frames(Tick, [Tick('A', 1.0, 2 ** 63, True)])
+    with pytest.raises(TypeError):
+        encode_frames(Tick, [('ACME', 1.0, 1, True, b'')])
+
+    class Untyped(TrafaretRecord):
+        values: list
+
+    with pytest.raises(TypeError):
+        frame_codes(Untyped)
+
+
+
+def test_decode_checks_record_type():
+    frame = struct.pack('<I', 8) + bytes(8)
+    with pytest.raises(ValueError):
+        _decode_frames(Tick, 'q', frame, 0, -1, 100)
+    with pytest.raises(TypeError):
+        _decode_frames(int, 'q', frame, 0, -1, 100)
+
+
+def test_read_frames():
+    data = encode_frames(Tick, TICKS * 10)
+
+    async def main():
+        reader = asyncio.StreamReader()
+        ticks = []
+
+        async def other():
+            # runs between the batches of data that is already buffered
+            ticks.append(len(batches))
+
+        async def consume():
+            async for records in read_frames(reader, Tick, batch_size=4,
+                                             chunk_size=len(data)):
+                batches.append(records)
+                asyncio.ensure_future(other())
+
+        batches = []
+        reader.feed_data(data)
+        reader.feed_eof()
+        await consume()
+        return batches, ticks
+
+    batches, ticks = asyncio.run(main())
+    assert [len(batch) for batch in batches] == [4] * 7 + [2]
+    assert [record for batch in batches for record in batch] == TICKS * 10
+    assert ticks[0] < len(batches)
+
+
+def test_read_frames_truncated():
+    async def main():
+        reader = asyncio.StreamReader()
+        reader.feed_data(encode_frames(Tick, TICKS)[:-3])
+        reader.feed_eof()
+        return [batch async for batch in read_frames(reader, Tick)]
+
+    with pytest.raises(ValueError):
+        asyncio.run(main())
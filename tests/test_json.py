@@ -0,0 +1,150 @@
+import datetime
+import json
+import math
+
+import pytest
+
+from trafaretrecord import TrafaretRecord, memoryslots, trafaretrecord
+
+
+class Point(TrafaretRecord):
+    x: float
+    y: float
+
+
+class Item(TrafaretRecord):
+    id: int
+    name: str
+    where: Point
+    tags: list
+    active: bool = True
+
+
+def _item():
+    return Item(2 ** 70, 'quote " back \\ ctl \x01\n é 😀', Point(1.5, -2.0),
+                [None, True, 3, (4, 5.25), {'k': 'v'}], False)
+
+
+def test_to_json_matches_json():
+    item = _item()
+    data = item._to_json()
+    assert isinstance(data, bytes)
+    assert json.loads(data) == {
+        'id': 2 ** 70, 'name': item.name, 'where': {'x': 1.5, 'y': -2.0},
+        'tags': [None, True, 3, [4, 5.25], {'k': 'v'}], 'active': False,
+    }
+    assert data == json.dumps(
+        json.loads(data), ensure_ascii=False,
+        separators=(',', ':')).encode('utf-8')
+
+
+
+def test_to_json_surrogates():
+    P = trafaretrecord('P', 'v')
+    for value in ('x\udcff', '\ud800\udc00', '"\ud800\x01'):
+        assert P(value)._to_json() == \
+            ('{"v":%s}' % json.dumps(value)).encode()
+    # only surrogates are escaped, other characters stay UTF-8
+    data = P('\ud7ff\udfff\ue000é\n')._to_json()
+    assert data == b'{"v":"\xed\x9f\xbf\\udfff\xee\x80\x80\xc3\xa9\\n"}'
+    assert json.loads(data)['v'] == '\ud7ff\udfff\ue000é\n'
+
+
+@pytest.mark.parametrize('value', [
+    0, -1, 2 ** 63 - 1, -2 ** 63, 2 ** 64, 0.1, -0.0, 1e300, 5e-324,
+    float('inf'), float('-inf'), '', 'x' * 1000, True, None,
+])
+def test_scalars(value):
+    P = trafaretrecord('P', 'v')
+    data = P(value)._to_json()
+    assert data == ('{"v":%s}' % json.dumps(value)).encode()
+    assert P._from_json(data).v == value
+
+
+def test_nan():
+    P = trafaretrecord('P', 'v')
+    assert P(float('nan'))._to_json() == b'{"v":NaN}'
+    assert math.isnan(P._from_json(b'{"v":NaN}').v)
+
+
+def test_dict_keys():
+    P = trafaretrecord('P', 'v')
+    assert P({1: 0, 2.5: 0, False: 0, None: 0})._to_json() == \
+        b'{"v":{"1":0,"2.5":0,"false":0,"null":0}}'
+    with pytest.raises(TypeError):
+        P({(1,): 0})._to_json()
+
+
+def test_default():
+    P = trafaretrecord('P', 'v')
+    day = datetime.date(2020, 1, 2)
+    with pytest.raises(TypeError):
+        P(day)._to_json()
+    assert P(day)._to_json(default=str) == b'{"v":"2020-01-02"}'
+    assert P.to_json_many([P(day)], default=lambda d: d.year) == \
+        b'[{"v":2020}]'
+
+
+def test_plain_memoryslots_as_array():
+    P = trafaretrecord('P', 'v')
+    assert P(memoryslots(1, 'a'))._to_json() == b'{"v":[1,"a"]}'
+
+
+def test_to_json_many():
+    items = [_item(), Item(1, 'b', Point(0.0, 0.0), [])]
+    assert Item.to_json_many(items) == \
+        b'[' + b','.join(i._to_json() for i in items) + b']'
+    assert Item.to_json_many(iter([])) == b'[]'
+
+
+def test_from_json_round_trip():
+    item = _item()
+    item.tags = [None, True, 3, [4, 5.25], {'k': 'v'}]
+    for data in (item._to_json(), item._to_json().decode('utf-8'),
+                 bytearray(item._to_json())):
+        result = Item._from_json(data)
+        assert result == item
+        assert type(result.where) is Point
+
+
+def test_from_json_parsing():
+    item = Item._from_json(
+        ' { "where" : {"y": 1, "x": 2e1}, "name": "\\u00e9\\ud83d\\ude00\\/",'
+        ' "tags": [ ], "id": -0, "id": 7 } ')
+    assert item == Item(7, 'é😀/', Point(20.0, 1), [], True)
+    assert Item._from_json(
+        '{"id":1,"name":"","where":null,"tags":{"a":[1.5]}}').tags == \
+        {'a': [1.5]}
+
+
+@pytest.mark.parametrize('data', [
+    '', '[]', '{', '{"id":1,}', '{"id":01}', '{"id":1.}', '{"id":"a}',
+    '{"id":"\\x"}', '{"id":"\x01"}', '{"id":tru}',
+    '{"id":1,"name":"","where":null,"tags":[]} x',
+    '{"id" 1}', '{id:1}',
+])
+def test_from_json_invalid(data):
+    with pytest.raises(ValueError):
+        Item._from_json(data)
+
+
+def test_from_json_surrogates():
+    base = b'{"id":1,"where":null,"tags":[],"name":"%s"}'
+    for raw in (b'\xed\xa0\x80', b'\\n\xed\xa0\x80', b'\\ud800\xed\xb0\x80',
+                b'\xff', b'a\\u00e9\xc3'):
+        # json.loads() decodes bytes with surrogatepass, the input is
+        # held to strict UTF-8 here
+        with pytest.raises(UnicodeDecodeError):
+            (base % raw).decode('utf-8')
+        with pytest.raises(ValueError):
+            Item._from_json(base % raw)
+    for escaped in (b'\\ud800', b'x\\udc00\xc3\xa9', b'\\ud83d\\ude00'):
+        assert Item._from_json(base % escaped).name == \
+            json.loads(base % escaped)['name']
+
+
+def test_from_json_fields():
+    with pytest.raises(TypeError):
+        Item._from_json('{"id":1}')  # missing fields without default
+    with pytest.raises(TypeError):
+        Item._from_json('{"id":1,"name":"","where":null,"tags":[],"x":1}')
@@ -0,0 +1,105 @@
+from collections import OrderedDict
+from types import MappingProxyType
+
+import pytest
+
+from trafaretrecord import Embedded, TrafaretRecord, trafaretrecord
+
+
+class Point(TrafaretRecord):
+    x: float
+    y: float
+
+
+class Item(TrafaretRecord, track_dirty=True):
+    id: int
+    name: str
+    where: Point
+    tags: list = None
+    active: bool = True
+
+
+class Placed(TrafaretRecord):
+    id: int
+    where: Embedded[Point]
+
+
+Pair = trafaretrecord('Pair', 'a b')
+
+
+def test_from_mapping():
+    data = {'id': 1, 'name': 'a', 'where': Point(1.0, 2.0), 'tags': [3],
+            'active': False}
+    item = Item._from_mapping(data)
+    assert type(item) is Item
+    assert item == Item(**data)
+    assert item._dirty_fields() == ()
+    assert Pair._from_mapping({'b': 2, 'a': 1}) == Pair(1, 2)
+
+
+@pytest.mark.parametrize('wrap', [OrderedDict, MappingProxyType])
+def test_from_other_mappings(wrap):
+    item = Item._from_mapping(wrap({'id': 1, 'name': 'a', 'where': None}))
+    assert item == Item(1, 'a', None)
+
+
+def test_from_mapping_defaults():
+    item = Item._from_mapping({'name': 'a', 'id': 1, 'where': None})
+    assert item.tags is None and item.active is True
+    with pytest.raises(TypeError,
+                       match="mapping has no field 'where' of Item"):
+        Item._from_mapping({'id': 1, 'name': 'a'})
+    with pytest.raises(TypeError, match='expected a mapping'):
+        Item._from_mapping(1)
+
+
+def test_from_mapping_extra():
+    data = {'id': 1, 'name': 'a', 'where': None, 'other': 0}
+    assert Item._from_mapping(data) == Item(1, 'a', None)
+    with pytest.raises(TypeError, match="no field 'other'"):
+        Item._from_mapping(data, extra='error')
+    del data['other']
+    assert Item._from_mapping(data, extra='error') == Item(1, 'a', None)
+    with pytest.raises(ValueError, match='extra must be'):
+        Item._from_mapping(data, extra='forbid')
+
+
+def test_from_mapping_nested():
+    item = Item._from_mapping({'id': 1, 'name': 'a',
+                               'where': {'x': 1.5, 'y': -2.0},
+                               'tags': {'x': 1}})
+    assert type(item.where) is Point
+    assert item.where == Point(1.5, -2.0)
+    assert item.tags == {'x': 1}    # not a record field
+    with pytest.raises(TypeError, match="no field 'z'"):
+        Item._from_mapping({'id': 1, 'name': 'a',
+                            'where': {'x': 1, 'y': 2, 'z': 3}},
+                           extra='error')
+
+
+def test_from_mapping_embedded():
+    placed = Placed._from_mapping({'id': 1, 'where_x': 1.0, 'where_y': 2.0})
+    assert placed == Placed(1, Point(1.0, 2.0))
+    for where in ({'x': 1.0, 'y': 2.0}, [1.0, 2.0], Point(1.0, 2.0)):
+        data = {'id': 1, 'where': where}
+        assert Placed._from_mapping(data) == placed
+        assert Placed._from_mapping(data, extra='error') == placed
+    with pytest.raises(TypeError, match="no field 'z'"):
+        Placed._from_mapping({'id': 1, 'where': {'x': 1, 'y': 2, 'z': 3}},
+                             extra='error')
+    with pytest.raises(TypeError, match="no field 'id'"):
+        Placed._from_mapping({'where': [1, 2], 'where_x': 1, 'where_y': 2})
+    for where in ([1.0], 'ab', Pair(1, 2)):
+        with pytest.raises(TypeError):
+            Placed._from_mapping({'id': 1, 'where': where})
+
+
+def test_from_mappings():
+    rows = [{'a': i, 'b': -i} for i in range(100)]
+    assert Pair._from_mappings(rows) == [Pair(i, -i) for i in range(100)]
+    assert Pair._from_mappings(iter(rows[:2])) == [Pair(0, 0), Pair(1, -1)]
+    assert Pair._from_mappings([]) == []
+    with pytest.raises(TypeError, match="no field 'c'"):
+        Pair._from_mappings([{'a': 1, 'b': 2, 'c': 3}], extra='error')
+    with pytest.raises(TypeError, match="no field 'b'"):
+        Pair._from_mappings([{'a': 1, 'b': 2}, {'a': 1}])
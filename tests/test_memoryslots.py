@@ -1,7 +1,9 @@
+import copy
 import pickle
+import sys
 
 import pytest
-from trafaretrecord import memoryslots
+from trafaretrecord import memoryslots, trafaretrecord
 
 
 def test_constructors():
@@ -94,3 +96,94 @@ def test_no_comdat_folding():
 
     with pytest.raises(TypeError):
         [3,] + T((1,2))
+
+
+def test_copy():
+    class T(memoryslots): pass
+
+    for ms in (memoryslots(1, [2]), T(1, [2])):
+        shallow = copy.copy(ms)
+        deep = copy.deepcopy(ms)
+        assert type(shallow) is type(deep) is type(ms)
+        assert shallow is not ms and shallow[1] is ms[1]
+        assert deep == ms and deep[1] is not ms[1]
+
+    t = T(1)
+    t.extra = [2]
+    assert copy.copy(t).extra is t.extra
+    assert copy.deepcopy(t).extra == [2]
+    assert copy.deepcopy(t).extra is not t.extra
+
+
+
+def test_partial_slice_of_record():
+    R = trafaretrecord('R', 'a b c')
+    r = R(1, 2, 3)
+
+    assert type(r[0:3]) is R and r[0:3] == r
+    part = r[0:1]
+    assert type(part) is memoryslots and part == (1,)
+    with pytest.raises(IndexError):
+        R.c.__get__(part)
+    with pytest.raises(IndexError):
+        R.c.__set__(part, 4)
+    assert part == (1,)
+
+
+def _load_memoryslots_module():
+    import importlib.util
+
+    spec = importlib.util.find_spec('trafaretrecord.memoryslots')
+    module = importlib.util.module_from_spec(spec)
+    spec.loader.exec_module(module)
+    return module
+
+
+def test_module_isolation():
+    memoryslots_module = sys.modules['trafaretrecord.memoryslots']
+    other = _load_memoryslots_module()
+    assert other.memoryslots is not memoryslots
+    assert other.itemgetset is not memoryslots_module.itemgetset
+
+    a = other.memoryslots(1, 2, 3)
+    assert type(a) is other.memoryslots
+    assert a == (1, 2, 3)
+    assert type(a + (4,)) is other.memoryslots
+    assert type(a * 2) is other.memoryslots
+    assert type(iter(a)) is other.memoryslotsiter
+
+    class T(other.memoryslots):
+        __slots__ = ()
+        x = other.itemgetset(0)
+
+    t = T(1, 2)
+    t.x = 10
+    assert t == (10, 2)
+    assert type(t[:]) is T
+
+
+def _subinterpreters():
+    try:
+        import _interpreters as interpreters    # Python 3.13+
+    except ImportError:
+        interpreters = pytest.importorskip('_xxsubinterpreters')
+        return interpreters, interpreters.create(isolated=True)
+    return interpreters, interpreters.create('isolated')
+
+
+def test_subinterpreter():
+    interpreters, interp = _subinterpreters()
+    try:
+        # raises before Python 3.13, returns the error since
+        failure = interpreters.run_string(interp, (
+            "import sys\n"
+            "sys.path[:] = %r\n"
+            "from trafaretrecord import trafaretrecord\n"
+            "P = trafaretrecord('P', 'x y')\n"
+            "p = P(1, 2)\n"
+            "p.x = 5\n"
+            "assert tuple(p) == (5, 2)\n"
+        ) % (sys.path,))
+        assert failure is None, failure
+    finally:
+        interpreters.destroy(interp)
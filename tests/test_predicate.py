@@ -0,0 +1,120 @@
+import operator
+import random
+
+import pytest
+
+from trafaretrecord import TrafaretRecord, trafaretrecord
+from trafaretrecord.shared import SharedRecordArray
+
+
+class Order(TrafaretRecord):
+    side: str
+    price: float
+    size: int
+    done: bool
+
+
+class Level(TrafaretRecord):
+    price: float
+    size: int
+    done: bool
+
+
+def _orders(n):
+    rnd = random.Random(3)
+    return [Order(rnd.choice('BS'), rnd.random() * 20, rnd.randrange(100),
+                  rnd.random() < 0.3)
+            for _ in range(n)]
+
+
+def test_where():
+    orders = _orders(2000)
+    selected = Order.where(
+        (Order.price > 10) & (Order.side == 'B') |
+        ~(Order.size < 90) & (Order.done == True)  # noqa: E712
+    )
+    expected = [o for o in orders
+                if (o.price > 10 and o.side == 'B') or
+                (o.size >= 90 and o.done)]
+    assert selected(orders) == expected
+    assert selected(iter(orders)) == expected
+    assert selected.indices(orders) == [
+        i for i, o in enumerate(orders) if o in expected]
+    assert list(selected.mask(orders[:3])) == [
+        int(o in expected) for o in orders[:3]]
+
+
+@pytest.mark.parametrize('op', [operator.lt, operator.le, operator.eq,
+                                operator.ne, operator.gt, operator.ge])
+@pytest.mark.parametrize('value', [50, 49.5, 50.0, 2 ** 70, -1e300,
+                                   float('nan'), float('inf')])
+def test_mixed_numeric_comparisons(op, value):
+    orders = _orders(300)
+    orders[0].size = 2 ** 63 - 1
+    selected = Order.where(op(Order.size, value))(orders)
+    assert selected == [o for o in orders if op(o.size, value)]
+    selected = Order.where(op(Order.price, value))(orders)
+    assert selected == [o for o in orders if op(o.price, value)]
+
+
+def test_object_fields():
+    Point = trafaretrecord('Point', 'x y')
+    points = [Point(1, 'a'), Point(2.5, None), Point(10 ** 30, 'b')]
+    assert Point.where(Point.x > 2)(points) == points[1:]
+    assert Point.where(Point.y != 'a')(points) == points[1:]
+    assert Point.where(5 > Point.x)(points) == points[:2]
+
+
+def test_shared_array():
+    orders = _orders(1000)
+    levels = [Level(o.price, o.size, o.done) for o in orders]
+    condition = (Level.price >= 10.5) & (Level.size != 3) & \
+        (Level.done == 1) | (Level.size > 97.5)
+    with SharedRecordArray.from_records(Level, levels) as array:
+        try:
+            assert Level.where(condition).mask(array) == \
+                Level.where(condition).mask(levels)
+            assert Level.where(condition)(array) == \
+                Level.where(condition)(levels)
+        finally:
+            array.unlink()
+
+
+def test_descriptors_stay_descriptors():
+    assert Order.price == Order.price
+    assert Order.price != Order.size
+    assert {Order.price: 1}[Order.price] == 1
+    assert Order.price in [None, 1, Order.price]
+    assert Order.price not in [None, 1, 'a']
+    assert (Order.price == None) is False  # noqa: E711
+    assert (Order.price != ()) is True
+    with pytest.raises(TypeError):
+        bool(Order.price > 1)
+    with pytest.raises(TypeError):
+        Order.where(lambda order: True)
+    with pytest.raises(TypeError):
+        Order.where(Order.size > 1)(_orders(2) + [(1, 2)])
+    assert 'field(2) > 1' in repr(Order.where(Order.size > 1))
+
+
+def test_fields_of_other_classes():
+    class Sub(Level):
+        pass
+
+    levels = [Sub(1.0, 1, False), Sub(2.0, 9, True)]
+    assert Sub.where(Level.size > 5)(levels) == levels[1:]
+    with pytest.raises(TypeError, match='not a field of Level'):
+        Level.where(Order.price > 5)    # Order.price is field 1, Level.size
+    with pytest.raises(TypeError):
+        Level.where((Level.size > 5) & (Order.side == 'B'))
+
+
+def test_list_changed_by_comparisons():
+    class Value(object):
+        def __eq__(self, other):
+            points.clear()
+            return True
+
+    Point = trafaretrecord('Point', 'x y')
+    points = [Point(1, Value()) for _ in range(20)]
+    assert Point.where(Point.y == 'a').mask(points) == bytearray([1] * 20)
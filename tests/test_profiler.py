@@ -0,0 +1,95 @@
+import pytest
+
+from trafaretrecord import TrafaretRecord, computed, trafaretrecord
+from trafaretrecord.profiler import FieldCounts, FieldProfiler
+
+Wide = trafaretrecord('Wide', ['f%d' % i for i in range(12)])
+
+
+class Order(TrafaretRecord):
+    id: int
+    price: float
+    size: int
+    note: str = ''
+
+    @computed('price', 'size')
+    def value(self):
+        return self.price * self.size
+
+
+def test_counts():
+    order = Order(1, 2.0, 3)
+    with FieldProfiler(Order) as profiler:
+        for i in range(100):
+            order.price
+            order.price = i
+        order.size
+        order[3]  # indexing is not counted
+        order.value
+    order.price  # after stop()
+
+    assert profiler.counts(Order) == [
+        FieldCounts('id', 0, 0),
+        FieldCounts('price', 101, 100),  # value reads price and size
+        FieldCounts('size', 2, 0),
+        FieldCounts('note', 0, 0),
+    ]
+    assert [c.name for c in profiler.report()[Order]] == [
+        'price', 'size', 'id', 'note']
+    assert not Order.price.profiled
+
+
+def test_live_counts_and_restart():
+    order = Order(1, 2.0, 3)
+    profiler = FieldProfiler(Order)
+    assert profiler.counts(Order)[0] == FieldCounts('id', 0, 0)
+    profiler.start()
+    order.id
+    assert profiler.counts(Order)[0] == FieldCounts('id', 1, 0)
+    profiler.start()
+    assert profiler.counts(Order)[0] == FieldCounts('id', 0, 0)
+    profiler.stop()
+
+
+def test_sampling():
+    record = Wide(*range(12))
+    with FieldProfiler(Wide, period=10) as profiler:
+        for i in range(1000):
+            record.f0
+            record.f1 = i
+        for i in range(9):
+            record.f2
+    counts = profiler.counts(Wide)
+    assert counts[0] == FieldCounts('f0', 1000, 0)
+    assert counts[1] == FieldCounts('f1', 0, 1000)
+    assert counts[2] == FieldCounts('f2', 0, 0)
+
+
+def test_hot_fields_and_subclasses():
+    class Sub(Wide):
+        __slots__ = ()
+
+    record = Sub(*range(12))
+    with FieldProfiler(Wide) as profiler:
+        for i in range(90):
+            record.f5
+        for i in range(9):
+            record.f7
+        record.f0
+    assert profiler.hot_fields(Wide) == ('f5',)
+    assert profiler.hot_fields(Wide, share=0.95) == ('f5', 'f7')
+    assert profiler.hot_fields(Wide, share=1) == ('f5', 'f7', 'f0')
+
+
+def test_errors():
+    with pytest.raises(ValueError):
+        FieldProfiler(Order, period=0)
+    with pytest.raises(ValueError):
+        Order.id.profile(-1)
+
+    class Plain(object):
+        _fields = ('x',)
+        x = None
+
+    with pytest.raises(TypeError):
+        FieldProfiler(Plain)
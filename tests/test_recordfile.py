@@ -0,0 +1,132 @@
+import pytest
+
+from trafaretrecord import TrafaretRecord
+from trafaretrecord.recordfile import RecordFile
+
+
+class Trade(TrafaretRecord):
+    id: int
+    symbol: str
+    price: float
+    payload: bytes
+    buy: bool
+
+
+class Tick(TrafaretRecord):
+    id: int
+    price: float
+
+
+TRADES = [
+    Trade(1, 'ABC', 1.5, b'\x00\x01', True),
+    Trade(2, 'ДЕФ', 2.5, b'', False),
+    Trade(3, '', 3.5, b'xyz', True),
+]
+
+
+@pytest.fixture
+def path(tmp_path):
+    return str(tmp_path / 'trades.rec')
+
+
+def test_roundtrip(path):
+    with RecordFile.create(path, Trade) as f:
+        f.extend(TRADES)
+        assert len(f) == 3
+        assert list(f) == TRADES
+
+    with RecordFile.open(path, Trade) as f:
+        assert len(f) == 3
+        assert f[1] == TRADES[1]
+        assert type(f[-1]) is Trade
+        assert f[-1] == TRADES[-1]
+        f.verify()
+        with pytest.raises(IndexError):
+            f[3]
+        with pytest.raises(OSError):
+            f.append(TRADES[0])
+
+
+def test_append_grows(path):
+    records = [Trade(i, 's%d' % i, float(i), b'p' * (i % 7), bool(i % 2))
+               for i in range(1000)]
+    with RecordFile.create(path, Trade, capacity=4) as f:
+        for record in records[:10]:
+            f.append(record)
+        f.extend(records[10:])
+        f.verify()
+
+    with RecordFile.open(path, Trade, writable=True) as f:
+        assert list(f) == records
+        f.append(Trade(1000, 'last', 0.0, b'', False))
+        f.verify()
+
+    with RecordFile.open(path, Trade) as f:
+        assert len(f) == 1001
+        assert f[1000].symbol == 'last'
+        assert f[999] == records[999]
+
+
+def test_growth_keeps_a_valid_header(path):
+    records = [Trade(i, 's%d' % i * 20, float(i), b'p' * 50, True)
+               for i in range(8)]
+    with RecordFile.create(path, Trade, capacity=4) as f:
+        f.extend(records[:4])
+
+        # a crash after the heap moved, before the header of the new rows
+        written = []
+
+        def write_state():
+            if written:
+                raise KeyboardInterrupt
+            written.append(True)
+            RecordFile._write_state(f)
+        f._write_state = write_state
+        with pytest.raises(KeyboardInterrupt):
+            f.extend(records[4:])
+
+        with RecordFile.open(path, Trade) as crashed:
+            assert list(crashed) == records[:4]
+            crashed.verify()
+
+
+def test_growth_with_exported_views(path):
+    with RecordFile.create(path, Trade, capacity=2) as f:
+        f.extend(TRADES[:2])
+        view = memoryview(f._mmap)
+        with pytest.raises(BufferError):
+            f.extend(TRADES * 100)
+        assert list(f) == TRADES[:2]
+        f.verify()
+        view.release()
+        f.extend(TRADES * 100)
+        assert len(f) == 302
+        f.verify()
+
+
+def test_fixed_width_only(path):
+    with RecordFile.create(path, Tick, capacity=0) as f:
+        f.extend(Tick(i, i / 2) for i in range(100))
+    with RecordFile.open(path, Tick) as f:
+        assert f[99] == Tick(99, 49.5)
+        f.verify()
+
+
+def test_schema_mismatch(path):
+    RecordFile.create(path, Trade).close()
+    with pytest.raises(ValueError):
+        RecordFile.open(path, Tick)
+
+
+def test_checksum(path):
+    with RecordFile.create(path, Trade) as f:
+        f.extend(TRADES)
+        offset = f._heap_offset
+
+    with open(path, 'r+b') as raw:
+        raw.seek(offset + 5)
+        raw.write(b'!')
+
+    with RecordFile.open(path, Trade) as f:
+        with pytest.raises(ValueError):
+            f.verify()
@@ -0,0 +1,178 @@
+import multiprocessing
+import os
+import pickle
+import threading
+
+import pytest
+
+from trafaretrecord import TrafaretRecord, trafaretrecord
+from trafaretrecord.shared import SharedRecordArray
+
+
+class Quote(TrafaretRecord):
+    price: float
+    size: int
+    active: bool
+
+
+class Pair(TrafaretRecord):
+    a: int
+    b: int
+
+
+QUOTES = [Quote(1.5, 10, True), Quote(2.5, 20, False), Quote(3.5, 30, True)]
+
+
+@pytest.fixture
+def quotes():
+    array = SharedRecordArray.from_records(Quote, QUOTES)
+    yield array
+    array.close()
+    array.unlink()
+
+
+def test_roundtrip(quotes):
+    assert len(quotes) == 3
+    assert list(quotes) == QUOTES
+    assert type(quotes[0]) is Quote
+    assert quotes[-1] == Quote(3.5, 30, True)
+
+    quotes[1] = Quote(price=9.0, size=90, active=True)
+    assert quotes[1] == Quote(9.0, 90, True)
+
+    with pytest.raises(IndexError):
+        quotes[3]
+    with pytest.raises(TypeError):
+        quotes[0] = (1.0, 2)
+
+
+def test_columns_are_views(quotes):
+    sizes = quotes.column('size')
+    assert sizes.format == 'q'
+    assert sizes.tolist() == [10, 20, 30]
+
+    sizes[0] = 11
+    assert quotes[0].size == 11
+
+
+def test_attach(quotes):
+    with SharedRecordArray.attach(quotes.name, Quote) as other:
+        assert list(other) == QUOTES
+        other[2] = Quote(0.5, 5, False)
+    assert quotes[2] == Quote(0.5, 5, False)
+
+    with pytest.raises(ValueError):
+        SharedRecordArray.attach(quotes.name, Pair)
+
+
+def test_pickle_attaches(quotes):
+    other = pickle.loads(pickle.dumps(quotes))
+    try:
+        assert other.name == quotes.name
+        other[0] = Quote(7.0, 70, False)
+        assert quotes[0] == Quote(7.0, 70, False)
+    finally:
+        other.close()
+
+
+def test_untyped_record():
+    Point = trafaretrecord('Point', 'x y')
+    with pytest.raises(TypeError):
+        SharedRecordArray.create(Point, 1)
+
+
+def _double_sizes(array):
+    for index, quote in enumerate(array):
+        array[index] = quote._replace(size=quote.size * 2)
+    array.close()
+
+
+def test_other_process(quotes):
+    try:
+        context = multiprocessing.get_context('fork')
+    except ValueError:
+        pytest.skip('fork start method is not available')
+    process = context.Process(target=_double_sizes, args=(quotes,))
+    process.start()
+    process.join()
+    assert process.exitcode == 0
+    assert quotes.column('size').tolist() == [20, 40, 60]
+
+
+def test_versioned_rows():
+    array = SharedRecordArray.create(Pair, 4, versioned=True)
+    stop = threading.Event()
+    torn = []
+
+    def write(start):
+        value = start
+        while not stop.is_set():
+            for index in range(len(array)):
+                array[index] = Pair(value, value)
+            value += 2
+
+    def read():
+        for _ in range(2000):
+            for pair in array:
+                if pair.a != pair.b:
+                    torn.append(pair)
+
+    writers = [threading.Thread(target=write, args=(n,)) for n in range(2)]
+    for writer in writers:
+        writer.start()
+    try:
+        read()
+    finally:
+        stop.set()
+        for writer in writers:
+            writer.join()
+        array.close()
+        array.unlink()
+    assert torn == []
+
+
+
+@pytest.mark.parametrize('versioned', [False, True])
+def test_bad_value_leaves_row(versioned):
+    array = SharedRecordArray.create(Quote, 1, versioned=versioned)
+    try:
+        array[0] = Quote(1.5, 10, True)
+        with pytest.raises(TypeError):
+            array[0] = (5.5, 'x', False)
+        with pytest.raises((OverflowError, ValueError)):
+            array[0] = (5.5, 2 ** 63, False)
+        assert array[0] == Quote(1.5, 10, True)
+    finally:
+        array.close()
+        array.unlink()
+
+
+def _die_while_writing(array):
+    from trafaretrecord.memoryslots import _seqlock_write_begin
+    _seqlock_write_begin(array._versions, 1)
+    os._exit(0)
+
+
+def test_dead_writer_times_out():
+    try:
+        context = multiprocessing.get_context('fork')
+    except ValueError:
+        pytest.skip('fork start method is not available')
+    array = SharedRecordArray.create(Pair, 2, versioned=True,
+                                     lock_timeout=0.05)
+    try:
+        process = context.Process(target=_die_while_writing, args=(array,))
+        process.start()
+        process.join()
+        assert process.exitcode == 0
+        assert array[0] == Pair(0, 0)
+        with pytest.raises(TimeoutError):
+            array[1]
+        with pytest.raises(TimeoutError):
+            array[1] = Pair(1, 1)
+        other = pickle.loads(pickle.dumps(array))
+        assert other.lock_timeout == 0.05
+        other.close()
+    finally:
+        array.close()
+        array.unlink()
@@ -0,0 +1,90 @@
+import operator
+import random
+
+import pytest
+
+from trafaretrecord import TrafaretRecord, key_by, sort_by, top_k
+
+
+class Row(TrafaretRecord):
+    a: int
+    b: float
+    c: str
+    d: object
+
+
+def _rows(n):
+    rnd = random.Random(7)
+    return [Row(rnd.randrange(20), rnd.random(), rnd.choice('xyz'),
+                rnd.choice([(1,), (0, 1), ()]))
+            for _ in range(n)]
+
+
+def _expected(rows, fields):
+    for field in reversed(fields):
+        rows = sorted(rows, key=operator.attrgetter(field.lstrip('-')),
+                      reverse=field.startswith('-'))
+    return rows
+
+
+@pytest.mark.parametrize('fields', [
+    ('a',), ('-a', 'b'), ('c', '-a'), ('-c',), ('d', '-c', 'a'),
+])
+def test_sort_by(fields):
+    rows = _rows(1000)
+    expected = _expected(rows, fields)
+
+    def same(got, exp):
+        return len(got) == len(exp) and all(
+            x is y for x, y in zip(got, exp))
+
+    assert same(sort_by(rows, *fields), expected)
+    assert same(sort_by(rows, *fields, limit=300), expected[:300])
+    assert same(top_k(rows, 5, *fields), expected[:5])
+    assert same(top_k(rows, 5000, *fields), expected)
+
+
+def test_sort_by_descriptor_and_big_ints():
+    rows = [Row(2 ** 70, 0.0, '', None), Row(-1, 0.0, '', None)]
+    assert sort_by(rows, Row.a) == rows[::-1]
+    assert sort_by(iter(rows), '-a', limit=1) == rows[:1]
+    assert sort_by([], 'a') == []
+
+
+def test_sort_by_errors():
+    rows = _rows(3)
+    with pytest.raises(AttributeError):
+        sort_by(rows, 'missing')
+    with pytest.raises(TypeError):
+        sort_by(rows)
+    with pytest.raises(TypeError):
+        sort_by(rows + [(1, 2, 3, 4)], 'a')
+    with pytest.raises(TypeError):
+        sort_by(rows + [Row('x', 0.0, '', None)], 'a')
+    with pytest.raises(ValueError):
+        top_k(rows, -1, 'a')
+
+
+def test_sort_by_list_changed_by_keys():
+    class Key(object):
+        def __init__(self, value):
+            self.value = value
+
+        def __lt__(self, other):
+            rows.clear()
+            return self.value < other.value
+
+    rows = [Row(0, 0.0, 'x', Key(i % 7)) for i in range(50)]
+    expected = sorted(rows, key=lambda row: row.d.value)
+    result = sort_by(rows, 'd')
+    assert [row.d.value for row in result] == \
+        [row.d.value for row in expected]
+
+
+def test_key_by():
+    rows = _rows(100)
+    assert sorted(rows, key=key_by(Row, 'c', 'a')) == \
+        sorted(rows, key=lambda r: (r.c, r.a))
+    assert key_by(Row, Row.b)(rows[0]) == rows[0].b
+    with pytest.raises(TypeError):
+        key_by(tuple, 'a')
@@ -0,0 +1,206 @@
+import copy
+import gc
+import random
+
+import pytest
+
+from trafaretrecord import TrafaretRecord, trafaretrecord
+from trafaretrecord.table import RecordTable
+
+
+class Order(TrafaretRecord):
+    id: int
+    symbol: str
+    price: float
+
+
+def _orders(n):
+    rnd = random.Random(5)
+    return [Order(i, rnd.choice(['ACME', 'INIT', 'TECH']),
+                  float(rnd.randrange(50)))
+            for i in range(n)]
+
+
+def _table(orders):
+    return RecordTable(Order, orders, unique='id', index='symbol',
+                       ordered='price')
+
+
+def _check(table, orders):
+    assert len(table) == len(orders)
+    for order in orders:
+        assert table.get('id', order.id) is order
+    for symbol in ('ACME', 'INIT', 'TECH'):
+        assert sorted(o.id for o in table.find('symbol', symbol)) == \
+            sorted(o.id for o in orders if o.symbol == symbol)
+    by_price = table.range('price')
+    assert [o.price for o in by_price] == sorted(o.price for o in orders)
+    assert sorted(o.id for o in by_price) == sorted(o.id for o in orders)
+
+
+def test_lookups():
+    orders = _orders(300)
+    table = _table(orders)
+    _check(table, orders)
+    assert table.get('id', -1) is None
+    assert table.find('id', 7) == [orders[7]]
+    assert table.find('price', 3.0) == [o for o in orders if o.price == 3.0]
+    assert table.lookup('id')[7] is orders[7]
+    assert table.lookup('symbol')['ACME'] == table.find('symbol', 'ACME')
+    table.lookup('symbol')['ACME'].clear()     # a copy
+    assert table.find('symbol', 'ACME')
+    assert 'ACME' in table.lookup('symbol')
+    assert len(table.lookup('symbol')) == 3
+    with pytest.raises(TypeError):
+        table.lookup('id')[7] = None
+    with pytest.raises(TypeError):
+        table.get('symbol', 'ACME')
+    with pytest.raises(KeyError):
+        table.find('nope', 1)
+
+
+def test_range():
+    orders = _orders(300)
+    table = _table(orders)
+    by_price = sorted(orders, key=lambda o: o.price)
+    assert table.range('price', 10, 20) == \
+        [o for o in by_price if 10 <= o.price < 20]
+    assert table.range('price', 10, 20, inclusive=(False, True)) == \
+        [o for o in by_price if 10 < o.price <= 20]
+    assert table.range('price', high=5) == \
+        [o for o in by_price if o.price < 5]
+    with pytest.raises(TypeError):
+        table.range('symbol', 'A', 'B')
+
+
+def test_mutation_updates_indexes():
+    orders = _orders(200)
+    table = _table(orders)
+    rnd = random.Random(1)
+    for order in rnd.sample(orders, 50):
+        order.price = float(rnd.randrange(50))
+        order.symbol = rnd.choice(['ACME', 'INIT', 'TECH'])
+    order = orders[3]
+    order.id = 1000
+    order[2] = 99.0
+    order._replace(symbol='ZZZ')
+    _check(table, orders)
+    assert table.get('id', 3) is None
+    assert table.find('symbol', 'ZZZ') == [order]
+    assert table.range('price', 99)[-1] is order
+
+
+def test_unique_violation():
+    orders = _orders(10)
+    table = _table(orders)
+    with pytest.raises(ValueError):
+        orders[0].id = 1
+    assert orders[0].id == 0
+    with pytest.raises(ValueError):
+        table.add(Order(1, 'ACME', 1.0))
+    with pytest.raises(TypeError):
+        orders[0].id = []
+    _check(table, orders)
+
+
+def test_remove():
+    orders = _orders(20)
+    table = _table(orders)
+    removed = orders.pop(5)
+    table.remove(removed)
+    assert removed not in table
+    removed.id = 6  # no longer checked against the table
+    _check(table, orders)
+    with pytest.raises(KeyError):
+        table.remove(removed)
+    table.discard(removed)
+    table.clear()
+    assert len(table) == 0 and table.range('price') == []
+
+
+def test_rejection_leaves_other_tables():
+    orders = _orders(2)
+    first = RecordTable(Order, orders, index='id')
+    second = RecordTable(Order, orders, unique='id')
+    for assign in (lambda: setattr(orders[0], 'id', 1),
+                   lambda: orders[0].__setitem__(slice(0, 3),
+                                                 (1, 'NEW', 5.0))):
+        with pytest.raises(ValueError):
+            assign()
+        assert orders[0][:] == (0, orders[0].symbol, orders[0].price)
+        assert first.find('id', 0) == [orders[0]]
+        assert first.find('id', 1) == [orders[1]]
+        assert second.get('id', 0) is orders[0]
+
+
+def test_slice_assignment_updates_indexes():
+    orders = _orders(3)
+    table = _table(orders)
+    orders[0][:] = (10, 'NEW', 99.0)
+    assert table.get('id', 10) is orders[0]
+    assert table.find('symbol', 'NEW') == [orders[0]]
+    assert table.range('price', 99.0)[-1] is orders[0]
+    assert table.get('id', 0) is None
+
+
+
+def test_bad_slice_assignment():
+    orders = _orders(2)
+    table = _table(orders)
+    with pytest.raises(ValueError):
+        orders[0][0:2] = [1]
+    with pytest.raises(TypeError):
+        del orders[0][0:2]
+    with pytest.raises(TypeError):
+        del orders[0][0]
+    assert orders[0][:2] == (0, orders[0].symbol)
+    assert table.get('id', 0) is orders[0]
+
+
+def test_nan_keys():
+    orders = [Order(i, 'ACME', float('nan')) for i in range(3)]
+    table = _table(orders)
+    orders[1].price = 1.0
+    assert table.range('price', 1.0, 1.0, (True, True)) == [orders[1]]
+    assert table.range('price') == [orders[1], orders[0], orders[2]]
+    assert table.find('price', float('nan')) == []
+    table.remove(orders[2])
+    orders[0].price = 0.5
+    assert table.range('price') == [orders[0], orders[1]]
+
+
+def test_several_tables():
+    orders = _orders(20)
+    first = _table(orders)
+    second = RecordTable(Order, orders[:10], ordered='id')
+    first.remove(orders[0])
+    orders[0].id = 100
+    assert second.range('id')[-1] is orders[0]
+    assert first.get('id', 100) is None
+
+    del second
+    gc.collect()
+    orders[1].id = 101
+    assert first.get('id', 101) is orders[1]
+
+
+def test_copies_are_not_held():
+    orders = _orders(5)
+    table = _table(orders)
+    clone = copy.copy(orders[0])
+    clone.id = 1
+    assert table.get('id', 1) is orders[1]
+    assert clone not in table
+
+
+def test_record_types():
+    Point = trafaretrecord('Point', 'x y')
+    table = RecordTable(Point, [Point(1, 2)], unique='x')
+    table.get('x', 1).x = 5
+    assert table.get('x', 5) == (5, 2)
+    with pytest.raises(TypeError):
+        table.add(Order(1, 'ACME', 1.0))
+    with pytest.raises(ValueError):
+        RecordTable(Point, unique='z')
+    with pytest.raises(ValueError):
+        RecordTable(Point, unique='x', ordered='x')
@@ -1,6 +1,9 @@
+import copy
 import typing
 
-from trafaretrecord import TrafaretRecord
+import pytest
+
+from trafaretrecord import TrafaretRecord, computed
 
 
 def test_initialization():
@@ -77,6 +80,90 @@ def test_typing_self():
            {'same': typing.Type['A'], 'many': typing.Sequence[AnyTrafaret]}
     assert tmp.same is the_same
     assert tmp.many == [the_same, the_same]
-    eval_type = tmp._field_types['same']._subs_tree()[1]._eval_type(globals(),
-                                                                    locals())
-    assert eval_type is A
+    eval_type = typing._eval_type(tmp._field_types['same'], globals(),
+                                  locals())
+    assert typing.get_args(eval_type) == (A,)
+
+
+def test_computed_fields():
+    calls = []
+
+    class A(TrafaretRecord):
+        first: str
+        last: str
+        age: int
+
+        @computed('first', 'last')
+        def full(self):
+            calls.append('full')
+            return '%s %s' % (self.first, self.last)
+
+        @computed('age')
+        def adult(self):
+            calls.append('adult')
+            return self.age >= 18
+
+    tmp = A('John', 'Doe', 17)
+    assert A._computed_fields == ('full', 'adult')
+    assert tmp.full == 'John Doe'
+    assert tmp.full == 'John Doe'
+    assert calls == ['full']
+
+    tmp.age = 18
+    assert tmp.full == 'John Doe'
+    assert tmp.adult is True
+    assert calls == ['full', 'adult']
+
+    tmp.first = 'Jane'
+    assert tmp.full == 'Jane Doe'
+    tmp[1] = 'Roe'
+    assert tmp.full == 'Jane Roe'
+    tmp[:2] = ['J.', 'R.']
+    assert tmp.full == 'J. R.'
+    assert calls == ['full', 'adult', 'full', 'full', 'full']
+
+    del tmp.full
+    assert tmp.full == 'J. R.'
+    assert len(calls) == 6
+
+    with pytest.raises(AttributeError):
+        tmp.full = 'x'
+
+    # hidden slots stay out of the tuple protocol
+    assert len(tmp) == 3
+    assert tuple(tmp) == ('J.', 'R.', 18)
+    assert tmp == A('J.', 'R.', 18)
+    assert copy.deepcopy(tmp).full == 'J. R.'
+
+
+def test_computed_fields_subclass():
+    class A(TrafaretRecord):
+        x: int
+
+        @computed('x')
+        def double(self):
+            return self.x * 2
+
+    class B(A):
+        pass
+
+    class C(TrafaretRecord):
+        x: int
+
+    tmp = B(2)
+    tmp.note = 'subclass instances have a __dict__'
+    assert tmp.double == 4
+    tmp.x = 3
+    assert tmp.double == 6
+    assert tmp.note == 'subclass instances have a __dict__'
+    assert A(2).__sizeof__() > C(2).__sizeof__()
+
+
+def test_computed_fields_unknown_source():
+    with pytest.raises(ValueError):
+        class A(TrafaretRecord):
+            x: int
+
+            @computed('y')
+            def double(self):
+                return self.y * 2
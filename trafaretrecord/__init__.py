@@ -1,8 +1,14 @@
 # -*- coding: utf-8 -*-
+import os
 
-from .memoryslots import memoryslots, itemgetset
-from .constructor import trafaretrecord, TrafaretRecord
+from .memoryslots import memoryslots, itemgetset, sort_by, top_k, key_by, _C_API
+from .constructor import trafaretrecord, TrafaretRecord, computed, Embedded
 
 __author__ = """Vladimir Bolshakov"""
 __email__ = 'vovanbo@gmail.com'
 __version__ = '0.1.2'
+
+
+def get_include():
+    'Directory of memoryslots_api.h, for extensions using the C API'
+    return os.path.dirname(os.path.abspath(__file__))
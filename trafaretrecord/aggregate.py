@@ -0,0 +1,155 @@
+import os
+from functools import lru_cache
+from operator import itemgetter
+
+from .constructor import trafaretrecord
+from .memoryslots import _extract_column, _factorize, _group_aggregate
+
+AGGREGATES = ('sum', 'min', 'max', 'count', 'mean')
+
+
+def _parse_aggregate(name, spec):
+    if isinstance(spec, str):
+        spec = (spec, None)
+    op, field = spec
+    if op not in AGGREGATES:
+        raise ValueError('Unknown aggregate %r for %r' % (op, name))
+    if field is None and op != 'count':
+        raise ValueError('Aggregate %r of %r needs a field' % (op, name))
+    return op, field
+
+
+@lru_cache(maxsize=256)
+def _result_type(names):
+    'Record class of the aggregates ``names``, built once per spec'
+    return trafaretrecord('Aggregates', names)
+
+
+class _RecordColumns(object):
+    'Typed columns extracted from a sequence of records'
+
+    _formats = {int: 'q', float: 'd', bool: '?'}
+
+    def __init__(self, records):
+        self.records = records if isinstance(records, (list, tuple)) \
+            else list(records)
+        self.record_type = type(self.records[0]) if self.records else None
+        self._columns = {}
+
+    def _index(self, name):
+        return self.record_type._fields.index(name)
+
+    def _extract(self, name, format, exact=False):
+        column = self._columns.get((name, format, exact))
+        if column is None:
+            column = memoryview(_extract_column(
+                self.records, self._index(name), format, exact)).cast(format)
+            self._columns[name, format, exact] = column
+        return column
+
+    def values(self, name):
+        return list(map(itemgetter(self._index(name)), self.records))
+
+    def column(self, name):
+        field_types = getattr(self.record_type, '_field_types', {})
+        format = self._formats.get(field_types.get(name))
+        if format is not None:
+            return self._extract(name, format)
+        try:
+            return self._extract(name, 'q')
+        except (TypeError, OverflowError):
+            return self._extract(name, 'd')
+
+    def int_column(self, name):
+        field_type = getattr(self.record_type, '_field_types', {}).get(name)
+        if field_type not in (int, None):
+            return None
+        try:
+            # untyped fields may hold bools, that must stay bool keys
+            return self._extract(name, 'q', field_type is None)
+        except (TypeError, OverflowError):
+            return None
+
+
+class _ArrayColumns(object):
+    'Columns of a SharedRecordArray, used in place'
+
+    def __init__(self, shared):
+        self.record_type = shared.record_type
+        self._shared = shared
+
+    def values(self, name):
+        return self._shared.column(name).tolist()
+
+    def column(self, name):
+        return self._shared.column(name)
+
+    def int_column(self, name):
+        column = self._shared.column(name)
+        return column if column.format == 'q' else None
+
+
+def _key_column(columns, name):
+    """
+    Return the int64 keys of field ``name`` and the list of values that the
+    keys number, or None if the keys are the field values themselves
+    """
+    column = columns.int_column(name)
+    if column is not None:
+        return column, None
+    codes, values = _factorize(columns.values(name))
+    return memoryview(codes).cast('q'), values
+
+
+def group_by(source, by, threads=None, **aggregates):
+    """
+    Group records by the fields ``by`` and compute aggregates per group.
+
+    ``source`` is a sequence of records or a ``SharedRecordArray``.
+    Aggregates are given as keyword arguments ``name=(op, field)`` with op
+    one of ``sum``, ``min``, ``max``, ``count`` and ``mean``; ``count`` may
+    be given alone. The result maps every group key (a field value, or a
+    tuple of them when grouping by several fields) to a record of the
+    aggregates, in the order the groups first appear::
+
+        >>> totals = group_by(trades, 'side', volume=('sum', 'size'),
+        ...                   trades='count')
+        >>> totals['B'].volume
+
+    Only ``int``, ``float`` and ``bool`` fields can be aggregated. Grouping
+    and aggregation run in C without the GIL, split across ``threads``
+    threads (all CPUs by default) for large inputs. Idle threads are kept
+    for a moment to serve the next call, and the record class of every set
+    of aggregate names is kept as well.
+    """
+    if isinstance(by, str):
+        by = (by,)
+    if not by:
+        raise ValueError('group_by needs at least one field to group by')
+    specs = [(name,) + _parse_aggregate(name, spec)
+             for name, spec in aggregates.items()]
+
+    if hasattr(source, 'column') and hasattr(source, 'record_type'):
+        columns = _ArrayColumns(source)
+    else:
+        columns = _RecordColumns(source)
+    result_type = _result_type(tuple(name for name, _, _ in specs))
+    if columns.record_type is None:
+        return {}
+
+    keys, uniques = zip(*(_key_column(columns, name) for name in by))
+
+    groups, results = _group_aggregate(
+        keys,
+        [(op, None if op == 'count' else columns.column(field))
+         for _, op, field in specs],
+        threads or os.cpu_count() or 1,
+    )
+
+    result = {}
+    for group, values in zip(groups, zip(*results) if results
+                             else [()] * len(groups)):
+        key = tuple(code if names is None else names[code]
+                    for code, names in zip(group, uniques))
+        result[key[0] if len(key) == 1 else key] = result_type._make(values)
+    return result
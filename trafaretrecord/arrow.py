@@ -0,0 +1,105 @@
+from .memoryslots import (_arrow_column, _arrow_export, _arrow_import,
+                          _arrow_import_stream, _arrow_schema)
+
+# Arrow C data interface formats of the field types
+ARROW_FORMATS = {
+    int: 'l',
+    float: 'g',
+    bool: 'b',
+    str: 'u',
+    bytes: 'z',
+}
+
+# SharedRecordArray columns that already have the Arrow layout
+_SHARED_FORMATS = {'q': 'l', 'd': 'g'}
+
+
+def arrow_formats(record_type):
+    'Return the Arrow format string of every field of ``record_type``'
+    field_types = getattr(record_type, '_field_types', None)
+    if field_types is None:
+        raise TypeError('%s has no _field_types, declare it as '
+                        'a TrafaretRecord' % record_type.__name__)
+    formats = []
+    for name in record_type._fields:
+        format = ARROW_FORMATS.get(field_types[name])
+        if format is None:
+            raise TypeError('Field %r of %s has no Arrow type: %r' % (
+                name, record_type.__name__, field_types[name]))
+        formats.append(format)
+    return tuple(formats)
+
+
+class ArrowRecords(object):
+    """
+    Records of ``record_type`` exported through the Arrow PyCapsule
+    interface, so that Arrow consumers accept them directly::
+
+        >>> table = pyarrow.table(Trade.to_arrow(trades))
+
+    The records become a struct array with one nullable child array per
+    field, typed after ``_field_types``; ``None`` values are nulls. Columns
+    of a list of records are packed once, when the object is created. The
+    ``int`` and ``float`` columns of a ``SharedRecordArray`` are exported
+    without copying and stay referenced until the consumer releases them.
+    """
+
+    def __init__(self, record_type, source):
+        formats = arrow_formats(record_type)
+        if hasattr(source, 'column') and hasattr(source, 'record_type'):
+            if not issubclass(source.record_type, record_type):
+                raise TypeError('Expected an array of %s, got %s' % (
+                    record_type.__name__, source.record_type.__name__))
+            columns = [self._shared_column(source.column(name), format)
+                       for name, format in zip(record_type._fields, formats)]
+        else:
+            source = source if isinstance(source, (list, tuple)) \
+                else list(source)
+            for record in source:
+                if not isinstance(record, record_type):
+                    raise TypeError('Expected %s, got %s' % (
+                        record_type.__name__, type(record).__name__))
+            columns = [_arrow_column(source, index, format)
+                       for index, format in enumerate(formats)]
+
+        self.record_type = record_type
+        self.formats = tuple(format for format, _, _ in columns)
+        self._columns = tuple((null_count, buffers)
+                              for _, null_count, buffers in columns)
+        self._length = len(source)
+
+    @staticmethod
+    def _shared_column(column, format):
+        if _SHARED_FORMATS.get(column.format) == format:
+            return format, 0, (None, column)
+        return _arrow_column(column.tolist(), -1, format)
+
+    def __len__(self):
+        return self._length
+
+    def __repr__(self):
+        return '%s(%s, length=%d)' % (self.__class__.__name__,
+                                      self.record_type.__name__, self._length)
+
+    def __arrow_c_schema__(self):
+        return _arrow_schema(self.record_type._fields, self.formats)
+
+    def __arrow_c_array__(self, requested_schema=None):
+        return _arrow_export(self.record_type._fields, self.formats,
+                             self._columns, self._length)
+
+
+def from_arrow(record_type, data):
+    """
+    Return the list of records of ``record_type`` held by ``data``: an
+    object with ``__arrow_c_array__`` or ``__arrow_c_stream__`` (such as a
+    pyarrow ``RecordBatch`` or ``Table``), or a pair of ``arrow_schema`` and
+    ``arrow_array`` capsules. Every field must have a column of the same
+    name.
+    """
+    if hasattr(data, '__arrow_c_array__'):
+        return _arrow_import(record_type, *data.__arrow_c_array__())
+    if hasattr(data, '__arrow_c_stream__'):
+        return _arrow_import_stream(record_type, data.__arrow_c_stream__())
+    schema, array = data
+    return _arrow_import(record_type, schema, array)
@@ -1,17 +1,24 @@
 import itertools
+import json
 import logging
 import re
 import sys
+from collections import OrderedDict
+from collections.abc import Mapping
 from keyword import iskeyword as _iskeyword
 from typing import _type_check
 
+from .memoryslots import (cachedgetset, embeddedgetset, embeddedview,
+                          memoryslots, slotlayout)
+
 _PY36 = sys.version_info[:2] >= (3, 6)
 IDENTIFIER_REGEX = re.compile(r'^[a-z_][a-z0-9_]*$', flags=re.I)
 
 # attributes prohibited to set in TrafaretRecord class syntax
 _prohibited = ('__new__', '__init__', '__slots__', '__getnewargs__',
                '_fields', '_field_defaults', '_field_types',
-               '_make', '_replace', '_asdict')
+               '_make', '_replace', '_asdict', '_computed_fields',
+               '__slotlayout__', '_json_keys', '_embedded', '_view_type')
 
 _special = ('__module__', '__name__', '__qualname__', '__annotations__')
 
@@ -25,10 +32,17 @@ def isidentifier(s):
 _class_template = """\
 from builtins import property as _property
 from collections import OrderedDict
-from trafaretrecord.memoryslots import memoryslots, itemgetset
+from collections.abc import Mapping
+from trafaretrecord.memoryslots import memoryslots, itemgetset, slotlayout
+from trafaretrecord.predicate import RecordFilter
+from trafaretrecord.arrow import ArrowRecords, from_arrow
 
 _memoryslots = memoryslots
 _itemgetset = itemgetset
+_slotlayout = slotlayout
+_RecordFilter = RecordFilter
+_ArrowRecords = ArrowRecords
+_from_arrow = from_arrow
 
 class {typename}(memoryslots):
     '{typename}({arg_list})'
@@ -37,6 +51,10 @@ class {typename}(memoryslots):
 
     _fields = tuple({field_names!r})
 
+    __slotlayout__ = _slotlayout(0, (), {dirty_fields:d})
+
+    _json_keys = {json_keys!r}
+
     def __new__(_cls, {arg_list}):
         'Create new instance of {typename}({arg_list})'
         return _memoryslots.__new__(_cls, {arg_list})
@@ -51,6 +69,27 @@ class {typename}(memoryslots):
             )
         return result
 
+    @classmethod
+    def where(_cls, predicate):
+        \"\"\"
+        Return a filter of {typename} records satisfying predicate, built
+        from the fields like ({typename}.x > 0) & ~({typename}.x == 5)
+        \"\"\"
+        return _RecordFilter(_cls, predicate)
+
+    @classmethod
+    def to_arrow(_cls, records):
+        \"\"\"
+        Export {typename} records, or a SharedRecordArray of them, through
+        the Arrow PyCapsule interface
+        \"\"\"
+        return _ArrowRecords(_cls, records)
+
+    @classmethod
+    def from_arrow(_cls, data):
+        'Return the list of {typename} records of an Arrow array or stream'
+        return _from_arrow(_cls, data)
+
     def _replace(_self, **kwds):
         \"\"\"
         Return a new {typename} object replacing specified fields
@@ -90,7 +129,7 @@ _field_template = '    {name} = _itemgetset({index:d})'
 
 
 def trafaretrecord(typename, field_names, verbose=False, rename=False,
-                   source=True):
+                   source=True, track_dirty=False):
     """Returns a new subclass of array with named fields.
 
     >>> Point = trafaretrecord('Point', ['x', 'y'])
@@ -111,6 +150,9 @@ def trafaretrecord(typename, field_names, verbose=False, rename=False,
     Point(x=11, y=22)
     >>> p._replace(x=100)    # _replace() is like str.replace() but targets named fields
     Point(x=100, y=22)
+
+    With ``track_dirty=True`` every record remembers which fields were set
+    since it was created or since ``_clear_dirty()``, see ``_dirty_fields()``.
     """
 
     # Validate the field names.  At the user's option, either generate an error
@@ -156,6 +198,8 @@ def trafaretrecord(typename, field_names, verbose=False, rename=False,
         typename=typename,
         field_names=tuple(field_names),
         num_fields=len(field_names),
+        json_keys=_json_keys(field_names),
+        dirty_fields=len(field_names) if track_dirty else 0,
         arg_list=repr(tuple(field_names)).replace("'", "")[1:-1],
         repr_fmt=', '.join(_repr_template.format(name=name)
                            for name in field_names),
@@ -188,15 +232,261 @@ def trafaretrecord(typename, field_names, verbose=False, rename=False,
     return result
 
 
+def _json_keys(field_names):
+    'Encoded JSON object key of every field, with the preceding delimiter'
+    return tuple(
+        (b'{' if index == 0 else b',') +
+        json.dumps(name, ensure_ascii=False).encode('utf-8') + b':'
+        for index, name in enumerate(field_names)
+    )
+
+
+class computed(object):
+    """Declare a cached computed field of a TrafaretRecord.
+
+    >>> class Event(TrafaretRecord):
+    ...     name: str
+    ...
+    ...     @computed('name')
+    ...     def key(self):
+    ...         return self.name.lower()
+    >>> e = Event('Start')
+    >>> e.key
+    'start'
+    >>> e.name = 'Stop'
+    >>> e.key
+    'stop'
+
+    The value is computed on first access and kept in a hidden slot of the
+    record until one of the source fields is set.
+    """
+
+    def __init__(self, *sources):
+        self.sources = sources
+        self.func = None
+
+    def __call__(self, func):
+        self.func = func
+        return self
+
+
+def _add_computed_fields(klass, fields):
+    dependencies = [[] for _ in klass._fields]
+    embedded = getattr(klass, '_embedded', {})
+    for index, (name, field) in enumerate(fields):
+        if field.func is None:
+            raise TypeError('Computed field %r has no function' % name)
+        for source in field.sources:
+            if source in embedded:
+                offset, record_type = embedded[source]
+                positions = range(offset, offset + len(record_type._fields))
+            elif source in klass._fields:
+                positions = (klass._fields.index(source),)
+            else:
+                raise ValueError('Computed field %r depends on unknown '
+                                 'field %r' % (name, source))
+            for position in positions:
+                dependencies[position].append(index)
+        setattr(klass, name, cachedgetset(index, field.func))
+
+    klass.__slotlayout__ = slotlayout(len(fields), dependencies,
+                                      klass.__slotlayout__.dirty_fields)
+    klass._computed_fields = tuple(name for name, _ in fields)
+
+
+class Embedded(object):
+    """Annotation of a field holding a record embedded in the outer record.
+
+    >>> class Price(TrafaretRecord):
+    ...     amount: float
+    ...     currency: str
+    >>> class Order(TrafaretRecord):
+    ...     id: int
+    ...     price: Embedded[Price]
+    >>> order = Order(1, Price(9.5, 'EUR'))
+    >>> order._fields
+    ('id', 'price_amount', 'price_currency')
+    >>> order.price.amount
+    9.5
+
+    The fields of the embedded record are stored inline among the fields of
+    the outer record, prefixed with the field name, so no separate record
+    object is allocated. ``order.price`` is a view of them that reads and
+    writes the outer record; setting ``order.price`` copies the fields of a
+    record, a mapping of field names or a sequence into it, all at once.
+    """
+
+    def __init__(self, record_type):
+        if getattr(record_type, '_field_types', None) is None:
+            raise TypeError('Embedded record %r must be a TrafaretRecord' % (
+                record_type,))
+        self.record_type = record_type
+
+    def __class_getitem__(cls, record_type):
+        return cls(record_type)
+
+    def __call__(self, *args, **kwargs):
+        return self.record_type(*args, **kwargs)
+
+    def __repr__(self):
+        return 'Embedded[%s]' % self.record_type.__name__
+
+
+class _EmbeddedView(embeddedview):
+    'View of the fields of a record embedded in another record'
+
+    __slots__ = ()
+
+    def __len__(self):
+        return len(self._fields)
+
+    def __iter__(self):
+        return iter(self._record[self._offset:
+                                 self._offset + len(self._fields)])
+
+    def __getitem__(self, index):
+        return tuple(self)[index]
+
+    def __eq__(self, other):
+        if isinstance(other, (tuple, memoryslots, embeddedview)):
+            return tuple(self) == tuple(other)
+        return NotImplemented
+
+    __hash__ = None
+
+    def __repr__(self):
+        return '%s(%s)' % (self._record_type.__name__, ', '.join(
+            '%s=%r' % item for item in zip(self._fields, self)))
+
+    def _asdict(self):
+        return OrderedDict(zip(self._fields, self))
+
+    def _detach(self):
+        'Return a separate record of the embedded class with the same values'
+        return self._record_type._make(self)
+
+    @classmethod
+    def _values(cls, value):
+        'Return the values to set to the fields of a view from ``value``'
+        return _embedded_values(value, cls._record_type)
+
+
+def _view_type(record_type):
+    'The embeddedview subclass showing embedded records of ``record_type``'
+    view_type = record_type.__dict__.get('_view_type')
+    if view_type is not None:
+        return view_type
+
+    ns = {'__slots__': (), '_fields': record_type._fields,
+          '_record_type': record_type,
+          '__doc__': 'View of an embedded %s' % record_type.__name__}
+    for index, name in enumerate(record_type._fields):
+        ns[name] = embeddedgetset(index)
+    for name, (offset, embedded) in record_type._embedded.items():
+        ns[name] = embeddedgetset(offset, _view_type(embedded))
+    for name in getattr(record_type, '_computed_fields', ()):
+        ns[name] = property(record_type.__dict__[name].func)
+    view_type = type(record_type.__name__ + 'View', (_EmbeddedView,), ns)
+    record_type._view_type = view_type
+    return view_type
+
+
+def _embedded_values(value, record_type, name=None):
+    """
+    Return the values of the fields of the ``record_type`` given as
+    ``value`` for the embedded field ``name``: a record or view of
+    ``record_type``, a mapping of its field names, or a sequence of as many
+    values as it has fields
+    """
+    if isinstance(value, Mapping):
+        value = record_type(**value)
+    elif isinstance(value, (str, bytes, bytearray)) or \
+            isinstance(value, memoryslots) and \
+            not isinstance(value, record_type) or \
+            isinstance(value, embeddedview) and \
+            not issubclass(value._record_type, record_type):
+        raise TypeError('Expected %s%s, got %s' % (
+            record_type.__name__, _embedded_field(name),
+            type(value).__name__))
+    values = tuple(value)
+    if len(values) != len(record_type._fields):
+        raise TypeError('Expected %d values%s, got %d' % (
+            len(record_type._fields), _embedded_field(name), len(values)))
+    return values
+
+
+def _embedded_field(name):
+    return '' if name is None else ' for embedded field %r' % name
+
+
+_embedded_new_template = """\
+def __new__(_cls, {arg_list}):
+    'Create new instance of {typename}({arg_list})'
+    return _memoryslots.__new__(_cls, {values})
+"""
+
+
+def _flatten_embedded(types):
+    """
+    Return the field types with the fields of the embedded records inlined,
+    and the offset and record type of every embedded field
+    """
+    fields = []
+    embedded = {}
+    for name, field_type in types:
+        if not isinstance(field_type, Embedded):
+            fields.append((name, field_type))
+            continue
+        record_type = field_type.record_type
+        embedded[name] = (len(fields), record_type)
+        fields.extend(('%s_%s' % (name, field_name),
+                       record_type._field_types[field_name])
+                      for field_name in record_type._fields)
+    return fields, embedded
+
+
+def _add_embedded_fields(klass, names, embedded):
+    'Take the declared fields ``names`` in __new__, view embedded records'
+    values = []
+    for name in names:
+        if name in embedded:
+            values.append('*_embedded_values(%s, _%s_type, %r)' % (
+                name, name, name))
+        else:
+            values.append(name)
+    namespace = dict(_memoryslots=memoryslots,
+                     _embedded_values=_embedded_values)
+    namespace.update(('_%s_type' % name, record_type)
+                     for name, (offset, record_type) in embedded.items())
+    exec(_embedded_new_template.format(typename=klass.__name__,
+                                       arg_list=', '.join(names),
+                                       values=', '.join(values)), namespace)
+    klass.__new__ = staticmethod(namespace['__new__'])
+    klass.__reduce__ = _reduce_flat
+
+    for name, (offset, record_type) in embedded.items():
+        setattr(klass, name, embeddedgetset(offset, _view_type(record_type)))
+
+
+def _reduce_flat(self):
+    'Reduce to _make() of the fields, which __new__ takes nested'
+    return type(self)._make, (tuple(self),)
+
+
 # The below code is almost the same as
 # https://github.com/python/typing/blob/master/src/typing.py#L2060-L2154
 
-def _make_trafaretrecord(name, types):
+def _make_trafaretrecord(name, types, track_dirty=False):
     msg = "TrafaretRecord('Name', [(f0, t0), (f1, t1), ...]); " \
           "each t must be a type"
     types = [(n, _type_check(t, msg)) for n, t in types]
-    rec_cls = trafaretrecord(name, [n for n, t in types])
-    rec_cls._field_types = dict(types)
+    fields, embedded = _flatten_embedded(types)
+    rec_cls = trafaretrecord(name, [n for n, t in fields],
+                             track_dirty=track_dirty)
+    rec_cls._field_types = dict(fields)
+    rec_cls._embedded = embedded
+    if embedded:
+        _add_embedded_fields(rec_cls, [n for n, t in types], embedded)
     try:
         rec_cls.__module__ = \
             sys._getframe(2).f_globals.get('__name__', '__main__')
@@ -206,7 +496,7 @@ def _make_trafaretrecord(name, types):
 
 
 class TrafaretRecordMeta(type):
-    def __new__(cls, typename, bases, ns):
+    def __new__(cls, typename, bases, ns, track_dirty=False):
         if ns.get('_root', False):
             return super().__new__(cls, typename, bases, ns)
 
@@ -217,7 +507,7 @@ class TrafaretRecordMeta(type):
             )
 
         types = ns.get('__annotations__', {})
-        klass = _make_trafaretrecord(typename, types.items())
+        klass = _make_trafaretrecord(typename, types.items(), track_dirty)
 
         defaults = []
         defaults_dict = {}
@@ -235,14 +525,26 @@ class TrafaretRecordMeta(type):
                     )
                 )
         klass.__new__.__defaults__ = tuple(defaults)
+        for name, (offset, record_type) in klass._embedded.items():
+            if name in defaults_dict:
+                defaults_dict.update(zip(
+                    klass._fields[offset:],
+                    _embedded_values(defaults_dict.pop(name),
+                                     record_type, name)))
         klass._field_defaults = defaults_dict
+        computed_fields = [(key, value) for key, value in ns.items()
+                           if isinstance(value, computed)]
+        if computed_fields:
+            _add_computed_fields(klass, computed_fields)
         # update from user namespace without overriding special TrafaretRecord
         # attributes
         for key in ns:
             if key in _prohibited:
                 raise AttributeError("Cannot overwrite TrafaretRecordMeta "
                                      "attribute " + key)
-            elif key not in _special and key not in klass._fields:
+            elif key not in _special and key not in klass._fields and \
+                    key not in klass._embedded and \
+                    not isinstance(ns[key], computed):
                 setattr(klass, key, ns[key])
 
         return klass
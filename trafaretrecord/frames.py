@@ -0,0 +1,135 @@
+import asyncio
+
+from .memoryslots import _decode_frames, _encode_frames
+
+# frame codes of the field types, see memoryslots.c
+FRAME_CODES = {
+    bool: '?',
+    int: 'q',
+    float: 'd',
+    str: 'u',
+    bytes: 'z',
+}
+
+MAX_FRAME_SIZE = 16 * 1024 * 1024
+
+# compact the buffer once this many decoded bytes are ahead of the data
+_COMPACT_SIZE = 64 * 1024
+
+
+def frame_codes(record_type):
+    'Return the frame codes of the fields of ``record_type`` as a string'
+    field_types = getattr(record_type, '_field_types', None)
+    if field_types is None:
+        raise TypeError('%s has no _field_types, declare it as '
+                        'a TrafaretRecord' % record_type.__name__)
+    codes = []
+    for name in record_type._fields:
+        code = FRAME_CODES.get(field_types[name])
+        if code is None:
+            raise TypeError('Field %r of %s has no frame encoding: %r' % (
+                name, record_type.__name__, field_types[name]))
+        codes.append(code)
+    return ''.join(codes)
+
+
+def encode_frames(record_type, records):
+    """
+    Return ``records`` of ``record_type`` encoded as length-prefixed frames,
+    one frame per record, as read by ``FrameDecoder``
+    """
+    return _encode_frames(frame_codes(record_type), records)
+
+
+class FrameDecoder(object):
+    """
+    Incremental decoder of length-prefixed frames of records.
+
+    Every frame is the payload size as a little-endian uint32 followed by
+    the fields of one record of ``record_type``: ``bool`` as one byte,
+    ``int`` and ``float`` as little-endian int64 and double, ``str`` and
+    ``bytes`` as a uint32 size and the UTF-8 or raw bytes. Byte chunks of
+    any size are given to ``feed()``; complete frames are decoded straight
+    into records by ``decode()``, and a partial frame waits for the next
+    chunks::
+
+        >>> decoder = FrameDecoder(Trade)
+        >>> decoder.feed(chunk)
+        >>> for trade in decoder.decode():
+        ...     handle(trade)
+
+    Frames larger than ``max_frame_size`` raise ValueError rather than
+    being buffered.
+    """
+
+    def __init__(self, record_type, max_frame_size=MAX_FRAME_SIZE):
+        self.record_type = record_type
+        self.max_frame_size = max_frame_size
+        self._codes = frame_codes(record_type)
+        self._buffer = bytearray()
+        self._offset = 0
+
+    def __repr__(self):
+        return '%s(%s, pending=%d)' % (self.__class__.__name__,
+                                       self.record_type.__name__,
+                                       self.pending)
+
+    @property
+    def pending(self):
+        'Number of bytes fed but not decoded yet'
+        return len(self._buffer) - self._offset
+
+    def feed(self, data):
+        'Add a chunk of bytes to the data to decode'
+        if self._offset and (self._offset == len(self._buffer) or
+                             self._offset >= _COMPACT_SIZE):
+            del self._buffer[:self._offset]
+            self._offset = 0
+        self._buffer += data
+
+    def decode(self, max_records=None):
+        """
+        Return the list of records of the complete frames fed so far, at
+        most ``max_records`` of them; the others stay buffered
+        """
+        records, self._offset = _decode_frames(
+            self.record_type, self._codes, self._buffer, self._offset,
+            -1 if max_records is None else max_records, self.max_frame_size)
+        return records
+
+    def close(self):
+        'Raise ValueError if the data fed ends with a partial frame'
+        if self.pending:
+            raise ValueError('Stream of %s ends inside a frame (%d bytes '
+                             'left)' % (self.record_type.__name__,
+                                        self.pending))
+
+
+async def read_frames(reader, record_type, batch_size=1024,
+                      chunk_size=64 * 1024, max_frame_size=MAX_FRAME_SIZE):
+    """
+    Asynchronously iterate over the records of ``record_type`` read from
+    the ``asyncio.StreamReader`` ``reader`` in frames, as lists of at most
+    ``batch_size`` records::
+
+        >>> async for trades in read_frames(reader, Trade):
+        ...     book.extend(trades)
+
+    The event loop runs other tasks between batches, also when the data
+    read holds many of them. Raises ValueError if the stream ends inside a
+    frame.
+    """
+    decoder = FrameDecoder(record_type, max_frame_size)
+    while True:
+        records = decoder.decode(batch_size)
+        if records:
+            yield records
+            if len(records) == batch_size:
+                # more may be buffered already, let other tasks run first
+                await asyncio.sleep(0)
+                continue
+        chunk = await reader.read(chunk_size)
+        if not chunk:
+            decoder.close()
+            return
+        decoder.feed(chunk)
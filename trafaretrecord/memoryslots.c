@@ -2,56 +2,377 @@
 
 #include "pyconfig.h"
 #include "Python.h"
+#include "structmember.h"
+#include <time.h>
+#ifndef MS_WINDOWS
+#include <pthread.h>
+#endif
+
+#define MEMORYSLOTS_MODULE
+#include "memoryslots_api.h"
+
+#if PY_VERSION_HEX < 0x03090000
+#error "trafaretrecord.memoryslots requires Python 3.9 or newer"
+#endif
+
+/* Per-interpreter module state.  All types are heap types created from specs
+ * in memoryslots_exec(), so every (sub)interpreter importing the module gets
+ * its own independent set of type objects. */
+
+/* The slotlayout of a record class, valid while the class keeps the
+ * version tag it had when the entry was made: any change of the class
+ * attributes, or of those of its bases, gives it a new tag. */
+typedef struct {
+    PyTypeObject *type;         /* not owned, only compared */
+    unsigned int version;
+    PyObject *layout;           /* borrowed from the class, may be NULL */
+} layout_cache_entry;
+
+#define LAYOUT_CACHE_SIZE 64    /* a power of two */
+
+typedef struct {
+    PyTypeObject *memoryslots_type;
+    PyTypeObject *memoryslotsiter_type;
+    PyTypeObject *itemgetset_type;
+    PyTypeObject *slotlayout_type;
+    PyTypeObject *cachedgetset_type;
+    PyTypeObject *predicate_type;
+    PyTypeObject *embeddedview_type;
+    PyTypeObject *embeddedgetset_type;
+    PyObject *str_slotlayout;
+    PyObject *str_deepcopy;
+    PyObject *str_field_check;
+    PyObject *str_field_changed;
+    PyObject *str_json_keys;
+    PyObject *str_fields;
+    PyObject *str_field_types;
+    PyObject *str_values;
+    PyObject *str_embedded;
+    PyObject *copy_deepcopy;    /* copy.deepcopy, imported on first use */
+    layout_cache_entry layout_cache[LAYOUT_CACHE_SIZE];
+} memoryslots_state;
+
+static struct PyModuleDef memoryslotsmodule;
+
+static inline memoryslots_state *
+get_memoryslots_state(PyObject *module)
+{
+    void *state = PyModule_GetState(module);
+    assert(state != NULL);
+    return (memoryslots_state *)state;
+}
+
+#if PY_VERSION_HEX < 0x030B0000
+static PyObject *
+PyType_GetModuleByDef(PyTypeObject *type, PyModuleDef *def)
+{
+    PyObject *mro = type->tp_mro;
+    Py_ssize_t i, n;
 
-#ifndef Py_RETURN_NOTIMPLEMENTED
-/* Macro for returning Py_NotImplemented from a function */
-#define Py_RETURN_NOTIMPLEMENTED \
-    return Py_INCREF(Py_NotImplemented), Py_NotImplemented
+    assert(mro != NULL && PyTuple_Check(mro));
+    n = PyTuple_GET_SIZE(mro);
+    for (i = 0; i < n; i++) {
+        PyTypeObject *base = (PyTypeObject *)PyTuple_GET_ITEM(mro, i);
+        PyObject *module;
+
+        if (!PyType_HasFeature(base, Py_TPFLAGS_HEAPTYPE))
+            continue;
+        module = ((PyHeapTypeObject *)base)->ht_module;
+        if (module != NULL && PyModule_GetDef(module) == def)
+            return module;
+    }
+
+    PyErr_Format(PyExc_TypeError,
+                 "PyType_GetModuleByDef: No superclass of '%s' has the given module",
+                 type->tp_name);
+    return NULL;
+}
 #endif
 
-#if PY_MAJOR_VERSION == 2
+/* The module that defined type, if it is one of this module's types */
+static inline PyObject *
+memoryslots_type_module(PyTypeObject *type)
+{
+    PyObject *module;
+
+    if (!PyType_HasFeature(type, Py_TPFLAGS_HEAPTYPE))
+        return NULL;
+    module = ((PyHeapTypeObject *)type)->ht_module;
+    if (module == NULL || PyModule_GetDef(module) != &memoryslotsmodule)
+        return NULL;
+    return module;
+}
+
+/* Find the module state through any subclass of the module's types.  The
+ * state is needed on every iteration, comparison, slice and pickle of a
+ * record, so the module's own types and the record classes deriving from
+ * them directly are recognized first, without walking the MRO. */
+static memoryslots_state *
+memoryslots_state_by_type(PyTypeObject *type)
+{
+    PyObject *module = memoryslots_type_module(type);
+
+    if (module == NULL && type->tp_base != NULL)
+        module = memoryslots_type_module(type->tp_base);
+    if (module == NULL) {
+        module = PyType_GetModuleByDef(type, &memoryslotsmodule);
+        if (module == NULL)
+            return NULL;
+    }
+    return get_memoryslots_state(module);
+}
+
 static PyObject *
-_PyObject_GetBuiltin(const char *name)
+memoryslots_get_builtin(const char *name)
 {
-    PyObject *mod_name, *mod, *attr;
+    PyObject *builtins, *attr;
 
-    mod_name = PyUnicode_FromString("__builtin__");   /* borrowed */
-    if (mod_name == NULL)
+    builtins = PyEval_GetBuiltins();   /* borrowed */
+    if (builtins == NULL)
         return NULL;
-    mod = PyImport_Import(mod_name);
-    if (mod == NULL)
+    attr = PyDict_GetItemString(builtins, name);   /* borrowed */
+    if (attr == NULL) {
+        PyErr_SetString(PyExc_AttributeError, name);
         return NULL;
-    attr = PyObject_GetAttrString(mod, name);
-    Py_DECREF(mod);
+    }
+    Py_INCREF(attr);
     return attr;
 }
+
+typedef PyTupleObject PyMemorySlotsObject;
+
+/* Every memoryslots instance carries one extra word past the end of its
+ * regular layout, that is after ob_item and after the __dict__/__weakref__
+ * pointers a Python subclass may add there.  The word holds the slotlayout
+ * of the record class, or NULL, and is followed by the hidden slots that
+ * the layout describes.  Hidden slots are not part of Py_SIZE, so they are
+ * invisible to len(), iteration, comparison and pickling.  Records of
+ * classes that track dirty fields end with a bitmap of the fields set
+ * since the record was created or last cleaned.
+ *
+ * The low bit of the word is set while the record is held by a table that
+ * indexes its fields (see memoryslots_notify()). */
+
+typedef struct {
+    PyObject_HEAD
+    Py_ssize_t n_hidden;      /* number of hidden slots */
+    Py_ssize_t n_fields;      /* number of fields with dependents */
+    Py_ssize_t *deps_start;   /* n_fields + 1 offsets into deps */
+    Py_ssize_t *deps;         /* hidden slots to reset when a field is set */
+    Py_ssize_t n_dirty;       /* number of fields tracked in the bitmap */
+    PyObject *observers;      /* list of (weak references to) tables */
+} slotlayout_object;
+
+#define MEMORYSLOTS_WATCHED ((uintptr_t)1)
+
+#define memoryslots_extra(op) \
+    ((PyObject **)((char *)(op) + Py_TYPE(op)->tp_basicsize + \
+                   Py_SIZE(op) * sizeof(PyObject *)))
+#define memoryslots_layout(op) \
+    ((slotlayout_object *)((uintptr_t)memoryslots_extra(op)[0] & \
+                           ~MEMORYSLOTS_WATCHED))
+#define memoryslots_watched(op) \
+    ((uintptr_t)memoryslots_extra(op)[0] & MEMORYSLOTS_WATCHED)
+#define memoryslots_hidden(op) (memoryslots_extra(op) + 1)
+
+#define DIRTY_BITS (8 * sizeof(size_t))
+#define dirty_words(n_dirty) (((n_dirty) + DIRTY_BITS - 1) / DIRTY_BITS)
+#define memoryslots_dirty(op, layout) \
+    ((size_t *)(memoryslots_hidden(op) + (layout)->n_hidden))
+
+/* Field i was set: mark it dirty and reset the hidden slots computed
+ * from it */
+static void
+memoryslots_invalidate(PyObject *op, Py_ssize_t i)
+{
+    slotlayout_object *layout = memoryslots_layout(op);
+    PyObject **hidden;
+    Py_ssize_t k;
+
+    if (layout == NULL)
+        return;
+    if (i < layout->n_dirty)
+        memoryslots_dirty(op, layout)[i / DIRTY_BITS] |=
+            (size_t)1 << (i % DIRTY_BITS);
+    if (i >= layout->n_fields)
+        return;
+
+    hidden = memoryslots_hidden(op);
+    for (k = layout->deps_start[i]; k < layout->deps_start[i + 1]; k++) {
+        Py_CLEAR(hidden[layout->deps[k]]);
+    }
+}
+
+/* Let every table holding a watched record accept the n values about to be
+ * set to the fields ilow..ilow+n-1.  All the tables first check every
+ * value with _field_check(record, i, value), which raises to refuse it
+ * (for example a duplicate key of a unique index); only when all of them
+ * accept, their indexes are updated with _field_changed(record, i, value).
+ * A refused value thus leaves every table and the record unchanged. */
+static int
+memoryslots_notify_many(PyObject *op, Py_ssize_t ilow, Py_ssize_t n,
+                        PyObject **values)
+{
+    slotlayout_object *layout;
+    memoryslots_state *state;
+    PyObject *observers, *tables = NULL, *index, *r;
+    PyObject *methods[2];
+    Py_ssize_t k, t, m;
+    int appended, res = -1;
+
+    if (!memoryslots_watched(op) || n == 0)
+        return 0;
+    layout = memoryslots_layout(op);
+    if (layout == NULL || PyList_GET_SIZE(layout->observers) == 0)
+        return 0;
+    state = memoryslots_state_by_type(Py_TYPE(op));
+    if (state == NULL)
+        return -1;
+
+    /* the tables may register or go away while they are called */
+    observers = PyList_AsTuple(layout->observers);
+    if (observers == NULL)
+        return -1;
+    tables = PyList_New(0);
+    if (tables == NULL)
+        goto done;
+    for (t = 0; t < PyTuple_GET_SIZE(observers); t++) {
+        PyObject *table = PyTuple_GET_ITEM(observers, t);
+
+        if (PyWeakref_Check(table)) {
+#if PY_VERSION_HEX >= 0x030D0000
+            if (PyWeakref_GetRef(table, &table) < 0)
+                goto done;
+            if (table == NULL)
+                continue;
+#else
+            table = PyWeakref_GetObject(table);   /* borrowed */
+            if (table == NULL)
+                goto done;
+            if (table == Py_None)
+                continue;
+            Py_INCREF(table);
 #endif
+        }
+        else {
+            Py_INCREF(table);
+        }
+        appended = PyList_Append(tables, table);
+        Py_DECREF(table);
+        if (appended < 0)
+            goto done;
+    }
 
-#define DEFERRED_ADDRESS(addr) 0
+    methods[0] = state->str_field_check;
+    methods[1] = state->str_field_changed;
+    for (m = 0; m < 2; m++) {
+        for (t = 0; t < PyList_GET_SIZE(tables); t++) {
+            for (k = 0; k < n; k++) {
+                index = PyLong_FromSsize_t(ilow + k);
+                if (index == NULL)
+                    goto done;
+                r = PyObject_CallMethodObjArgs(PyList_GET_ITEM(tables, t),
+                                               methods[m], op, index,
+                                               values[k], NULL);
+                Py_DECREF(index);
+                if (r == NULL)
+                    goto done;
+                Py_DECREF(r);
+            }
+        }
+    }
+    res = 0;
 
-static PyTypeObject PyMemorySlots_Type;
-typedef PyTupleObject PyMemorySlotsObject;
+done:
+    Py_XDECREF(tables);
+    Py_DECREF(observers);
+    return res;
+}
+
+#define memoryslots_notify(op, i, value) \
+    memoryslots_notify_many((op), (i), 1, &(value))
+
+/* Find the slotlayout declared by a record class as __slotlayout__.  Every
+ * new record needs it, so it is looked up once per class and version of
+ * the class, then taken from the layout cache of the module. */
+static int
+memoryslots_type_layout(PyTypeObject *type, slotlayout_object **layout)
+{
+    memoryslots_state *state;
+    layout_cache_entry *entry;
+    PyObject *ob;
+
+    *layout = NULL;
+    state = memoryslots_state_by_type(type);
+    if (state == NULL)
+        return -1;
+    if (type == state->memoryslots_type)
+        return 0;
+
+    entry = &state->layout_cache[((uintptr_t)type >> 4) &
+                                 (LAYOUT_CACHE_SIZE - 1)];
+    if (entry->type == type && entry->version == type->tp_version_tag &&
+        entry->version != 0 &&
+        PyType_HasFeature(type, Py_TPFLAGS_VALID_VERSION_TAG)) {
+        *layout = (slotlayout_object *)entry->layout;
+        return 0;
+    }
+
+    ob = PyObject_GetAttr((PyObject *)type, state->str_slotlayout);
+    if (ob == NULL) {
+        if (!PyErr_ExceptionMatches(PyExc_AttributeError))
+            return -1;
+        PyErr_Clear();
+    }
+    else if (ob == Py_None) {
+        Py_CLEAR(ob);
+    }
+    else if (!Py_IS_TYPE(ob, state->slotlayout_type)) {
+        PyErr_Format(PyExc_TypeError,
+                     "%.200s.__slotlayout__ must be a slotlayout, not %.200s",
+                     type->tp_name, Py_TYPE(ob)->tp_name);
+        Py_DECREF(ob);
+        return -1;
+    }
+    /* the lookup gave the class a version tag, that stays the same as long
+     * as the class holds the layout */
+    entry->type = type;
+    entry->version = PyType_HasFeature(type, Py_TPFLAGS_VALID_VERSION_TAG) ?
+                     type->tp_version_tag : 0;
+    entry->layout = ob;
+    Py_XDECREF(ob);
+    *layout = (slotlayout_object *)ob;
+    return 0;
+}
 
 PyObject *
-PyMemorySlots_New(Py_ssize_t size)
+PyMemorySlots_New(PyTypeObject *type, Py_ssize_t size)
 {
     PyMemorySlotsObject *op;
-    Py_ssize_t i;
+    slotlayout_object *layout;
+    Py_ssize_t n_extra;
 
     if (size < 0) {
         PyErr_BadInternalCall();
         return NULL;
     }
 
-    op = PyObject_GC_NewVar(PyMemorySlotsObject, &PyMemorySlots_Type, size);
-    if (op == NULL)
+    if (memoryslots_type_layout(type, &layout) < 0)
         return NULL;
+    n_extra = layout != NULL ?
+              layout->n_hidden + dirty_words(layout->n_dirty) : 0;
+    if (size > PY_SSIZE_T_MAX - 1 - n_extra)
+        return PyErr_NoMemory();
 
-    for (i = Py_SIZE(op); --i >= 0; ) {
-        op->ob_item[i] = NULL;
-    }
+    /* tp_alloc zero-fills the object, so the record starts clean, and
+     * starts GC tracking */
+    op = (PyMemorySlotsObject*)(type->tp_alloc(type, size + 1 + n_extra));
+    if (op == NULL)
+        return NULL;
 
-    PyObject_GC_Track(op);
+    Py_SET_SIZE(op, size);
+    Py_XINCREF(layout);
+    memoryslots_extra(op)[0] = (PyObject *)layout;
 
     return (PyObject*)op;
 }
@@ -65,7 +386,7 @@ memoryslots_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
     PyObject *item;
 
     if (args == NULL)
-        return PyMemorySlots_New(0);
+        return PyMemorySlots_New(type, 0);
 
     tmp = (PyTupleObject*)PySequence_Tuple(args);
     if (tmp == NULL)
@@ -73,13 +394,7 @@ memoryslots_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 
     n = PyTuple_GET_SIZE(tmp);
 
-    if (type == &PyMemorySlots_Type) {
-        newobj = (PyMemorySlotsObject*)PyMemorySlots_New(n);
-    } else {
-        assert(PyType_IsSubtype(type, &PyMemorySlots_Type));
-        newobj = (PyMemorySlotsObject*)(type->tp_alloc(type, n));
-    }
-
+    newobj = (PyMemorySlotsObject*)PyMemorySlots_New(type, n);
     if (newobj == NULL) {
         Py_DECREF(tmp);
         return NULL;
@@ -116,6 +431,22 @@ memoryslots_getnewargs(PyMemorySlotsObject *ob)
     return (PyObject*)res;
 }
 
+static void
+memoryslots_clear_hidden(PyMemorySlotsObject *op)
+{
+    slotlayout_object *layout = memoryslots_layout(op);
+    PyObject **hidden;
+    Py_ssize_t i;
+
+    if (layout == NULL)
+        return;
+
+    hidden = memoryslots_hidden(op);
+    for (i = layout->n_hidden; --i >= 0; ) {
+        Py_CLEAR(hidden[i]);
+    }
+}
+
 static int
 memoryslots_clear(PyMemorySlotsObject *op)
 {
@@ -124,12 +455,15 @@ memoryslots_clear(PyMemorySlotsObject *op)
     for (i = Py_SIZE(op); --i >= 0; ) {
         Py_CLEAR(op->ob_item[i]);
     }
+    memoryslots_clear_hidden(op);
     return 0;
 }
 
 static void
 memoryslots_dealloc(PyMemorySlotsObject *op)
 {
+    PyTypeObject *tp = Py_TYPE(op);
+    PyObject **extra;
     Py_ssize_t i;
 
     PyObject_GC_UnTrack(op);
@@ -137,18 +471,32 @@ memoryslots_dealloc(PyMemorySlotsObject *op)
     for (i = Py_SIZE(op); --i >= 0; ) {
         Py_CLEAR(op->ob_item[i]);
     }
-    Py_TYPE(op)->tp_free((PyObject *)op);
+    memoryslots_clear_hidden(op);
+    extra = memoryslots_extra(op);
+    Py_XDECREF(memoryslots_layout(op));
+    extra[0] = NULL;
+    tp->tp_free((PyObject *)op);
+    Py_DECREF(tp);
     /*Py_TRASHCAN_SAFE_END(op)*/
 }
 
 static int
 memoryslots_traverse(PyMemorySlotsObject *o, visitproc visit, void *arg)
 {
+    slotlayout_object *layout = memoryslots_layout(o);
     Py_ssize_t i;
 
+    Py_VISIT(Py_TYPE(o));
     for (i = Py_SIZE(o); --i >= 0; ) {
         Py_VISIT(o->ob_item[i]);
     }
+    if (layout != NULL) {
+        PyObject **hidden = memoryslots_hidden(o);
+
+        for (i = layout->n_hidden; --i >= 0; ) {
+            Py_VISIT(hidden[i]);
+        }
+    }
     return 0;
 }
 
@@ -162,22 +510,17 @@ memoryslots_repr(PyObject *dd)
     n = PyTuple_GET_SIZE(dd);
 
     if (n == 0) {
-#if PY_MAJOR_VERSION >= 3
         result = PyUnicode_FromString("memoryslots()\0");
-#else
-        result = PyString_FromString("memoryslots()\0");
-#endif
         return result;
     }
 
     if (n == 1) {
         v = PyTuple_GET_ITEM(dd, 0);
         baserepr = PyObject_Repr(v);
-#if PY_MAJOR_VERSION >= 3
+        if (baserepr == NULL)
+            return NULL;
         result = PyUnicode_FromFormat("memoryslots(%U)", baserepr);
-#else
-        result = PyString_FromFormat("memoryslots(%s)", PyString_AS_STRING(baserepr));
-#endif
+        Py_DECREF(baserepr);
         return result;
     }
 
@@ -185,11 +528,7 @@ memoryslots_repr(PyObject *dd)
     if (baserepr == NULL)
         return NULL;
 
-#if PY_MAJOR_VERSION >= 3
     result = PyUnicode_FromFormat("memoryslots%U", baserepr);
-#else
-    result = PyString_FromFormat("memoryslots%s", PyString_AS_STRING(baserepr));
-#endif
     Py_DECREF(baserepr);
     return result;
 }
@@ -205,6 +544,7 @@ memoryslots_concat(PyTupleObject *a, PyObject *bb)
     Py_ssize_t i, n;
     PyObject **src, **dest;
     PyTupleObject *np;
+    memoryslots_state *state;
 
     if (!PyTuple_Check(bb)) {
         PyErr_Format(PyExc_TypeError,
@@ -212,12 +552,17 @@ memoryslots_concat(PyTupleObject *a, PyObject *bb)
                  Py_TYPE(bb)->tp_name);
         return NULL;
     }
+
+    state = memoryslots_state_by_type(Py_TYPE(a));
+    if (state == NULL)
+        return NULL;
+
 #define b ((PyTupleObject *)bb)
     size = Py_SIZE(a) + Py_SIZE(b);
     if (size < 0)
         return PyErr_NoMemory();
 
-    np = (PyTupleObject *) PyMemorySlots_New(size);
+    np = (PyTupleObject *) PyMemorySlots_New(state->memoryslots_type, size);
     if (np == NULL) {
         return NULL;
     }
@@ -255,6 +600,11 @@ memoryslots_slice(PyObject *a, Py_ssize_t ilow, Py_ssize_t ihigh)
     PyObject **src, **dest;
     Py_ssize_t i;
     Py_ssize_t len;
+    memoryslots_state *state;
+
+    state = memoryslots_state_by_type(Py_TYPE(a));
+    if (state == NULL)
+        return NULL;
 
     if (ilow < 0)
         ilow = 0;
@@ -262,17 +612,18 @@ memoryslots_slice(PyObject *a, Py_ssize_t ilow, Py_ssize_t ihigh)
         ihigh = Py_SIZE(a);
     if (ihigh < ilow)
         ihigh = ilow;
-    if (ilow == 0 && ihigh == Py_SIZE(a) && Py_TYPE(a) == &PyMemorySlots_Type) {
+    if (ilow == 0 && ihigh == Py_SIZE(a) && Py_TYPE(a) == state->memoryslots_type) {
         Py_INCREF(a);
         return a;
     }
 
     len = ihigh - ilow;
 
-    if (Py_TYPE(a) == &PyMemorySlots_Type)
-        np = (PyTupleObject*)PyMemorySlots_New(len);
-    else
-        np = (PyTupleObject*)(Py_TYPE(a)->tp_alloc(Py_TYPE(a), len));
+    /* a record class lays out its fields, hidden slots and layout word
+     * for exactly Py_SIZE(a) items, so a partial slice is a plain
+     * memoryslots */
+    np = (PyTupleObject*)PyMemorySlots_New(
+        len == Py_SIZE(a) ? Py_TYPE(a) : state->memoryslots_type, len);
     if (np == NULL)
         return NULL;
 
@@ -294,13 +645,17 @@ memoryslots_ass_slice(PyObject *a, Py_ssize_t ilow, Py_ssize_t ihigh, PyObject *
 {
     PyObject **item;
     PyObject **vitem = NULL;
-    PyObject *v_as_SF = NULL; /* PySequence_Fast(v) */
+    PyObject *v_as_SF = NULL; /* PySequence_Tuple(v) */
     Py_ssize_t n;
     Py_ssize_t k;
     int result = -1;
 
-    if (v == NULL)
+    if (v == NULL) {
+        PyErr_Format(PyExc_TypeError,
+                     "'%.200s' object doesn't support item deletion",
+                     Py_TYPE(a)->tp_name);
         return result;
+    }
     else {
         if (a == v) {
             v = memoryslots_slice(v, 0, PyTuple_GET_SIZE(v));
@@ -311,12 +666,13 @@ memoryslots_ass_slice(PyObject *a, Py_ssize_t ilow, Py_ssize_t ihigh, PyObject *
             Py_DECREF(v);
             return result;
         }
-        v_as_SF = PySequence_Fast(v, "can only assign an iterable");
+        /* a copy, that the tables called below cannot change */
+        v_as_SF = PySequence_Tuple(v);
         if(v_as_SF == NULL) {
             return result;
         }
-        n = PySequence_Fast_GET_SIZE(v_as_SF);
-        vitem = PySequence_Fast_ITEMS(v_as_SF);
+        n = PyTuple_GET_SIZE(v_as_SF);
+        vitem = ((PyTupleObject *)v_as_SF)->ob_item;
     }
 
     if (ilow < 0)
@@ -330,18 +686,29 @@ memoryslots_ass_slice(PyObject *a, Py_ssize_t ilow, Py_ssize_t ihigh, PyObject *
         ihigh = Py_SIZE(a);
 
     if (n != ihigh - ilow) {
+        PyErr_Format(PyExc_ValueError,
+                     "attempt to assign sequence of size %zd "
+                     "to slice of size %zd", n, ihigh - ilow);
         Py_XDECREF(v_as_SF);
         return -1;
     }
 
+    /* the tables accept the whole slice before any field is set */
+    if (memoryslots_notify_many(a, ilow, n, vitem) < 0) {
+        Py_XDECREF(v_as_SF);
+        return -1;
+    }
     item = ((PyTupleObject*)a)->ob_item;
     if (n > 0) {
         for (k = 0; k < n; k++, ilow++) {
             PyObject *w = vitem[k];
-            PyObject *u = item[ilow];
-            Py_XDECREF(u);
-            item[ilow] = w;
+            PyObject *u;
+
+            u = item[ilow];
             Py_XINCREF(w);
+            item[ilow] = w;
+            memoryslots_invalidate(a, ilow);
+            Py_XDECREF(u);
         }
     }
     Py_XDECREF(v_as_SF);
@@ -360,13 +727,20 @@ memoryslots_ass_item(PyObject *a, Py_ssize_t i, PyObject *v)
         return -1;
     }
 
-    if (v == NULL)
+    if (v == NULL) {
+        PyErr_Format(PyExc_TypeError,
+                     "'%.200s' object doesn't support item deletion",
+                     Py_TYPE(a)->tp_name);
+        return -1;
+    }
+    if (memoryslots_notify(a, i, v) < 0)
         return -1;
 
     old_value = PyTuple_GET_ITEM(a, i);
-    Py_XDECREF(old_value);
-    PyTuple_SET_ITEM(a, i, v);
     Py_INCREF(v);
+    PyTuple_SET_ITEM(a, i, v);
+    memoryslots_invalidate(a, i);
+    Py_XDECREF(old_value);
     return 0;
 }
 
@@ -398,15 +772,9 @@ memoryslots_subscript(PyObject* self, PyObject* item)
     else if (PySlice_Check(item)) {
         Py_ssize_t start, stop, step, slicelength;
 
-#if PY_MAJOR_VERSION >= 3
         if (PySlice_GetIndicesEx(item, (PyTuple_GET_SIZE(self)), &start, &stop, &step, &slicelength) < 0) {
             return NULL;
         }
-#else
-        if (PySlice_GetIndicesEx(((PySliceObject*)item), (PyTuple_GET_SIZE(self)), &start, &stop, &step, &slicelength) < 0)  {
-            return NULL;
-        }
-#endif
 
         return memoryslots_slice((PyObject*)self, start, stop);
     }
@@ -426,21 +794,15 @@ memoryslots_ass_subscript(PyObject* self, PyObject* item, PyObject* value)
         if (i == -1 && PyErr_Occurred())
             return -1;
         if (i < 0)
-            i += PyList_GET_SIZE(self);
+            i += PyTuple_GET_SIZE(self);
         return memoryslots_ass_item(self, i, value);
     }
     else if (PySlice_Check(item)) {
         Py_ssize_t start, stop, step, slicelength;
 
-#if PY_MAJOR_VERSION >= 3
         if (PySlice_GetIndicesEx(item, (Py_SIZE(self)), &start, &stop, &step, &slicelength) < 0) {
             return -1;
         }
-#else
-        if (PySlice_GetIndicesEx(((PySliceObject*)item), (Py_SIZE(self)), &start, &stop, &step, &slicelength) < 0) {
-            return -1;
-        }
-#endif
 
         return memoryslots_ass_slice(self, start, stop, value);
 
@@ -448,7 +810,7 @@ memoryslots_ass_subscript(PyObject* self, PyObject* item, PyObject* value)
     else {
         PyErr_Format(PyExc_TypeError,
                      "indices must be integers, not %.200s",
-                     item->ob_type->tp_name);
+                     Py_TYPE(item)->tp_name);
         return -1;
     }
 }
@@ -460,15 +822,21 @@ memoryslots_repeat(PyTupleObject *a, Py_ssize_t n)
     Py_ssize_t size;
     PyTupleObject *np;
     PyObject **p, **items;
+    memoryslots_state *state;
+
+    state = memoryslots_state_by_type(Py_TYPE(a));
+    if (state == NULL)
+        return NULL;
+
     if (n < 0)
         n = 0;
     if (Py_SIZE(a) == 0) {
-        return PyMemorySlots_New(0);
+        return PyMemorySlots_New(state->memoryslots_type, 0);
     }
     if (n > PY_SSIZE_T_MAX / Py_SIZE(a))
         return PyErr_NoMemory();
     size = Py_SIZE(a);
-    np = (PyTupleObject *) PyMemorySlots_New(Py_SIZE(a) * n);
+    np = (PyTupleObject *) PyMemorySlots_New(state->memoryslots_type, Py_SIZE(a) * n);
     if (np == NULL)
         return NULL;
 
@@ -502,9 +870,14 @@ PyDoc_STRVAR(memoryslots_sizeof_doc,
 static PyObject *
 memoryslots_sizeof(PyMemorySlotsObject *self)
 {
+    slotlayout_object *layout = memoryslots_layout(self);
     Py_ssize_t res;
 
-    res = PyMemorySlots_Type.tp_basicsize + Py_SIZE(self) * sizeof(PyObject*);
+    res = Py_TYPE(self)->tp_basicsize + Py_SIZE(self) * sizeof(PyObject*);
+    res += sizeof(PyObject*);
+    if (layout != NULL)
+        res += (layout->n_hidden + dirty_words(layout->n_dirty)) *
+               sizeof(PyObject*);
     return PyLong_FromSsize_t(res);
 }
 
@@ -514,9 +887,14 @@ memoryslots_richcompare(PyObject *v, PyObject *w, int op)
     PyTupleObject *vt, *wt;
     Py_ssize_t i;
     Py_ssize_t vlen, wlen;
+    memoryslots_state *state;
 
-    if (!PyType_IsSubtype(Py_TYPE(v), &PyMemorySlots_Type) ||
-       (!PyType_IsSubtype(Py_TYPE(w), &PyMemorySlots_Type) && !PyTuple_Check(w)))
+    state = memoryslots_state_by_type(Py_TYPE(v));
+    if (state == NULL)
+        return NULL;
+
+    if (!PyObject_TypeCheck(v, state->memoryslots_type) ||
+       (!PyObject_TypeCheck(w, state->memoryslots_type) && !PyTuple_Check(w)))
         Py_RETURN_NOTIMPLEMENTED;
 
     vt = (PyTupleObject *)v;
@@ -581,481 +959,7427 @@ memoryslots_richcompare(PyObject *v, PyObject *w, int op)
     return PyObject_RichCompare(vt->ob_item[i], wt->ob_item[i], op);
 }
 
-static PySequenceMethods memoryslots_as_sequence = {
-    (lenfunc)memoryslots_len,                          /* sq_length */
-    (binaryfunc)memoryslots_concat,                    /* sq_concat */
-    (ssizeargfunc)memoryslots_repeat,                  /* sq_repeat */
-    (ssizeargfunc)memoryslots_item,                    /* sq_item */
-    0,                                                 /* sq_slice */
-    (ssizeobjargproc)memoryslots_ass_item,             /* sq_ass_item */
-    0,                                                 /* sq_ass_item */
-    0,                                                 /* sq_ass_slice */
-    0,                                                 /* sq_contains */
-};
+/*********************** copying **************************/
 
-static PyMappingMethods memoryslots_as_mapping = {
-    (lenfunc)memoryslots_len,
-    (binaryfunc)memoryslots_subscript,
-    (objobjargproc)memoryslots_ass_subscript
-};
+/* Copies keep the exact type of the record.  The instance __dict__ of a
+ * Python subclass without __slots__ is copied as well. */
 
-PyDoc_STRVAR(memoryslots_copy_doc, "D.copy() -> a shallow copy of D.");
+static int
+memoryslots_copy_dict(PyObject *ob, PyObject *copy, PyObject *memo,
+                      memoryslots_state *state);
+
+PyDoc_STRVAR(memoryslots_copy_doc, "D.__copy__() -> a shallow copy of D.");
 
 static PyObject *
 memoryslots_copy(PyObject *ob)
 {
-    return memoryslots_slice(ob, 0, PyTuple_GET_SIZE(ob));
-}
+    slotlayout_object *layout = memoryslots_layout(ob);
+    PyObject **src, **dest;
+    PyObject *np;
+    Py_ssize_t i, n = Py_SIZE(ob);
 
+    np = PyMemorySlots_New(Py_TYPE(ob), n);
+    if (np == NULL)
+        return NULL;
 
-PyDoc_STRVAR(memoryslots_reduce_doc, "D.__reduce__()");
+    src = ((PyTupleObject *)ob)->ob_item;
+    dest = ((PyTupleObject *)np)->ob_item;
+    for (i = 0; i < n; i++) {
+        Py_INCREF(src[i]);
+        dest[i] = src[i];
+    }
 
-static PyObject *
-memoryslots_reduce(PyObject *ob)
-{
-    PyObject *args;
-    PyObject *result;
-    PyObject *tmp;
+    /* cached computed fields still match the copied field values */
+    if (layout != NULL && memoryslots_layout(np) == layout) {
+        src = memoryslots_hidden(ob);
+        dest = memoryslots_hidden(np);
+        for (i = 0; i < layout->n_hidden; i++) {
+            Py_XINCREF(src[i]);
+            dest[i] = src[i];
+        }
+    }
 
-    tmp = PySequence_Tuple(ob);
-    args = PyTuple_Pack(1, tmp);
-    Py_DECREF(tmp);
-    if (args == NULL)
+    if (memoryslots_copy_dict(ob, np, NULL, NULL) < 0) {
+        Py_DECREF(np);
         return NULL;
-
-    result = PyTuple_Pack(2, &PyMemorySlots_Type, args);
-    Py_DECREF(args);
-    return result;
+    }
+    return np;
 }
 
+/* Remember in memo that ob was copied to copy, the same way as
+ * copy.deepcopy() does, and keep ob alive as long as memo unless the
+ * caller does: copy.deepcopy() keeps the object it called __deepcopy__ of
+ * alive itself. */
+static int
+memoryslots_memo_store(PyObject *memo, PyObject *ob, PyObject *copy,
+                       int keep)
+{
+    PyObject *key, *keep_alive;
+    int res;
 
-static PyMethodDef memoryslots_methods[] = {
-    {"__getnewargs__",          (PyCFunction)memoryslots_getnewargs,  METH_NOARGS},
-        /*{"copy", (PyCFunction)memoryslots_copy, METH_NOARGS, memoryslots_copy_doc},*/
-    {"__copy__", (PyCFunction)memoryslots_copy, METH_NOARGS, memoryslots_copy_doc},
-    {"__len__", (PyCFunction)memoryslots_len, METH_NOARGS, memoryslots_len_doc},
-    {"__sizeof__",      (PyCFunction)memoryslots_sizeof, METH_NOARGS, memoryslots_sizeof_doc},
-    {"__reduce__", (PyCFunction)memoryslots_reduce, METH_NOARGS, memoryslots_reduce_doc},
-    {NULL}
-};
-
-// static PyMemberDef memoryslots_members[] = {
-//     {"default_factory", T_OBJECT,
-//      offsetof(memoryslotsobject, default_factory), 0,
-//      PyDoc_STR("Factory for default value called by __missing__().")},
-//     {NULL}
-// };
-
-static PyObject* memoryslots_iter(PyObject *seq);
-
-static PyTypeObject PyMemorySlots_Type = {
-    PyVarObject_HEAD_INIT(DEFERRED_ADDRESS(&PyType_Type), 0)
-    "trafaretrecord.memoryslots.memoryslots",          /* tp_name */
-    sizeof(PyMemorySlotsObject) - sizeof(PyObject*),      /* tp_basicsize */
-    sizeof(PyObject*),                              /* tp_itemsize */
-    /* methods */
-    (destructor)memoryslots_dealloc,        /* tp_dealloc */
-    0,                                      /* tp_print */
-    0,                                      /* tp_getattr */
-    0,                                      /* tp_setattr */
-    0,                                      /* tp_reserved */
-    (reprfunc)memoryslots_repr,             /* tp_repr */
-    0,                                      /* tp_as_number */
-    &memoryslots_as_sequence,               /* tp_as_sequence */
-    &memoryslots_as_mapping,                /* tp_as_mapping */
-    PyObject_HashNotImplemented,            /* tp_hash */
-    0,                                      /* tp_call */
-    0,                                      /* tp_str */
-    PyObject_GenericGetAttr,                /* tp_getattro */
-    PyObject_GenericSetAttr,                /* tp_setattro */
-    0,                                      /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC | Py_TPFLAGS_BASETYPE,
-                                            /* tp_flags */
-    memoryslots_doc,                        /* tp_doc */
-    (traverseproc)memoryslots_traverse,     /* tp_traverse */
-    (inquiry)memoryslots_clear,             /* tp_clear */
-    memoryslots_richcompare,                /* tp_richcompare */
-    0,                                      /* tp_weaklistoffset*/
-    memoryslots_iter,                       /* tp_iter */
-    0,                                      /* tp_iternext */
-    memoryslots_methods,                    /* tp_methods */
-    0,                                      /* tp_members */
-    0,                                      /* tp_getset */
-    0,                                      /* tp_base */
-    0,                                      /* tp_memoryslots */
-    0,                                      /* tp_descr_get */
-    0,                                      /* tp_descr_set */
-    0,                                      /* tp_memoryslotsoffset */
-    0,                                      /* tp_init */
-    0,                                      /* tp_alloc */
-    memoryslots_new,                        /* tp_new */
-    PyObject_GC_Del,                        /* tp_free */
-    0                                       /* tp_is_gc */
-};
-
-/*********************** MemorySlots Iterator **************************/
-
-typedef struct {
-    PyObject_HEAD
-    Py_ssize_t it_index;
-    PyTupleObject *it_seq; /* Set to NULL when iterator is exhausted */
-} memoryslotsiterobject;
+    key = PyLong_FromVoidPtr(ob);
+    if (key == NULL)
+        return -1;
+    res = PyDict_SetItem(memo, key, copy);
+    Py_DECREF(key);
+    if (res < 0 || !keep)
+        return res;
 
-static void
-memoryslotsiter_dealloc(memoryslotsiterobject *it)
-{
-    PyObject_GC_UnTrack(it);
-    Py_CLEAR(it->it_seq);
-    PyObject_GC_Del(it);
+    key = PyLong_FromVoidPtr(memo);
+    if (key == NULL)
+        return -1;
+    keep_alive = PyDict_GetItemWithError(memo, key);   /* borrowed */
+    if (keep_alive == NULL) {
+        if (PyErr_Occurred() || (keep_alive = PyList_New(0)) == NULL) {
+            Py_DECREF(key);
+            return -1;
+        }
+        res = PyDict_SetItem(memo, key, keep_alive);
+        Py_DECREF(keep_alive);
+        if (res < 0) {
+            Py_DECREF(key);
+            return -1;
+        }
+    }
+    Py_DECREF(key);
+    return PyList_Append(keep_alive, ob);
 }
 
-static int
-memoryslotsiter_traverse(memoryslotsiterobject *it, visitproc visit, void *arg)
+static PyObject *
+memoryslots_memo_lookup(PyObject *memo, PyObject *ob)
 {
-    Py_VISIT(it->it_seq);
-    return 0;
-}
+    PyObject *key, *copy;
 
-static int
-memoryslotsiter_clear(memoryslotsiterobject *it)
-{
-    Py_CLEAR(it->it_seq);
-    return 0;
+    key = PyLong_FromVoidPtr(ob);
+    if (key == NULL)
+        return NULL;
+    copy = PyDict_GetItemWithError(memo, key);   /* borrowed */
+    Py_DECREF(key);
+    Py_XINCREF(copy);
+    return copy;
 }
 
+static PyObject *memoryslots_deepcopy_object(memoryslots_state *state,
+                                             PyObject *ob, PyObject *memo);
+
 static PyObject *
-memoryslotsiter_next(memoryslotsiterobject *it)
+memoryslots_deepcopy_list(memoryslots_state *state, PyObject *ob, PyObject *memo)
 {
-    PyTupleObject *seq;
-    PyObject *item;
+    PyObject *copy, *item, *v;
+    Py_ssize_t i;
 
-    assert(it != NULL);
-    seq = it->it_seq;
-    if (seq == NULL)
+    copy = PyList_New(0);
+    if (copy == NULL)
         return NULL;
-    assert(PyTuple_Check(seq));
+    if (memoryslots_memo_store(memo, ob, copy, 1) < 0)
+        goto error;
 
-    if (it->it_index < PyTuple_GET_SIZE(seq)) {
-        item = PyTuple_GET_ITEM(seq, it->it_index);
+    /* the list may change while an item is copied by Python code */
+    for (i = 0; i < PyList_GET_SIZE(ob); i++) {
+        item = PyList_GET_ITEM(ob, i);
         Py_INCREF(item);
-        ++it->it_index;
-        return item;
+        v = memoryslots_deepcopy_object(state, item, memo);
+        Py_DECREF(item);
+        if (v == NULL)
+            goto error;
+        if (PyList_Append(copy, v) < 0) {
+            Py_DECREF(v);
+            goto error;
+        }
+        Py_DECREF(v);
     }
+    return copy;
 
-    Py_DECREF(seq);
-    it->it_seq = NULL;
+error:
+    Py_DECREF(copy);
     return NULL;
 }
 
 static PyObject *
-memoryslotsiter_len(memoryslotsiterobject *it)
+memoryslots_deepcopy_dict(memoryslots_state *state, PyObject *ob, PyObject *memo)
 {
-    Py_ssize_t len = 0;
-    if (it->it_seq)
-        len = PyTuple_GET_SIZE(it->it_seq) - it->it_index;
-    return PyLong_FromSsize_t(len);
-}
+    PyObject *copy, *key, *value, *k, *v;
+    Py_ssize_t pos = 0;
 
-PyDoc_STRVAR(length_hint_doc, "Private method returning an estimate of len(list(it)).");
+    copy = PyDict_New();
+    if (copy == NULL)
+        return NULL;
+    if (memoryslots_memo_store(memo, ob, copy, 1) < 0)
+        goto error;
+
+    while (PyDict_Next(ob, &pos, &key, &value)) {
+        Py_INCREF(key);
+        Py_INCREF(value);
+        k = memoryslots_deepcopy_object(state, key, memo);
+        v = k != NULL ? memoryslots_deepcopy_object(state, value, memo) : NULL;
+        Py_DECREF(key);
+        Py_DECREF(value);
+        if (v == NULL || PyDict_SetItem(copy, k, v) < 0) {
+            Py_XDECREF(k);
+            Py_XDECREF(v);
+            goto error;
+        }
+        Py_DECREF(k);
+        Py_DECREF(v);
+    }
+    return copy;
+
+error:
+    Py_DECREF(copy);
+    return NULL;
+}
 
 static PyObject *
-memoryslotsiter_reduce(memoryslotsiterobject *it)
+memoryslots_deepcopy_tuple(memoryslots_state *state, PyObject *ob, PyObject *memo)
 {
-    if (it->it_seq)
-        return Py_BuildValue("N(O)n", _PyObject_GetBuiltin("iter"),
-                             it->it_seq, it->it_index);
+    PyObject *copy, *v;
+    Py_ssize_t i, n = PyTuple_GET_SIZE(ob);
+    int changed = 0;
+
+    copy = PyTuple_New(n);
+    if (copy == NULL)
+        return NULL;
+    for (i = 0; i < n; i++) {
+        v = memoryslots_deepcopy_object(state, PyTuple_GET_ITEM(ob, i), memo);
+        if (v == NULL) {
+            Py_DECREF(copy);
+            return NULL;
+        }
+        changed |= v != PyTuple_GET_ITEM(ob, i);
+        PyTuple_SET_ITEM(copy, i, v);
+    }
+
+    /* a tuple of atoms is its own copy, like in copy.deepcopy() */
+    if (!changed) {
+        Py_DECREF(copy);
+        Py_INCREF(ob);
+        return ob;
+    }
+    /* the tuple may have been copied through a cycle of its items */
+    v = memoryslots_memo_lookup(memo, ob);
+    if (v != NULL || PyErr_Occurred()) {
+        Py_DECREF(copy);
+        return v;
+    }
+    if (memoryslots_memo_store(memo, ob, copy, 1) < 0) {
+        Py_DECREF(copy);
+        return NULL;
+    }
+    return copy;
+}
+
+static PyObject *
+memoryslots_deepcopy_record(memoryslots_state *state, PyObject *ob,
+                            PyObject *memo, int keep)
+{
+    PyObject *copy, *item, *v;
+    PyObject **dest;
+    Py_ssize_t i, n = Py_SIZE(ob);
+
+    copy = PyMemorySlots_New(Py_TYPE(ob), n);
+    if (copy == NULL)
+        return NULL;
+    /* the copy may be reached through a cycle before it is filled */
+    dest = ((PyTupleObject *)copy)->ob_item;
+    for (i = 0; i < n; i++) {
+        Py_INCREF(Py_None);
+        dest[i] = Py_None;
+    }
+    if (memoryslots_memo_store(memo, ob, copy, keep) < 0)
+        goto error;
+
+    for (i = 0; i < n; i++) {
+        /* the field may be set while it is copied by Python code */
+        item = PyTuple_GET_ITEM(ob, i);
+        Py_INCREF(item);
+        v = memoryslots_deepcopy_object(state, item, memo);
+        Py_DECREF(item);
+        if (v == NULL)
+            goto error;
+        Py_SETREF(dest[i], v);
+    }
+
+    /* cached computed fields are left to be recomputed from the copies */
+    if (memoryslots_copy_dict(ob, copy, memo, state) < 0)
+        goto error;
+    return copy;
+
+error:
+    Py_DECREF(copy);
+    return NULL;
+}
+
+/* True if a record of type tp does not override __deepcopy__ */
+static int
+memoryslots_native_deepcopy(memoryslots_state *state, PyTypeObject *tp)
+{
+    PyObject *method, *native;
+    int res;
+
+    if (tp == state->memoryslots_type)
+        return 1;
+    method = PyObject_GetAttr((PyObject *)tp, state->str_deepcopy);
+    if (method == NULL)
+        return -1;
+    native = PyObject_GetAttr((PyObject *)state->memoryslots_type,
+                              state->str_deepcopy);
+    if (native == NULL) {
+        Py_DECREF(method);
+        return -1;
+    }
+    res = method == native;
+    Py_DECREF(method);
+    Py_DECREF(native);
+    return res;
+}
+
+static PyObject *
+memoryslots_deepcopy_fallback(memoryslots_state *state, PyObject *ob,
+                              PyObject *memo)
+{
+    PyObject *copy_module;
+
+    if (state->copy_deepcopy == NULL) {
+        copy_module = PyImport_ImportModule("copy");
+        if (copy_module == NULL)
+            return NULL;
+        state->copy_deepcopy = PyObject_GetAttrString(copy_module, "deepcopy");
+        Py_DECREF(copy_module);
+        if (state->copy_deepcopy == NULL)
+            return NULL;
+    }
+    return PyObject_CallFunctionObjArgs(state->copy_deepcopy, ob, memo, NULL);
+}
+
+/* Deep copy of ob: records, lists, dicts and tuples are copied here and
+ * atoms are shared; anything else goes through copy.deepcopy() with the
+ * same memo. */
+static PyObject *
+memoryslots_deepcopy_object(memoryslots_state *state, PyObject *ob, PyObject *memo)
+{
+    PyTypeObject *tp = Py_TYPE(ob);
+    PyObject *copy;
+    int native;
+
+    if (ob == Py_None || ob == Py_Ellipsis || ob == Py_NotImplemented ||
+        tp == &PyLong_Type || tp == &PyFloat_Type || tp == &PyBool_Type ||
+        tp == &PyUnicode_Type || tp == &PyBytes_Type ||
+        tp == &PyComplex_Type || PyType_Check(ob) ||
+        PyFunction_Check(ob) || PyCFunction_Check(ob)) {
+        Py_INCREF(ob);
+        return ob;
+    }
+
+    copy = memoryslots_memo_lookup(memo, ob);
+    if (copy != NULL || PyErr_Occurred())
+        return copy;
+
+    if (Py_EnterRecursiveCall(" in __deepcopy__"))
+        return NULL;
+    if (tp == &PyList_Type)
+        copy = memoryslots_deepcopy_list(state, ob, memo);
+    else if (tp == &PyDict_Type)
+        copy = memoryslots_deepcopy_dict(state, ob, memo);
+    else if (tp == &PyTuple_Type)
+        copy = memoryslots_deepcopy_tuple(state, ob, memo);
+    else if (PyObject_TypeCheck(ob, state->memoryslots_type)) {
+        native = memoryslots_native_deepcopy(state, tp);
+        if (native < 0)
+            copy = NULL;
+        else if (native)
+            copy = memoryslots_deepcopy_record(state, ob, memo, 1);
+        else
+            copy = memoryslots_deepcopy_fallback(state, ob, memo);
+    }
+    else
+        copy = memoryslots_deepcopy_fallback(state, ob, memo);
+    Py_LeaveRecursiveCall();
+    return copy;
+}
+
+/* Copy the instance __dict__ of ob to copy, deep if memo is not NULL */
+static int
+memoryslots_copy_dict(PyObject *ob, PyObject *copy, PyObject *memo,
+                      memoryslots_state *state)
+{
+    PyObject *dict, *dict_copy;
+    int res;
+
+    if (Py_TYPE(ob)->tp_dictoffset == 0)
+        return 0;
+    dict = PyObject_GenericGetDict(ob, NULL);
+    if (dict == NULL)
+        return -1;
+    if (!PyDict_Check(dict) || PyDict_GET_SIZE(dict) == 0) {
+        Py_DECREF(dict);
+        return 0;
+    }
+
+    if (memo == NULL)
+        dict_copy = PyDict_Copy(dict);
     else
-        return Py_BuildValue("N(())", _PyObject_GetBuiltin("iter"));
+        dict_copy = memoryslots_deepcopy_object(state, dict, memo);
+    Py_DECREF(dict);
+    if (dict_copy == NULL)
+        return -1;
+    res = PyObject_GenericSetDict(copy, dict_copy, NULL);
+    Py_DECREF(dict_copy);
+    return res;
+}
+
+PyDoc_STRVAR(memoryslots_deepcopy_doc,
+"D.__deepcopy__(memo) -> a deep copy of D.\n\n"
+"Nested records, lists, dicts and tuples are copied natively, other\n"
+"values through copy.deepcopy() with the same memo.");
+
+static PyObject *
+memoryslots_deepcopy(PyObject *ob, PyObject *args)
+{
+    memoryslots_state *state;
+    PyObject *memo = Py_None, *result;
+
+    if (!PyArg_ParseTuple(args, "|O:__deepcopy__", &memo))
+        return NULL;
+    state = memoryslots_state_by_type(Py_TYPE(ob));
+    if (state == NULL)
+        return NULL;
+
+    if (memo == Py_None) {
+        memo = PyDict_New();
+        if (memo == NULL)
+            return NULL;
+    }
+    else if (PyDict_Check(memo)) {
+        Py_INCREF(memo);
+    }
+    else {
+        PyErr_Format(PyExc_TypeError, "memo must be a dict, not %.200s",
+                     Py_TYPE(memo)->tp_name);
+        return NULL;
+    }
+
+    /* copy.deepcopy() has already checked memo for ob itself */
+    if (Py_EnterRecursiveCall(" in __deepcopy__")) {
+        Py_DECREF(memo);
+        return NULL;
+    }
+    result = memoryslots_deepcopy_record(state, ob, memo, 0);
+    Py_LeaveRecursiveCall();
+    Py_DECREF(memo);
+    return result;
+}
+
+
+PyDoc_STRVAR(memoryslots_reduce_doc, "D.__reduce__()");
+
+static PyObject *
+memoryslots_reduce(PyObject *ob)
+{
+    PyObject *args;
+    PyObject *result;
+    PyObject *tmp;
+    memoryslots_state *state;
+
+    state = memoryslots_state_by_type(Py_TYPE(ob));
+    if (state == NULL)
+        return NULL;
+
+    tmp = PySequence_Tuple(ob);
+    if (tmp == NULL)
+        return NULL;
+    args = PyTuple_Pack(1, tmp);
+    Py_DECREF(tmp);
+    if (args == NULL)
+        return NULL;
+
+    result = PyTuple_Pack(2, (PyObject *)state->memoryslots_type, args);
+    Py_DECREF(args);
+    return result;
+}
+
+/*********************** dirty fields **************************/
+
+static slotlayout_object *
+memoryslots_dirty_layout(PyObject *op)
+{
+    slotlayout_object *layout = memoryslots_layout(op);
+
+    if (layout == NULL || layout->n_dirty == 0) {
+        PyErr_Format(PyExc_TypeError,
+                     "%.200s records do not track dirty fields",
+                     Py_TYPE(op)->tp_name);
+        return NULL;
+    }
+    return layout;
+}
+
+PyDoc_STRVAR(memoryslots_dirty_fields_doc,
+"D._dirty_fields() -> tuple of the indices of the fields set since D was\n"
+"created or last cleaned by D._clear_dirty().");
+
+static PyObject *
+memoryslots_dirty_fields(PyObject *self)
+{
+    slotlayout_object *layout = memoryslots_dirty_layout(self);
+    PyObject *result, *index;
+    size_t *dirty;
+    Py_ssize_t w, n_words;
+
+    if (layout == NULL)
+        return NULL;
+    result = PyList_New(0);
+    if (result == NULL)
+        return NULL;
+
+    dirty = memoryslots_dirty(self, layout);
+    n_words = dirty_words(layout->n_dirty);
+    for (w = 0; w < n_words; w++) {
+        size_t bits = dirty[w];
+        Py_ssize_t i = w * DIRTY_BITS;
+
+        for (; bits != 0; bits >>= 1, i++) {
+            if (!(bits & 1))
+                continue;
+            index = PyLong_FromSsize_t(i);
+            if (index == NULL || PyList_Append(result, index) < 0) {
+                Py_XDECREF(index);
+                Py_DECREF(result);
+                return NULL;
+            }
+            Py_DECREF(index);
+        }
+    }
+    Py_SETREF(result, PyList_AsTuple(result));
+    return result;
+}
+
+PyDoc_STRVAR(memoryslots_clear_dirty_doc,
+"D._clear_dirty() -- mark every field of D as clean.");
+
+static PyObject *
+memoryslots_clear_dirty(PyObject *self)
+{
+    slotlayout_object *layout = memoryslots_dirty_layout(self);
+
+    if (layout == NULL)
+        return NULL;
+    memset(memoryslots_dirty(self, layout), 0,
+           dirty_words(layout->n_dirty) * sizeof(size_t));
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(memoryslots_diff_doc,
+"D._diff(other) -> tuple of the indices of the fields of D whose value\n"
+"differs from the same field of other, a record or tuple of the same size.");
+
+static PyObject *
+memoryslots_diff(PyObject *self, PyObject *other)
+{
+    memoryslots_state *state;
+    PyObject *result, *index;
+    Py_ssize_t i, n = Py_SIZE(self);
+
+    state = memoryslots_state_by_type(Py_TYPE(self));
+    if (state == NULL)
+        return NULL;
+    if (!PyObject_TypeCheck(other, state->memoryslots_type) &&
+        !PyTuple_Check(other)) {
+        PyErr_Format(PyExc_TypeError,
+                     "_diff() expects a record or a tuple, not %.200s",
+                     Py_TYPE(other)->tp_name);
+        return NULL;
+    }
+    if (Py_SIZE(other) != n) {
+        PyErr_Format(PyExc_ValueError,
+                     "_diff() expects %zd fields, got %zd", n, Py_SIZE(other));
+        return NULL;
+    }
+
+    result = PyList_New(0);
+    if (result == NULL)
+        return NULL;
+    /* fields may be set by __eq__, so they are read again at every step */
+    for (i = 0; i < n && i < Py_SIZE(other); i++) {
+        PyObject *a = PyTuple_GET_ITEM(self, i);
+        PyObject *b = PyTuple_GET_ITEM(other, i);
+        int eq;
+
+        if (a == b)
+            continue;
+        Py_INCREF(a);
+        Py_INCREF(b);
+        eq = PyObject_RichCompareBool(a, b, Py_EQ);
+        Py_DECREF(a);
+        Py_DECREF(b);
+        if (eq < 0)
+            goto error;
+        if (eq)
+            continue;
+        index = PyLong_FromSsize_t(i);
+        if (index == NULL || PyList_Append(result, index) < 0) {
+            Py_XDECREF(index);
+            goto error;
+        }
+        Py_DECREF(index);
+    }
+    Py_SETREF(result, PyList_AsTuple(result));
+    return result;
+
+error:
+    Py_DECREF(result);
+    return NULL;
+}
+
+/*********************** JSON **************************/
+
+/* Records are written as JSON objects with the keys of the class attribute
+ * _json_keys: for every field, the already encoded '{"name":' (first field)
+ * or ',"name":' prefix.  Records of classes without _json_keys are written
+ * as arrays.  Strings are written as UTF-8 rather than escaped to ASCII.
+ * Reading parses an object straight into the slots of a new record. */
+
+typedef struct {
+    char *data;
+    Py_ssize_t size;
+    Py_ssize_t allocated;
+    PyObject *default_;     /* called for objects with no JSON form */
+    memoryslots_state *state;
+    PyTypeObject *keys_type;    /* class of the last record written */
+    PyObject *keys;             /* and its _json_keys, or NULL */
+} jsonwriter;
+
+static int
+jsonwriter_grow(jsonwriter *w, Py_ssize_t n)
+{
+    Py_ssize_t allocated = w->allocated;
+    char *data;
+
+    while (allocated - w->size < n) {
+        if (allocated > PY_SSIZE_T_MAX / 2) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        allocated *= 2;
+    }
+    data = PyMem_Realloc(w->data, allocated);
+    if (data == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    w->data = data;
+    w->allocated = allocated;
+    return 0;
+}
+
+#define jsonwriter_reserve(w, n) \
+    ((w)->allocated - (w)->size >= (n) ? 0 : jsonwriter_grow((w), (n)))
+
+static int
+jsonwriter_write(jsonwriter *w, const char *s, Py_ssize_t n)
+{
+    if (jsonwriter_reserve(w, n) < 0)
+        return -1;
+    memcpy(w->data + w->size, s, n);
+    w->size += n;
+    return 0;
+}
+
+/* Write s as a JSON string.  Lone surrogates, which have no UTF-8 form,
+ * are escaped as \uXXXX like json.dumps() does. */
+static int
+jsonwriter_str(jsonwriter *w, PyObject *s)
+{
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *p, *end, *run;
+    PyObject *bytes = NULL;
+    Py_ssize_t n;
+    int res = -1;
+
+    p = (const unsigned char *)PyUnicode_AsUTF8AndSize(s, &n);
+    if (p == NULL) {
+        if (!PyErr_ExceptionMatches(PyExc_UnicodeEncodeError))
+            return -1;
+        PyErr_Clear();
+        bytes = PyUnicode_AsEncodedString(s, "utf-8", "surrogatepass");
+        if (bytes == NULL)
+            return -1;
+        p = (const unsigned char *)PyBytes_AS_STRING(bytes);
+        n = PyBytes_GET_SIZE(bytes);
+    }
+    end = p + n;
+    if (jsonwriter_reserve(w, n + 2) < 0)
+        goto done;
+    w->data[w->size++] = '"';
+
+    for (run = p; p < end; p++) {
+        unsigned int c = *p;
+        char *out;
+
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            /* ED A0..BF is the surrogatepass encoding of a surrogate */
+            if (c != 0xED || bytes == NULL || p[1] < 0xA0)
+                continue;
+        }
+        if (jsonwriter_write(w, (const char *)run, p - run) < 0 ||
+            jsonwriter_reserve(w, 6) < 0)
+            goto done;
+        out = w->data + w->size;
+        out[0] = '\\';
+        switch (c) {
+        case '"': out[1] = '"'; break;
+        case '\\': out[1] = '\\'; break;
+        case '\b': out[1] = 'b'; break;
+        case '\f': out[1] = 'f'; break;
+        case '\n': out[1] = 'n'; break;
+        case '\r': out[1] = 'r'; break;
+        case '\t': out[1] = 't'; break;
+        default:
+            if (c == 0xED) {
+                c = 0xD000 | (p[1] & 0x3F) << 6 | (p[2] & 0x3F);
+                p += 2;
+            }
+            out[1] = 'u';
+            out[2] = hex[c >> 12];
+            out[3] = hex[(c >> 8) & 0xf];
+            out[4] = hex[(c >> 4) & 0xf];
+            out[5] = hex[c & 0xf];
+            w->size += 4;
+        }
+        w->size += 2;
+        run = p + 1;
+    }
+    if (jsonwriter_write(w, (const char *)run, end - run) < 0)
+        goto done;
+    res = jsonwriter_write(w, "\"", 1);
+
+done:
+    Py_XDECREF(bytes);
+    return res;
+}
+
+static int
+jsonwriter_int(jsonwriter *w, PyObject *v)
+{
+    char buf[24], *q = buf + sizeof(buf);
+    unsigned long long u;
+    long long x;
+    int overflow;
+
+    x = PyLong_AsLongLongAndOverflow(v, &overflow);
+    if (x == -1 && PyErr_Occurred())
+        return -1;
+    if (overflow) {
+        /* int.__repr__, as json does for int subclasses like IntEnum */
+        PyObject *s = PyLong_Type.tp_repr(v);
+        const char *digits;
+        Py_ssize_t n;
+        int res;
+
+        if (s == NULL)
+            return -1;
+        digits = PyUnicode_AsUTF8AndSize(s, &n);
+        res = digits == NULL ? -1 : jsonwriter_write(w, digits, n);
+        Py_DECREF(s);
+        return res;
+    }
+
+    u = x < 0 ? 0ULL - (unsigned long long)x : (unsigned long long)x;
+    do {
+        *--q = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (x < 0)
+        *--q = '-';
+    return jsonwriter_write(w, q, buf + sizeof(buf) - q);
+}
+
+static int
+jsonwriter_float(jsonwriter *w, PyObject *v)
+{
+    double x = PyFloat_AS_DOUBLE(v);
+    char *s;
+    int res;
+
+    /* the same non-standard literals as json.dumps() */
+    if (x != x)
+        return jsonwriter_write(w, "NaN", 3);
+    if (x == HUGE_VAL)
+        return jsonwriter_write(w, "Infinity", 8);
+    if (x == -HUGE_VAL)
+        return jsonwriter_write(w, "-Infinity", 9);
+
+    s = PyOS_double_to_string(x, 'r', 0, Py_DTSF_ADD_DOT_0, NULL);
+    if (s == NULL)
+        return -1;
+    res = jsonwriter_write(w, s, strlen(s));
+    PyMem_Free(s);
+    return res;
+}
+
+static int jsonwriter_value(jsonwriter *w, PyObject *v);
+
+/* Write item, keeping it alive in case default() changes its container */
+static int
+jsonwriter_item(jsonwriter *w, PyObject *item)
+{
+    int res;
+
+    Py_INCREF(item);
+    res = jsonwriter_value(w, item);
+    Py_DECREF(item);
+    return res;
+}
+
+static int
+jsonwriter_record(jsonwriter *w, PyObject *v)
+{
+    PyObject *keys;
+    Py_ssize_t i, n = Py_SIZE(v);
+
+    if (Py_TYPE(v) != w->keys_type) {
+        keys = PyObject_GetAttr((PyObject *)Py_TYPE(v),
+                                w->state->str_json_keys);
+        if (keys == NULL) {
+            if (!PyErr_ExceptionMatches(PyExc_AttributeError))
+                return -1;
+            PyErr_Clear();
+        }
+        Py_INCREF(Py_TYPE(v));
+        Py_XSETREF(w->keys_type, Py_TYPE(v));
+        Py_XSETREF(w->keys, keys);
+    }
+    /* nested records may replace the cached keys while these are used */
+    keys = w->keys;
+    if (keys == NULL || !PyTuple_Check(keys) || PyTuple_GET_SIZE(keys) != n) {
+        if (jsonwriter_write(w, "[", 1) < 0)
+            return -1;
+        for (i = 0; i < n; i++) {
+            if ((i > 0 && jsonwriter_write(w, ",", 1) < 0) ||
+                jsonwriter_item(w, PyTuple_GET_ITEM(v, i)) < 0)
+                return -1;
+        }
+        return jsonwriter_write(w, "]", 1);
+    }
+
+    if (n == 0)
+        return jsonwriter_write(w, "{}", 2);
+    Py_INCREF(keys);
+    for (i = 0; i < n; i++) {
+        PyObject *key = PyTuple_GET_ITEM(keys, i);
+
+        if (!PyBytes_Check(key)) {
+            PyErr_Format(PyExc_TypeError,
+                         "%.200s._json_keys must hold bytes, not %.200s",
+                         Py_TYPE(v)->tp_name, Py_TYPE(key)->tp_name);
+            goto error;
+        }
+        if (jsonwriter_write(w, PyBytes_AS_STRING(key),
+                             PyBytes_GET_SIZE(key)) < 0 ||
+            jsonwriter_item(w, PyTuple_GET_ITEM(v, i)) < 0)
+            goto error;
+    }
+    Py_DECREF(keys);
+    return jsonwriter_write(w, "}", 1);
+
+error:
+    Py_DECREF(keys);
+    return -1;
+}
+
+static int
+jsonwriter_sequence(jsonwriter *w, PyObject *v)
+{
+    Py_ssize_t i;
+
+    if (jsonwriter_write(w, "[", 1) < 0)
+        return -1;
+    /* the size is read again as default() may change a list */
+    for (i = 0; i < PySequence_Fast_GET_SIZE(v); i++) {
+        if ((i > 0 && jsonwriter_write(w, ",", 1) < 0) ||
+            jsonwriter_item(w, PySequence_Fast_GET_ITEM(v, i)) < 0)
+            return -1;
+    }
+    return jsonwriter_write(w, "]", 1);
+}
+
+static int
+jsonwriter_key(jsonwriter *w, PyObject *key)
+{
+    int res;
+
+    if (PyUnicode_Check(key))
+        return jsonwriter_str(w, key);
+    if (key == Py_True)
+        return jsonwriter_write(w, "\"true\"", 6);
+    if (key == Py_False)
+        return jsonwriter_write(w, "\"false\"", 7);
+    if (key == Py_None)
+        return jsonwriter_write(w, "\"null\"", 6);
+    if (!PyLong_Check(key) && !PyFloat_Check(key)) {
+        PyErr_Format(PyExc_TypeError,
+                     "keys must be str, int, float, bool or None, "
+                     "not %.200s", Py_TYPE(key)->tp_name);
+        return -1;
+    }
+    if (jsonwriter_write(w, "\"", 1) < 0)
+        return -1;
+    res = PyLong_Check(key) ? jsonwriter_int(w, key)
+                            : jsonwriter_float(w, key);
+    if (res < 0)
+        return -1;
+    return jsonwriter_write(w, "\"", 1);
+}
+
+static int
+jsonwriter_dict(jsonwriter *w, PyObject *v)
+{
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    int first = 1;
+
+    if (jsonwriter_write(w, "{", 1) < 0)
+        return -1;
+    while (PyDict_Next(v, &pos, &key, &value)) {
+        if ((!first && jsonwriter_write(w, ",", 1) < 0) ||
+            jsonwriter_key(w, key) < 0 ||
+            jsonwriter_write(w, ":", 1) < 0 ||
+            jsonwriter_item(w, value) < 0)
+            return -1;
+        first = 0;
+    }
+    return jsonwriter_write(w, "}", 1);
+}
+
+static int
+jsonwriter_default(jsonwriter *w, PyObject *v)
+{
+    PyObject *converted;
+    int res;
+
+    if (w->default_ == NULL) {
+        PyErr_Format(PyExc_TypeError,
+                     "Object of type %.200s is not JSON serializable",
+                     Py_TYPE(v)->tp_name);
+        return -1;
+    }
+    converted = PyObject_CallOneArg(w->default_, v);
+    if (converted == NULL)
+        return -1;
+    res = jsonwriter_value(w, converted);
+    Py_DECREF(converted);
+    return res;
+}
+
+static int
+jsonwriter_value(jsonwriter *w, PyObject *v)
+{
+    int res;
+
+    if (PyUnicode_Check(v))
+        return jsonwriter_str(w, v);
+    if (v == Py_None)
+        return jsonwriter_write(w, "null", 4);
+    if (v == Py_True)
+        return jsonwriter_write(w, "true", 4);
+    if (v == Py_False)
+        return jsonwriter_write(w, "false", 5);
+    if (PyLong_Check(v))
+        return jsonwriter_int(w, v);
+    if (PyFloat_Check(v))
+        return jsonwriter_float(w, v);
+
+    if (Py_EnterRecursiveCall(" while encoding JSON"))
+        return -1;
+    if (PyObject_TypeCheck(v, w->state->memoryslots_type))
+        res = jsonwriter_record(w, v);
+    else if (PyList_Check(v) || PyTuple_Check(v))
+        res = jsonwriter_sequence(w, v);
+    else if (PyDict_Check(v))
+        res = jsonwriter_dict(w, v);
+    else
+        res = jsonwriter_default(w, v);
+    Py_LeaveRecursiveCall();
+    return res;
+}
+
+static PyObject *
+memoryslots_json_encode(memoryslots_state *state, PyObject *ob,
+                        PyObject *default_, int many)
+{
+    jsonwriter w;
+    PyObject *it = NULL, *item, *result = NULL;
+    int res;
+
+    w.allocated = 256;
+    w.size = 0;
+    w.data = PyMem_Malloc(w.allocated);
+    w.default_ = default_ == Py_None ? NULL : default_;
+    w.state = state;
+    w.keys_type = NULL;
+    w.keys = NULL;
+    if (w.data == NULL)
+        return PyErr_NoMemory();
+
+    if (!many) {
+        res = jsonwriter_value(&w, ob);
+    }
+    else {
+        it = PyObject_GetIter(ob);
+        res = it == NULL ? -1 : jsonwriter_write(&w, "[", 1);
+        while (res == 0 && (item = PyIter_Next(it)) != NULL) {
+            if (w.size > 1)
+                res = jsonwriter_write(&w, ",", 1);
+            if (res == 0)
+                res = jsonwriter_value(&w, item);
+            Py_DECREF(item);
+        }
+        if (res == 0 && PyErr_Occurred())
+            res = -1;
+        if (res == 0)
+            res = jsonwriter_write(&w, "]", 1);
+        Py_XDECREF(it);
+    }
+
+    if (res == 0)
+        result = PyBytes_FromStringAndSize(w.data, w.size);
+    PyMem_Free(w.data);
+    Py_XDECREF(w.keys_type);
+    Py_XDECREF(w.keys);
+    return result;
+}
+
+typedef struct {
+    const char *start;
+    const char *p;
+    const char *end;        /* *end is always '\0' */
+    memoryslots_state *state;
+} jsonreader;
+
+static void
+jsonreader_error(jsonreader *r, const char *msg)
+{
+    PyErr_Format(PyExc_ValueError, "%s at byte %zd of JSON input",
+                 msg, (Py_ssize_t)(r->p - r->start));
+}
+
+static void
+jsonreader_skip(jsonreader *r)
+{
+    const char *p = r->p;
+
+    while (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')
+        p++;
+    r->p = p;
+}
+
+static int
+jsonreader_literal(jsonreader *r, const char *literal, Py_ssize_t n)
+{
+    if (r->end - r->p < n || memcmp(r->p, literal, n) != 0) {
+        jsonreader_error(r, "Expecting value");
+        return -1;
+    }
+    r->p += n;
+    return 0;
+}
+
+static int
+jsonreader_hex4(const char *p)
+{
+    int i, cp = 0;
+
+    for (i = 0; i < 4; i++) {
+        char c = p[i];
+
+        cp <<= 4;
+        if (c >= '0' && c <= '9')
+            cp |= c - '0';
+        else if (c >= 'a' && c <= 'f')
+            cp |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            cp |= c - 'A' + 10;
+        else
+            return -1;
+    }
+    return cp;
+}
+
+/* Parse the string starting after the opening quote at r->p.  Strings
+ * without escapes are decoded in place, the others through a buffer that
+ * is never longer than the escaped form.  The input must be valid UTF-8:
+ * lone surrogates only come from \u escapes, as with json.loads(). */
+static PyObject *
+jsonreader_string(jsonreader *r)
+{
+    const char *s = r->p + 1, *q, *p;
+    char *buf, *out;
+    PyObject *result;
+    int surrogates = 0;
+
+    for (q = s; *q != '"' && *q != '\\' && (unsigned char)*q >= 0x20; q++)
+        ;
+    if (*q == '"') {
+        r->p = q + 1;
+        return PyUnicode_DecodeUTF8(s, q - s, NULL);
+    }
+
+    for (; q < r->end && *q != '"'; q++) {
+        if (*q == '\\')
+            q++;
+    }
+    if (q >= r->end) {
+        jsonreader_error(r, "Unterminated string");
+        return NULL;
+    }
+
+    buf = out = PyMem_Malloc(q - s);
+    if (buf == NULL)
+        return PyErr_NoMemory();
+    for (p = s; p < q; ) {
+        unsigned char c = (unsigned char)*p;
+        int cp;
+
+        if (c != '\\') {
+            if (c < 0x20) {
+                r->p = p;
+                jsonreader_error(r, "Invalid control character");
+                PyMem_Free(buf);
+                return NULL;
+            }
+            *out++ = (char)c;
+            p++;
+            continue;
+        }
+        switch (p[1]) {
+        case '"': *out++ = '"'; break;
+        case '\\': *out++ = '\\'; break;
+        case '/': *out++ = '/'; break;
+        case 'b': *out++ = '\b'; break;
+        case 'f': *out++ = '\f'; break;
+        case 'n': *out++ = '\n'; break;
+        case 'r': *out++ = '\r'; break;
+        case 't': *out++ = '\t'; break;
+        case 'u':
+            cp = q - p >= 6 ? jsonreader_hex4(p + 2) : -1;
+            if (cp < 0) {
+                r->p = p;
+                jsonreader_error(r, "Invalid \\uXXXX escape");
+                PyMem_Free(buf);
+                return NULL;
+            }
+            p += 4;
+            if (cp >= 0xD800 && cp < 0xDC00 && q - p >= 8 &&
+                p[2] == '\\' && p[3] == 'u') {
+                int low = jsonreader_hex4(p + 4);
+
+                if (low >= 0xDC00 && low < 0xE000) {
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    p += 6;
+                }
+            }
+            /* lone surrogates are kept, as json.loads() does */
+            if (cp >= 0xD800 && cp < 0xE000)
+                surrogates = 1;
+            if (cp < 0x80) {
+                *out++ = (char)cp;
+            }
+            else if (cp < 0x800) {
+                *out++ = (char)(0xC0 | (cp >> 6));
+                *out++ = (char)(0x80 | (cp & 0x3F));
+            }
+            else if (cp < 0x10000) {
+                *out++ = (char)(0xE0 | (cp >> 12));
+                *out++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+                *out++ = (char)(0x80 | (cp & 0x3F));
+            }
+            else {
+                *out++ = (char)(0xF0 | (cp >> 18));
+                *out++ = (char)(0x80 | ((cp >> 12) & 0x3F));
+                *out++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+                *out++ = (char)(0x80 | (cp & 0x3F));
+            }
+            break;
+        default:
+            r->p = p;
+            jsonreader_error(r, "Invalid \\escape");
+            PyMem_Free(buf);
+            return NULL;
+        }
+        p += 2;
+    }
+
+    if (!surrogates) {
+        result = PyUnicode_DecodeUTF8(buf, out - buf, NULL);
+    }
+    else {
+        /* escapes are ASCII, so the input is valid if it decodes as is */
+        result = PyUnicode_DecodeUTF8(s, q - s, NULL);
+        if (result != NULL)
+            Py_SETREF(result, PyUnicode_DecodeUTF8(buf, out - buf,
+                                                   "surrogatepass"));
+    }
+    PyMem_Free(buf);
+    r->p = q + 1;
+    return result;
+}
+
+#define JSON_DIGIT(c) ((c) >= '0' && (c) <= '9')
+
+static PyObject *
+jsonreader_number(jsonreader *r)
+{
+    const char *s = r->p, *p = s;
+    int is_float = 0;
+
+    if (*p == '-')
+        p++;
+    if (*p == '0') {
+        p++;
+    }
+    else if (JSON_DIGIT(*p)) {
+        while (JSON_DIGIT(*p))
+            p++;
+    }
+    else {
+        jsonreader_error(r, "Expecting value");
+        return NULL;
+    }
+    if (*p == '.' && JSON_DIGIT(p[1])) {
+        for (p++; JSON_DIGIT(*p); p++)
+            ;
+        is_float = 1;
+    }
+    if ((*p == 'e' || *p == 'E') &&
+        (JSON_DIGIT(p[1]) ||
+         ((p[1] == '+' || p[1] == '-') && JSON_DIGIT(p[2])))) {
+        for (p += 2; JSON_DIGIT(*p); p++)
+            ;
+        is_float = 1;
+    }
+    r->p = p;
+
+    if (is_float) {
+        char *endptr;
+        double x = PyOS_string_to_double(s, &endptr, NULL);
+
+        if (x == -1.0 && PyErr_Occurred())
+            return NULL;
+        return PyFloat_FromDouble(x);
+    }
+    if (p - s <= 18) {
+        long long x = 0;
+        const char *d;
+
+        for (d = *s == '-' ? s + 1 : s; d < p; d++)
+            x = x * 10 + (*d - '0');
+        return PyLong_FromLongLong(*s == '-' ? -x : x);
+    }
+    else {
+        PyObject *digits, *result;
+
+        digits = PyBytes_FromStringAndSize(s, p - s);
+        if (digits == NULL)
+            return NULL;
+        result = PyLong_FromString(PyBytes_AS_STRING(digits), NULL, 10);
+        Py_DECREF(digits);
+        return result;
+    }
+}
+
+static PyObject *jsonreader_value(jsonreader *r);
+
+static PyObject *
+jsonreader_array(jsonreader *r)
+{
+    PyObject *list, *item;
+
+    list = PyList_New(0);
+    if (list == NULL)
+        return NULL;
+    r->p++;
+    jsonreader_skip(r);
+    if (*r->p == ']') {
+        r->p++;
+        return list;
+    }
+    for (;;) {
+        jsonreader_skip(r);
+        item = jsonreader_value(r);
+        if (item == NULL)
+            goto error;
+        if (PyList_Append(list, item) < 0) {
+            Py_DECREF(item);
+            goto error;
+        }
+        Py_DECREF(item);
+        jsonreader_skip(r);
+        if (*r->p == ']')
+            break;
+        if (*r->p != ',') {
+            jsonreader_error(r, "Expecting ',' delimiter");
+            goto error;
+        }
+        r->p++;
+    }
+    r->p++;
+    return list;
+
+error:
+    Py_DECREF(list);
+    return NULL;
+}
+
+/* Parse '"key" :' of an object member, leaving r->p at the value */
+static PyObject *
+jsonreader_key(jsonreader *r)
+{
+    PyObject *key;
+
+    jsonreader_skip(r);
+    if (*r->p != '"') {
+        jsonreader_error(r, "Expecting property name enclosed in double quotes");
+        return NULL;
+    }
+    key = jsonreader_string(r);
+    if (key == NULL)
+        return NULL;
+    jsonreader_skip(r);
+    if (*r->p != ':') {
+        Py_DECREF(key);
+        jsonreader_error(r, "Expecting ':' delimiter");
+        return NULL;
+    }
+    r->p++;
+    jsonreader_skip(r);
+    return key;
+}
+
+/* After a member, skip ',' and return 1, or skip '}' and return 0 */
+static int
+jsonreader_next_member(jsonreader *r)
+{
+    jsonreader_skip(r);
+    if (*r->p == ',') {
+        r->p++;
+        return 1;
+    }
+    if (*r->p == '}') {
+        r->p++;
+        return 0;
+    }
+    jsonreader_error(r, "Expecting ',' delimiter");
+    return -1;
+}
+
+static PyObject *
+jsonreader_object(jsonreader *r)
+{
+    PyObject *dict, *key, *value;
+    int more;
+
+    dict = PyDict_New();
+    if (dict == NULL)
+        return NULL;
+    r->p++;
+    jsonreader_skip(r);
+    if (*r->p == '}') {
+        r->p++;
+        return dict;
+    }
+    do {
+        key = jsonreader_key(r);
+        if (key == NULL)
+            goto error;
+        value = jsonreader_value(r);
+        if (value == NULL) {
+            Py_DECREF(key);
+            goto error;
+        }
+        more = PyDict_SetItem(dict, key, value);
+        Py_DECREF(key);
+        Py_DECREF(value);
+        if (more < 0)
+            goto error;
+        more = jsonreader_next_member(r);
+    } while (more > 0);
+    if (more < 0)
+        goto error;
+    return dict;
+
+error:
+    Py_DECREF(dict);
+    return NULL;
+}
+
+static PyObject *
+jsonreader_value(jsonreader *r)
+{
+    PyObject *result;
+
+    switch (*r->p) {
+    case '"':
+        return jsonreader_string(r);
+    case '{':
+    case '[':
+        if (Py_EnterRecursiveCall(" while decoding JSON"))
+            return NULL;
+        result = *r->p == '{' ? jsonreader_object(r) : jsonreader_array(r);
+        Py_LeaveRecursiveCall();
+        return result;
+    case 't':
+        if (jsonreader_literal(r, "true", 4) < 0)
+            return NULL;
+        Py_RETURN_TRUE;
+    case 'f':
+        if (jsonreader_literal(r, "false", 5) < 0)
+            return NULL;
+        Py_RETURN_FALSE;
+    case 'n':
+        if (jsonreader_literal(r, "null", 4) < 0)
+            return NULL;
+        Py_RETURN_NONE;
+    case 'N':
+        if (jsonreader_literal(r, "NaN", 3) < 0)
+            return NULL;
+        return PyFloat_FromDouble(Py_NAN);
+    case 'I':
+        if (jsonreader_literal(r, "Infinity", 8) < 0)
+            return NULL;
+        return PyFloat_FromDouble(HUGE_VAL);
+    case '-':
+        if (r->p[1] == 'I') {
+            if (jsonreader_literal(r, "-Infinity", 9) < 0)
+                return NULL;
+            return PyFloat_FromDouble(-HUGE_VAL);
+        }
+        /* fall through */
+    default:
+        return jsonreader_number(r);
+    }
+}
+
+/* Index of the field named key, trying the field after the previous one
+ * first since objects usually list the fields in order */
+static Py_ssize_t
+jsonreader_field(PyObject *fields, PyObject *key, Py_ssize_t next)
+{
+    Py_ssize_t i, n = PyTuple_GET_SIZE(fields);
+
+    if (next < n && PyTuple_GET_ITEM(fields, next) == key)
+        return next;
+    for (i = 0; i < n; i++) {
+        Py_ssize_t k = (next + i) % n;
+        int eq = PyUnicode_Compare(PyTuple_GET_ITEM(fields, k), key);
+
+        if (eq == 0)
+            return k;
+        if (eq == -1 && PyErr_Occurred())
+            return -1;
+    }
+    return -1;
+}
+
+/* The record class of field name if _field_types declares one */
+static PyTypeObject *
+memoryslots_field_record_type(memoryslots_state *state, PyObject *field_types,
+                              PyObject *name)
+{
+    PyObject *t;
+
+    if (field_types == NULL || !PyDict_Check(field_types))
+        return NULL;
+    t = PyDict_GetItemWithError(field_types, name);   /* borrowed */
+    if (t == NULL || !PyType_Check(t) ||
+        !PyType_IsSubtype((PyTypeObject *)t, state->memoryslots_type))
+        return NULL;
+    return (PyTypeObject *)t;
+}
+
+/* Offset and record class of the entry of the embedded field name in the
+ * _embedded dict of type: (offset, record class) */
+static int
+memoryslots_embedded_entry(memoryslots_state *state, PyTypeObject *type,
+                           PyObject *name, PyObject *entry,
+                           Py_ssize_t *offset, PyTypeObject **record_type)
+{
+    PyObject *t;
+
+    if (!PyTuple_Check(entry) || PyTuple_GET_SIZE(entry) != 2 ||
+        !PyType_Check(t = PyTuple_GET_ITEM(entry, 1)) ||
+        !PyType_IsSubtype((PyTypeObject *)t, state->memoryslots_type)) {
+        PyErr_Format(PyExc_TypeError,
+                     "%.200s._embedded[%R] must be (offset, record class)",
+                     type->tp_name, name);
+        return -1;
+    }
+    *offset = PyLong_AsSsize_t(PyTuple_GET_ITEM(entry, 0));
+    if (*offset == -1 && PyErr_Occurred())
+        return -1;
+    *record_type = (PyTypeObject *)t;
+    return 0;
+}
+
+/* Offset and record class of the embedded field name of type, declared in
+ * its _embedded.  Returns 1 if name is an embedded field, 0 if not and -1
+ * on errors. */
+static int
+memoryslots_embedded_field(memoryslots_state *state, PyTypeObject *type,
+                           PyObject *name, Py_ssize_t *offset,
+                           PyTypeObject **record_type)
+{
+    PyObject *embedded, *entry;
+    int res = 0;
+
+    embedded = PyObject_GetAttr((PyObject *)type, state->str_embedded);
+    if (embedded == NULL) {
+        if (!PyErr_ExceptionMatches(PyExc_AttributeError))
+            return -1;
+        PyErr_Clear();
+        return 0;
+    }
+    if (!PyDict_Check(embedded)) {
+        Py_DECREF(embedded);
+        return 0;
+    }
+    entry = PyDict_GetItemWithError(embedded, name);   /* borrowed */
+    if (entry == NULL)
+        res = PyErr_Occurred() ? -1 : 0;
+    else if (memoryslots_embedded_entry(state, type, name, entry, offset,
+                                        record_type) < 0)
+        res = -1;
+    else
+        res = 1;
+    Py_DECREF(embedded);
+    return res;
+}
+
+/* Set the fields of the embedded field name of record, starting at offset,
+ * to the values of value: a record of record_type or a list or tuple of as
+ * many values as it has fields.  Steals a reference to value. */
+static int
+memoryslots_set_embedded(memoryslots_state *state, PyObject *record,
+                         PyObject *name, Py_ssize_t offset,
+                         PyTypeObject *record_type, PyObject *value)
+{
+    PyObject **items = ((PyTupleObject *)record)->ob_item, *fields, *seq, *v;
+    Py_ssize_t i, n;
+
+    if (!PyObject_TypeCheck(value, record_type) &&
+        !PyList_CheckExact(value) && !PyTuple_CheckExact(value)) {
+        PyErr_Format(PyExc_TypeError,
+                     "Expected %.200s for embedded field %R, got %.200s",
+                     record_type->tp_name, name, Py_TYPE(value)->tp_name);
+        Py_DECREF(value);
+        return -1;
+    }
+    seq = PySequence_Tuple(value);
+    Py_DECREF(value);
+    if (seq == NULL)
+        return -1;
+    fields = PyObject_GetAttr((PyObject *)record_type, state->str_fields);
+    if (fields == NULL || !PyTuple_Check(fields)) {
+        if (fields != NULL)
+            PyErr_Format(PyExc_TypeError, "%.200s._fields must be a tuple",
+                         record_type->tp_name);
+        Py_XDECREF(fields);
+        Py_DECREF(seq);
+        return -1;
+    }
+    n = PyTuple_GET_SIZE(fields);
+    Py_DECREF(fields);
+    if (PyTuple_GET_SIZE(seq) != n || offset < 0 ||
+        n > Py_SIZE(record) - offset) {
+        PyErr_Format(PyExc_TypeError,
+                     "Expected %zd values for embedded field %R, got %zd",
+                     n, name, PyTuple_GET_SIZE(seq));
+        Py_DECREF(seq);
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        v = PyTuple_GET_ITEM(seq, i);
+        Py_INCREF(v);
+        Py_XSETREF(items[offset + i], v);
+    }
+    Py_DECREF(seq);
+    return 0;
+}
+
+static PyObject *jsonreader_record(jsonreader *r, PyTypeObject *type);
+
+static PyObject *
+jsonreader_field_value(jsonreader *r, PyObject *field_types, PyObject *name)
+{
+    PyTypeObject *nested;
+    PyObject *result;
+
+    if (*r->p != '{')
+        return jsonreader_value(r);
+    nested = memoryslots_field_record_type(r->state, field_types, name);
+    if (nested == NULL) {
+        if (PyErr_Occurred())
+            return NULL;
+        return jsonreader_value(r);
+    }
+    if (Py_EnterRecursiveCall(" while decoding JSON"))
+        return NULL;
+    result = jsonreader_record(r, nested);
+    Py_LeaveRecursiveCall();
+    return result;
+}
+
+/* Set the fields of record still NULL to their _field_defaults.  The
+ * defaults are looked up once into *defaults, that the caller releases;
+ * source names what the values came from in errors. */
+static int
+memoryslots_fill_defaults(PyObject *record, PyObject *fields,
+                          PyObject **defaults, const char *source)
+{
+    PyTypeObject *type = Py_TYPE(record);
+    PyObject **items = ((PyTupleObject *)record)->ob_item;
+    Py_ssize_t i;
+
+    for (i = 0; i < Py_SIZE(record); i++) {
+        PyObject *value;
+
+        if (items[i] != NULL)
+            continue;
+        if (*defaults == NULL) {
+            *defaults = PyObject_GetAttrString((PyObject *)type,
+                                               "_field_defaults");
+            if (*defaults == NULL) {
+                if (!PyErr_ExceptionMatches(PyExc_AttributeError))
+                    return -1;
+                PyErr_Clear();
+                *defaults = PyDict_New();
+                if (*defaults == NULL)
+                    return -1;
+            }
+        }
+        value = PyObject_GetItem(*defaults, PyTuple_GET_ITEM(fields, i));
+        if (value == NULL) {
+            if (PyErr_ExceptionMatches(PyExc_KeyError)) {
+                PyErr_Clear();
+                PyErr_Format(PyExc_TypeError, "%s has no field %R of %.200s",
+                             source, PyTuple_GET_ITEM(fields, i),
+                             type->tp_name);
+            }
+            return -1;
+        }
+        items[i] = value;
+    }
+    return 0;
+}
+
+/* Parse the value of key, that is not a field of type, into the fields of
+ * the embedded record of that name: a nested object or an array */
+static int
+jsonreader_embedded(jsonreader *r, PyTypeObject *type, PyObject *record,
+                    PyObject *key)
+{
+    PyTypeObject *record_type;
+    PyObject *value;
+    Py_ssize_t offset;
+    int res;
+
+    res = memoryslots_embedded_field(r->state, type, key, &offset,
+                                     &record_type);
+    if (res <= 0) {
+        if (res == 0)
+            PyErr_Format(PyExc_TypeError, "%.200s has no field %R",
+                         type->tp_name, key);
+        return -1;
+    }
+    if (*r->p == '{') {
+        if (Py_EnterRecursiveCall(" while decoding JSON"))
+            return -1;
+        value = jsonreader_record(r, record_type);
+        Py_LeaveRecursiveCall();
+    }
+    else {
+        value = jsonreader_value(r);
+    }
+    if (value == NULL)
+        return -1;
+    return memoryslots_set_embedded(r->state, record, key, offset,
+                                    record_type, value);
+}
+
+static PyObject *
+jsonreader_record(jsonreader *r, PyTypeObject *type)
+{
+    PyObject *fields, *field_types, *record = NULL, *key, *value;
+    PyObject *defaults = NULL;
+    PyObject **items;
+    Py_ssize_t n, i, next = 0;
+    int more;
+
+    if (*r->p != '{') {
+        jsonreader_error(r, "Expecting '{'");
+        return NULL;
+    }
+    fields = PyObject_GetAttr((PyObject *)type, r->state->str_fields);
+    if (fields == NULL)
+        return NULL;
+    if (!PyTuple_Check(fields)) {
+        PyErr_Format(PyExc_TypeError, "%.200s._fields must be a tuple",
+                     type->tp_name);
+        Py_DECREF(fields);
+        return NULL;
+    }
+    field_types = PyObject_GetAttr((PyObject *)type, r->state->str_field_types);
+    if (field_types == NULL) {
+        if (!PyErr_ExceptionMatches(PyExc_AttributeError))
+            goto error;
+        PyErr_Clear();
+    }
+
+    n = PyTuple_GET_SIZE(fields);
+    record = PyMemorySlots_New(type, n);
+    if (record == NULL)
+        goto error;
+    items = ((PyTupleObject *)record)->ob_item;
+
+    r->p++;
+    jsonreader_skip(r);
+    if (*r->p == '}') {
+        r->p++;
+        more = 0;
+    }
+    else {
+        do {
+            key = jsonreader_key(r);
+            if (key == NULL)
+                goto error;
+            PyUnicode_InternInPlace(&key);
+            i = jsonreader_field(fields, key, next);
+            if (i < 0) {
+                if (PyErr_Occurred() ||
+                    jsonreader_embedded(r, type, record, key) < 0) {
+                    Py_DECREF(key);
+                    goto error;
+                }
+                Py_DECREF(key);
+                more = jsonreader_next_member(r);
+                continue;
+            }
+            value = jsonreader_field_value(r, field_types, key);
+            Py_DECREF(key);
+            if (value == NULL)
+                goto error;
+            Py_XSETREF(items[i], value);
+            next = i + 1;
+            more = jsonreader_next_member(r);
+        } while (more > 0);
+    }
+    if (more < 0 ||
+        memoryslots_fill_defaults(record, fields, &defaults, "JSON object") < 0)
+        goto error;
+
+    Py_DECREF(fields);
+    Py_XDECREF(field_types);
+    Py_XDECREF(defaults);
+    return record;
+
+error:
+    Py_DECREF(fields);
+    Py_XDECREF(field_types);
+    Py_XDECREF(defaults);
+    Py_XDECREF(record);
+    return NULL;
+}
+
+PyDoc_STRVAR(memoryslots_to_json_doc,
+"D._to_json(default=None) -> D as UTF-8 JSON bytes.\n\n"
+"Records are written as objects, str, int, float, bool, None, lists,\n"
+"tuples and dicts as usual; default(obj) converts any other object.");
+
+static PyObject *
+memoryslots_to_json(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"default", NULL};
+    memoryslots_state *state;
+    PyObject *default_ = Py_None;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:_to_json", kwlist,
+                                     &default_))
+        return NULL;
+    state = memoryslots_state_by_type(Py_TYPE(self));
+    if (state == NULL)
+        return NULL;
+    return memoryslots_json_encode(state, self, default_, 0);
+}
+
+PyDoc_STRVAR(memoryslots_to_json_many_doc,
+"D.to_json_many(records, default=None) -> records as a UTF-8 JSON array.");
+
+static PyObject *
+memoryslots_to_json_many(PyObject *cls, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"records", "default", NULL};
+    memoryslots_state *state;
+    PyObject *records, *default_ = Py_None;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O:to_json_many", kwlist,
+                                     &records, &default_))
+        return NULL;
+    state = memoryslots_state_by_type((PyTypeObject *)cls);
+    if (state == NULL)
+        return NULL;
+    return memoryslots_json_encode(state, records, default_, 1);
+}
+
+PyDoc_STRVAR(memoryslots_from_json_doc,
+"D._from_json(data) -> new record from a JSON object.\n\n"
+"data is str or UTF-8 bytes.  Object members are parsed straight into\n"
+"the fields, fields missing from the object take their default, and\n"
+"objects in fields whose _field_types entry is a record class become\n"
+"records of that class.");
+
+static PyObject *
+memoryslots_from_json(PyObject *cls, PyObject *data)
+{
+    memoryslots_state *state;
+    PyObject *copy = NULL, *result;
+    jsonreader r;
+    const char *s;
+    Py_ssize_t n;
+
+    state = memoryslots_state_by_type((PyTypeObject *)cls);
+    if (state == NULL)
+        return NULL;
+
+    if (PyUnicode_Check(data)) {
+        s = PyUnicode_AsUTF8AndSize(data, &n);
+    }
+    else {
+        if (!PyBytes_Check(data)) {
+            copy = PyBytes_FromObject(data);
+            if (copy == NULL)
+                return NULL;
+            data = copy;
+        }
+        s = PyBytes_AS_STRING(data);
+        n = PyBytes_GET_SIZE(data);
+    }
+    if (s == NULL)
+        return NULL;
+
+    r.start = r.p = s;
+    r.end = s + n;
+    r.state = state;
+    jsonreader_skip(&r);
+    result = jsonreader_record(&r, (PyTypeObject *)cls);
+    if (result != NULL) {
+        jsonreader_skip(&r);
+        if (r.p != r.end) {
+            jsonreader_error(&r, "Extra data");
+            Py_CLEAR(result);
+        }
+    }
+    Py_XDECREF(copy);
+    return result;
+}
+
+/*********************** mappings **************************/
+
+/* Records are filled straight from a mapping: each name of _fields is
+ * looked up once, with its cached hash for dicts, missing fields take their
+ * default, and dicts in fields whose _field_types entry is a record class
+ * become records of that class. */
+
+typedef struct {
+    memoryslots_state *state;
+    PyTypeObject *type;
+    PyObject *fields;
+    PyObject *field_types;      /* NULL if the class declares none */
+    PyObject *embedded;         /* _embedded dict, NULL if none */
+    PyObject *defaults;         /* looked up on first use */
+    int extra_error;            /* keys that are not fields raise TypeError */
+} mappingreader;
+
+static int
+mappingreader_init(mappingreader *m, memoryslots_state *state,
+                   PyTypeObject *type, int extra_error)
+{
+    m->state = state;
+    m->type = type;
+    m->field_types = m->embedded = m->defaults = NULL;
+    m->extra_error = extra_error;
+    m->fields = PyObject_GetAttr((PyObject *)type, state->str_fields);
+    if (m->fields == NULL)
+        return -1;
+    if (!PyTuple_Check(m->fields)) {
+        PyErr_Format(PyExc_TypeError, "%.200s._fields must be a tuple",
+                     type->tp_name);
+        Py_CLEAR(m->fields);
+        return -1;
+    }
+    m->field_types = PyObject_GetAttr((PyObject *)type, state->str_field_types);
+    if (m->field_types == NULL) {
+        if (!PyErr_ExceptionMatches(PyExc_AttributeError)) {
+            Py_CLEAR(m->fields);
+            return -1;
+        }
+        PyErr_Clear();
+    }
+    m->embedded = PyObject_GetAttr((PyObject *)type, state->str_embedded);
+    if (m->embedded == NULL) {
+        if (!PyErr_ExceptionMatches(PyExc_AttributeError)) {
+            Py_CLEAR(m->fields);
+            Py_CLEAR(m->field_types);
+            return -1;
+        }
+        PyErr_Clear();
+    }
+    else if (!PyDict_Check(m->embedded) || PyDict_GET_SIZE(m->embedded) == 0) {
+        Py_CLEAR(m->embedded);
+    }
+    return 0;
+}
+
+static void
+mappingreader_release(mappingreader *m)
+{
+    Py_XDECREF(m->fields);
+    Py_XDECREF(m->field_types);
+    Py_XDECREF(m->embedded);
+    Py_XDECREF(m->defaults);
+}
+
+/* Raise TypeError for the first key of mapping that is not a field */
+static int
+mappingreader_extra(mappingreader *m, PyObject *mapping)
+{
+    PyObject *it, *key;
+    int res = 0;
+
+    it = PyObject_GetIter(mapping);
+    if (it == NULL)
+        return -1;
+    while (res == 0 && (key = PyIter_Next(it)) != NULL) {
+        res = PySequence_Contains(m->fields, key);
+        if (res == 0 && m->embedded != NULL)
+            res = PyDict_Contains(m->embedded, key);
+        if (res == 0) {
+            PyErr_Format(PyExc_TypeError, "%.200s has no field %R",
+                         m->type->tp_name, key);
+            res = -1;
+        }
+        else if (res > 0) {
+            res = 0;
+        }
+        Py_DECREF(key);
+    }
+    Py_DECREF(it);
+    if (res == 0 && PyErr_Occurred())
+        res = -1;
+    return res;
+}
+
+static PyObject *mappingreader_record(mappingreader *m, PyObject *mapping);
+
+/* Set the fields of the embedded records given in nested form in mapping,
+ * a dict becoming a record of the embedded class.  Returns the number of
+ * embedded fields found. */
+static Py_ssize_t
+mappingreader_embedded(mappingreader *m, PyObject *mapping, PyObject *record)
+{
+    PyObject *name, *entry, *value, *nested;
+    PyTypeObject *record_type;
+    mappingreader nested_reader;
+    Py_ssize_t pos = 0, offset, found = 0;
+
+    while (PyDict_Next(m->embedded, &pos, &name, &entry)) {
+        if (memoryslots_embedded_entry(m->state, m->type, name, entry,
+                                       &offset, &record_type) < 0)
+            return -1;
+        value = PyObject_GetItem(mapping, name);
+        if (value == NULL) {
+            if (!PyErr_ExceptionMatches(PyExc_KeyError))
+                return -1;
+            PyErr_Clear();
+            continue;
+        }
+        if (PyDict_Check(value)) {
+            if (mappingreader_init(&nested_reader, m->state, record_type,
+                                   m->extra_error) < 0) {
+                Py_DECREF(value);
+                return -1;
+            }
+            if (Py_EnterRecursiveCall(" while building a record from a mapping"))
+                nested = NULL;
+            else {
+                nested = mappingreader_record(&nested_reader, value);
+                Py_LeaveRecursiveCall();
+            }
+            mappingreader_release(&nested_reader);
+            Py_SETREF(value, nested);
+            if (value == NULL)
+                return -1;
+        }
+        if (memoryslots_set_embedded(m->state, record, name, offset,
+                                     record_type, value) < 0)
+            return -1;
+        found++;
+    }
+    return found;
+}
+
+/* value of field name, made a record if it is a dict for a record field */
+static PyObject *
+mappingreader_value(mappingreader *m, PyObject *name, PyObject *value)
+{
+    PyTypeObject *nested;
+    mappingreader nested_reader;
+    PyObject *result;
+
+    if (!PyDict_Check(value)) {
+        Py_INCREF(value);
+        return value;
+    }
+    nested = memoryslots_field_record_type(m->state, m->field_types, name);
+    if (nested == NULL) {
+        if (PyErr_Occurred())
+            return NULL;
+        Py_INCREF(value);
+        return value;
+    }
+    if (mappingreader_init(&nested_reader, m->state, nested,
+                           m->extra_error) < 0)
+        return NULL;
+    if (Py_EnterRecursiveCall(" while building a record from a mapping")) {
+        mappingreader_release(&nested_reader);
+        return NULL;
+    }
+    result = mappingreader_record(&nested_reader, value);
+    Py_LeaveRecursiveCall();
+    mappingreader_release(&nested_reader);
+    return result;
+}
+
+static PyObject *
+mappingreader_record(mappingreader *m, PyObject *mapping)
+{
+    PyObject *record, **items;
+    Py_ssize_t n, i, found = 0, embedded = 0, size;
+    int is_dict = PyDict_Check(mapping);
+
+    if (!is_dict && !PyMapping_Check(mapping)) {
+        PyErr_Format(PyExc_TypeError, "expected a mapping, got %.200s",
+                     Py_TYPE(mapping)->tp_name);
+        return NULL;
+    }
+    n = PyTuple_GET_SIZE(m->fields);
+    record = PyMemorySlots_New(m->type, n);
+    if (record == NULL)
+        return NULL;
+    items = ((PyTupleObject *)record)->ob_item;
+
+    for (i = 0; i < n; i++) {
+        PyObject *name = PyTuple_GET_ITEM(m->fields, i), *value;
+
+        if (is_dict) {
+            value = PyDict_GetItemWithError(mapping, name);   /* borrowed */
+            if (value == NULL) {
+                if (PyErr_Occurred())
+                    goto error;
+                continue;
+            }
+            items[i] = mappingreader_value(m, name, value);
+        }
+        else {
+            value = PyObject_GetItem(mapping, name);
+            if (value == NULL) {
+                if (!PyErr_ExceptionMatches(PyExc_KeyError))
+                    goto error;
+                PyErr_Clear();
+                continue;
+            }
+            items[i] = mappingreader_value(m, name, value);
+            Py_DECREF(value);
+        }
+        if (items[i] == NULL)
+            goto error;
+        found++;
+    }
+
+    if (m->embedded != NULL) {
+        embedded = mappingreader_embedded(m, mapping, record);
+        if (embedded < 0)
+            goto error;
+    }
+    if (m->extra_error) {
+        size = is_dict ? PyDict_GET_SIZE(mapping) : PyObject_Size(mapping);
+        if (size < 0)
+            goto error;
+        if (size > found + embedded && mappingreader_extra(m, mapping) < 0)
+            goto error;
+    }
+    if ((found < n || embedded) &&
+        memoryslots_fill_defaults(record, m->fields, &m->defaults,
+                                  "mapping") < 0)
+        goto error;
+    return record;
+
+error:
+    Py_DECREF(record);
+    return NULL;
+}
+
+/* extra='ignore' or 'error' as 0 or 1, -1 on other values */
+static int
+mapping_extra_policy(const char *extra)
+{
+    if (strcmp(extra, "ignore") == 0)
+        return 0;
+    if (strcmp(extra, "error") == 0)
+        return 1;
+    PyErr_Format(PyExc_ValueError,
+                 "extra must be 'ignore' or 'error', not '%.100s'", extra);
+    return -1;
+}
+
+PyDoc_STRVAR(memoryslots_from_mapping_doc,
+"D._from_mapping(mapping, extra='ignore') -> new record from a mapping.\n\n"
+"Fields are filled straight from the mapping values of their names;\n"
+"fields missing from the mapping take their default, and dicts in fields\n"
+"whose _field_types entry is a record class become records of that\n"
+"class.  Keys that are not fields are ignored, or raise TypeError if\n"
+"extra is 'error'.");
+
+static PyObject *
+memoryslots_from_mapping(PyObject *cls, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"mapping", "extra", NULL};
+    memoryslots_state *state;
+    mappingreader m;
+    PyObject *mapping, *result;
+    const char *extra = "ignore";
+    int extra_error;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|s:_from_mapping", kwlist,
+                                     &mapping, &extra))
+        return NULL;
+    extra_error = mapping_extra_policy(extra);
+    if (extra_error < 0)
+        return NULL;
+    state = memoryslots_state_by_type((PyTypeObject *)cls);
+    if (state == NULL)
+        return NULL;
+    if (mappingreader_init(&m, state, (PyTypeObject *)cls, extra_error) < 0)
+        return NULL;
+    result = mappingreader_record(&m, mapping);
+    mappingreader_release(&m);
+    return result;
+}
+
+PyDoc_STRVAR(memoryslots_from_mappings_doc,
+"D._from_mappings(mappings, extra='ignore') -> list of new records.\n\n"
+"_from_mapping() of every mapping of the iterable mappings.");
+
+static PyObject *
+memoryslots_from_mappings(PyObject *cls, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"mappings", "extra", NULL};
+    memoryslots_state *state;
+    mappingreader m;
+    PyObject *mappings, *it, *mapping, *record, *result;
+    const char *extra = "ignore";
+    int extra_error, res = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|s:_from_mappings", kwlist,
+                                     &mappings, &extra))
+        return NULL;
+    extra_error = mapping_extra_policy(extra);
+    if (extra_error < 0)
+        return NULL;
+    state = memoryslots_state_by_type((PyTypeObject *)cls);
+    if (state == NULL)
+        return NULL;
+    it = PyObject_GetIter(mappings);
+    if (it == NULL)
+        return NULL;
+    result = PyList_New(0);
+    if (result == NULL ||
+        mappingreader_init(&m, state, (PyTypeObject *)cls, extra_error) < 0) {
+        Py_XDECREF(result);
+        Py_DECREF(it);
+        return NULL;
+    }
+
+    while (res == 0 && (mapping = PyIter_Next(it)) != NULL) {
+        record = mappingreader_record(&m, mapping);
+        Py_DECREF(mapping);
+        if (record == NULL) {
+            res = -1;
+            break;
+        }
+        res = PyList_Append(result, record);
+        Py_DECREF(record);
+    }
+    if (res < 0 || PyErr_Occurred())
+        Py_CLEAR(result);
+    mappingreader_release(&m);
+    Py_DECREF(it);
+    return result;
+}
+
+static PyMethodDef memoryslots_methods[] = {
+    {"__getnewargs__",          (PyCFunction)memoryslots_getnewargs,  METH_NOARGS},
+        /*{"copy", (PyCFunction)memoryslots_copy, METH_NOARGS, memoryslots_copy_doc},*/
+    {"__copy__", (PyCFunction)memoryslots_copy, METH_NOARGS, memoryslots_copy_doc},
+    {"__deepcopy__", (PyCFunction)memoryslots_deepcopy, METH_VARARGS, memoryslots_deepcopy_doc},
+    {"__len__", (PyCFunction)memoryslots_len, METH_NOARGS, memoryslots_len_doc},
+    {"__sizeof__",      (PyCFunction)memoryslots_sizeof, METH_NOARGS, memoryslots_sizeof_doc},
+    {"__reduce__", (PyCFunction)memoryslots_reduce, METH_NOARGS, memoryslots_reduce_doc},
+    {"_dirty_fields", (PyCFunction)memoryslots_dirty_fields, METH_NOARGS, memoryslots_dirty_fields_doc},
+    {"_clear_dirty", (PyCFunction)memoryslots_clear_dirty, METH_NOARGS, memoryslots_clear_dirty_doc},
+    {"_diff", (PyCFunction)memoryslots_diff, METH_O, memoryslots_diff_doc},
+    {"_to_json", (PyCFunction)(void(*)(void))memoryslots_to_json, METH_VARARGS | METH_KEYWORDS, memoryslots_to_json_doc},
+    {"to_json_many", (PyCFunction)(void(*)(void))memoryslots_to_json_many, METH_VARARGS | METH_KEYWORDS | METH_CLASS, memoryslots_to_json_many_doc},
+    {"_from_json", (PyCFunction)memoryslots_from_json, METH_O | METH_CLASS, memoryslots_from_json_doc},
+    {"_from_mapping", (PyCFunction)(void(*)(void))memoryslots_from_mapping, METH_VARARGS | METH_KEYWORDS | METH_CLASS, memoryslots_from_mapping_doc},
+    {"_from_mappings", (PyCFunction)(void(*)(void))memoryslots_from_mappings, METH_VARARGS | METH_KEYWORDS | METH_CLASS, memoryslots_from_mappings_doc},
+    {NULL}
+};
+
+static PyObject* memoryslots_iter(PyObject *seq);
+
+static PyType_Slot memoryslots_slots[] = {
+    {Py_tp_dealloc, memoryslots_dealloc},
+    {Py_tp_repr, memoryslots_repr},
+    {Py_sq_length, memoryslots_len},
+    {Py_sq_concat, memoryslots_concat},
+    {Py_sq_repeat, memoryslots_repeat},
+    {Py_sq_item, memoryslots_item},
+    {Py_sq_ass_item, memoryslots_ass_item},
+    {Py_mp_length, memoryslots_len},
+    {Py_mp_subscript, memoryslots_subscript},
+    {Py_mp_ass_subscript, memoryslots_ass_subscript},
+    {Py_tp_hash, PyObject_HashNotImplemented},
+    {Py_tp_getattro, PyObject_GenericGetAttr},
+    {Py_tp_setattro, PyObject_GenericSetAttr},
+    {Py_tp_doc, (void *)memoryslots_doc},
+    {Py_tp_traverse, memoryslots_traverse},
+    {Py_tp_clear, memoryslots_clear},
+    {Py_tp_richcompare, memoryslots_richcompare},
+    {Py_tp_iter, memoryslots_iter},
+    {Py_tp_methods, memoryslots_methods},
+    {Py_tp_new, memoryslots_new},
+    {Py_tp_free, PyObject_GC_Del},
+    {0, 0}
+};
+
+static PyType_Spec memoryslots_spec = {
+    "trafaretrecord.memoryslots.memoryslots",           /* name */
+    sizeof(PyMemorySlotsObject) - sizeof(PyObject*),    /* basicsize */
+    sizeof(PyObject*),                                  /* itemsize */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC | Py_TPFLAGS_BASETYPE,
+                                                        /* flags */
+    memoryslots_slots                                   /* slots */
+};
+
+/*********************** MemorySlots Iterator **************************/
+
+typedef struct {
+    PyObject_HEAD
+    Py_ssize_t it_index;
+    PyTupleObject *it_seq; /* Set to NULL when iterator is exhausted */
+} memoryslotsiterobject;
+
+static void
+memoryslotsiter_dealloc(memoryslotsiterobject *it)
+{
+    PyTypeObject *tp = Py_TYPE(it);
+
+    PyObject_GC_UnTrack(it);
+    Py_CLEAR(it->it_seq);
+    PyObject_GC_Del(it);
+    Py_DECREF(tp);
+}
+
+static int
+memoryslotsiter_traverse(memoryslotsiterobject *it, visitproc visit, void *arg)
+{
+    Py_VISIT(Py_TYPE(it));
+    Py_VISIT(it->it_seq);
+    return 0;
+}
+
+static int
+memoryslotsiter_clear(memoryslotsiterobject *it)
+{
+    Py_CLEAR(it->it_seq);
+    return 0;
+}
+
+static PyObject *
+memoryslotsiter_next(memoryslotsiterobject *it)
+{
+    PyTupleObject *seq;
+    PyObject *item;
+
+    assert(it != NULL);
+    seq = it->it_seq;
+    if (seq == NULL)
+        return NULL;
+
+    if (it->it_index < PyTuple_GET_SIZE(seq)) {
+        item = PyTuple_GET_ITEM(seq, it->it_index);
+        Py_INCREF(item);
+        ++it->it_index;
+        return item;
+    }
+
+    Py_DECREF(seq);
+    it->it_seq = NULL;
+    return NULL;
+}
+
+static PyObject *
+memoryslotsiter_len(memoryslotsiterobject *it)
+{
+    Py_ssize_t len = 0;
+    if (it->it_seq)
+        len = PyTuple_GET_SIZE(it->it_seq) - it->it_index;
+    return PyLong_FromSsize_t(len);
+}
+
+PyDoc_STRVAR(length_hint_doc, "Private method returning an estimate of len(list(it)).");
+
+static PyObject *
+memoryslotsiter_reduce(memoryslotsiterobject *it)
+{
+    if (it->it_seq)
+        return Py_BuildValue("N(O)n", memoryslots_get_builtin("iter"),
+                             it->it_seq, it->it_index);
+    else
+        return Py_BuildValue("N(())", memoryslots_get_builtin("iter"));
+}
+
+PyDoc_STRVAR(memoryslotsiter_reduce_doc, "D.__reduce__()");
+
+
+static PyObject *
+memoryslotsiter_setstate(memoryslotsiterobject *it, PyObject *state)
+{
+    Py_ssize_t index;
+
+    index = PyLong_AsSsize_t(state);
+    if (index == -1 && PyErr_Occurred())
+        return NULL;
+    if (it->it_seq != NULL) {
+        if (index < 0)
+            index = 0;
+        else if (index > PyTuple_GET_SIZE(it->it_seq))
+            index = PyTuple_GET_SIZE(it->it_seq); /* exhausted iterator */
+        it->it_index = index;
+    }
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(setstate_doc, "Set state information for unpickling.");
+
+
+static PyMethodDef memoryslotsiter_methods[] = {
+    {"__length_hint__", (PyCFunction)memoryslotsiter_len, METH_NOARGS, length_hint_doc},
+    {"__reduce__",      (PyCFunction)memoryslotsiter_reduce, METH_NOARGS, memoryslotsiter_reduce_doc},
+    {"__setstate__",    (PyCFunction)memoryslotsiter_setstate, METH_O, setstate_doc},
+    {NULL,              NULL}           /* sentinel */
+};
+
+static PyType_Slot memoryslotsiter_slots[] = {
+    {Py_tp_dealloc, memoryslotsiter_dealloc},
+    {Py_tp_getattro, PyObject_GenericGetAttr},
+    {Py_tp_traverse, memoryslotsiter_traverse},
+    {Py_tp_clear, memoryslotsiter_clear},
+    {Py_tp_iter, PyObject_SelfIter},
+    {Py_tp_iternext, memoryslotsiter_next},
+    {Py_tp_methods, memoryslotsiter_methods},
+    {0, 0}
+};
+
+static PyType_Spec memoryslotsiter_spec = {
+    "trafaretrecord.memoryslots.memoryslots_iterator",  /* name */
+    sizeof(memoryslotsiterobject),                      /* basicsize */
+    0,                                                  /* itemsize */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,            /* flags */
+    memoryslotsiter_slots                               /* slots */
+};
+
+static PyObject *
+memoryslots_iter(PyObject *seq)
+{
+    memoryslotsiterobject *it;
+    memoryslots_state *state;
+
+    state = memoryslots_state_by_type(Py_TYPE(seq));
+    if (state == NULL)
+        return NULL;
+
+    it = PyObject_GC_New(memoryslotsiterobject, state->memoryslotsiter_type);
+    if (it == NULL)
+        return NULL;
+    it->it_index = 0;
+    it->it_seq = (PyTupleObject *)seq;
+    Py_INCREF(seq);
+    PyObject_GC_Track(it);
+    return (PyObject *)it;
+}
+
+/*********************** itemgetset descriptor **************************/
+
+/* While a descriptor is profiled, one in period reads and one in period
+ * writes of its field through attribute access are counted. */
+
+struct itemgetset_object {
+  PyObject_HEAD
+  Py_ssize_t i;
+  Py_ssize_t period;        /* 0 while not profiled */
+  Py_ssize_t read_countdown;
+  Py_ssize_t write_countdown;
+  Py_ssize_t reads;
+  Py_ssize_t writes;
+};
+
+#define itemgetset_sample(ob, countdown, count) \
+    do { \
+        if (--(ob)->countdown == 0) { \
+            (ob)->countdown = (ob)->period; \
+            (ob)->count++; \
+        } \
+    } while (0)
+
+PyDoc_STRVAR(itemgetset_profile_doc,
+"profile(period=1)\n\n"
+"Reset the access counts and count one in period reads and writes of the\n"
+"field from now on; period 0 stops counting.");
+
+static PyObject *
+itemgetset_profile(struct itemgetset_object *ob, PyObject *args)
+{
+    Py_ssize_t period = 1;
+
+    if (!PyArg_ParseTuple(args, "|n:profile", &period))
+        return NULL;
+    if (period < 0) {
+        PyErr_SetString(PyExc_ValueError, "period must be >= 0");
+        return NULL;
+    }
+    ob->period = period;
+    ob->read_countdown = ob->write_countdown = period;
+    ob->reads = ob->writes = 0;
+    Py_RETURN_NONE;
+}
+
+/* Estimated (reads, writes) since profile() */
+static PyObject *
+itemgetset_counts(struct itemgetset_object *ob, void *closure)
+{
+    Py_ssize_t period = ob->period ? ob->period : 1;
+
+    return Py_BuildValue("nn", ob->reads * period, ob->writes * period);
+}
+
+static PyObject *
+itemgetset_profiled(struct itemgetset_object *ob, void *closure)
+{
+    return PyBool_FromLong(ob->period != 0);
+}
+
+static PyMethodDef itemgetset_methods[] = {
+  {"profile", (PyCFunction)itemgetset_profile, METH_VARARGS, itemgetset_profile_doc},
+  {0, 0, 0, 0}
+};
+
+static PyGetSetDef itemgetset_getset[] = {
+    {"counts", (getter)itemgetset_counts, NULL, NULL, NULL},
+    {"profiled", (getter)itemgetset_profiled, NULL, NULL, NULL},
+    {NULL}
+};
+
+static PyObject* itemgetset_new(PyTypeObject *t, PyObject *args, PyObject *k) {
+    PyObject *ob;
+    Py_ssize_t i;
+
+    if (!PyArg_ParseTuple(args, "n:itemgetset", &i))
+        return NULL;
+
+    ob = t->tp_alloc(t, 0);
+    if (ob == NULL)
+        return NULL;
+
+    ((struct itemgetset_object*)ob)->i = i;
+    return ob;
+}
+
+static void itemgetset_dealloc(PyObject *o) {
+    PyTypeObject *tp = Py_TYPE(o);
+
+    tp->tp_free(o);
+    Py_DECREF(tp);
+}
+
+static PyObject* itemgetset_get(PyObject *self, PyObject *obj, PyObject *type) {
+    Py_ssize_t i;
+    PyObject *v;
+
+    if (obj == NULL || obj == Py_None) {
+        Py_INCREF(self);
+        return self;
+    }
+    i = ((struct itemgetset_object*)self)->i;
+    if (((struct itemgetset_object*)self)->period)
+        itemgetset_sample((struct itemgetset_object*)self, read_countdown,
+                          reads);
+    if (i >= Py_SIZE(obj)) {
+        PyErr_SetString(PyExc_IndexError, "field index out of range");
+        return NULL;
+    }
+    v = PyTuple_GET_ITEM(obj, i);
+    Py_INCREF(v);
+    return v;
+}
+
+static int itemgetset_set(PyObject *self, PyObject *obj, PyObject *value) {
+    Py_ssize_t i;
+    PyObject *v;
+
+    if (value == NULL) {
+        PyErr_SetString(PyExc_NotImplementedError, "__delete__");
+        return -1;
+    }
+    if (obj == NULL || obj == Py_None)
+        return 0;
+
+    i = ((struct itemgetset_object*)self)->i;
+    if (i >= Py_SIZE(obj)) {
+        PyErr_SetString(PyExc_IndexError, "field index out of range");
+        return -1;
+    }
+    if (memoryslots_notify(obj, i, value) < 0)
+        return -1;
+    if (((struct itemgetset_object*)self)->period)
+        itemgetset_sample((struct itemgetset_object*)self, write_countdown,
+                          writes);
+    v = PyTuple_GET_ITEM(obj, i);
+    Py_INCREF(value);
+    PyTuple_SET_ITEM(obj, i, value);
+    memoryslots_invalidate(obj, i);
+    Py_XDECREF(v);
+    return 0;
+}
+
+static PyObject *predicate_compare(memoryslots_state *state, PyObject *field,
+                                   int op, PyObject *value);
+
+/* Comparing a field descriptor with a constant that can be compared with a
+ * column (a number, str or bytes) builds a predicate for Rec.where();
+ * descriptors compare with each other and with other objects by
+ * identity. */
+static PyObject *
+itemgetset_richcompare(PyObject *self, PyObject *other, int op)
+{
+    memoryslots_state *state;
+
+    if (!PyLong_Check(other) && !PyFloat_Check(other) &&
+        !PyUnicode_Check(other) && !PyBytes_Check(other))
+        Py_RETURN_NOTIMPLEMENTED;
+    state = memoryslots_state_by_type(Py_TYPE(self));
+    if (state == NULL)
+        return NULL;
+    return predicate_compare(state, self, op, other);
+}
+
+/* Identity hash, which defining comparisons would otherwise remove */
+static Py_hash_t
+itemgetset_hash(PyObject *self)
+{
+    size_t y = (size_t)self;
+
+    y = (y >> 4) | (y << (8 * SIZEOF_VOID_P - 4));
+    if (y == (size_t)-1)
+        y = (size_t)-2;
+    return (Py_hash_t)y;
+}
+
+static PyType_Slot itemgetset_slots[] = {
+    {Py_tp_dealloc, itemgetset_dealloc},
+    {Py_tp_richcompare, itemgetset_richcompare},
+    {Py_tp_hash, itemgetset_hash},
+    {Py_tp_methods, itemgetset_methods},
+    {Py_tp_getset, itemgetset_getset},
+    {Py_tp_descr_get, itemgetset_get},
+    {Py_tp_descr_set, itemgetset_set},
+    {Py_tp_new, itemgetset_new},
+    {0, 0}
+};
+
+static PyType_Spec itemgetset_spec = {
+    "trafaretrecord.memoryslots.itemgetset",            /* name */
+    sizeof(struct itemgetset_object),                   /* basicsize */
+    0,                                                  /* itemsize */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,           /* flags */
+    itemgetset_slots                                    /* slots */
+};
+
+/*********************** slotlayout **************************/
+
+PyDoc_STRVAR(slotlayout_doc,
+"slotlayout(n_hidden, dependencies, dirty_fields=0) --> slotlayout\n\n"
+"Hidden slots of the instances of a record class, declared as the\n"
+"class attribute __slotlayout__.  dependencies[i] lists the hidden slots\n"
+"that are reset whenever field i is set.  Setting one of the first\n"
+"dirty_fields fields marks it dirty in a bitmap of the record.  observers\n"
+"lists the tables (or weak references to them) whose\n"
+"_field_check(record, i, value) and then _field_changed(record, i, value)\n"
+"are called before a field of a watched record is set.");
+
+static PyObject *
+slotlayout_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    slotlayout_object *op;
+    Py_ssize_t n_hidden, n_fields, n_deps, n_dirty = 0, i, k;
+    PyObject *dependencies, *fast = NULL;
+
+    if (!PyArg_ParseTuple(args, "nO|n:slotlayout", &n_hidden, &dependencies,
+                          &n_dirty))
+        return NULL;
+    if (n_hidden < 0 || n_dirty < 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "n_hidden and dirty_fields must be >= 0");
+        return NULL;
+    }
+
+    fast = PySequence_Fast(dependencies, "dependencies must be a sequence");
+    if (fast == NULL)
+        return NULL;
+    n_fields = PySequence_Fast_GET_SIZE(fast);
+
+    n_deps = 0;
+    for (i = 0; i < n_fields; i++) {
+        Py_ssize_t n = PyObject_Length(PySequence_Fast_GET_ITEM(fast, i));
+        if (n < 0)
+            goto error;
+        n_deps += n;
+    }
+
+    op = (slotlayout_object *)type->tp_alloc(type, 0);
+    if (op == NULL)
+        goto error;
+    op->n_hidden = n_hidden;
+    op->n_fields = n_fields;
+    op->n_dirty = n_dirty;
+    op->observers = PyList_New(0);
+    op->deps_start = PyMem_New(Py_ssize_t, n_fields + 1);
+    op->deps = PyMem_New(Py_ssize_t, n_deps ? n_deps : 1);
+    if (op->observers == NULL) {
+        Py_DECREF(op);
+        goto error;
+    }
+    if (op->deps_start == NULL || op->deps == NULL) {
+        Py_DECREF(op);
+        PyErr_NoMemory();
+        goto error;
+    }
+
+    k = 0;
+    for (i = 0; i < n_fields; i++) {
+        PyObject *field_deps, *item;
+        Py_ssize_t j, n;
+
+        op->deps_start[i] = k;
+        field_deps = PySequence_Tuple(PySequence_Fast_GET_ITEM(fast, i));
+        if (field_deps == NULL) {
+            Py_DECREF(op);
+            goto error;
+        }
+        n = PyTuple_GET_SIZE(field_deps);
+        for (j = 0; j < n && k < n_deps; j++) {
+            Py_ssize_t slot;
+
+            item = PyTuple_GET_ITEM(field_deps, j);
+            slot = PyNumber_AsSsize_t(item, PyExc_IndexError);
+            if (slot == -1 && PyErr_Occurred()) {
+                Py_DECREF(field_deps);
+                Py_DECREF(op);
+                goto error;
+            }
+            if (slot < 0 || slot >= n_hidden) {
+                PyErr_Format(PyExc_IndexError,
+                             "hidden slot %zd out of range", slot);
+                Py_DECREF(field_deps);
+                Py_DECREF(op);
+                goto error;
+            }
+            op->deps[k++] = slot;
+        }
+        Py_DECREF(field_deps);
+    }
+    op->deps_start[n_fields] = k;
+
+    Py_DECREF(fast);
+    return (PyObject *)op;
+
+error:
+    Py_XDECREF(fast);
+    return NULL;
+}
+
+static void
+slotlayout_dealloc(slotlayout_object *op)
+{
+    PyTypeObject *tp = Py_TYPE(op);
+
+    PyMem_Free(op->deps_start);
+    PyMem_Free(op->deps);
+    Py_XDECREF(op->observers);
+    tp->tp_free((PyObject *)op);
+    Py_DECREF(tp);
+}
+
+static PyObject *
+slotlayout_dependencies(slotlayout_object *op, void *closure)
+{
+    PyObject *result;
+    Py_ssize_t i, k;
+
+    result = PyTuple_New(op->n_fields);
+    if (result == NULL)
+        return NULL;
+    for (i = 0; i < op->n_fields; i++) {
+        Py_ssize_t start = op->deps_start[i];
+        PyObject *field_deps = PyTuple_New(op->deps_start[i + 1] - start);
+
+        if (field_deps == NULL) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        for (k = start; k < op->deps_start[i + 1]; k++) {
+            PyObject *slot = PyLong_FromSsize_t(op->deps[k]);
+            if (slot == NULL) {
+                Py_DECREF(field_deps);
+                Py_DECREF(result);
+                return NULL;
+            }
+            PyTuple_SET_ITEM(field_deps, k - start, slot);
+        }
+        PyTuple_SET_ITEM(result, i, field_deps);
+    }
+    return result;
+}
+
+static PyObject *
+slotlayout_n_hidden(slotlayout_object *op, void *closure)
+{
+    return PyLong_FromSsize_t(op->n_hidden);
+}
+
+static PyObject *
+slotlayout_dirty_fields(slotlayout_object *op, void *closure)
+{
+    return PyLong_FromSsize_t(op->n_dirty);
+}
+
+static PyObject *
+slotlayout_observers(slotlayout_object *op, void *closure)
+{
+    Py_INCREF(op->observers);
+    return op->observers;
+}
+
+static PyGetSetDef slotlayout_getset[] = {
+    {"n_hidden", (getter)slotlayout_n_hidden, NULL, NULL, NULL},
+    {"dirty_fields", (getter)slotlayout_dirty_fields, NULL, NULL, NULL},
+    {"observers", (getter)slotlayout_observers, NULL, NULL, NULL},
+    {"dependencies", (getter)slotlayout_dependencies, NULL, NULL, NULL},
+    {NULL}
+};
+
+static PyType_Slot slotlayout_slots[] = {
+    {Py_tp_dealloc, slotlayout_dealloc},
+    {Py_tp_doc, (void *)slotlayout_doc},
+    {Py_tp_getset, slotlayout_getset},
+    {Py_tp_new, slotlayout_new},
+    {0, 0}
+};
+
+static PyType_Spec slotlayout_spec = {
+    "trafaretrecord.memoryslots.slotlayout",            /* name */
+    sizeof(slotlayout_object),                          /* basicsize */
+    0,                                                  /* itemsize */
+    Py_TPFLAGS_DEFAULT,                                 /* flags */
+    slotlayout_slots                                    /* slots */
+};
+
+/*********************** cachedgetset descriptor **************************/
+
+/* Descriptor of a computed field: the value of func(record) is cached in
+ * hidden slot i and reset when one of the fields it depends on is set. */
+
+struct cachedgetset_object {
+    PyObject_HEAD
+    Py_ssize_t i;
+    PyObject *func;
+    PyTypeObject *base;     /* memoryslots type of the defining module */
+};
+
+PyDoc_STRVAR(cachedgetset_doc,
+"cachedgetset(i, func) --> descriptor caching func(record) in hidden slot i");
+
+static PyObject *
+cachedgetset_new(PyTypeObject *t, PyObject *args, PyObject *k)
+{
+    struct cachedgetset_object *ob;
+    memoryslots_state *state;
+    Py_ssize_t i;
+    PyObject *func;
+
+    if (!PyArg_ParseTuple(args, "nO:cachedgetset", &i, &func))
+        return NULL;
+    if (!PyCallable_Check(func)) {
+        PyErr_SetString(PyExc_TypeError, "cachedgetset function must be callable");
+        return NULL;
+    }
+    state = memoryslots_state_by_type(t);
+    if (state == NULL)
+        return NULL;
+
+    ob = (struct cachedgetset_object *)t->tp_alloc(t, 0);
+    if (ob == NULL)
+        return NULL;
+    ob->i = i;
+    Py_INCREF(func);
+    ob->func = func;
+    Py_INCREF(state->memoryslots_type);
+    ob->base = state->memoryslots_type;
+    return (PyObject *)ob;
+}
+
+static int
+cachedgetset_traverse(struct cachedgetset_object *ob, visitproc visit, void *arg)
+{
+    Py_VISIT(Py_TYPE(ob));
+    Py_VISIT(ob->func);
+    Py_VISIT(ob->base);
+    return 0;
+}
+
+static int
+cachedgetset_clear(struct cachedgetset_object *ob)
+{
+    Py_CLEAR(ob->func);
+    Py_CLEAR(ob->base);
+    return 0;
+}
+
+static void
+cachedgetset_dealloc(struct cachedgetset_object *ob)
+{
+    PyTypeObject *tp = Py_TYPE(ob);
+
+    PyObject_GC_UnTrack(ob);
+    cachedgetset_clear(ob);
+    tp->tp_free((PyObject *)ob);
+    Py_DECREF(tp);
+}
+
+static PyObject **
+cachedgetset_slot(struct cachedgetset_object *self, PyObject *obj)
+{
+    slotlayout_object *layout;
+
+    if (self->func == NULL || !PyObject_TypeCheck(obj, self->base)) {
+        PyErr_Format(PyExc_TypeError,
+                     "cachedgetset does not apply to '%.200s' object",
+                     Py_TYPE(obj)->tp_name);
+        return NULL;
+    }
+    layout = memoryslots_layout(obj);
+    if (layout == NULL || self->i < 0 || self->i >= layout->n_hidden) {
+        PyErr_Format(PyExc_TypeError,
+                     "'%.200s' object has no hidden slot %zd",
+                     Py_TYPE(obj)->tp_name, self->i);
+        return NULL;
+    }
+    return memoryslots_hidden(obj) + self->i;
+}
+
+static PyObject *
+cachedgetset_get(PyObject *self, PyObject *obj, PyObject *type)
+{
+    struct cachedgetset_object *ob = (struct cachedgetset_object *)self;
+    PyObject **slot, *v, *old;
+
+    if (obj == NULL || obj == Py_None) {
+        Py_INCREF(self);
+        return self;
+    }
+    slot = cachedgetset_slot(ob, obj);
+    if (slot == NULL)
+        return NULL;
+
+    v = *slot;
+    if (v != NULL) {
+        Py_INCREF(v);
+        return v;
+    }
+
+    v = PyObject_CallOneArg(ob->func, obj);
+    if (v == NULL)
+        return NULL;
+    /* the slot may have been filled while func was running */
+    old = *slot;
+    Py_INCREF(v);
+    *slot = v;
+    Py_XDECREF(old);
+    return v;
+}
+
+static int
+cachedgetset_set(PyObject *self, PyObject *obj, PyObject *value)
+{
+    PyObject **slot;
+
+    if (value != NULL) {
+        PyErr_SetString(PyExc_AttributeError, "computed field is read-only");
+        return -1;
+    }
+    slot = cachedgetset_slot((struct cachedgetset_object *)self, obj);
+    if (slot == NULL)
+        return -1;
+    /* deleting a computed field drops its cached value */
+    Py_CLEAR(*slot);
+    return 0;
+}
+
+static PyObject *
+cachedgetset_get_doc(struct cachedgetset_object *ob, void *closure)
+{
+    if (ob->func == NULL)
+        Py_RETURN_NONE;
+    return PyObject_GetAttrString(ob->func, "__doc__");
+}
+
+static PyMemberDef cachedgetset_members[] = {
+    {"func", T_OBJECT, offsetof(struct cachedgetset_object, func), READONLY, NULL},
+    {NULL}
+};
+
+static PyGetSetDef cachedgetset_getset[] = {
+    {"__doc__", (getter)cachedgetset_get_doc, NULL, NULL, NULL},
+    {NULL}
+};
+
+static PyType_Slot cachedgetset_slots[] = {
+    {Py_tp_dealloc, cachedgetset_dealloc},
+    {Py_tp_doc, (void *)cachedgetset_doc},
+    {Py_tp_traverse, cachedgetset_traverse},
+    {Py_tp_clear, cachedgetset_clear},
+    {Py_tp_members, cachedgetset_members},
+    {Py_tp_getset, cachedgetset_getset},
+    {Py_tp_descr_get, cachedgetset_get},
+    {Py_tp_descr_set, cachedgetset_set},
+    {Py_tp_new, cachedgetset_new},
+    {0, 0}
+};
+
+static PyType_Spec cachedgetset_spec = {
+    "trafaretrecord.memoryslots.cachedgetset",          /* name */
+    sizeof(struct cachedgetset_object),                 /* basicsize */
+    0,                                                  /* itemsize */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,            /* flags */
+    cachedgetset_slots                                  /* slots */
+};
+
+/*********************** embedded records **************************/
+
+/* The fields of a record embedded in another are stored inline among the
+ * fields of the outer record, from some offset on, so the embedded record
+ * is not a separate object.  An embeddedview shows them as a record of
+ * their own: it holds the outer record and the offset, and its reads and
+ * writes go to the fields of the outer record.
+ *
+ * embeddedgetset(offset, view_type) is the descriptor of an embedded
+ * record: it returns a view_type view of the fields from offset on, of a
+ * record or of a view.  Without view_type it is the descriptor of the
+ * field at offset of a view. */
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *record;
+    Py_ssize_t offset;
+} embeddedview_object;
+
+PyDoc_STRVAR(embeddedview_doc,
+"embeddedview(record, offset) --> view of the fields of record from offset");
+
+static PyObject *
+embeddedview_make(PyTypeObject *type, PyObject *record, Py_ssize_t offset)
+{
+    embeddedview_object *view;
+
+    view = (embeddedview_object *)type->tp_alloc(type, 0);
+    if (view == NULL)
+        return NULL;
+    Py_INCREF(record);
+    view->record = record;
+    view->offset = offset;
+    return (PyObject *)view;
+}
+
+static PyObject *
+embeddedview_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"record", "offset", NULL};
+    memoryslots_state *state;
+    PyObject *record;
+    Py_ssize_t offset;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "On:embeddedview", kwlist,
+                                     &record, &offset))
+        return NULL;
+    state = memoryslots_state_by_type(type);
+    if (state == NULL)
+        return NULL;
+    if (!PyObject_TypeCheck(record, state->memoryslots_type)) {
+        PyErr_Format(PyExc_TypeError, "expected a memoryslots, got %.200s",
+                     Py_TYPE(record)->tp_name);
+        return NULL;
+    }
+    if (offset < 0 || offset > Py_SIZE(record)) {
+        PyErr_SetString(PyExc_IndexError, "offset out of range");
+        return NULL;
+    }
+    return embeddedview_make(type, record, offset);
+}
+
+static int
+embeddedview_traverse(embeddedview_object *view, visitproc visit, void *arg)
+{
+    Py_VISIT(Py_TYPE(view));
+    Py_VISIT(view->record);
+    return 0;
+}
+
+static int
+embeddedview_clear(embeddedview_object *view)
+{
+    Py_CLEAR(view->record);
+    return 0;
+}
+
+static void
+embeddedview_dealloc(embeddedview_object *view)
+{
+    PyTypeObject *tp = Py_TYPE(view);
+
+    PyObject_GC_UnTrack(view);
+    embeddedview_clear(view);
+    tp->tp_free((PyObject *)view);
+    Py_DECREF(tp);
+}
+
+PyDoc_STRVAR(embeddedview_values_doc,
+"V._values(value) -> tuple of the values to set to the fields of a view\n\n"
+"value is a sequence of as many values as the view has fields; mappings\n"
+"are refused, iterating over them would give their keys.");
+
+static PyObject *
+embeddedview_values(PyObject *cls, PyObject *value)
+{
+    memoryslots_state *state;
+    PyObject *fields, *values;
+    Py_ssize_t size;
+
+    if (PyDict_Check(value) || PyAnySet_Check(value) ||
+        PyUnicode_Check(value) || PyBytes_Check(value)) {
+        PyErr_Format(PyExc_TypeError,
+                     "expected a sequence of values for %.200s, got %.200s",
+                     ((PyTypeObject *)cls)->tp_name, Py_TYPE(value)->tp_name);
+        return NULL;
+    }
+    state = memoryslots_state_by_type((PyTypeObject *)cls);
+    if (state == NULL)
+        return NULL;
+    fields = PyObject_GetAttr(cls, state->str_fields);
+    if (fields == NULL)
+        return NULL;
+    size = PyObject_Length(fields);
+    Py_DECREF(fields);
+    if (size < 0)
+        return NULL;
+    values = PySequence_Tuple(value);
+    if (values != NULL && PyTuple_GET_SIZE(values) != size) {
+        PyErr_Format(PyExc_TypeError, "expected %zd values for %.200s, got %zd",
+                     size, ((PyTypeObject *)cls)->tp_name,
+                     PyTuple_GET_SIZE(values));
+        Py_CLEAR(values);
+    }
+    return values;
+}
+
+static PyMethodDef embeddedview_methods[] = {
+    {"_values", (PyCFunction)embeddedview_values, METH_O | METH_CLASS,
+     embeddedview_values_doc},
+    {NULL, NULL}
+};
+
+static PyMemberDef embeddedview_members[] = {
+    {"_record", T_OBJECT, offsetof(embeddedview_object, record), READONLY, NULL},
+    {"_offset", T_PYSSIZET, offsetof(embeddedview_object, offset), READONLY, NULL},
+    {NULL}
+};
+
+static PyType_Slot embeddedview_slots[] = {
+    {Py_tp_dealloc, embeddedview_dealloc},
+    {Py_tp_doc, (void *)embeddedview_doc},
+    {Py_tp_traverse, embeddedview_traverse},
+    {Py_tp_clear, embeddedview_clear},
+    {Py_tp_members, embeddedview_members},
+    {Py_tp_methods, embeddedview_methods},
+    {Py_tp_new, embeddedview_new},
+    {0, 0}
+};
+
+static PyType_Spec embeddedview_spec = {
+    "trafaretrecord.memoryslots.embeddedview",          /* name */
+    sizeof(embeddedview_object),                        /* basicsize */
+    0,                                                  /* itemsize */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC,
+    embeddedview_slots                                  /* slots */
+};
+
+struct embeddedgetset_object {
+    PyObject_HEAD
+    Py_ssize_t offset;
+    Py_ssize_t size;            /* number of fields of view_type */
+    PyTypeObject *view_type;    /* NULL for a field of a view */
+    PyTypeObject *base;         /* memoryslots type of the defining module */
+    PyTypeObject *view_base;    /* embeddedview type of the defining module */
+};
+
+PyDoc_STRVAR(embeddedgetset_doc,
+"embeddedgetset(offset, view_type=None) --> descriptor\n\n"
+"Descriptor of the record embedded from field offset on, as a view_type\n"
+"view, or of the field at offset of a view if view_type is None.");
+
+static PyObject *
+embeddedgetset_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"offset", "view_type", NULL};
+    struct embeddedgetset_object *ob;
+    memoryslots_state *state;
+    PyObject *view_type = Py_None, *fields;
+    Py_ssize_t offset, size = 1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "n|O:embeddedgetset", kwlist,
+                                     &offset, &view_type))
+        return NULL;
+    state = memoryslots_state_by_type(type);
+    if (state == NULL)
+        return NULL;
+    if (offset < 0) {
+        PyErr_SetString(PyExc_ValueError, "offset must be >= 0");
+        return NULL;
+    }
+    if (view_type != Py_None) {
+        if (!PyType_Check(view_type) ||
+            !PyType_IsSubtype((PyTypeObject *)view_type,
+                              state->embeddedview_type)) {
+            PyErr_SetString(PyExc_TypeError,
+                            "view_type must be an embeddedview subclass");
+            return NULL;
+        }
+        fields = PyObject_GetAttr(view_type, state->str_fields);
+        if (fields == NULL)
+            return NULL;
+        size = PyObject_Length(fields);
+        Py_DECREF(fields);
+        if (size < 0)
+            return NULL;
+    }
+
+    ob = (struct embeddedgetset_object *)type->tp_alloc(type, 0);
+    if (ob == NULL)
+        return NULL;
+    ob->offset = offset;
+    ob->size = size;
+    if (view_type != Py_None) {
+        Py_INCREF(view_type);
+        ob->view_type = (PyTypeObject *)view_type;
+    }
+    Py_INCREF(state->memoryslots_type);
+    ob->base = state->memoryslots_type;
+    Py_INCREF(state->embeddedview_type);
+    ob->view_base = state->embeddedview_type;
+    return (PyObject *)ob;
+}
+
+static int
+embeddedgetset_traverse(struct embeddedgetset_object *ob, visitproc visit,
+                        void *arg)
+{
+    Py_VISIT(Py_TYPE(ob));
+    Py_VISIT(ob->view_type);
+    Py_VISIT(ob->base);
+    Py_VISIT(ob->view_base);
+    return 0;
+}
+
+static int
+embeddedgetset_clear(struct embeddedgetset_object *ob)
+{
+    Py_CLEAR(ob->view_type);
+    Py_CLEAR(ob->base);
+    Py_CLEAR(ob->view_base);
+    return 0;
+}
+
+static void
+embeddedgetset_dealloc(struct embeddedgetset_object *ob)
+{
+    PyTypeObject *tp = Py_TYPE(ob);
+
+    PyObject_GC_UnTrack(ob);
+    embeddedgetset_clear(ob);
+    tp->tp_free((PyObject *)ob);
+    Py_DECREF(tp);
+}
+
+/* The outer record of obj and the offset of the descriptor's fields in it,
+ * checking that they are all fields of the record */
+static PyObject *
+embeddedgetset_target(struct embeddedgetset_object *ob, PyObject *obj,
+                      Py_ssize_t *offset)
+{
+    PyObject *record;
+
+    if (PyObject_TypeCheck(obj, ob->view_base)) {
+        record = ((embeddedview_object *)obj)->record;
+        *offset = ((embeddedview_object *)obj)->offset + ob->offset;
+    }
+    else if (ob->view_type != NULL && PyObject_TypeCheck(obj, ob->base)) {
+        record = obj;
+        *offset = ob->offset;
+    }
+    else {
+        record = NULL;
+    }
+    if (record == NULL) {
+        PyErr_Format(PyExc_TypeError,
+                     "embeddedgetset does not apply to '%.200s' object",
+                     Py_TYPE(obj)->tp_name);
+        return NULL;
+    }
+    if (*offset + ob->size > Py_SIZE(record)) {
+        PyErr_Format(PyExc_IndexError,
+                     "'%.200s' object has no fields %zd to %zd",
+                     Py_TYPE(record)->tp_name, *offset,
+                     *offset + ob->size - 1);
+        return NULL;
+    }
+    return record;
+}
+
+static PyObject *
+embeddedgetset_get(PyObject *self, PyObject *obj, PyObject *type)
+{
+    struct embeddedgetset_object *ob = (struct embeddedgetset_object *)self;
+    PyObject *record, *v;
+    Py_ssize_t offset;
+
+    if (obj == NULL || obj == Py_None) {
+        Py_INCREF(self);
+        return self;
+    }
+    record = embeddedgetset_target(ob, obj, &offset);
+    if (record == NULL)
+        return NULL;
+    if (ob->view_type != NULL)
+        return embeddedview_make(ob->view_type, record, offset);
+    v = PyTuple_GET_ITEM(record, offset);
+    Py_INCREF(v);
+    return v;
+}
+
+/* Setting an embedded record sets all its fields at once, to the values
+ * given by view_type._values(value), as a slice assignment does */
+static int
+embeddedgetset_set(PyObject *self, PyObject *obj, PyObject *value)
+{
+    struct embeddedgetset_object *ob = (struct embeddedgetset_object *)self;
+    memoryslots_state *state;
+    PyObject *record, *values;
+    Py_ssize_t offset;
+    int res = -1;
+
+    if (value == NULL) {
+        PyErr_SetString(PyExc_AttributeError,
+                        "fields of embedded records cannot be deleted");
+        return -1;
+    }
+    record = embeddedgetset_target(ob, obj, &offset);
+    if (record == NULL)
+        return -1;
+    if (ob->view_type == NULL)
+        return memoryslots_ass_item(record, offset, value);
+
+    state = memoryslots_state_by_type(Py_TYPE(self));
+    if (state == NULL)
+        return -1;
+    values = PyObject_CallMethodObjArgs((PyObject *)ob->view_type,
+                                        state->str_values, value, NULL);
+    if (values == NULL)
+        return -1;
+    if (!PyTuple_Check(values) || PyTuple_GET_SIZE(values) != ob->size)
+        PyErr_Format(PyExc_TypeError,
+                     "%.200s._values() must return a tuple of %zd values",
+                     ob->view_type->tp_name, ob->size);
+    else
+        res = memoryslots_ass_slice(record, offset, offset + ob->size,
+                                    values);
+    Py_DECREF(values);
+    return res;
+}
+
+static PyMemberDef embeddedgetset_members[] = {
+    {"offset", T_PYSSIZET, offsetof(struct embeddedgetset_object, offset), READONLY, NULL},
+    {"view_type", T_OBJECT, offsetof(struct embeddedgetset_object, view_type), READONLY, NULL},
+    {NULL}
+};
+
+static PyType_Slot embeddedgetset_slots[] = {
+    {Py_tp_dealloc, embeddedgetset_dealloc},
+    {Py_tp_doc, (void *)embeddedgetset_doc},
+    {Py_tp_traverse, embeddedgetset_traverse},
+    {Py_tp_clear, embeddedgetset_clear},
+    {Py_tp_members, embeddedgetset_members},
+    {Py_tp_descr_get, embeddedgetset_get},
+    {Py_tp_descr_set, embeddedgetset_set},
+    {Py_tp_new, embeddedgetset_new},
+    {0, 0}
+};
+
+static PyType_Spec embeddedgetset_spec = {
+    "trafaretrecord.memoryslots.embeddedgetset",        /* name */
+    sizeof(struct embeddedgetset_object),               /* basicsize */
+    0,                                                  /* itemsize */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,            /* flags */
+    embeddedgetset_slots                                /* slots */
+};
+
+/*********************** seqlock counters **************************/
+
+/* Per-row version counters for records stored in shared memory.  A counter
+ * is an aligned 64-bit word in a writable buffer; it is odd while a writer
+ * owns the row and is bumped to the next even value when the write ends. */
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define seqlock_load(p) \
+    ((uint64_t)_InterlockedOr64((volatile __int64 *)(p), 0))
+#define seqlock_cas(p, expected, desired) \
+    (_InterlockedCompareExchange64((volatile __int64 *)(p), \
+        (__int64)(desired), (__int64)(expected)) == (__int64)(expected))
+#define seqlock_store(p, v) \
+    _InterlockedExchange64((volatile __int64 *)(p), (__int64)(v))
+#define seqlock_fence() MemoryBarrier()
+#else
+#define seqlock_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define seqlock_cas(p, expected, desired) \
+    __atomic_compare_exchange_n((p), &(expected), (desired), 0, \
+        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define seqlock_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define seqlock_fence() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#endif
+
+/* Seconds on a monotonic clock, to bound the time spent waiting for a row:
+ * a writer process that dies while it owns a row leaves its counter odd. */
+static double
+seqlock_clock(void)
+{
+#if defined(MS_WINDOWS)
+    return (double)GetTickCount64() / 1e3;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+/* Busy-wait hint to the CPU between two loads of a counter */
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define seqlock_pause() _mm_pause()
+#elif defined(_MSC_VER) && defined(_M_ARM64)
+#define seqlock_pause() __yield()
+#elif defined(__x86_64__) || defined(__i386__)
+#define seqlock_pause() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define seqlock_pause() __asm__ __volatile__("yield")
+#else
+#define seqlock_pause() ((void)0)
+#endif
+
+/* loads of a locked counter spent spinning before sleeping between them */
+#define SEQLOCK_SPINS 128
+/* first and longest sleeps between loads, in microseconds */
+#define SEQLOCK_MIN_SLEEP_US 10
+#define SEQLOCK_MAX_SLEEP_US 1000
+
+static void
+seqlock_sleep(long us)
+{
+#if defined(MS_WINDOWS)
+    /* Sleep() counts whole milliseconds; Sleep(0) only yields */
+    Sleep(us >= 1000 ? (DWORD)(us / 1000) : 0);
+#else
+    struct timespec ts;
+
+    ts.tv_sec = 0;
+    ts.tv_nsec = us * 1000;
+    nanosleep(&ts, NULL);
+#endif
+}
+
+/* Wait until the row is not being written, then take it for writing if
+ * `write` is set.  A negative timeout waits forever.  Short writes are
+ * waited for with the GIL held and a CPU pause between loads; after
+ * SEQLOCK_SPINS loads the GIL is dropped around sleeps that double up to
+ * SEQLOCK_MAX_SLEEP_US, so that the owner can run if it is a thread of
+ * this process. */
+static int
+seqlock_wait(uint64_t *counter, Py_ssize_t index, double timeout, int write,
+             uint64_t *version)
+{
+    double deadline = timeout < 0 ? -1.0 : seqlock_clock() + timeout;
+    unsigned long spins = 0;
+    long sleep_us = SEQLOCK_MIN_SLEEP_US;
+    uint64_t v;
+
+    for (;;) {
+        v = seqlock_load(counter);
+        if (!(v & 1)) {
+            if (!write)
+                break;
+            if (seqlock_cas(counter, v, v + 1))
+                break;
+            continue;
+        }
+        if (spins < SEQLOCK_SPINS) {
+            spins++;
+            seqlock_pause();
+            continue;
+        }
+        Py_BEGIN_ALLOW_THREADS
+        seqlock_sleep(sleep_us);
+        Py_END_ALLOW_THREADS
+        sleep_us = Py_MIN(2 * sleep_us, SEQLOCK_MAX_SLEEP_US);
+        if (PyErr_CheckSignals() < 0)
+            return -1;
+        if (deadline >= 0 && seqlock_clock() > deadline) {
+            PyObject *seconds = PyFloat_FromDouble(timeout);
+
+            if (seconds != NULL) {
+                PyErr_Format(PyExc_TimeoutError,
+                             "row %zd has been locked for writing for "
+                             "more than %S seconds, its writer may have "
+                             "died", index, seconds);
+                Py_DECREF(seconds);
+            }
+            return -1;
+        }
+    }
+    *version = v;
+    return 0;
+}
+
+static uint64_t *
+seqlock_counter(Py_buffer *view, Py_ssize_t index)
+{
+    if (index < 0 || index >= view->len / (Py_ssize_t)sizeof(uint64_t)) {
+        PyErr_SetString(PyExc_IndexError, "seqlock index out of range");
+        return NULL;
+    }
+    if ((uintptr_t)view->buf % sizeof(uint64_t)) {
+        PyErr_SetString(PyExc_ValueError, "seqlock buffer is not 8-byte aligned");
+        return NULL;
+    }
+    return (uint64_t *)view->buf + index;
+}
+
+PyDoc_STRVAR(seqlock_write_begin_doc,
+"_seqlock_write_begin(buffer, index, timeout=-1) -- take the row for writing, waiting\n\
+for other writers at most timeout seconds (forever if negative)");
+
+static PyObject *
+seqlock_write_begin(PyObject *module, PyObject *args)
+{
+    Py_buffer view;
+    Py_ssize_t index;
+    double timeout = -1.0;
+    uint64_t *counter, v;
+
+    if (!PyArg_ParseTuple(args, "w*n|d:_seqlock_write_begin", &view, &index,
+                          &timeout))
+        return NULL;
+    counter = seqlock_counter(&view, index);
+    if (counter == NULL || seqlock_wait(counter, index, timeout, 1, &v) < 0) {
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+
+    PyBuffer_Release(&view);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(seqlock_write_end_doc,
+"_seqlock_write_end(buffer, index) -- publish the row written since _seqlock_write_begin");
+
+static PyObject *
+seqlock_write_end(PyObject *module, PyObject *args)
+{
+    Py_buffer view;
+    Py_ssize_t index;
+    uint64_t *counter, v;
+
+    if (!PyArg_ParseTuple(args, "w*n:_seqlock_write_end", &view, &index))
+        return NULL;
+    counter = seqlock_counter(&view, index);
+    if (counter == NULL) {
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+
+    v = seqlock_load(counter);
+    if (!(v & 1)) {
+        PyBuffer_Release(&view);
+        PyErr_SetString(PyExc_RuntimeError, "row is not locked for writing");
+        return NULL;
+    }
+    seqlock_store(counter, v + 1);
+
+    PyBuffer_Release(&view);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(seqlock_read_begin_doc,
+"_seqlock_read_begin(buffer, index, timeout=-1) -> version, waiting while the row is\n\
+being written, at most timeout seconds (forever if negative)");
+
+static PyObject *
+seqlock_read_begin(PyObject *module, PyObject *args)
+{
+    Py_buffer view;
+    Py_ssize_t index;
+    double timeout = -1.0;
+    uint64_t *counter, v;
+
+    if (!PyArg_ParseTuple(args, "w*n|d:_seqlock_read_begin", &view, &index,
+                          &timeout))
+        return NULL;
+    counter = seqlock_counter(&view, index);
+    if (counter == NULL || seqlock_wait(counter, index, timeout, 0, &v) < 0) {
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+
+    PyBuffer_Release(&view);
+    return PyLong_FromUnsignedLongLong(v);
+}
+
+PyDoc_STRVAR(seqlock_read_retry_doc,
+"_seqlock_read_retry(buffer, index, version) -> True if the row changed since _seqlock_read_begin");
+
+static PyObject *
+seqlock_read_retry(PyObject *module, PyObject *args)
+{
+    Py_buffer view;
+    Py_ssize_t index;
+    unsigned long long version;
+    uint64_t *counter;
+    int changed;
+
+    if (!PyArg_ParseTuple(args, "w*nK:_seqlock_read_retry", &view, &index, &version))
+        return NULL;
+    counter = seqlock_counter(&view, index);
+    if (counter == NULL) {
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+
+    seqlock_fence();
+    changed = seqlock_load(counter) != (uint64_t)version;
+
+    PyBuffer_Release(&view);
+    return PyBool_FromLong(changed);
+}
+
+/*********************** field lookup **************************/
+
+/* Index of the field `name` of a record class, read from its itemgetset
+ * descriptor.  field may also be the descriptor itself. */
+static Py_ssize_t
+memoryslots_field_index(memoryslots_state *state, PyTypeObject *type,
+                        PyObject *field)
+{
+    PyObject *descr = field;
+
+    if (PyUnicode_Check(field)) {
+        Py_ssize_t i;
+
+        /* a class attribute lookup returns the descriptor itself */
+        descr = PyObject_GetAttr((PyObject *)type, field);
+        if (descr == NULL) {
+            if (!PyErr_ExceptionMatches(PyExc_AttributeError))
+                return -1;
+            PyErr_Clear();
+        }
+        if (descr == NULL || !Py_IS_TYPE(descr, state->itemgetset_type)) {
+            Py_XDECREF(descr);
+            PyErr_Format(PyExc_AttributeError,
+                         "'%.200s' has no field '%U'", type->tp_name, field);
+            return -1;
+        }
+        i = ((struct itemgetset_object *)descr)->i;
+        Py_DECREF(descr);
+        return i;
+    }
+    else if (!Py_IS_TYPE(descr, state->itemgetset_type)) {
+        PyErr_Format(PyExc_TypeError,
+                     "field must be a name or an itemgetset, not %.200s",
+                     Py_TYPE(field)->tp_name);
+        return -1;
+    }
+    return ((struct itemgetset_object *)descr)->i;
+}
+
+/*********************** sorting **************************/
+
+/* Records are sorted through a permutation of their positions.  The values
+ * of every sort field are extracted once into a column: a C array when all
+ * values are exact ints that fit in 64 bits or exact floats, so that
+ * comparisons do not touch Python objects, and an array of references
+ * otherwise. */
+
+enum { SORTKEY_INT64, SORTKEY_DOUBLE, SORTKEY_STR, SORTKEY_OBJECT };
+
+typedef struct {
+    int kind;
+    int descending;
+    union {
+        int64_t *i64;
+        double *f64;
+        PyObject **objects;    /* strong references */
+    } values;
+} sortkey;
+
+typedef struct {
+    sortkey *keys;
+    Py_ssize_t n_keys;
+    Py_ssize_t n_values;
+    int error;                 /* a comparison raised an exception */
+} sortkeys;
+
+static void
+sortkeys_free(sortkeys *sk)
+{
+    Py_ssize_t k, i;
+
+    if (sk->keys == NULL)
+        return;
+    for (k = 0; k < sk->n_keys; k++) {
+        sortkey *key = &sk->keys[k];
+
+        if ((key->kind == SORTKEY_STR || key->kind == SORTKEY_OBJECT) &&
+            key->values.objects != NULL) {
+            for (i = 0; i < sk->n_values; i++)
+                Py_XDECREF(key->values.objects[i]);
+        }
+        PyMem_Free(key->values.i64);
+    }
+    PyMem_Free(sk->keys);
+    sk->keys = NULL;
+}
+
+/* Extract field `index` of every record into a typed column */
+static int
+sortkey_extract(sortkey *key, PyObject **records, Py_ssize_t n,
+                Py_ssize_t index)
+{
+    int all_int = 1, all_float = 1, all_str = 1, overflow;
+    Py_ssize_t i;
+
+    for (i = 0; i < n; i++) {
+        PyObject *v = PyTuple_GET_ITEM(records[i], index);
+
+        all_int &= Py_IS_TYPE(v, &PyLong_Type) || PyBool_Check(v);
+        all_float &= PyFloat_CheckExact(v);
+        all_str &= PyUnicode_CheckExact(v);
+    }
+
+    if (all_int) {
+        key->kind = SORTKEY_INT64;
+        key->values.i64 = PyMem_New(int64_t, n ? n : 1);
+        if (key->values.i64 == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        for (i = 0; i < n; i++) {
+            long long v = PyLong_AsLongLongAndOverflow(
+                PyTuple_GET_ITEM(records[i], index), &overflow);
+
+            if (overflow)
+                break;
+            key->values.i64[i] = (int64_t)v;
+        }
+        if (i == n)
+            return 0;
+        /* big ints are compared as objects */
+        PyMem_Free(key->values.i64);
+        key->values.i64 = NULL;
+    }
+    else if (all_float) {
+        key->kind = SORTKEY_DOUBLE;
+        key->values.f64 = PyMem_New(double, n ? n : 1);
+        if (key->values.f64 == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        for (i = 0; i < n; i++)
+            key->values.f64[i] = PyFloat_AS_DOUBLE(
+                PyTuple_GET_ITEM(records[i], index));
+        return 0;
+    }
+
+    key->kind = all_str ? SORTKEY_STR : SORTKEY_OBJECT;
+    key->values.objects = PyMem_New(PyObject *, n ? n : 1);
+    if (key->values.objects == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        PyObject *v = PyTuple_GET_ITEM(records[i], index);
+
+        Py_INCREF(v);
+        key->values.objects[i] = v;
+    }
+    return 0;
+}
+
+static int
+sortkeys_init(sortkeys *sk, memoryslots_state *state, PyObject **records,
+              Py_ssize_t n, PyObject *fields)
+{
+    PyTypeObject *type = Py_TYPE(records[0]);
+    Py_ssize_t k, i;
+
+    sk->n_keys = PyTuple_GET_SIZE(fields);
+    sk->n_values = n;
+    sk->error = 0;
+    sk->keys = PyMem_New(sortkey, sk->n_keys);
+    if (sk->keys == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    memset(sk->keys, 0, sk->n_keys * sizeof(sortkey));
+
+    for (i = 0; i < n; i++) {
+        if (!PyObject_TypeCheck(records[i], type)) {
+            PyErr_Format(PyExc_TypeError,
+                         "expected %.200s records, got %.200s",
+                         type->tp_name, Py_TYPE(records[i])->tp_name);
+            return -1;
+        }
+    }
+
+    for (k = 0; k < sk->n_keys; k++) {
+        PyObject *field = PyTuple_GET_ITEM(fields, k);
+        Py_ssize_t index;
+
+        if (PyUnicode_Check(field) && PyUnicode_GET_LENGTH(field) > 0 &&
+            PyUnicode_READ_CHAR(field, 0) == '-') {
+            sk->keys[k].descending = 1;
+            field = PyUnicode_Substring(field, 1, PyUnicode_GET_LENGTH(field));
+            if (field == NULL)
+                return -1;
+            index = memoryslots_field_index(state, type, field);
+            Py_DECREF(field);
+        }
+        else {
+            index = memoryslots_field_index(state, type, field);
+        }
+        if (index < 0)
+            return -1;
+        for (i = 0; i < n; i++) {
+            if (index >= Py_SIZE(records[i])) {
+                PyErr_SetString(PyExc_IndexError, "field index out of range");
+                return -1;
+            }
+        }
+        if (sortkey_extract(&sk->keys[k], records, n, index) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int
+sortkeys_numeric(sortkeys *sk)
+{
+    Py_ssize_t k;
+
+    for (k = 0; k < sk->n_keys; k++) {
+        if (sk->keys[k].kind != SORTKEY_INT64 &&
+            sk->keys[k].kind != SORTKEY_DOUBLE)
+            return 0;
+    }
+    return 1;
+}
+
+/* Three-way comparison of records a and b on all keys.  Only "<" is used,
+ * like in list.sort(), so NaNs compare equal to everything. */
+static int
+sortkeys_compare(sortkeys *sk, Py_ssize_t a, Py_ssize_t b)
+{
+    Py_ssize_t k;
+    int lt, gt;
+
+    if (sk->error)
+        return 0;
+    for (k = 0; k < sk->n_keys; k++) {
+        sortkey *key = &sk->keys[k];
+
+        switch (key->kind) {
+        case SORTKEY_INT64:
+            lt = key->values.i64[a] < key->values.i64[b];
+            gt = key->values.i64[b] < key->values.i64[a];
+            break;
+        case SORTKEY_DOUBLE:
+            lt = key->values.f64[a] < key->values.f64[b];
+            gt = key->values.f64[b] < key->values.f64[a];
+            break;
+        case SORTKEY_STR:
+            lt = PyUnicode_Compare(key->values.objects[a],
+                                   key->values.objects[b]);
+            gt = lt > 0;
+            lt = lt < 0;
+            break;
+        default:
+            lt = PyObject_RichCompareBool(key->values.objects[a],
+                                          key->values.objects[b], Py_LT);
+            gt = lt == 0 ? PyObject_RichCompareBool(key->values.objects[b],
+                                                    key->values.objects[a],
+                                                    Py_LT) : 0;
+            if (lt < 0 || gt < 0) {
+                sk->error = 1;
+                return 0;
+            }
+            break;
+        }
+        if (lt || gt)
+            return (lt ? -1 : 1) * (key->descending ? -1 : 1);
+    }
+    return 0;
+}
+
+/* Strict order of the positions: keys first, then original position */
+static int
+sortkeys_before(sortkeys *sk, Py_ssize_t a, Py_ssize_t b)
+{
+    int c = sortkeys_compare(sk, a, b);
+
+    return c < 0 || (c == 0 && a < b);
+}
+
+/* Bottom-up merge sort of positions, tmp has room for n of them.  Ties are
+ * broken by position, so the sort is stable for any input permutation. */
+static Py_ssize_t *
+sortkeys_mergesort(sortkeys *sk, Py_ssize_t *perm, Py_ssize_t *tmp,
+                   Py_ssize_t n)
+{
+    Py_ssize_t width, lo, i, j, k, mid, hi, *swap;
+
+    for (width = 1; width < n && !sk->error; width *= 2) {
+        for (lo = 0; lo < n; lo += 2 * width) {
+            mid = Py_MIN(lo + width, n);
+            hi = Py_MIN(lo + 2 * width, n);
+            i = lo;
+            j = mid;
+            k = lo;
+            while (i < mid && j < hi) {
+                if (sortkeys_before(sk, perm[j], perm[i]))
+                    tmp[k++] = perm[j++];
+                else
+                    tmp[k++] = perm[i++];
+            }
+            while (i < mid)
+                tmp[k++] = perm[i++];
+            while (j < hi)
+                tmp[k++] = perm[j++];
+        }
+        swap = perm;
+        perm = tmp;
+        tmp = swap;
+    }
+    return perm;
+}
+
+static void
+sortkeys_sift_down(sortkeys *sk, Py_ssize_t *heap, Py_ssize_t n, Py_ssize_t i)
+{
+    for (;;) {
+        Py_ssize_t child = 2 * i + 1, last = i;
+
+        if (child < n && sortkeys_before(sk, heap[last], heap[child]))
+            last = child;
+        if (child + 1 < n && sortkeys_before(sk, heap[last], heap[child + 1]))
+            last = child + 1;
+        if (last == i)
+            return;
+        child = heap[i];
+        heap[i] = heap[last];
+        heap[last] = child;
+        i = last;
+    }
+}
+
+/* Select the first `limit` positions in a max-heap of size limit, the
+ * root being the last of the selected positions. */
+static void
+sortkeys_select(sortkeys *sk, Py_ssize_t *heap, Py_ssize_t n, Py_ssize_t limit)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < limit; i++)
+        heap[i] = i;
+    for (i = limit / 2; --i >= 0; )
+        sortkeys_sift_down(sk, heap, limit, i);
+    for (i = limit; i < n && !sk->error; i++) {
+        if (sortkeys_before(sk, i, heap[0])) {
+            heap[0] = i;
+            sortkeys_sift_down(sk, heap, limit, 0);
+        }
+    }
+}
+
+/* Sort the sequence of records by fields, keeping the first limit records
+ * or all of them if limit is negative. */
+static PyObject *
+memoryslots_sorted(memoryslots_state *state, PyObject *records,
+                   PyObject *fields, Py_ssize_t limit)
+{
+    PyObject *fast, *result = NULL;
+    PyObject **items;
+    Py_ssize_t n, i, *perm = NULL, *tmp = NULL, *sorted;
+    sortkeys sk = {NULL, 0, 0, 0};
+    int numeric;
+
+    if (PyTuple_GET_SIZE(fields) == 0) {
+        PyErr_SetString(PyExc_TypeError, "at least one field is required");
+        return NULL;
+    }
+    /* a copy of the records: comparing keys may run code that changes the
+     * given list, and other threads may change it while keys are sorted
+     * without the GIL */
+    fast = PySequence_Tuple(records);
+    if (fast == NULL)
+        return NULL;
+    n = PyTuple_GET_SIZE(fast);
+    items = ((PyTupleObject *)fast)->ob_item;
+    if (limit < 0 || limit > n)
+        limit = n;
+    if (limit == 0) {
+        Py_DECREF(fast);
+        return PyList_New(0);
+    }
+
+    if (!PyObject_TypeCheck(items[0], state->memoryslots_type)) {
+        PyErr_Format(PyExc_TypeError, "expected records, got %.200s",
+                     Py_TYPE(items[0])->tp_name);
+        goto done;
+    }
+    if (sortkeys_init(&sk, state, items, n, fields) < 0)
+        goto done;
+
+    perm = PyMem_New(Py_ssize_t, n);
+    tmp = PyMem_New(Py_ssize_t, n);
+    if (perm == NULL || tmp == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    /* numeric keys do not need the GIL to be compared */
+    numeric = sortkeys_numeric(&sk);
+    if (numeric) {
+        Py_BEGIN_ALLOW_THREADS
+        if (limit < n / 8) {
+            sortkeys_select(&sk, tmp, n, limit);
+            sorted = sortkeys_mergesort(&sk, tmp, perm, limit);
+        }
+        else {
+            for (i = 0; i < n; i++)
+                perm[i] = i;
+            sorted = sortkeys_mergesort(&sk, perm, tmp, n);
+        }
+        Py_END_ALLOW_THREADS
+    }
+    else if (limit < n / 8) {
+        sortkeys_select(&sk, tmp, n, limit);
+        sorted = sortkeys_mergesort(&sk, tmp, perm, limit);
+    }
+    else {
+        for (i = 0; i < n; i++)
+            perm[i] = i;
+        sorted = sortkeys_mergesort(&sk, perm, tmp, n);
+    }
+    if (sk.error)
+        goto done;
+
+    result = PyList_New(limit);
+    if (result == NULL)
+        goto done;
+    for (i = 0; i < limit; i++) {
+        PyObject *v = items[sorted[i]];
+
+        Py_INCREF(v);
+        PyList_SET_ITEM(result, i, v);
+    }
+
+done:
+    sortkeys_free(&sk);
+    PyMem_Free(perm);
+    PyMem_Free(tmp);
+    Py_DECREF(fast);
+    return result;
+}
+
+PyDoc_STRVAR(sort_by_doc,
+"sort_by(records, *fields, limit=None) -> list\n\n"
+"Return a new list of the records stably sorted by the given fields.\n"
+"A field name prefixed with '-' sorts in descending order.  With limit,\n"
+"only the first limit records of the sorted order are returned.");
+
+static PyObject *
+memoryslots_sort_by(PyObject *module, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"limit", NULL};
+    PyObject *empty, *limit_ob = Py_None, *fields, *result;
+    Py_ssize_t limit = -1;
+
+    if (PyTuple_GET_SIZE(args) < 1) {
+        PyErr_SetString(PyExc_TypeError, "sort_by() missing records");
+        return NULL;
+    }
+    empty = PyTuple_New(0);
+    if (empty == NULL)
+        return NULL;
+    if (!PyArg_ParseTupleAndKeywords(empty, kwds, "|O:sort_by", kwlist,
+                                     &limit_ob)) {
+        Py_DECREF(empty);
+        return NULL;
+    }
+    Py_DECREF(empty);
+    if (limit_ob != Py_None) {
+        limit = PyNumber_AsSsize_t(limit_ob, PyExc_OverflowError);
+        if (limit == -1 && PyErr_Occurred())
+            return NULL;
+        if (limit < 0) {
+            PyErr_SetString(PyExc_ValueError, "limit must be >= 0");
+            return NULL;
+        }
+    }
+
+    fields = PyTuple_GetSlice(args, 1, PyTuple_GET_SIZE(args));
+    if (fields == NULL)
+        return NULL;
+    result = memoryslots_sorted(get_memoryslots_state(module),
+                                PyTuple_GET_ITEM(args, 0), fields, limit);
+    Py_DECREF(fields);
+    return result;
+}
+
+PyDoc_STRVAR(top_k_doc,
+"top_k(records, k, *fields) -> list\n\n"
+"Return the first k records in the order of sort_by(records, *fields).\n"
+"The selection takes O(n log k) time.");
+
+static PyObject *
+memoryslots_top_k(PyObject *module, PyObject *args)
+{
+    PyObject *fields, *result;
+    Py_ssize_t k;
+
+    if (PyTuple_GET_SIZE(args) < 2) {
+        PyErr_SetString(PyExc_TypeError, "top_k() missing records or k");
+        return NULL;
+    }
+    k = PyNumber_AsSsize_t(PyTuple_GET_ITEM(args, 1), PyExc_OverflowError);
+    if (k == -1 && PyErr_Occurred())
+        return NULL;
+    if (k < 0) {
+        PyErr_SetString(PyExc_ValueError, "k must be >= 0");
+        return NULL;
+    }
+
+    fields = PyTuple_GetSlice(args, 2, PyTuple_GET_SIZE(args));
+    if (fields == NULL)
+        return NULL;
+    result = memoryslots_sorted(get_memoryslots_state(module),
+                                PyTuple_GET_ITEM(args, 0), fields, k);
+    Py_DECREF(fields);
+    return result;
+}
+
+PyDoc_STRVAR(key_by_doc,
+"key_by(record_type, *fields) -> key function\n\n"
+"Return an operator.itemgetter over the slots of the given fields of\n"
+"record_type, for use as a key of sorted(), min(), max() or groupby().");
+
+static PyObject *
+memoryslots_key_by(PyObject *module, PyObject *args)
+{
+    memoryslots_state *state = get_memoryslots_state(module);
+    PyObject *type, *indices, *operator_module, *itemgetter, *result;
+    Py_ssize_t k, n = PyTuple_GET_SIZE(args) - 1;
+
+    if (n < 1) {
+        PyErr_SetString(PyExc_TypeError,
+                        "key_by() requires a record type and fields");
+        return NULL;
+    }
+    type = PyTuple_GET_ITEM(args, 0);
+    if (!PyType_Check(type) ||
+        !PyType_IsSubtype((PyTypeObject *)type, state->memoryslots_type)) {
+        PyErr_SetString(PyExc_TypeError,
+                        "key_by() requires a memoryslots subclass");
+        return NULL;
+    }
+
+    indices = PyTuple_New(n);
+    if (indices == NULL)
+        return NULL;
+    for (k = 0; k < n; k++) {
+        Py_ssize_t index = memoryslots_field_index(
+            state, (PyTypeObject *)type, PyTuple_GET_ITEM(args, k + 1));
+        PyObject *v;
+
+        if (index < 0 || (v = PyLong_FromSsize_t(index)) == NULL) {
+            Py_DECREF(indices);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(indices, k, v);
+    }
+
+    operator_module = PyImport_ImportModule("operator");
+    if (operator_module == NULL) {
+        Py_DECREF(indices);
+        return NULL;
+    }
+    itemgetter = PyObject_GetAttrString(operator_module, "itemgetter");
+    Py_DECREF(operator_module);
+    if (itemgetter == NULL) {
+        Py_DECREF(indices);
+        return NULL;
+    }
+    result = PyObject_Call(itemgetter, indices, NULL);
+    Py_DECREF(itemgetter);
+    Py_DECREF(indices);
+    return result;
+}
+
+/*********************** grouped aggregation **************************/
+
+/* Hash grouping of rows by int64 key columns, aggregating typed value
+ * columns.  Rows are split into chunks that are aggregated into separate
+ * tables by worker threads with the GIL released; the tables are then
+ * merged in chunk order, so groups keep the order of first appearance.
+ * Worker threads only run C code, so they are shared by the interpreters
+ * of the process, and kept between calls until they have been idle for
+ * AGG_IDLE_US. */
+
+#define AGG_MIN_CHUNK (1 << 16)    /* rows worth a thread of their own */
+#define AGG_IDLE_US 100000          /* before an idle worker thread exits */
+
+enum { AGG_SUM, AGG_MIN, AGG_MAX, AGG_COUNT, AGG_MEAN };
+enum { AGG_INT64, AGG_DOUBLE, AGG_BOOL, AGG_NONE };
+
+static const char * const agg_op_names[] = {"sum", "min", "max", "count", "mean"};
+
+typedef struct {
+    int op;
+    int kind;               /* kind of the column, AGG_NONE for count */
+    const void *data;
+} aggspec;
+
+typedef union {
+    int64_t i;
+    double f;
+} aggvalue;
+
+typedef struct {
+    Py_ssize_t n_keys, n_aggs;
+    const aggspec *aggs;
+    size_t mask;            /* hash slots - 1 */
+    Py_ssize_t *slots;      /* group id + 1, 0 for an empty slot */
+    Py_ssize_t n_groups, max_groups;
+    uint64_t *hashes;       /* per group */
+    int64_t *keys;          /* n_keys per group */
+    int64_t *counts;        /* rows per group */
+    aggvalue *values;       /* n_aggs per group */
+    int error;              /* AGG_ERROR_* */
+} aggtable;
+
+enum { AGG_OK, AGG_ERROR_MEMORY, AGG_ERROR_OVERFLOW };
+
+static uint64_t
+aggkey_hash(const int64_t *key, Py_ssize_t n)
+{
+    uint64_t h = 0x9E3779B97F4A7C15ULL;
+    Py_ssize_t k;
+
+    for (k = 0; k < n; k++) {
+        /* splitmix64 finalizer of each key component */
+        uint64_t x = (uint64_t)key[k] + h;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+        h = x ^ (x >> 31);
+    }
+    return h;
+}
+
+static int
+aggtable_init(aggtable *t, Py_ssize_t n_keys, Py_ssize_t n_aggs,
+              const aggspec *aggs)
+{
+    memset(t, 0, sizeof(aggtable));
+    t->n_keys = n_keys;
+    t->n_aggs = n_aggs;
+    t->aggs = aggs;
+    t->mask = 63;
+    t->max_groups = 32;
+    t->slots = PyMem_RawCalloc(t->mask + 1, sizeof(Py_ssize_t));
+    t->hashes = PyMem_RawMalloc(t->max_groups * sizeof(uint64_t));
+    t->keys = PyMem_RawMalloc(t->max_groups * (n_keys ? n_keys : 1) * sizeof(int64_t));
+    t->counts = PyMem_RawMalloc(t->max_groups * sizeof(int64_t));
+    t->values = PyMem_RawMalloc(t->max_groups * (n_aggs ? n_aggs : 1) * sizeof(aggvalue));
+    if (t->slots == NULL || t->hashes == NULL || t->keys == NULL ||
+        t->counts == NULL || t->values == NULL) {
+        t->error = AGG_ERROR_MEMORY;
+        return -1;
+    }
+    return 0;
+}
+
+static void
+aggtable_free(aggtable *t)
+{
+    PyMem_RawFree(t->slots);
+    PyMem_RawFree(t->hashes);
+    PyMem_RawFree(t->keys);
+    PyMem_RawFree(t->counts);
+    PyMem_RawFree(t->values);
+    t->slots = NULL;
+    t->hashes = NULL;
+    t->keys = NULL;
+    t->counts = NULL;
+    t->values = NULL;
+}
+
+#define AGG_REALLOC(p, n, type) do { \
+        void *_p = PyMem_RawRealloc((p), (n) * sizeof(type)); \
+        if (_p == NULL) \
+            return -1; \
+        (p) = _p; \
+    } while (0)
+
+/* Double the table, keeping at most half of the hash slots in use */
+static int
+aggtable_grow(aggtable *t)
+{
+    Py_ssize_t *slots, g;
+    size_t mask = 2 * t->mask + 1, i;
+
+    t->max_groups *= 2;
+    AGG_REALLOC(t->hashes, t->max_groups, uint64_t);
+    AGG_REALLOC(t->keys, t->max_groups * (t->n_keys ? t->n_keys : 1), int64_t);
+    AGG_REALLOC(t->counts, t->max_groups, int64_t);
+    AGG_REALLOC(t->values, t->max_groups * (t->n_aggs ? t->n_aggs : 1), aggvalue);
+
+    slots = PyMem_RawCalloc(mask + 1, sizeof(Py_ssize_t));
+    if (slots == NULL)
+        return -1;
+    for (g = 0; g < t->n_groups; g++) {
+        for (i = t->hashes[g] & mask; slots[i]; i = (i + 1) & mask)
+            ;
+        slots[i] = g + 1;
+    }
+    PyMem_RawFree(t->slots);
+    t->slots = slots;
+    t->mask = mask;
+    return 0;
+}
+
+#undef AGG_REALLOC
+
+/* Group id of key, adding a group with no rows if it is new */
+static Py_ssize_t
+aggtable_group(aggtable *t, const int64_t *key)
+{
+    uint64_t h = aggkey_hash(key, t->n_keys);
+    size_t i;
+    Py_ssize_t g;
+
+    for (i = h & t->mask; (g = t->slots[i]) != 0; i = (i + 1) & t->mask) {
+        g--;
+        if (t->hashes[g] == h &&
+            !memcmp(t->keys + g * t->n_keys, key, t->n_keys * sizeof(int64_t)))
+            return g;
+    }
+
+    if (t->n_groups == t->max_groups) {
+        if (aggtable_grow(t) < 0) {
+            t->error = AGG_ERROR_MEMORY;
+            return -1;
+        }
+        for (i = h & t->mask; t->slots[i]; i = (i + 1) & t->mask)
+            ;
+    }
+    g = t->n_groups++;
+    t->slots[i] = g + 1;
+    t->hashes[g] = h;
+    memcpy(t->keys + g * t->n_keys, key, t->n_keys * sizeof(int64_t));
+    t->counts[g] = 0;
+    memset(t->values + g * t->n_aggs, 0, t->n_aggs * sizeof(aggvalue));
+    return g;
+}
+
+static int
+agg_add_int64(int64_t *acc, int64_t v)
+{
+    if ((v > 0 && *acc > INT64_MAX - v) || (v < 0 && *acc < INT64_MIN - v))
+        return -1;
+    *acc += v;
+    return 0;
+}
+
+/* Fold the value v (of the kind of spec) into the accumulator of a group
+ * that already has `count` rows */
+static int
+agg_fold(const aggspec *spec, aggvalue *acc, aggvalue v, int64_t count)
+{
+    int is_double = spec->kind == AGG_DOUBLE;
+
+    switch (spec->op) {
+    case AGG_SUM:
+        if (is_double)
+            acc->f += v.f;
+        else if (agg_add_int64(&acc->i, v.i) < 0)
+            return -1;
+        break;
+    case AGG_MEAN:
+        acc->f += v.f;
+        break;
+    case AGG_MIN:
+        if (count == 0 || (is_double ? v.f < acc->f : v.i < acc->i))
+            *acc = v;
+        break;
+    case AGG_MAX:
+        if (count == 0 || (is_double ? v.f > acc->f : v.i > acc->i))
+            *acc = v;
+        break;
+    }
+    return 0;
+}
+
+static aggvalue
+agg_read(const aggspec *spec, Py_ssize_t row)
+{
+    aggvalue v;
+
+    switch (spec->kind) {
+    case AGG_INT64:
+        v.i = ((const int64_t *)spec->data)[row];
+        break;
+    case AGG_DOUBLE:
+        v.f = ((const double *)spec->data)[row];
+        break;
+    case AGG_BOOL:
+        v.i = ((const unsigned char *)spec->data)[row] != 0;
+        break;
+    default:
+        v.i = 0;
+    }
+    if (spec->op == AGG_MEAN && spec->kind != AGG_DOUBLE)
+        v.f = (double)v.i;
+    return v;
+}
+
+static void
+aggtable_add_rows(aggtable *t, const int64_t * const *key_columns,
+                  Py_ssize_t start, Py_ssize_t stop)
+{
+    int64_t key_buf[8], *key = key_buf;
+    Py_ssize_t row, k, a, g;
+
+    if (t->n_keys > 8) {
+        key = PyMem_RawMalloc(t->n_keys * sizeof(int64_t));
+        if (key == NULL) {
+            t->error = AGG_ERROR_MEMORY;
+            return;
+        }
+    }
+    for (row = start; row < stop && t->error == AGG_OK; row++) {
+        for (k = 0; k < t->n_keys; k++)
+            key[k] = key_columns[k][row];
+        g = aggtable_group(t, key);
+        if (g < 0)
+            break;
+        for (a = 0; a < t->n_aggs; a++) {
+            if (agg_fold(&t->aggs[a], &t->values[g * t->n_aggs + a],
+                         agg_read(&t->aggs[a], row), t->counts[g]) < 0) {
+                t->error = AGG_ERROR_OVERFLOW;
+                break;
+            }
+        }
+        t->counts[g]++;
+    }
+    if (key != key_buf)
+        PyMem_RawFree(key);
+}
+
+/* Merge the groups of src into t, in the order of src */
+static void
+aggtable_merge(aggtable *t, const aggtable *src)
+{
+    Py_ssize_t gs, g, a;
+
+    if (src->error != AGG_OK) {
+        t->error = src->error;
+        return;
+    }
+    for (gs = 0; gs < src->n_groups && t->error == AGG_OK; gs++) {
+        g = aggtable_group(t, src->keys + gs * src->n_keys);
+        if (g < 0)
+            break;
+        for (a = 0; a < t->n_aggs; a++) {
+            const aggspec *spec = &t->aggs[a];
+            aggvalue *acc = &t->values[g * t->n_aggs + a];
+            aggvalue v = src->values[gs * t->n_aggs + a];
+
+            /* sums of partial sums, extremes of partial extremes */
+            if (agg_fold(spec, acc, v, t->counts[g]) < 0) {
+                t->error = AGG_ERROR_OVERFLOW;
+                break;
+            }
+        }
+        t->counts[g] += src->counts[gs];
+    }
+}
+
+typedef struct {
+    aggtable table;
+    const int64_t * const *key_columns;
+    Py_ssize_t start, stop;
+    struct aggworker *worker;   /* thread aggregating the chunk, or NULL */
+} aggtask;
+
+/* A worker thread waits on start for a task, and releases done once the
+ * task is aggregated. */
+typedef struct aggworker {
+    PyThread_type_lock start, done;
+    aggtask *task;
+    int claimed;                /* taken off the idle list for a task */
+    struct aggworker *next;     /* in the idle list */
+} aggworker;
+
+/* The idle workers of the process, guarded by agg_pool_lock */
+static PyThread_type_lock agg_pool_lock;
+static aggworker *agg_pool_idle;
+
+#if defined(_MSC_VER)
+#define agg_cas_ptr(p, expected, desired) \
+    (_InterlockedCompareExchangePointer((void * volatile *)(p), \
+        (desired), (expected)) == (expected))
+#define agg_load_ptr(p) \
+    _InterlockedCompareExchangePointer((void * volatile *)(p), NULL, NULL)
+#else
+#define agg_cas_ptr(p, expected, desired) \
+    __atomic_compare_exchange_n((p), &(expected), (desired), 0, \
+        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define agg_load_ptr(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#endif
+
+static PyThread_type_lock
+agg_pool_mutex(void)
+{
+    PyThread_type_lock lock, expected = NULL;
+
+    lock = agg_load_ptr(&agg_pool_lock);
+    if (lock != NULL)
+        return lock;
+    lock = PyThread_allocate_lock();
+    if (lock == NULL)
+        return NULL;
+    if (!agg_cas_ptr(&agg_pool_lock, expected, lock)) {
+        /* installed by another interpreter */
+        PyThread_free_lock(lock);
+    }
+    return agg_load_ptr(&agg_pool_lock);
+}
+
+#ifndef MS_WINDOWS
+static pthread_once_t agg_pool_once = PTHREAD_ONCE_INIT;
+
+/* Runs in the child of a fork, before it has any other thread: the
+ * workers of the parent do not exist there, and one of them may have held
+ * the lock */
+static void
+agg_pool_after_fork(void)
+{
+    agg_pool_lock = NULL;
+    agg_pool_idle = NULL;
+}
+
+static void
+agg_pool_register_atfork(void)
+{
+    pthread_atfork(NULL, NULL, agg_pool_after_fork);
+}
+#endif
+
+static void
+aggworker_free(aggworker *w)
+{
+    if (w->start != NULL)
+        PyThread_free_lock(w->start);
+    if (w->done != NULL)
+        PyThread_free_lock(w->done);
+    PyMem_RawFree(w);
+}
+
+static void
+aggworker_run(void *arg)
+{
+    aggworker *w = (aggworker *)arg;
+    aggworker **link;
+    aggtask *task;
+
+    for (;;) {
+        if (PyThread_acquire_lock_timed(w->start, AGG_IDLE_US, 0) !=
+                PY_LOCK_ACQUIRED) {
+            /* exit unless a task was given meanwhile */
+            PyThread_acquire_lock(agg_pool_lock, WAIT_LOCK);
+            if (!w->claimed) {
+                for (link = &agg_pool_idle; *link != w; link = &(*link)->next)
+                    ;
+                *link = w->next;
+                PyThread_release_lock(agg_pool_lock);
+                break;
+            }
+            PyThread_release_lock(agg_pool_lock);
+            continue;
+        }
+        task = w->task;
+        aggtable_add_rows(&task->table, task->key_columns,
+                          task->start, task->stop);
+        PyThread_release_lock(w->done);
+    }
+    aggworker_free(w);
+}
+
+/* Take an idle worker, or start a new one; NULL if no thread can be
+ * started. */
+static aggworker *
+aggworker_get(void)
+{
+    PyThread_type_lock lock;
+    aggworker *w;
+
+#ifndef MS_WINDOWS
+    pthread_once(&agg_pool_once, agg_pool_register_atfork);
+#endif
+    lock = agg_pool_mutex();
+    if (lock == NULL)
+        return NULL;
+    PyThread_acquire_lock(lock, WAIT_LOCK);
+    w = agg_pool_idle;
+    if (w != NULL) {
+        agg_pool_idle = w->next;
+        w->claimed = 1;
+    }
+    PyThread_release_lock(lock);
+    if (w != NULL)
+        return w;
+
+    w = PyMem_RawCalloc(1, sizeof(aggworker));
+    if (w == NULL)
+        return NULL;
+    w->claimed = 1;
+    w->start = PyThread_allocate_lock();
+    w->done = PyThread_allocate_lock();
+    if (w->start == NULL || w->done == NULL) {
+        aggworker_free(w);
+        return NULL;
+    }
+    PyThread_acquire_lock(w->start, WAIT_LOCK);
+    PyThread_acquire_lock(w->done, WAIT_LOCK);
+    if (PyThread_start_new_thread(aggworker_run, w) ==
+            PYTHREAD_INVALID_THREAD_ID) {
+        aggworker_free(w);
+        return NULL;
+    }
+    return w;
+}
+
+static void
+aggworker_put(aggworker *w)
+{
+    PyThread_acquire_lock(agg_pool_lock, WAIT_LOCK);
+    w->task = NULL;
+    w->claimed = 0;
+    w->next = agg_pool_idle;
+    agg_pool_idle = w;
+    PyThread_release_lock(agg_pool_lock);
+}
+
+static int
+agg_column_kind(Py_buffer *view)
+{
+    const char *format = view->format ? view->format : "B";
+
+    if (format[0] == '@' || format[0] == '=' || format[0] == '<')
+        format++;
+    if (!strcmp(format, "q") && view->itemsize == 8)
+        return AGG_INT64;
+    if (!strcmp(format, "d") && view->itemsize == 8)
+        return AGG_DOUBLE;
+    if (!strcmp(format, "?") && view->itemsize == 1)
+        return AGG_BOOL;
+    PyErr_Format(PyExc_TypeError,
+                 "aggregated columns must have format 'q', 'd' or '?', not '%s'",
+                 format);
+    return -1;
+}
+
+static PyObject *
+aggvalue_as_object(const aggspec *spec, aggvalue v, int64_t count)
+{
+    switch (spec->op) {
+    case AGG_COUNT:
+        return PyLong_FromLongLong(count);
+    case AGG_MEAN:
+        return PyFloat_FromDouble(v.f / (double)count);
+    default:
+        if (spec->kind == AGG_DOUBLE)
+            return PyFloat_FromDouble(v.f);
+        if (spec->kind == AGG_BOOL && spec->op != AGG_SUM)
+            return PyBool_FromLong((long)v.i);
+        return PyLong_FromLongLong(v.i);
+    }
+}
+
+/* Build ([key tuple, ...], [[aggregate of group, ...], ...]) */
+static PyObject *
+aggtable_result(aggtable *t)
+{
+    PyObject *groups, *columns, *v;
+    Py_ssize_t g, k, a;
+
+    groups = PyList_New(t->n_groups);
+    columns = PyList_New(t->n_aggs);
+    if (groups == NULL || columns == NULL)
+        goto error;
+    for (g = 0; g < t->n_groups; g++) {
+        PyObject *key = PyTuple_New(t->n_keys);
+
+        if (key == NULL)
+            goto error;
+        PyList_SET_ITEM(groups, g, key);
+        for (k = 0; k < t->n_keys; k++) {
+            v = PyLong_FromLongLong(t->keys[g * t->n_keys + k]);
+            if (v == NULL)
+                goto error;
+            PyTuple_SET_ITEM(key, k, v);
+        }
+    }
+    for (a = 0; a < t->n_aggs; a++) {
+        PyObject *column = PyList_New(t->n_groups);
+
+        if (column == NULL)
+            goto error;
+        PyList_SET_ITEM(columns, a, column);
+        for (g = 0; g < t->n_groups; g++) {
+            v = aggvalue_as_object(&t->aggs[a], t->values[g * t->n_aggs + a],
+                                   t->counts[g]);
+            if (v == NULL)
+                goto error;
+            PyList_SET_ITEM(column, g, v);
+        }
+    }
+    return Py_BuildValue("NN", groups, columns);
+
+error:
+    Py_XDECREF(groups);
+    Py_XDECREF(columns);
+    return NULL;
+}
+
+PyDoc_STRVAR(group_aggregate_doc,
+"_group_aggregate(keys, aggregates, threads) -> (groups, columns)\n\n"
+"Group rows by the int64 buffers in keys and compute aggregates, a\n"
+"sequence of (op, buffer) pairs with op one of 'sum', 'min', 'max',\n"
+"'count' and 'mean' (the buffer of 'count' may be None).  groups lists\n"
+"the key tuples in order of first appearance, columns holds one list of\n"
+"results per aggregate.");
+
+static PyObject *
+memoryslots_group_aggregate(PyObject *module, PyObject *args)
+{
+    PyObject *keys_ob, *aggs_ob, *keys_fast = NULL, *aggs_fast = NULL;
+    PyObject *result = NULL;
+    Py_buffer *views = NULL;
+    aggspec *aggs = NULL;
+    const int64_t **key_columns = NULL;
+    aggtask *tasks = NULL;
+    Py_ssize_t n_keys, n_aggs, n_views = 0, n_rows = -1, n_tasks = 0;
+    Py_ssize_t threads, i, chunk;
+    int error;
+
+    if (!PyArg_ParseTuple(args, "OOn:_group_aggregate",
+                          &keys_ob, &aggs_ob, &threads))
+        return NULL;
+    keys_fast = PySequence_Fast(keys_ob, "keys must be a sequence");
+    if (keys_fast == NULL)
+        return NULL;
+    aggs_fast = PySequence_Fast(aggs_ob, "aggregates must be a sequence");
+    if (aggs_fast == NULL)
+        goto done;
+    n_keys = PySequence_Fast_GET_SIZE(keys_fast);
+    n_aggs = PySequence_Fast_GET_SIZE(aggs_fast);
+
+    views = PyMem_New(Py_buffer, n_keys + n_aggs);
+    aggs = PyMem_New(aggspec, n_aggs ? n_aggs : 1);
+    key_columns = PyMem_New(const int64_t *, n_keys ? n_keys : 1);
+    if (views == NULL || aggs == NULL || key_columns == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+#define GET_COLUMN(ob, kind) do { \
+        Py_ssize_t _rows; \
+        if (PyObject_GetBuffer((ob), &views[n_views], \
+                               PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) < 0) \
+            goto done; \
+        n_views++; \
+        if (((kind) = agg_column_kind(&views[n_views - 1])) < 0) \
+            goto done; \
+        _rows = views[n_views - 1].len / views[n_views - 1].itemsize; \
+        if (n_rows >= 0 && _rows != n_rows) { \
+            PyErr_SetString(PyExc_ValueError, "columns differ in length"); \
+            goto done; \
+        } \
+        n_rows = _rows; \
+    } while (0)
+
+    for (i = 0; i < n_keys; i++) {
+        int kind;
+
+        GET_COLUMN(PySequence_Fast_GET_ITEM(keys_fast, i), kind);
+        if (kind != AGG_INT64) {
+            PyErr_SetString(PyExc_TypeError, "key columns must have format 'q'");
+            goto done;
+        }
+        key_columns[i] = views[n_views - 1].buf;
+    }
+    for (i = 0; i < n_aggs; i++) {
+        PyObject *spec = PySequence_Fast_GET_ITEM(aggs_fast, i), *op, *column;
+        int k;
+
+        if (!PyArg_ParseTuple(spec, "UO:aggregate", &op, &column))
+            goto done;
+        for (k = 0; k < (int)Py_ARRAY_LENGTH(agg_op_names); k++) {
+            if (PyUnicode_CompareWithASCIIString(op, agg_op_names[k]) == 0)
+                break;
+        }
+        if (k == (int)Py_ARRAY_LENGTH(agg_op_names)) {
+            PyErr_Format(PyExc_ValueError, "unknown aggregate %R", op);
+            goto done;
+        }
+        aggs[i].op = k;
+        aggs[i].kind = AGG_NONE;
+        aggs[i].data = NULL;
+        if (column == Py_None) {
+            if (k != AGG_COUNT) {
+                PyErr_Format(PyExc_ValueError, "aggregate %R needs a column", op);
+                goto done;
+            }
+        }
+        else if (k != AGG_COUNT) {
+            GET_COLUMN(column, aggs[i].kind);
+            aggs[i].data = views[n_views - 1].buf;
+        }
+    }
+#undef GET_COLUMN
+    if (n_rows < 0)
+        n_rows = 0;
+
+    /* every thread gets at least AGG_MIN_CHUNK rows */
+    n_tasks = Py_MAX(1, Py_MIN(threads, n_rows / AGG_MIN_CHUNK));
+    tasks = PyMem_New(aggtask, n_tasks);
+    if (tasks == NULL) {
+        n_tasks = 0;
+        PyErr_NoMemory();
+        goto done;
+    }
+    chunk = (n_rows + n_tasks - 1) / n_tasks;
+    for (i = 0; i < n_tasks; i++) {
+        aggtask *task = &tasks[i];
+
+        task->key_columns = key_columns;
+        task->start = Py_MIN(i * chunk, n_rows);
+        task->stop = Py_MIN(task->start + chunk, n_rows);
+        task->worker = NULL;
+        aggtable_init(&task->table, n_keys, n_aggs, aggs);
+    }
+    for (i = 1; i < n_tasks; i++) {
+        /* with no thread to spare, the chunk is run below */
+        tasks[i].worker = aggworker_get();
+        if (tasks[i].worker != NULL) {
+            tasks[i].worker->task = &tasks[i];
+            PyThread_release_lock(tasks[i].worker->start);
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    aggtable_add_rows(&tasks[0].table, key_columns, tasks[0].start, tasks[0].stop);
+    for (i = 1; i < n_tasks; i++) {
+        if (tasks[i].worker != NULL)
+            PyThread_acquire_lock(tasks[i].worker->done, WAIT_LOCK);
+        else
+            aggtable_add_rows(&tasks[i].table, key_columns,
+                              tasks[i].start, tasks[i].stop);
+        aggtable_merge(&tasks[0].table, &tasks[i].table);
+    }
+    Py_END_ALLOW_THREADS
+
+    for (i = 1; i < n_tasks; i++) {
+        if (tasks[i].worker != NULL)
+            aggworker_put(tasks[i].worker);
+    }
+
+    error = tasks[0].table.error;
+    if (error == AGG_ERROR_MEMORY)
+        PyErr_NoMemory();
+    else if (error == AGG_ERROR_OVERFLOW)
+        PyErr_SetString(PyExc_OverflowError, "int64 sum overflow");
+    else
+        result = aggtable_result(&tasks[0].table);
+
+done:
+    for (i = 0; i < n_tasks; i++)
+        aggtable_free(&tasks[i].table);
+    PyMem_Free(tasks);
+    for (i = 0; i < n_views; i++)
+        PyBuffer_Release(&views[i]);
+    PyMem_Free(views);
+    PyMem_Free(aggs);
+    PyMem_Free(key_columns);
+    Py_XDECREF(keys_fast);
+    Py_XDECREF(aggs_fast);
+    return result;
+}
+
+PyDoc_STRVAR(factorize_doc,
+"_factorize(values) -> (codes, uniques)\n\n"
+"Number the distinct hashable values in order of first appearance.\n"
+"codes is a bytearray of the int64 code of every value.");
+
+static PyObject *
+memoryslots_factorize(PyObject *module, PyObject *values)
+{
+    PyObject *fast, *index = NULL, *uniques = NULL, *codes = NULL;
+    PyObject **items;
+    int64_t *out;
+    Py_ssize_t i, n;
+
+    fast = PySequence_Fast(values, "values must be iterable");
+    if (fast == NULL)
+        return NULL;
+    n = PySequence_Fast_GET_SIZE(fast);
+    items = PySequence_Fast_ITEMS(fast);
+    index = PyDict_New();
+    uniques = PyList_New(0);
+    codes = PyByteArray_FromStringAndSize(NULL, n * (Py_ssize_t)sizeof(int64_t));
+    if (index == NULL || uniques == NULL || codes == NULL)
+        goto error;
+    out = (int64_t *)PyByteArray_AS_STRING(codes);
+
+    for (i = 0; i < n; i++) {
+        PyObject *code = PyDict_GetItemWithError(index, items[i]);   /* borrowed */
+
+        if (code == NULL) {
+            if (PyErr_Occurred())
+                goto error;
+            code = PyLong_FromSsize_t(PyList_GET_SIZE(uniques));
+            if (code == NULL)
+                goto error;
+            if (PyDict_SetItem(index, items[i], code) < 0 ||
+                PyList_Append(uniques, items[i]) < 0) {
+                Py_DECREF(code);
+                goto error;
+            }
+            Py_DECREF(code);
+        }
+        out[i] = (int64_t)PyLong_AsSsize_t(code);
+    }
+
+    Py_DECREF(fast);
+    Py_DECREF(index);
+    return Py_BuildValue("NN", codes, uniques);
+
+error:
+    Py_DECREF(fast);
+    Py_XDECREF(index);
+    Py_XDECREF(uniques);
+    Py_XDECREF(codes);
+    return NULL;
+}
+
+PyDoc_STRVAR(extract_column_doc,
+"_extract_column(records, index, format, exact=False) -> bytearray\n\n"
+"Pack field index of every record as format 'q' (int64), 'd' (double)\n"
+"or '?' (bool).  With exact, 'q' only accepts int values, not bools or\n"
+"other int subclasses.");
+
+static PyObject *
+memoryslots_extract_column(PyObject *module, PyObject *args)
+{
+    memoryslots_state *state = get_memoryslots_state(module);
+    PyObject *records, *fast, *column;
+    Py_ssize_t index, i, n;
+    int format, exact = 0, failed;
+    char *out;
+
+    if (!PyArg_ParseTuple(args, "OnC|p:_extract_column", &records, &index,
+                          &format, &exact))
+        return NULL;
+    if (format != 'q' && format != 'd' && format != '?') {
+        PyErr_Format(PyExc_ValueError, "unsupported column format '%c'", format);
+        return NULL;
+    }
+    /* conversions may run Python code that changes the records */
+    fast = PySequence_Tuple(records);
+    if (fast == NULL)
+        return NULL;
+    n = PyTuple_GET_SIZE(fast);
+    column = PyByteArray_FromStringAndSize(
+        NULL, n * (format == '?' ? 1 : (Py_ssize_t)sizeof(int64_t)));
+    if (column == NULL)
+        goto error;
+    out = PyByteArray_AS_STRING(column);
+
+    for (i = 0; i < n; i++) {
+        PyObject *record = PyTuple_GET_ITEM(fast, i), *v;
+
+        if (!PyObject_TypeCheck(record, state->memoryslots_type) ||
+            index < 0 || index >= Py_SIZE(record)) {
+            PyErr_Format(PyExc_TypeError,
+                         "expected a record with field %zd, got %.200s",
+                         index, Py_TYPE(record)->tp_name);
+            goto error;
+        }
+        v = PyTuple_GET_ITEM(record, index);
+        Py_INCREF(v);
+        if (format == 'q') {
+            long long x = -1;
+
+            if (exact && !PyLong_CheckExact(v))
+                PyErr_Format(PyExc_TypeError, "expected an int, got %.200s",
+                             Py_TYPE(v)->tp_name);
+            else
+                x = PyLong_AsLongLong(v);
+            ((int64_t *)out)[i] = (int64_t)x;
+            failed = x == -1 && PyErr_Occurred();
+        }
+        else if (format == 'd') {
+            double x = PyFloat_AsDouble(v);
+
+            ((double *)out)[i] = x;
+            failed = x == -1.0 && PyErr_Occurred();
+        }
+        else {
+            int x = PyObject_IsTrue(v);
+
+            out[i] = (char)x;
+            failed = x < 0;
+        }
+        Py_DECREF(v);
+        if (failed)
+            goto error;
+    }
+    Py_DECREF(fast);
+    return column;
+
+error:
+    Py_DECREF(fast);
+    Py_XDECREF(column);
+    return NULL;
+}
+
+/*********************** predicates **************************/
+
+/* Comparing an itemgetset descriptor with a constant, as in
+ * Rec.price > 10, builds a predicate; predicates combine with &, | and ~.
+ * A predicate is evaluated over a whole collection at once: every
+ * comparison fills a byte mask from a typed column in a tight loop, and
+ * masks are combined byte by byte. */
+
+enum { PRED_COMPARE, PRED_AND, PRED_OR, PRED_NOT };
+
+typedef struct {
+    PyObject_HEAD
+    int kind;
+    int op;                 /* Py_LT ... Py_GE of a comparison */
+    Py_ssize_t index;       /* field of a comparison */
+    PyObject *field;        /* its itemgetset descriptor */
+    PyObject *value;        /* constant of a comparison */
+    PyObject *left;         /* operands of &, | and ~ */
+    PyObject *right;
+} predicate_object;
+
+static const char * const predicate_op_names[] = {"<", "<=", "==", "!=", ">", ">="};
+
+static PyObject *
+predicate_create(memoryslots_state *state, int kind, int op, PyObject *field,
+                 PyObject *value, PyObject *left, PyObject *right)
+{
+    predicate_object *pred;
+
+    pred = PyObject_GC_New(predicate_object, state->predicate_type);
+    if (pred == NULL)
+        return NULL;
+    pred->kind = kind;
+    pred->op = op;
+    pred->index = field ? ((struct itemgetset_object *)field)->i : 0;
+    Py_XINCREF(field);
+    pred->field = field;
+    Py_XINCREF(value);
+    pred->value = value;
+    Py_XINCREF(left);
+    pred->left = left;
+    Py_XINCREF(right);
+    pred->right = right;
+    PyObject_GC_Track(pred);
+    return (PyObject *)pred;
+}
+
+static PyObject *
+predicate_compare(memoryslots_state *state, PyObject *field, int op,
+                  PyObject *value)
+{
+    return predicate_create(state, PRED_COMPARE, op, field, value, NULL, NULL);
+}
+
+static int
+predicate_traverse(predicate_object *pred, visitproc visit, void *arg)
+{
+    Py_VISIT(Py_TYPE(pred));
+    Py_VISIT(pred->field);
+    Py_VISIT(pred->value);
+    Py_VISIT(pred->left);
+    Py_VISIT(pred->right);
+    return 0;
+}
+
+static int
+predicate_clear(predicate_object *pred)
+{
+    Py_CLEAR(pred->field);
+    Py_CLEAR(pred->value);
+    Py_CLEAR(pred->left);
+    Py_CLEAR(pred->right);
+    return 0;
+}
+
+static void
+predicate_dealloc(predicate_object *pred)
+{
+    PyTypeObject *tp = Py_TYPE(pred);
+
+    PyObject_GC_UnTrack(pred);
+    predicate_clear(pred);
+    PyObject_GC_Del(pred);
+    Py_DECREF(tp);
+}
+
+static PyObject *
+predicate_repr(predicate_object *pred)
+{
+    switch (pred->kind) {
+    case PRED_COMPARE:
+        return PyUnicode_FromFormat("(field(%zd) %s %R)", pred->index,
+                                    predicate_op_names[pred->op], pred->value);
+    case PRED_AND:
+        return PyUnicode_FromFormat("(%R & %R)", pred->left, pred->right);
+    case PRED_OR:
+        return PyUnicode_FromFormat("(%R | %R)", pred->left, pred->right);
+    default:
+        return PyUnicode_FromFormat("~%R", pred->left);
+    }
+}
+
+static PyObject *
+predicate_combine(PyObject *a, PyObject *b, int kind)
+{
+    memoryslots_state *state;
+
+    /* either operand may be the predicate whose slot was called */
+    state = memoryslots_state_by_type(Py_TYPE(a));
+    if (state == NULL) {
+        PyErr_Clear();
+        state = memoryslots_state_by_type(Py_TYPE(b));
+        if (state == NULL)
+            return NULL;
+    }
+    if (!Py_IS_TYPE(a, state->predicate_type) ||
+        !Py_IS_TYPE(b, state->predicate_type))
+        Py_RETURN_NOTIMPLEMENTED;
+    return predicate_create(state, kind, 0, NULL, NULL, a, b);
+}
+
+static PyObject *
+predicate_and(PyObject *a, PyObject *b)
+{
+    return predicate_combine(a, b, PRED_AND);
+}
+
+static PyObject *
+predicate_or(PyObject *a, PyObject *b)
+{
+    return predicate_combine(a, b, PRED_OR);
+}
+
+static PyObject *
+predicate_invert(PyObject *a)
+{
+    memoryslots_state *state = memoryslots_state_by_type(Py_TYPE(a));
+
+    if (state == NULL)
+        return NULL;
+    return predicate_create(state, PRED_NOT, 0, NULL, NULL, a, NULL);
+}
+
+/* An equality of a field with a constant is true if they are the same
+ * object, as for other objects without __eq__, so that descriptors can be
+ * looked up in lists; other predicates have no truth value. */
+static int
+predicate_bool(PyObject *a)
+{
+    predicate_object *pred = (predicate_object *)a;
+
+    if (pred->kind == PRED_COMPARE && (pred->op == Py_EQ || pred->op == Py_NE))
+        return (pred->field == pred->value) == (pred->op == Py_EQ);
+    PyErr_SetString(PyExc_TypeError,
+                    "the truth value of a predicate is ambiguous, "
+                    "combine predicates with &, | and ~");
+    return -1;
+}
+
+/* Evaluation over columns.  A field is read either from a typed C array,
+ * a buffer given by the caller or gathered from the records in a single
+ * pass, or from the records themselves when its values are not all of
+ * one numeric kind. */
+
+enum { PCOL_RECORDS, PCOL_INT64, PCOL_DOUBLE, PCOL_BOOL, PCOL_UNKNOWN };
+
+typedef struct {
+    int kind;
+    void *data;
+} pcolumn;
+
+typedef struct {
+    Py_ssize_t n;
+    PyObject **records;     /* NULL when evaluating over buffers */
+    pcolumn *columns;       /* per field index */
+    Py_ssize_t n_columns;
+} predicate_input;
+
+#define PRED_LOOP(T, data, c, cmp) \
+    for (i = 0; i < n; i++) \
+        out[i] = ((const T *)(data))[i] cmp (c)
+
+#define PRED_COMPARE_LOOP(T, data, c) \
+    switch (op) { \
+    case Py_LT: PRED_LOOP(T, data, c, <); break; \
+    case Py_LE: PRED_LOOP(T, data, c, <=); break; \
+    case Py_EQ: PRED_LOOP(T, data, c, ==); break; \
+    case Py_NE: PRED_LOOP(T, data, c, !=); break; \
+    case Py_GT: PRED_LOOP(T, data, c, >); break; \
+    case Py_GE: PRED_LOOP(T, data, c, >=); break; \
+    }
+
+static void
+predicate_compare_int64(const int64_t *data, Py_ssize_t n, int op, int64_t c,
+                        unsigned char *out)
+{
+    Py_ssize_t i;
+
+    PRED_COMPARE_LOOP(int64_t, data, c)
+}
+
+static void
+predicate_compare_double(const double *data, Py_ssize_t n, int op, double c,
+                         unsigned char *out)
+{
+    Py_ssize_t i;
+
+    PRED_COMPARE_LOOP(double, data, c)
+}
+
+static void
+predicate_compare_bool(const unsigned char *data, Py_ssize_t n, int op,
+                       int64_t c, unsigned char *out)
+{
+    Py_ssize_t i;
+
+    /* any nonzero byte is a true value */
+    for (i = 0; i < n; i++)
+        out[i] = data[i] != 0;
+    PRED_COMPARE_LOOP(unsigned char, out, c)
+}
+
+#undef PRED_COMPARE_LOOP
+#undef PRED_LOOP
+
+/* The constant as int64 or double: PCOL_INT64, PCOL_DOUBLE or -1 */
+static int
+predicate_numeric_constant(PyObject *value, int64_t *i64, double *f64)
+{
+    int overflow;
+
+    if (Py_IS_TYPE(value, &PyLong_Type) || PyBool_Check(value)) {
+        long long v = PyLong_AsLongLongAndOverflow(value, &overflow);
+
+        if (overflow)
+            return -1;
+        *i64 = (int64_t)v;
+        *f64 = (double)v;
+        return PCOL_INT64;
+    }
+    if (PyFloat_CheckExact(value)) {
+        *f64 = PyFloat_AS_DOUBLE(value);
+        return PCOL_DOUBLE;
+    }
+    return -1;
+}
+
+/* Turn "int x <op> double c" into an exact "x <*op> *ci" on integers.
+ * Returns 1 if it did, 0 if the result is the constant *result. */
+static int
+predicate_int_bound(int *op, double c, int64_t *ci, int *result)
+{
+    double bound;
+
+    if (c != c) {           /* NaN */
+        *result = *op == Py_NE;
+        return 0;
+    }
+    switch (*op) {
+    case Py_LT: case Py_GE:
+        bound = ceil(c);
+        break;
+    case Py_LE: case Py_GT:
+        bound = floor(c);
+        break;
+    default:
+        if (floor(c) != c) {
+            *result = *op == Py_NE;
+            return 0;
+        }
+        bound = c;
+    }
+    /* 2**63 is exactly representable, every int64 is below it */
+    if (bound >= 9223372036854775808.0 || bound < -9223372036854775808.0) {
+        int above = bound > 0;  /* c is above every int64 */
+
+        switch (*op) {
+        case Py_LT: case Py_LE: *result = above; break;
+        case Py_GT: case Py_GE: *result = !above; break;
+        default: *result = *op == Py_NE;
+        }
+        return 0;
+    }
+    *ci = (int64_t)bound;
+    return 1;
+}
+
+/* Compare field values of records one by one */
+static int
+predicate_compare_records(predicate_object *pred, predicate_input *in,
+                          unsigned char *out)
+{
+    PyObject *c = pred->value;
+    Py_ssize_t i;
+    int str_eq = PyUnicode_CheckExact(c) && (pred->op == Py_EQ || pred->op == Py_NE);
+
+    for (i = 0; i < in->n; i++) {
+        PyObject *v = PyTuple_GET_ITEM(in->records[i], pred->index);
+        int r;
+
+        if (str_eq && PyUnicode_CheckExact(v))
+            r = (v == c || PyUnicode_Compare(v, c) == 0) == (pred->op == Py_EQ);
+        else if ((r = PyObject_RichCompareBool(v, c, pred->op)) < 0)
+            return -1;
+        out[i] = (unsigned char)r;
+    }
+    return 0;
+}
+
+static int
+predicate_eval_compare(predicate_object *pred, predicate_input *in,
+                       unsigned char *out)
+{
+    pcolumn *column = NULL;
+    int64_t ci = 0;
+    double cf = 0.0;
+    int ckind = predicate_numeric_constant(pred->value, &ci, &cf);
+    int op = pred->op, result;
+
+    if (pred->index < in->n_columns)
+        column = &in->columns[pred->index];
+    if (column == NULL || column->kind == PCOL_RECORDS ||
+        column->kind == PCOL_UNKNOWN) {
+        if (in->records != NULL)
+            return predicate_compare_records(pred, in, out);
+        PyErr_Format(PyExc_IndexError, "no column for field %zd", pred->index);
+        return -1;
+    }
+    if (ckind < 0) {
+        if (in->records != NULL)
+            return predicate_compare_records(pred, in, out);
+        PyErr_Format(PyExc_TypeError,
+                     "columns can only be compared with int, float or "
+                     "bool constants, not %.200s",
+                     Py_TYPE(pred->value)->tp_name);
+        return -1;
+    }
+
+    if (ckind == PCOL_DOUBLE && column->kind != PCOL_DOUBLE) {
+        if (!predicate_int_bound(&op, cf, &ci, &result)) {
+            memset(out, result, in->n);
+            return 0;
+        }
+    }
+    else if (ckind == PCOL_INT64 && column->kind == PCOL_DOUBLE &&
+             (ci > (1LL << 53) || ci < -(1LL << 53))) {
+        /* the int is not exactly a double */
+        if (in->records != NULL)
+            return predicate_compare_records(pred, in, out);
+        PyErr_SetString(PyExc_OverflowError,
+                        "int constant is too large to compare with a float column");
+        return -1;
+    }
+
+    switch (column->kind) {
+    case PCOL_INT64:
+        predicate_compare_int64(column->data, in->n, op, ci, out);
+        break;
+    case PCOL_DOUBLE:
+        predicate_compare_double(column->data, in->n, op, cf, out);
+        break;
+    default:
+        predicate_compare_bool(column->data, in->n, op, ci, out);
+    }
+    return 0;
+}
+
+static int
+predicate_eval(predicate_object *pred, predicate_input *in, unsigned char *out)
+{
+    unsigned char *tmp;
+    Py_ssize_t i, n = in->n;
+    int res;
+
+    switch (pred->kind) {
+    case PRED_COMPARE:
+        return predicate_eval_compare(pred, in, out);
+    case PRED_NOT:
+        if (predicate_eval((predicate_object *)pred->left, in, out) < 0)
+            return -1;
+        for (i = 0; i < n; i++)
+            out[i] ^= 1;
+        return 0;
+    }
+
+    if (predicate_eval((predicate_object *)pred->left, in, out) < 0)
+        return -1;
+    tmp = PyMem_Malloc(n ? n : 1);
+    if (tmp == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    res = predicate_eval((predicate_object *)pred->right, in, tmp);
+    if (res == 0) {
+        if (pred->kind == PRED_AND)
+            for (i = 0; i < n; i++)
+                out[i] &= tmp[i];
+        else
+            for (i = 0; i < n; i++)
+                out[i] |= tmp[i];
+    }
+    PyMem_Free(tmp);
+    return res;
+}
+
+/* Largest field index compared by the predicate */
+static Py_ssize_t
+predicate_max_index(predicate_object *pred)
+{
+    Py_ssize_t left;
+
+    if (pred->kind == PRED_COMPARE)
+        return pred->index;
+    left = predicate_max_index((predicate_object *)pred->left);
+    if (pred->right == NULL)
+        return left;
+    return Py_MAX(left, predicate_max_index((predicate_object *)pred->right));
+}
+
+/* Mark the columns compared with numeric constants to be gathered */
+static void
+predicate_mark_columns(predicate_object *pred, pcolumn *columns)
+{
+    int64_t ci;
+    double cf;
+
+    if (pred->kind != PRED_COMPARE) {
+        predicate_mark_columns((predicate_object *)pred->left, columns);
+        if (pred->right != NULL)
+            predicate_mark_columns((predicate_object *)pred->right, columns);
+    }
+    else if (predicate_numeric_constant(pred->value, &ci, &cf) >= 0) {
+        columns[pred->index].kind = PCOL_UNKNOWN;
+    }
+}
+
+/* Store v in a typed column, or give up on typing the column */
+static void
+pcolumn_gather(pcolumn *column, Py_ssize_t i, PyObject *v)
+{
+    int overflow;
+
+    if (column->kind == PCOL_UNKNOWN) {
+        if (Py_IS_TYPE(v, &PyLong_Type) || PyBool_Check(v))
+            column->kind = PCOL_INT64;
+        else if (PyFloat_CheckExact(v))
+            column->kind = PCOL_DOUBLE;
+        else {
+            column->kind = PCOL_RECORDS;
+            return;
+        }
+    }
+    if (column->kind == PCOL_INT64) {
+        if (Py_IS_TYPE(v, &PyLong_Type) || PyBool_Check(v)) {
+            long long x = PyLong_AsLongLongAndOverflow(v, &overflow);
+
+            if (!overflow) {
+                ((int64_t *)column->data)[i] = (int64_t)x;
+                return;
+            }
+        }
+        column->kind = PCOL_RECORDS;
+    }
+    else if (PyFloat_CheckExact(v)) {
+        ((double *)column->data)[i] = PyFloat_AS_DOUBLE(v);
+    }
+    else {
+        column->kind = PCOL_RECORDS;
+    }
+}
+
+PyDoc_STRVAR(predicate_mask_doc,
+"P._mask(records, record_type) -> bytearray\n\n"
+"Evaluate the predicate over a sequence of record_type instances, one\n"
+"byte per record, 1 where the predicate holds.");
+
+static PyObject *
+predicate_mask(predicate_object *pred, PyObject *args)
+{
+    PyObject *records, *type, *fast, *mask = NULL;
+    predicate_input in = {0, NULL, NULL, 0};
+    Py_ssize_t i, k, max_index = predicate_max_index(pred);
+    Py_ssize_t *gathered = NULL, n_gathered = 0;
+
+    if (!PyArg_ParseTuple(args, "OO!:_mask", &records, &PyType_Type, &type))
+        return NULL;
+    /* a copy, comparisons of field values may run code that changes the
+     * given list */
+    fast = PySequence_Tuple(records);
+    if (fast == NULL)
+        return NULL;
+    in.n = PyTuple_GET_SIZE(fast);
+    in.records = ((PyTupleObject *)fast)->ob_item;
+    in.n_columns = max_index + 1;
+    in.columns = PyMem_Calloc(in.n_columns, sizeof(pcolumn));
+    gathered = PyMem_New(Py_ssize_t, in.n_columns);
+    if (in.columns == NULL || gathered == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    predicate_mark_columns(pred, in.columns);
+    for (k = 0; k < in.n_columns; k++) {
+        if (in.columns[k].kind != PCOL_UNKNOWN)
+            continue;
+        in.columns[k].data = PyMem_Malloc(in.n ? in.n * sizeof(int64_t) : 1);
+        if (in.columns[k].data == NULL) {
+            PyErr_NoMemory();
+            goto done;
+        }
+        gathered[n_gathered++] = k;
+    }
+
+    /* a single pass over the records checks them and gathers the fields */
+    for (i = 0; i < in.n; i++) {
+        PyObject *record = in.records[i];
+
+        if (!PyObject_TypeCheck(record, (PyTypeObject *)type) ||
+            Py_SIZE(record) <= max_index) {
+            PyErr_Format(PyExc_TypeError, "expected %.200s records, got %.200s",
+                         ((PyTypeObject *)type)->tp_name,
+                         Py_TYPE(record)->tp_name);
+            goto done;
+        }
+        for (k = 0; k < n_gathered; k++) {
+            pcolumn *column = &in.columns[gathered[k]];
+
+            if (column->kind != PCOL_RECORDS)
+                pcolumn_gather(column, i, PyTuple_GET_ITEM(record, gathered[k]));
+        }
+    }
+
+    mask = PyByteArray_FromStringAndSize(NULL, in.n);
+    if (mask != NULL && predicate_eval(pred, &in, (unsigned char *)PyByteArray_AS_STRING(mask)) < 0)
+        Py_CLEAR(mask);
+
+done:
+    for (k = 0; k < n_gathered; k++)
+        PyMem_Free(in.columns[gathered[k]].data);
+    PyMem_Free(in.columns);
+    PyMem_Free(gathered);
+    Py_DECREF(fast);
+    return mask;
+}
+
+PyDoc_STRVAR(predicate_mask_columns_doc,
+"P._mask_columns(columns) -> bytearray\n\n"
+"Evaluate the predicate over typed columns, columns[i] being a buffer of\n"
+"format 'q', 'd' or '?' with the values of field i, or None.");
+
+static PyObject *
+predicate_mask_columns(predicate_object *pred, PyObject *columns)
+{
+    PyObject *fast, *mask = NULL;
+    predicate_input in = {-1, NULL, NULL, 0};
+    Py_buffer *views = NULL;
+    Py_ssize_t i, n_views = 0;
+
+    fast = PySequence_Fast(columns, "columns must be a sequence");
+    if (fast == NULL)
+        return NULL;
+    in.n_columns = PySequence_Fast_GET_SIZE(fast);
+    in.columns = PyMem_Calloc(in.n_columns ? in.n_columns : 1, sizeof(pcolumn));
+    views = PyMem_Calloc(in.n_columns ? in.n_columns : 1, sizeof(Py_buffer));
+    if (in.columns == NULL || views == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    for (n_views = 0; n_views < in.n_columns; n_views++) {
+        PyObject *column = PySequence_Fast_GET_ITEM(fast, n_views);
+        Py_buffer *view = &views[n_views];
+        const char *format;
+        Py_ssize_t rows;
+
+        if (column == Py_None)
+            continue;
+        if (PyObject_GetBuffer(column, view, PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) < 0) {
+            view->buf = NULL;
+            goto done;
+        }
+        format = view->format ? view->format : "B";
+        if (!strcmp(format, "q") && view->itemsize == 8)
+            in.columns[n_views].kind = PCOL_INT64;
+        else if (!strcmp(format, "d") && view->itemsize == 8)
+            in.columns[n_views].kind = PCOL_DOUBLE;
+        else if (!strcmp(format, "?") && view->itemsize == 1)
+            in.columns[n_views].kind = PCOL_BOOL;
+        else {
+            PyErr_Format(PyExc_TypeError, "columns must have format 'q', "
+                         "'d' or '?', not '%s'", format);
+            n_views++;
+            goto done;
+        }
+        in.columns[n_views].data = view->buf;
+
+        rows = view->len / view->itemsize;
+        if (in.n >= 0 && rows != in.n) {
+            PyErr_SetString(PyExc_ValueError, "columns differ in length");
+            n_views++;
+            goto done;
+        }
+        in.n = rows;
+    }
+    if (in.n < 0)
+        in.n = 0;
+
+    mask = PyByteArray_FromStringAndSize(NULL, in.n);
+    if (mask != NULL && predicate_eval(pred, &in, (unsigned char *)PyByteArray_AS_STRING(mask)) < 0)
+        Py_CLEAR(mask);
+
+done:
+    for (i = 0; i < n_views; i++) {
+        if (views[i].buf != NULL)
+            PyBuffer_Release(&views[i]);
+    }
+    PyMem_Free(views);
+    PyMem_Free(in.columns);
+    Py_DECREF(fast);
+    return mask;
+}
+
+static PyObject *
+predicate_fields(predicate_object *pred, void *closure)
+{
+    PyObject *left, *right, *result;
+
+    if (pred->kind == PRED_COMPARE)
+        return Py_BuildValue("(n)", pred->index);
+    left = predicate_fields((predicate_object *)pred->left, NULL);
+    if (left == NULL || pred->right == NULL)
+        return left;
+    right = predicate_fields((predicate_object *)pred->right, NULL);
+    if (right == NULL) {
+        Py_DECREF(left);
+        return NULL;
+    }
+    result = PySequence_Concat(left, right);
+    Py_DECREF(left);
+    Py_DECREF(right);
+    return result;
+}
+
+static PyObject *
+predicate_descriptors(predicate_object *pred, void *closure)
+{
+    PyObject *left, *right, *result;
+
+    if (pred->kind == PRED_COMPARE)
+        return PyTuple_Pack(1, pred->field);
+    left = predicate_descriptors((predicate_object *)pred->left, NULL);
+    if (left == NULL || pred->right == NULL)
+        return left;
+    right = predicate_descriptors((predicate_object *)pred->right, NULL);
+    if (right == NULL) {
+        Py_DECREF(left);
+        return NULL;
+    }
+    result = PySequence_Concat(left, right);
+    Py_DECREF(left);
+    Py_DECREF(right);
+    return result;
+}
+
+static PyMethodDef predicate_methods[] = {
+    {"_mask", (PyCFunction)predicate_mask, METH_VARARGS, predicate_mask_doc},
+    {"_mask_columns", (PyCFunction)predicate_mask_columns, METH_O, predicate_mask_columns_doc},
+    {NULL}
+};
+
+static PyGetSetDef predicate_getset[] = {
+    {"fields", (getter)predicate_fields, NULL,
+     "indices of the fields the predicate compares", NULL},
+    {"descriptors", (getter)predicate_descriptors, NULL,
+     "itemgetset descriptors of the fields, in the order of fields", NULL},
+    {NULL}
+};
+
+PyDoc_STRVAR(predicate_doc,
+"Condition on record fields, built by comparing itemgetset descriptors\n"
+"with constants and combined with &, | and ~.");
+
+static PyType_Slot predicate_slots[] = {
+    {Py_tp_dealloc, predicate_dealloc},
+    {Py_tp_repr, predicate_repr},
+    {Py_tp_doc, (void *)predicate_doc},
+    {Py_tp_traverse, predicate_traverse},
+    {Py_tp_clear, predicate_clear},
+    {Py_tp_methods, predicate_methods},
+    {Py_tp_getset, predicate_getset},
+    {Py_nb_and, predicate_and},
+    {Py_nb_or, predicate_or},
+    {Py_nb_invert, predicate_invert},
+    {Py_nb_bool, predicate_bool},
+    {0, 0}
+};
+
+static PyType_Spec predicate_spec = {
+    "trafaretrecord.memoryslots.predicate",             /* name */
+    sizeof(predicate_object),                           /* basicsize */
+    0,                                                  /* itemsize */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,            /* flags */
+    predicate_slots                                     /* slots */
+};
+
+/*********************** table watch **************************/
+
+PyDoc_STRVAR(watch_doc,
+"_watch(record, flag)\n\n"
+"Mark record as held (flag true) or no longer held by a table.  Setting a\n"
+"field of a marked record notifies the observers of its slotlayout.");
+
+static PyObject *
+memoryslots_watch(PyObject *module, PyObject *args)
+{
+    memoryslots_state *state = get_memoryslots_state(module);
+    PyObject *record, **extra;
+    slotlayout_object *layout;
+    int flag;
+
+    if (!PyArg_ParseTuple(args, "Op:_watch", &record, &flag))
+        return NULL;
+    if (!PyObject_TypeCheck(record, state->memoryslots_type)) {
+        PyErr_Format(PyExc_TypeError,
+                     "_watch() expects a memoryslots record, not %.200s",
+                     Py_TYPE(record)->tp_name);
+        return NULL;
+    }
+    layout = memoryslots_layout(record);
+    if (layout == NULL) {
+        PyErr_Format(PyExc_TypeError,
+                     "%.200s records have no slotlayout",
+                     Py_TYPE(record)->tp_name);
+        return NULL;
+    }
+
+    extra = memoryslots_extra(record);
+    extra[0] = (PyObject *)((uintptr_t)layout |
+                            (flag ? MEMORYSLOTS_WATCHED : 0));
+    Py_RETURN_NONE;
+}
+
+/*********************** Arrow C data interface **************************/
+
+/* Record collections are exchanged with Arrow as a struct array with one
+ * child array per field, using the C data interface structures wrapped in
+ * PyCapsules named "arrow_schema", "arrow_array" and "arrow_array_stream"
+ * (https://arrow.apache.org/docs/format/CDataInterface.html).  Exported
+ * buffers are views on the Python objects holding the columns; release
+ * callbacks may run in any thread, so the structures are allocated with
+ * PyMem_Raw* and the GIL is taken only to release the views. */
+
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema {
+    const char *format;
+    const char *name;
+    const char *metadata;
+    int64_t flags;
+    int64_t n_children;
+    struct ArrowSchema **children;
+    struct ArrowSchema *dictionary;
+    void (*release)(struct ArrowSchema *);
+    void *private_data;
+};
+
+struct ArrowArray {
+    int64_t length;
+    int64_t null_count;
+    int64_t offset;
+    int64_t n_buffers;
+    int64_t n_children;
+    const void **buffers;
+    struct ArrowArray **children;
+    struct ArrowArray *dictionary;
+    void (*release)(struct ArrowArray *);
+    void *private_data;
+};
+
+#endif  /* ARROW_C_DATA_INTERFACE */
+
+#ifndef ARROW_C_STREAM_INTERFACE
+#define ARROW_C_STREAM_INTERFACE
+
+struct ArrowArrayStream {
+    int (*get_schema)(struct ArrowArrayStream *, struct ArrowSchema *out);
+    int (*get_next)(struct ArrowArrayStream *, struct ArrowArray *out);
+    const char *(*get_last_error)(struct ArrowArrayStream *);
+    void (*release)(struct ArrowArrayStream *);
+    void *private_data;
+};
+
+#endif  /* ARROW_C_STREAM_INTERFACE */
+
+#define ARROW_MAX_BUFFERS 3
+
+/* Buffers of an exported array and the views that keep them alive */
+typedef struct {
+    const void *buffers[ARROW_MAX_BUFFERS];
+    Py_buffer views[ARROW_MAX_BUFFERS];
+} arrow_array_data;
+
+static char *
+arrow_strdup(const char *s)
+{
+    size_t n = strlen(s) + 1;
+    char *copy = PyMem_RawMalloc(n);
+
+    if (copy != NULL)
+        memcpy(copy, s, n);
+    return copy;
+}
+
+static void
+arrow_schema_release(struct ArrowSchema *schema)
+{
+    int64_t i;
+
+    for (i = 0; i < schema->n_children; i++) {
+        struct ArrowSchema *child = schema->children[i];
+
+        if (child->release != NULL)
+            child->release(child);
+        PyMem_RawFree(child);
+    }
+    PyMem_RawFree(schema->children);
+    PyMem_RawFree((void *)schema->format);
+    PyMem_RawFree((void *)schema->name);
+    schema->release = NULL;
+}
+
+static void
+arrow_array_release(struct ArrowArray *array)
+{
+    arrow_array_data *data = array->private_data;
+    int64_t i;
+
+    for (i = 0; i < array->n_children; i++) {
+        struct ArrowArray *child = array->children[i];
+
+        if (child->release != NULL)
+            child->release(child);
+        PyMem_RawFree(child);
+    }
+    PyMem_RawFree(array->children);
+    if (data != NULL) {
+        int k, has_views = 0;
+
+        for (k = 0; k < ARROW_MAX_BUFFERS; k++)
+            has_views |= data->views[k].obj != NULL;
+        /* after finalization the views can only be leaked */
+        if (has_views && Py_IsInitialized()) {
+            PyGILState_STATE gil = PyGILState_Ensure();
+
+            for (k = 0; k < ARROW_MAX_BUFFERS; k++) {
+                if (data->views[k].obj != NULL)
+                    PyBuffer_Release(&data->views[k]);
+            }
+            PyGILState_Release(gil);
+        }
+        PyMem_RawFree(data);
+    }
+    array->release = NULL;
+}
+
+static void
+arrow_schema_capsule_free(PyObject *capsule)
+{
+    struct ArrowSchema *schema = PyCapsule_GetPointer(capsule, "arrow_schema");
+
+    if (schema == NULL) {
+        PyErr_WriteUnraisable(capsule);
+        return;
+    }
+    if (schema->release != NULL)
+        schema->release(schema);
+    PyMem_RawFree(schema);
+}
+
+static void
+arrow_array_capsule_free(PyObject *capsule)
+{
+    struct ArrowArray *array = PyCapsule_GetPointer(capsule, "arrow_array");
+
+    if (array == NULL) {
+        PyErr_WriteUnraisable(capsule);
+        return;
+    }
+    if (array->release != NULL)
+        array->release(array);
+    PyMem_RawFree(array);
+}
+
+/* Struct schema with a nullable child of formats[i] named names[i] */
+static PyObject *
+arrow_schema_capsule(PyObject *names, PyObject *formats)
+{
+    struct ArrowSchema *schema;
+    PyObject *capsule;
+    Py_ssize_t i, n;
+
+    if (!PyTuple_Check(names) || !PyTuple_Check(formats) ||
+        PyTuple_GET_SIZE(names) != PyTuple_GET_SIZE(formats)) {
+        PyErr_SetString(PyExc_TypeError,
+                        "names and formats must be tuples of the same size");
+        return NULL;
+    }
+    n = PyTuple_GET_SIZE(names);
+
+    schema = PyMem_RawCalloc(1, sizeof(struct ArrowSchema));
+    if (schema == NULL)
+        return PyErr_NoMemory();
+    schema->release = arrow_schema_release;
+    schema->format = arrow_strdup("+s");
+    schema->name = arrow_strdup("");
+    schema->children = PyMem_RawCalloc(n ? n : 1, sizeof(struct ArrowSchema *));
+    if (schema->format == NULL || schema->name == NULL ||
+        schema->children == NULL)
+        goto nomemory;
+
+    for (i = 0; i < n; i++) {
+        const char *name, *format;
+        struct ArrowSchema *child;
+
+        name = PyUnicode_AsUTF8(PyTuple_GET_ITEM(names, i));
+        format = name == NULL ? NULL :
+                 PyUnicode_AsUTF8(PyTuple_GET_ITEM(formats, i));
+        if (format == NULL)
+            goto error;
+        child = PyMem_RawCalloc(1, sizeof(struct ArrowSchema));
+        if (child == NULL)
+            goto nomemory;
+        schema->children[i] = child;
+        schema->n_children = i + 1;
+        child->release = arrow_schema_release;
+        child->flags = ARROW_FLAG_NULLABLE;
+        child->format = arrow_strdup(format);
+        child->name = arrow_strdup(name);
+        if (child->format == NULL || child->name == NULL)
+            goto nomemory;
+    }
+
+    capsule = PyCapsule_New(schema, "arrow_schema", arrow_schema_capsule_free);
+    if (capsule == NULL) {
+        schema->release(schema);
+        PyMem_RawFree(schema);
+    }
+    return capsule;
+
+nomemory:
+    PyErr_NoMemory();
+error:
+    schema->release(schema);
+    PyMem_RawFree(schema);
+    return NULL;
+}
+
+static int
+arrow_array_data_new(struct ArrowArray *array)
+{
+    arrow_array_data *data = PyMem_RawCalloc(1, sizeof(arrow_array_data));
+
+    if (data == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    array->private_data = data;
+    array->buffers = data->buffers;
+    array->release = arrow_array_release;
+    return 0;
+}
+
+/* Struct array of length rows over columns, a tuple of
+ * (null_count, buffers) pairs; the buffers are None or objects supporting
+ * the buffer protocol, in the order the child format expects them. */
+static PyObject *
+arrow_array_capsule(PyObject *columns, int64_t length)
+{
+    struct ArrowArray *array;
+    PyObject *capsule;
+    Py_ssize_t i, n;
+
+    if (!PyTuple_Check(columns)) {
+        PyErr_SetString(PyExc_TypeError, "columns must be a tuple");
+        return NULL;
+    }
+    n = PyTuple_GET_SIZE(columns);
+
+    array = PyMem_RawCalloc(1, sizeof(struct ArrowArray));
+    if (array == NULL)
+        return PyErr_NoMemory();
+    if (arrow_array_data_new(array) < 0) {
+        PyMem_RawFree(array);
+        return NULL;
+    }
+    array->length = length;
+    array->n_buffers = 1;
+    array->children = PyMem_RawCalloc(n ? n : 1, sizeof(struct ArrowArray *));
+    if (array->children == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+
+    for (i = 0; i < n; i++) {
+        struct ArrowArray *child;
+        arrow_array_data *data;
+        PyObject *buffers;
+        long long null_count;
+        Py_ssize_t k;
+
+        if (!PyArg_ParseTuple(PyTuple_GET_ITEM(columns, i),
+                              "LO!:arrow column", &null_count,
+                              &PyTuple_Type, &buffers))
+            goto error;
+        if (PyTuple_GET_SIZE(buffers) > ARROW_MAX_BUFFERS) {
+            PyErr_SetString(PyExc_ValueError, "too many buffers in column");
+            goto error;
+        }
+        child = PyMem_RawCalloc(1, sizeof(struct ArrowArray));
+        if (child == NULL) {
+            PyErr_NoMemory();
+            goto error;
+        }
+        array->children[i] = child;
+        array->n_children = i + 1;
+        if (arrow_array_data_new(child) < 0)
+            goto error;
+        data = child->private_data;
+        child->length = length;
+        child->null_count = null_count;
+        child->n_buffers = PyTuple_GET_SIZE(buffers);
+        for (k = 0; k < child->n_buffers; k++) {
+            PyObject *buffer = PyTuple_GET_ITEM(buffers, k);
+
+            if (buffer == Py_None)
+                continue;
+            if (PyObject_GetBuffer(buffer, &data->views[k],
+                                   PyBUF_C_CONTIGUOUS) < 0)
+                goto error;
+            data->buffers[k] = data->views[k].buf;
+        }
+    }
+
+    capsule = PyCapsule_New(array, "arrow_array", arrow_array_capsule_free);
+    if (capsule == NULL) {
+        array->release(array);
+        PyMem_RawFree(array);
+    }
+    return capsule;
+
+error:
+    array->release(array);
+    PyMem_RawFree(array);
+    return NULL;
+}
+
+PyDoc_STRVAR(arrow_schema_doc,
+"_arrow_schema(names, formats) -> 'arrow_schema' PyCapsule\n\n"
+"Schema of a struct array with one nullable child per field.");
+
+static PyObject *
+memoryslots_arrow_schema(PyObject *module, PyObject *args)
+{
+    PyObject *names, *formats;
+
+    if (!PyArg_ParseTuple(args, "OO:_arrow_schema", &names, &formats))
+        return NULL;
+    return arrow_schema_capsule(names, formats);
+}
+
+PyDoc_STRVAR(arrow_export_doc,
+"_arrow_export(names, formats, columns, length) -> (schema, array)\n\n"
+"PyCapsules of a struct array of length rows.  columns holds a\n"
+"(null_count, buffers) pair per field; the buffers are exported without\n"
+"copying and stay referenced until the consumer releases the array.");
+
+static PyObject *
+memoryslots_arrow_export(PyObject *module, PyObject *args)
+{
+    PyObject *names, *formats, *columns, *schema, *array, *result;
+    long long length;
+
+    if (!PyArg_ParseTuple(args, "OOOL:_arrow_export", &names, &formats,
+                          &columns, &length))
+        return NULL;
+    if (PyTuple_Check(columns) && PyTuple_Check(names) &&
+        PyTuple_GET_SIZE(columns) != PyTuple_GET_SIZE(names)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "expected one column per name");
+        return NULL;
+    }
+    schema = arrow_schema_capsule(names, formats);
+    if (schema == NULL)
+        return NULL;
+    array = arrow_array_capsule(columns, length);
+    if (array == NULL) {
+        Py_DECREF(schema);
+        return NULL;
+    }
+    result = PyTuple_Pack(2, schema, array);
+    Py_DECREF(schema);
+    Py_DECREF(array);
+    return result;
+}
+
+/* Value i of values, or of field index of record i if index >= 0 */
+static PyObject *
+arrow_column_value(memoryslots_state *state, PyObject *values,
+                   Py_ssize_t index, Py_ssize_t i)
+{
+    PyObject *record = PySequence_Fast_GET_ITEM(values, i);
+
+    if (index < 0)
+        return record;
+    if (!PyObject_TypeCheck(record, state->memoryslots_type) ||
+        index >= Py_SIZE(record)) {
+        PyErr_Format(PyExc_TypeError,
+                     "expected records with field %zd, got %.200s",
+                     index, Py_TYPE(record)->tp_name);
+        return NULL;
+    }
+    return PyTuple_GET_ITEM(record, index);
+}
+
+/* Bytes of a str ('u') or bytes-like ('z') value */
+static const char *
+arrow_column_bytes(PyObject *value, char format, Py_ssize_t *size)
+{
+    if (format == 'u') {
+        if (!PyUnicode_Check(value)) {
+            PyErr_Format(PyExc_TypeError, "expected str, got %.200s",
+                         Py_TYPE(value)->tp_name);
+            return NULL;
+        }
+        return PyUnicode_AsUTF8AndSize(value, size);
+    }
+    if (PyBytes_Check(value)) {
+        *size = PyBytes_GET_SIZE(value);
+        return PyBytes_AS_STRING(value);
+    }
+    if (PyByteArray_Check(value)) {
+        *size = PyByteArray_GET_SIZE(value);
+        return PyByteArray_AS_STRING(value);
+    }
+    PyErr_Format(PyExc_TypeError, "expected bytes, got %.200s",
+                 Py_TYPE(value)->tp_name);
+    return NULL;
+}
+
+PyDoc_STRVAR(arrow_column_doc,
+"_arrow_column(values, index, format) -> (format, null_count, buffers)\n\n"
+"Arrow buffers of a column: field index of every record of values, or\n"
+"the values themselves if index is -1.  format is 'l' (int64), 'g'\n"
+"(double), 'b' (boolean), 'u' (utf8) or 'z' (binary); utf8 and binary\n"
+"columns too large for 32-bit offsets come back as 'U' and 'Z'.  None\n"
+"values are nulls.");
+
+static PyObject *
+memoryslots_arrow_column(PyObject *module, PyObject *args)
+{
+    memoryslots_state *state = get_memoryslots_state(module);
+    PyObject *values, *seq, *column = NULL, *validity = NULL, *data = NULL, *offsets = NULL;
+    PyObject *buffers = NULL, *result = NULL;
+    unsigned char *bits = NULL;
+    Py_ssize_t index, i, n, null_count = 0;
+    char format_name[2] = {0, 0};
+    int format;
+
+    if (!PyArg_ParseTuple(args, "OnC:_arrow_column", &values, &index, &format))
+        return NULL;
+    if (format != 'l' && format != 'g' && format != 'b' && format != 'u' &&
+        format != 'z') {
+        PyErr_Format(PyExc_ValueError, "unsupported Arrow format '%c'",
+                     format);
+        return NULL;
+    }
+    seq = PySequence_Fast(values, "values must be a sequence");
+    if (seq == NULL)
+        return NULL;
+    n = PySequence_Fast_GET_SIZE(seq);
+    column = PyTuple_New(n);
+    if (column == NULL)
+        goto done;
+
+    /* The values are taken first, as the conversions below may run Python
+     * code that changes the records or the sequence.  Nulls are found on
+     * the way, so that the validity bitmap is only built if needed. */
+    for (i = 0; i < n; i++) {
+        PyObject *v = arrow_column_value(state, seq, index, i);
+
+        if (v == NULL)
+            goto done;
+        Py_INCREF(v);
+        PyTuple_SET_ITEM(column, i, v);
+    }
+    for (i = 0; i < n; i++) {
+        if (PyTuple_GET_ITEM(column, i) != Py_None)
+            continue;
+        if (validity == NULL) {
+            validity = PyByteArray_FromStringAndSize(NULL, (n + 7) / 8);
+            if (validity == NULL)
+                goto done;
+            bits = (unsigned char *)PyByteArray_AS_STRING(validity);
+            memset(bits, 0xFF, (n + 7) / 8);
+            if (n & 7)
+                bits[n >> 3] = (unsigned char)((1 << (n & 7)) - 1);
+        }
+        bits[i >> 3] &= (unsigned char)~(1 << (i & 7));
+        null_count++;
+    }
+#define ARROW_IS_NULL(i) (bits != NULL && !(bits[(i) >> 3] & (1 << ((i) & 7))))
+
+    if (format == 'l' || format == 'g') {
+        data = PyByteArray_FromStringAndSize(NULL, n * 8);
+        if (data == NULL)
+            goto done;
+        for (i = 0; i < n; i++) {
+            PyObject *v = PyTuple_GET_ITEM(column, i);
+            char *out = PyByteArray_AS_STRING(data) + 8 * i;
+
+            if (format == 'l') {
+                int64_t x = ARROW_IS_NULL(i) ? 0 : PyLong_AsLongLong(v);
+
+                if (x == -1 && PyErr_Occurred())
+                    goto done;
+                memcpy(out, &x, 8);
+            }
+            else {
+                double x = ARROW_IS_NULL(i) ? 0.0 : PyFloat_AsDouble(v);
+
+                if (x == -1.0 && PyErr_Occurred())
+                    goto done;
+                memcpy(out, &x, 8);
+            }
+        }
+        buffers = PyTuple_Pack(2, validity ? validity : Py_None, data);
+    }
+    else if (format == 'b') {
+        unsigned char *out;
+
+        data = PyByteArray_FromStringAndSize(NULL, (n + 7) / 8);
+        if (data == NULL)
+            goto done;
+        out = (unsigned char *)PyByteArray_AS_STRING(data);
+        memset(out, 0, (n + 7) / 8);
+        for (i = 0; i < n; i++) {
+            PyObject *v = PyTuple_GET_ITEM(column, i);
+            int truth;
+
+            if (ARROW_IS_NULL(i))
+                continue;
+            truth = PyObject_IsTrue(v);
+            if (truth < 0)
+                goto done;
+            if (truth)
+                out[i >> 3] |= (unsigned char)(1 << (i & 7));
+        }
+        buffers = PyTuple_Pack(2, validity ? validity : Py_None, data);
+    }
+    else {
+        Py_ssize_t total = 0, size;
+        int large;
+        char *out;
+
+        for (i = 0; i < n; i++) {
+            PyObject *v = PyTuple_GET_ITEM(column, i);
+
+            if (ARROW_IS_NULL(i))
+                continue;
+            if (arrow_column_bytes(v, (char)format, &size) == NULL)
+                goto done;
+            total += size;
+        }
+        large = total > INT32_MAX;
+        offsets = PyByteArray_FromStringAndSize(NULL, (n + 1) * (large ? 8 : 4));
+        data = PyByteArray_FromStringAndSize(NULL, total);
+        if (offsets == NULL || data == NULL)
+            goto done;
+        out = PyByteArray_AS_STRING(data);
+
+        total = 0;
+        for (i = 0; i <= n; i++) {
+            char *offset = PyByteArray_AS_STRING(offsets) + i * (large ? 8 : 4);
+            PyObject *v;
+            const char *s;
+
+            if (large) {
+                int64_t x = total;
+                memcpy(offset, &x, 8);
+            }
+            else {
+                int32_t x = (int32_t)total;
+                memcpy(offset, &x, 4);
+            }
+            if (i == n || ARROW_IS_NULL(i))
+                continue;
+            v = PyTuple_GET_ITEM(column, i);
+            s = arrow_column_bytes(v, (char)format, &size);
+            if (s == NULL)
+                goto done;
+            /* a bytearray may have been resized by a finalizer */
+            if (size > PyByteArray_GET_SIZE(data) - total)
+                break;
+            memcpy(out + total, s, size);
+            total += size;
+        }
+        if (i <= n || total != PyByteArray_GET_SIZE(data)) {
+            PyErr_SetString(PyExc_RuntimeError,
+                            "column value changed size during conversion");
+            goto done;
+        }
+        if (large)
+            format = format == 'u' ? 'U' : 'Z';
+        buffers = PyTuple_Pack(3, validity ? validity : Py_None, offsets, data);
+    }
+#undef ARROW_IS_NULL
+
+    if (buffers != NULL) {
+        format_name[0] = (char)format;
+        result = Py_BuildValue("snO", format_name, null_count, buffers);
+    }
+
+done:
+    Py_DECREF(seq);
+    Py_XDECREF(column);
+    Py_XDECREF(validity);
+    Py_XDECREF(data);
+    Py_XDECREF(offsets);
+    Py_XDECREF(buffers);
+    return result;
+}
+
+/* Number of buffers of the formats that can be imported, or -1 */
+static int
+arrow_import_buffers(const char *format)
+{
+    if (format[0] == '\0' || format[1] != '\0')
+        return -1;
+    switch (format[0]) {
+    case 'n':
+        return 0;
+    case 'b': case 'c': case 'C': case 's': case 'S': case 'i': case 'I':
+    case 'l': case 'L': case 'f': case 'g':
+        return 2;
+    case 'u': case 'U': case 'z': case 'Z':
+        return 3;
+    default:
+        return -1;
+    }
+}
+
+/* Field index of every child of the struct schema, -1 if it has none */
+static Py_ssize_t *
+arrow_import_positions(PyTypeObject *type, PyObject *fields,
+                       struct ArrowSchema *schema)
+{
+    Py_ssize_t *positions, n_fields = PyTuple_GET_SIZE(fields);
+    char *seen;
+    int64_t k;
+    Py_ssize_t i;
+
+    if (schema->release == NULL || strcmp(schema->format, "+s") != 0) {
+        PyErr_Format(PyExc_ValueError,
+                     "expected an Arrow struct array of %.200s records",
+                     type->tp_name);
+        return NULL;
+    }
+    positions = PyMem_New(Py_ssize_t, schema->n_children ? schema->n_children : 1);
+    seen = PyMem_Calloc(n_fields ? n_fields : 1, 1);
+    if (positions == NULL || seen == NULL) {
+        PyMem_Free(positions);
+        PyMem_Free(seen);
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    for (k = 0; k < schema->n_children; k++) {
+        struct ArrowSchema *child = schema->children[k];
+        PyObject *name;
+
+        name = PyUnicode_FromString(child->name ? child->name : "");
+        if (name == NULL)
+            goto error;
+        positions[k] = -1;
+        for (i = 0; i < n_fields; i++) {
+            int eq = PyUnicode_Compare(PyTuple_GET_ITEM(fields, i), name);
+
+            if (eq == 0) {
+                positions[k] = i;
+                break;
+            }
+            if (eq == -1 && PyErr_Occurred()) {
+                Py_DECREF(name);
+                goto error;
+            }
+        }
+        if (positions[k] < 0 || seen[positions[k]]) {
+            PyErr_Format(PyExc_TypeError,
+                         positions[k] < 0 ? "%.200s has no field %R"
+                                          : "column %R of %.200s is repeated",
+                         type->tp_name, name);
+            Py_DECREF(name);
+            goto error;
+        }
+        if (arrow_import_buffers(child->format) < 0) {
+            PyErr_Format(PyExc_TypeError,
+                         "unsupported Arrow format '%s' of column %R",
+                         child->format, name);
+            Py_DECREF(name);
+            goto error;
+        }
+        Py_DECREF(name);
+        seen[positions[k]] = 1;
+    }
+    for (i = 0; i < n_fields; i++) {
+        if (!seen[i]) {
+            PyErr_Format(PyExc_TypeError, "Arrow array has no column %R",
+                         PyTuple_GET_ITEM(fields, i));
+            goto error;
+        }
+    }
+    PyMem_Free(seen);
+    return positions;
+
+error:
+    PyMem_Free(positions);
+    PyMem_Free(seen);
+    return NULL;
+}
+
+static int
+arrow_is_valid(const unsigned char *validity, int64_t j)
+{
+    return validity == NULL || (validity[j >> 3] >> (j & 7)) & 1;
+}
+
+/* Set field index of records[0:length] from the child array a of a struct
+ * array starting at row start */
+static int
+arrow_import_column(const char *format, struct ArrowArray *a, int64_t start,
+                    PyObject **records, Py_ssize_t length, Py_ssize_t index)
+{
+    const unsigned char *validity = NULL;
+    const char *values = NULL, *data = NULL;
+    int64_t off = start + a->offset;
+    Py_ssize_t i;
+    char f = format[0];
+
+    if (a->release == NULL || a->n_buffers != arrow_import_buffers(format) ||
+        a->length < start + length) {
+        PyErr_Format(PyExc_ValueError, "invalid Arrow '%s' child array",
+                     format);
+        return -1;
+    }
+    if (a->n_buffers > 0 && a->null_count != 0)
+        validity = a->buffers[0];
+    if (a->n_buffers > 1)
+        values = a->buffers[1];
+    if (a->n_buffers > 2)
+        data = a->buffers[2];
+    if (a->n_buffers > 1 && values == NULL && length > 0) {
+        PyErr_Format(PyExc_ValueError, "Arrow '%s' array has no values",
+                     format);
+        return -1;
+    }
+
+    for (i = 0; i < length; i++) {
+        int64_t j = off + i, s, e;
+        PyObject *v, **slot;
+
+        if (f == 'n' || !arrow_is_valid(validity, j)) {
+            v = Py_None;
+            Py_INCREF(v);
+        }
+        else switch (f) {
+        case 'b':
+            v = PyBool_FromLong(arrow_is_valid((const unsigned char *)values, j));
+            break;
+        case 'c': v = PyLong_FromLong(((const int8_t *)values)[j]); break;
+        case 'C': v = PyLong_FromLong(((const uint8_t *)values)[j]); break;
+        case 's': v = PyLong_FromLong(((const int16_t *)values)[j]); break;
+        case 'S': v = PyLong_FromLong(((const uint16_t *)values)[j]); break;
+        case 'i': v = PyLong_FromLong(((const int32_t *)values)[j]); break;
+        case 'I':
+            v = PyLong_FromUnsignedLong(((const uint32_t *)values)[j]);
+            break;
+        case 'l':
+            v = PyLong_FromLongLong(((const int64_t *)values)[j]);
+            break;
+        case 'L':
+            v = PyLong_FromUnsignedLongLong(((const uint64_t *)values)[j]);
+            break;
+        case 'f': v = PyFloat_FromDouble(((const float *)values)[j]); break;
+        case 'g': v = PyFloat_FromDouble(((const double *)values)[j]); break;
+        default:
+            if (f == 'u' || f == 'z') {
+                s = ((const int32_t *)values)[j];
+                e = ((const int32_t *)values)[j + 1];
+            }
+            else {
+                s = ((const int64_t *)values)[j];
+                e = ((const int64_t *)values)[j + 1];
+            }
+            if (e < s || (e > s && data == NULL)) {
+                PyErr_Format(PyExc_ValueError,
+                             "invalid offsets in Arrow '%s' array", format);
+                return -1;
+            }
+            if (f == 'u' || f == 'U')
+                v = PyUnicode_DecodeUTF8(e > s ? data + s : "",
+                                         (Py_ssize_t)(e - s), "strict");
+            else
+                v = PyBytes_FromStringAndSize(e > s ? data + s : "",
+                                              (Py_ssize_t)(e - s));
+        }
+        if (v == NULL)
+            return -1;
+        slot = ((PyTupleObject *)records[i])->ob_item + index;
+        Py_XSETREF(*slot, v);
+    }
+    return 0;
+}
+
+/* Append the records of a struct array to result */
+static int
+arrow_import_batch(PyTypeObject *type, Py_ssize_t n_fields,
+                   Py_ssize_t *positions, struct ArrowSchema *schema,
+                   struct ArrowArray *array, PyObject *result)
+{
+    Py_ssize_t i, start = PyList_GET_SIZE(result), length;
+    int64_t k;
+
+    if (array->release == NULL) {
+        PyErr_SetString(PyExc_ValueError, "Arrow array was released");
+        return -1;
+    }
+    if (array->n_children != schema->n_children || array->length < 0 ||
+        array->length > PY_SSIZE_T_MAX / 2) {
+        PyErr_SetString(PyExc_ValueError,
+                        "Arrow array does not match its schema");
+        return -1;
+    }
+    length = (Py_ssize_t)array->length;
+    if (array->n_buffers > 0 && array->null_count != 0 &&
+        array->buffers[0] != NULL) {
+        for (i = 0; i < length; i++) {
+            if (!arrow_is_valid(array->buffers[0], array->offset + i)) {
+                PyErr_Format(PyExc_ValueError,
+                             "Arrow struct array has a null row %zd", i);
+                return -1;
+            }
+        }
+    }
+
+    for (i = 0; i < length; i++) {
+        PyObject *record = PyMemorySlots_New(type, n_fields);
+
+        if (record == NULL || PyList_Append(result, record) < 0) {
+            Py_XDECREF(record);
+            return -1;
+        }
+        Py_DECREF(record);
+    }
+    for (k = 0; k < schema->n_children; k++) {
+        if (arrow_import_column(schema->children[k]->format,
+                                array->children[k], array->offset,
+                                ((PyListObject *)result)->ob_item + start,
+                                length, positions[k]) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static PyObject *
+arrow_import_fields(memoryslots_state *state, PyTypeObject *type)
+{
+    PyObject *fields;
+
+    if (!PyType_IsSubtype(type, state->memoryslots_type)) {
+        PyErr_Format(PyExc_TypeError, "%.200s is not a record class",
+                     type->tp_name);
+        return NULL;
+    }
+    fields = PyObject_GetAttr((PyObject *)type, state->str_fields);
+    if (fields != NULL && !PyTuple_Check(fields)) {
+        PyErr_Format(PyExc_TypeError, "%.200s._fields must be a tuple",
+                     type->tp_name);
+        Py_CLEAR(fields);
+    }
+    return fields;
+}
+
+PyDoc_STRVAR(arrow_import_doc,
+"_arrow_import(record_type, schema, array) -> list of records\n\n"
+"Records from 'arrow_schema' and 'arrow_array' PyCapsules of a struct\n"
+"array with one column named after every field of record_type.");
+
+static PyObject *
+memoryslots_arrow_import(PyObject *module, PyObject *args)
+{
+    memoryslots_state *state = get_memoryslots_state(module);
+    PyObject *schema_capsule, *array_capsule, *fields, *result;
+    struct ArrowSchema *schema;
+    struct ArrowArray *array;
+    PyTypeObject *type;
+    Py_ssize_t *positions;
+
+    if (!PyArg_ParseTuple(args, "O!OO:_arrow_import", &PyType_Type, &type,
+                          &schema_capsule, &array_capsule))
+        return NULL;
+    schema = PyCapsule_GetPointer(schema_capsule, "arrow_schema");
+    array = schema == NULL ? NULL :
+            PyCapsule_GetPointer(array_capsule, "arrow_array");
+    if (array == NULL)
+        return NULL;
+    fields = arrow_import_fields(state, type);
+    if (fields == NULL)
+        return NULL;
+    positions = arrow_import_positions(type, fields, schema);
+    if (positions == NULL) {
+        Py_DECREF(fields);
+        return NULL;
+    }
+
+    result = PyList_New(0);
+    if (result != NULL &&
+        arrow_import_batch(type, PyTuple_GET_SIZE(fields), positions,
+                           schema, array, result) < 0)
+        Py_CLEAR(result);
+    PyMem_Free(positions);
+    Py_DECREF(fields);
+    return result;
+}
+
+static void
+arrow_stream_error(struct ArrowArrayStream *stream, int code)
+{
+    const char *message = stream->get_last_error(stream);
+
+    PyErr_Format(PyExc_OSError, "Arrow stream failed (%d): %s", code,
+                 message != NULL ? message : strerror(code));
+}
+
+PyDoc_STRVAR(arrow_import_stream_doc,
+"_arrow_import_stream(record_type, stream) -> list of records\n\n"
+"Records from every struct array of an 'arrow_array_stream' PyCapsule.");
+
+static PyObject *
+memoryslots_arrow_import_stream(PyObject *module, PyObject *args)
+{
+    memoryslots_state *state = get_memoryslots_state(module);
+    PyObject *capsule, *fields, *result = NULL;
+    struct ArrowArrayStream *stream;
+    struct ArrowSchema schema;
+    struct ArrowArray array;
+    PyTypeObject *type;
+    Py_ssize_t *positions = NULL;
+    int code;
+
+    if (!PyArg_ParseTuple(args, "O!O:_arrow_import_stream", &PyType_Type,
+                          &type, &capsule))
+        return NULL;
+    stream = PyCapsule_GetPointer(capsule, "arrow_array_stream");
+    if (stream == NULL)
+        return NULL;
+    if (stream->release == NULL) {
+        PyErr_SetString(PyExc_ValueError, "Arrow stream was released");
+        return NULL;
+    }
+    fields = arrow_import_fields(state, type);
+    if (fields == NULL)
+        return NULL;
+
+    memset(&schema, 0, sizeof(schema));
+    code = stream->get_schema(stream, &schema);
+    if (code != 0) {
+        arrow_stream_error(stream, code);
+        goto done;
+    }
+    positions = arrow_import_positions(type, fields, &schema);
+    if (positions == NULL)
+        goto done;
+
+    result = PyList_New(0);
+    while (result != NULL) {
+        memset(&array, 0, sizeof(array));
+        code = stream->get_next(stream, &array);
+        if (code != 0) {
+            arrow_stream_error(stream, code);
+            Py_CLEAR(result);
+            break;
+        }
+        if (array.release == NULL)
+            break;
+        if (arrow_import_batch(type, PyTuple_GET_SIZE(fields), positions,
+                               &schema, &array, result) < 0)
+            Py_CLEAR(result);
+        array.release(&array);
+    }
+
+done:
+    if (schema.release != NULL)
+        schema.release(&schema);
+    PyMem_Free(positions);
+    Py_DECREF(fields);
+    return result;
+}
+
+/*********************** frames **************************/
+
+/* A frame is the size of its payload as a little-endian uint32, followed
+ * by the fields of one record in order: '?' as one byte, 'q' (int64) and
+ * 'd' (double) as 8 little-endian bytes, 'u' (str) and 'z' (bytes) as a
+ * uint32 size and the UTF-8 or raw bytes. */
+
+#define FRAME_HEADER 4
+
+/* The frame codes of the str codes_ob, or NULL with ValueError */
+static const char *
+frame_codes(PyObject *codes_ob, Py_ssize_t *n)
+{
+    const char *codes = PyUnicode_AsUTF8AndSize(codes_ob, n);
+    Py_ssize_t i;
+
+    if (codes == NULL)
+        return NULL;
+    for (i = 0; i < *n; i++) {
+        if (codes[i] == '\0' || strchr("?qduz", codes[i]) == NULL) {
+            PyErr_Format(PyExc_ValueError, "unsupported frame code '%c'",
+                         codes[i]);
+            return NULL;
+        }
+    }
+    return codes;
+}
+
+static uint32_t
+frame_load_u32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+           (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t
+frame_load_u64(const unsigned char *p)
+{
+    return (uint64_t)frame_load_u32(p) | (uint64_t)frame_load_u32(p + 4) << 32;
+}
+
+static void
+frame_store_u32(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static void
+frame_store_u64(unsigned char *p, uint64_t v)
+{
+    frame_store_u32(p, (uint32_t)v);
+    frame_store_u32(p + 4, (uint32_t)(v >> 32));
+}
+
+static int capi_check_size(PyTypeObject *type, Py_ssize_t size);
+
+/* Record of type decoded from the payload p..end */
+static PyObject *
+frame_record(PyTypeObject *type, const char *codes, Py_ssize_t n,
+             const unsigned char *p, const unsigned char *end)
+{
+    PyObject *record, **items;
+    Py_ssize_t i;
+
+    record = PyMemorySlots_New(type, n);
+    if (record == NULL)
+        return NULL;
+    items = ((PyTupleObject *)record)->ob_item;
+
+    for (i = 0; i < n; i++) {
+        PyObject *v;
+        uint64_t bits;
+        uint32_t size;
+        double d;
+
+        switch (codes[i]) {
+        case '?':
+            if (end - p < 1)
+                goto truncated;
+            v = PyBool_FromLong(*p++);
+            break;
+        case 'q':
+            if (end - p < 8)
+                goto truncated;
+            v = PyLong_FromLongLong((long long)frame_load_u64(p));
+            p += 8;
+            break;
+        case 'd':
+            if (end - p < 8)
+                goto truncated;
+            bits = frame_load_u64(p);
+            memcpy(&d, &bits, sizeof(d));
+            v = PyFloat_FromDouble(d);
+            p += 8;
+            break;
+        default:
+            if (end - p < 4)
+                goto truncated;
+            size = frame_load_u32(p);
+            p += 4;
+            if ((uint64_t)(end - p) < size)
+                goto truncated;
+            v = codes[i] == 'u' ?
+                PyUnicode_DecodeUTF8((const char *)p, size, NULL) :
+                PyBytes_FromStringAndSize((const char *)p, size);
+            p += size;
+        }
+        if (v == NULL)
+            goto error;
+        items[i] = v;
+    }
+    if (p != end) {
+        PyErr_Format(PyExc_ValueError,
+                     "corrupt frame: %zd bytes left after the fields of %.200s",
+                     (Py_ssize_t)(end - p), type->tp_name);
+        goto error;
+    }
+    return record;
+
+truncated:
+    PyErr_Format(PyExc_ValueError,
+                 "corrupt frame: field %zd of %.200s runs past the frame",
+                 i, type->tp_name);
+error:
+    Py_DECREF(record);
+    return NULL;
 }
 
-PyDoc_STRVAR(memoryslotsiter_reduce_doc, "D.__reduce__()");
-
+PyDoc_STRVAR(decode_frames_doc,
+"_decode_frames(record_type, codes, data, offset, max_records, max_size)\n"
+"    -> (records, offset)\n\n"
+"Decode the complete frames of the bytes-like data from offset on into a\n"
+"list of records of record_type, whose fields have the frame codes codes.\n"
+"At most max_records frames are decoded, all if it is -1.  Returns the\n"
+"records and the offset of the first frame left undecoded.  Frames with a\n"
+"payload larger than max_size bytes raise ValueError.");
 
 static PyObject *
-memoryslotsiter_setstate(memoryslotsiterobject *it, PyObject *state)
+memoryslots_decode_frames(PyObject *module, PyObject *args)
 {
-    Py_ssize_t index;
-
-#if PY_MAJOR_VERSION >= 3
-    index = PyLong_AsSsize_t(state);
-#else
-    index = PyNumber_AsSsize_t(state, NULL);
-#endif
-    if (index == -1 && PyErr_Occurred())
+    PyTypeObject *type;
+    const char *codes;
+    Py_ssize_t n, offset, max_records, max_size, count = 0;
+    PyObject *codes_ob, *records = NULL, *result = NULL;
+    const unsigned char *p, *end;
+    Py_buffer view;
+
+    if (!PyArg_ParseTuple(args, "O!Uy*nnn:_decode_frames", &PyType_Type,
+                          &type, &codes_ob, &view, &offset, &max_records,
+                          &max_size))
         return NULL;
-    if (it->it_seq != NULL) {
-        if (index < 0)
-            index = 0;
-        else if (index > PyTuple_GET_SIZE(it->it_seq))
-            index = PyTuple_GET_SIZE(it->it_seq); /* exhausted iterator */
-        it->it_index = index;
+    codes = frame_codes(codes_ob, &n);
+    if (codes == NULL || capi_check_size(type, n) < 0)
+        goto done;
+    if (offset < 0 || offset > view.len) {
+        PyErr_SetString(PyExc_ValueError, "offset out of range");
+        goto done;
     }
-    Py_RETURN_NONE;
+    records = PyList_New(0);
+    if (records == NULL)
+        goto done;
+
+    p = (const unsigned char *)view.buf + offset;
+    end = (const unsigned char *)view.buf + view.len;
+    while (count != max_records && end - p >= FRAME_HEADER) {
+        uint32_t size = frame_load_u32(p);
+        PyObject *record;
+        int res;
+
+        if (size > (uint64_t)max_size) {
+            PyErr_Format(PyExc_ValueError,
+                         "frame of %lu bytes is larger than the maximum of "
+                         "%zd", (unsigned long)size, max_size);
+            goto done;
+        }
+        if ((uint64_t)(end - p - FRAME_HEADER) < size)
+            break;
+        record = frame_record(type, codes, n, p + FRAME_HEADER,
+                              p + FRAME_HEADER + size);
+        if (record == NULL)
+            goto done;
+        res = PyList_Append(records, record);
+        Py_DECREF(record);
+        if (res < 0)
+            goto done;
+        p += FRAME_HEADER + size;
+        count++;
+    }
+    result = Py_BuildValue("On", records,
+                           (Py_ssize_t)(p - (const unsigned char *)view.buf));
+
+done:
+    Py_XDECREF(records);
+    PyBuffer_Release(&view);
+    return result;
 }
 
-PyDoc_STRVAR(setstate_doc, "Set state information for unpickling.");
+/* Write a uint32 size and the size bytes of data */
+static int
+frame_write_sized(jsonwriter *w, const void *data, Py_ssize_t size)
+{
+    unsigned char *out;
 
+    if ((uint64_t)size > UINT32_MAX) {
+        PyErr_SetString(PyExc_OverflowError, "value too long for a frame");
+        return -1;
+    }
+    if (jsonwriter_reserve(w, 4 + size) < 0)
+        return -1;
+    out = (unsigned char *)w->data + w->size;
+    frame_store_u32(out, (uint32_t)size);
+    memcpy(out + 4, data, size);
+    w->size += 4 + size;
+    return 0;
+}
 
-static PyMethodDef memoryslotsiter_methods[] = {
-    {"__length_hint__", (PyCFunction)memoryslotsiter_len, METH_NOARGS, length_hint_doc},
-    {"__reduce__",      (PyCFunction)memoryslotsiter_reduce, METH_NOARGS, memoryslotsiter_reduce_doc},
-    {"__setstate__",    (PyCFunction)memoryslotsiter_setstate, METH_O, setstate_doc},
-    {NULL,              NULL}           /* sentinel */
-};
+static int
+frame_write_field(jsonwriter *w, char code, PyObject *v)
+{
+    const char *data;
+    Py_ssize_t size;
+    Py_buffer view;
+    long long q;
+    uint64_t bits;
+    double d;
+    int res;
+
+    switch (code) {
+    case '?':
+        res = PyObject_IsTrue(v);
+        if (res < 0 || jsonwriter_reserve(w, 1) < 0)
+            return -1;
+        w->data[w->size++] = (char)res;
+        return 0;
+    case 'q':
+        q = PyLong_AsLongLong(v);
+        if (q == -1 && PyErr_Occurred())
+            return -1;
+        bits = (uint64_t)q;
+        break;
+    case 'd':
+        d = PyFloat_AsDouble(v);
+        if (d == -1.0 && PyErr_Occurred())
+            return -1;
+        memcpy(&bits, &d, sizeof(bits));
+        break;
+    case 'u':
+        data = PyUnicode_AsUTF8AndSize(v, &size);
+        if (data == NULL)
+            return -1;
+        return frame_write_sized(w, data, size);
+    default:
+        if (PyObject_GetBuffer(v, &view, PyBUF_SIMPLE) < 0)
+            return -1;
+        res = frame_write_sized(w, view.buf, view.len);
+        PyBuffer_Release(&view);
+        return res;
+    }
 
-PyTypeObject PyMemorySlotsIter_Type = {
-    PyVarObject_HEAD_INIT(DEFERRED_ADDRESS(&PyType_Type), 0)
-    "trafaretrecord.memoryslots.memoryslots_iterator",                           /* tp_name */
-    sizeof(memoryslotsiterobject),                    /* tp_basicsize */
-    0,                                          /* tp_itemsize */
-    /* methods */
-    (destructor)memoryslotsiter_dealloc,              /* tp_dealloc */
-    0,                                          /* tp_print */
-    0,                                          /* tp_getattr */
-    0,                                          /* tp_setattr */
-    0,                                          /* tp_reserved */
-    0,                                          /* tp_repr */
-    0,                                          /* tp_as_number */
-    0,                                          /* tp_as_sequence */
-    0,                                          /* tp_as_mapping */
-    0,                                          /* tp_hash */
-    0,                                          /* tp_call */
-    0,                                          /* tp_str */
-    PyObject_GenericGetAttr,                    /* tp_getattro */
-    0,                                          /* tp_setattro */
-    0,                                          /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    /* tp_flags */
-    0,                                          /* tp_doc */
-    (traverseproc)memoryslotsiter_traverse,     /* tp_traverse */
-    (inquiry)memoryslotsiter_clear,             /* tp_clear */
-    0,                                          /* tp_richcompare */
-    0,                                          /* tp_weaklistoffset */
-    PyObject_SelfIter,                          /* tp_iter */
-    (iternextfunc)memoryslotsiter_next,         /* tp_iternext */
-    memoryslotsiter_methods,                    /* tp_methods */
-    0,
-};
+    if (jsonwriter_reserve(w, 8) < 0)
+        return -1;
+    frame_store_u64((unsigned char *)w->data + w->size, bits);
+    w->size += 8;
+    return 0;
+}
+
+PyDoc_STRVAR(encode_frames_doc,
+"_encode_frames(codes, records) -> bytes\n\n"
+"Encode every record of the iterable records as one frame, its fields\n"
+"having the frame codes codes.");
 
 static PyObject *
-memoryslots_iter(PyObject *seq)
+memoryslots_encode_frames(PyObject *module, PyObject *args)
 {
-    memoryslotsiterobject *it;
-
-    it = PyObject_GC_New(memoryslotsiterobject, &PyMemorySlotsIter_Type);
+    memoryslots_state *state = get_memoryslots_state(module);
+    const char *codes;
+    Py_ssize_t n, i, start;
+    PyObject *codes_ob, *records, *it, *record, *result = NULL;
+    jsonwriter w;
+    int res = 0;
+
+    if (!PyArg_ParseTuple(args, "UO:_encode_frames", &codes_ob, &records))
+        return NULL;
+    codes = frame_codes(codes_ob, &n);
+    if (codes == NULL)
+        return NULL;
+    it = PyObject_GetIter(records);
     if (it == NULL)
         return NULL;
-    it->it_index = 0;
-    it->it_seq = (PyTupleObject *)seq;
-    Py_INCREF(seq);
-    PyObject_GC_Track(it);
-    return (PyObject *)it;
+
+    w.allocated = 256;
+    w.size = 0;
+    w.data = PyMem_Malloc(w.allocated);
+    w.default_ = NULL;
+    w.state = state;
+    w.keys_type = NULL;
+    w.keys = NULL;
+    if (w.data == NULL) {
+        Py_DECREF(it);
+        return PyErr_NoMemory();
+    }
+
+    while (res == 0 && (record = PyIter_Next(it)) != NULL) {
+        if (!PyObject_TypeCheck(record, state->memoryslots_type) ||
+            Py_SIZE(record) != n) {
+            PyErr_Format(PyExc_TypeError,
+                         "expected a record of %zd fields, got %.200s",
+                         n, Py_TYPE(record)->tp_name);
+            res = -1;
+        }
+        start = w.size;
+        if (res == 0)
+            res = jsonwriter_reserve(&w, FRAME_HEADER);
+        if (res == 0)
+            w.size += FRAME_HEADER;
+        for (i = 0; res == 0 && i < n; i++) {
+            res = frame_write_field(&w, codes[i],
+                                    PyTuple_GET_ITEM(record, i));
+        }
+        if (res == 0 && (uint64_t)(w.size - start - FRAME_HEADER) > UINT32_MAX) {
+            PyErr_SetString(PyExc_OverflowError, "record too large for a frame");
+            res = -1;
+        }
+        if (res == 0)
+            frame_store_u32((unsigned char *)w.data + start,
+                            (uint32_t)(w.size - start - FRAME_HEADER));
+        Py_DECREF(record);
+    }
+    if (res == 0 && !PyErr_Occurred())
+        result = PyBytes_FromStringAndSize(w.data, w.size);
+    Py_DECREF(it);
+    PyMem_Free(w.data);
+    Py_XDECREF(w.keys_type);
+    Py_XDECREF(w.keys);
+    return result;
 }
 
-struct itemgetset_object {
-  PyObject_HEAD
-  Py_ssize_t i;
-};
+/*********************** C API **************************/
 
-/*static PyTypeObject ItemGetSet_Type;*/
+/* State of the module of a record class, or NULL with TypeError */
+static memoryslots_state *
+capi_check_type(PyTypeObject *type)
+{
+    memoryslots_state *state = memoryslots_state_by_type(type);
 
-static PyMethodDef itemgetset_methods[] = {
-  {0, 0, 0, 0}
-};
+    if (state == NULL) {
+        PyErr_Clear();
+        PyErr_Format(PyExc_TypeError, "expected a memoryslots, got %.200s",
+                     type->tp_name);
+    }
+    return state;
+}
 
-static PyObject* itemgetset_new(PyTypeObject *t, PyObject *args, PyObject *k) {
-    PyObject *ob;
-    PyObject *item;
-    Py_ssize_t i;
+#define capi_check(op) capi_check_type(Py_TYPE(op))
 
-    ob = (PyObject*) PyBaseObject_Type.tp_new(t, PyTuple_New(0), 0);
-    if (ob == NULL)
+static Py_ssize_t capi_field_count(PyTypeObject *type);
+
+/* Check that type is a record class with size fields: records of any
+ * other size would have their descriptors read past their items */
+static int
+capi_check_size(PyTypeObject *type, Py_ssize_t size)
+{
+    memoryslots_state *state = capi_check_type(type);
+    Py_ssize_t n;
+
+    if (state == NULL)
+        return -1;
+    if (!PyType_IsSubtype(type, state->memoryslots_type)) {
+        PyErr_Format(PyExc_TypeError, "expected a memoryslots, got %.200s",
+                     type->tp_name);
+        return -1;
+    }
+    n = capi_field_count(type);
+    if (n < 0)
+        return -1;
+    if (size != n) {
+        PyErr_Format(PyExc_ValueError, "%.200s has %zd fields, not %zd",
+                     type->tp_name, n, size);
+        return -1;
+    }
+    return 0;
+}
+
+/* New record of a record class with one item per field */
+static PyObject *
+capi_new(PyTypeObject *type, Py_ssize_t size)
+{
+    if (capi_check_size(type, size) < 0)
         return NULL;
+    return PyMemorySlots_New(type, size);
+}
 
-    item = PyTuple_GET_ITEM(args, 0);
+static PyObject *
+capi_from_array(PyTypeObject *type, PyObject *const *items, Py_ssize_t size)
+{
+    PyObject *op;
+    Py_ssize_t i;
 
-    i = PyNumber_AsSsize_t(item, PyExc_IndexError);
-    if (i == -1 && PyErr_Occurred()) {
-        Py_DECREF(ob);
+    op = size < 0 ? NULL : capi_new(type, size);
+    if (op == NULL) {
+        if (size < 0)
+            PyErr_BadInternalCall();
+        for (i = 0; i < size; i++) {
+            Py_XDECREF(items[i]);
+        }
         return NULL;
     }
+    memcpy(((PyTupleObject *)op)->ob_item, items, size * sizeof(PyObject *));
+    return op;
+}
 
-    ((struct itemgetset_object*)ob)->i = i;
-    return ob;
+static PyObject *
+capi_get_item(PyObject *op, Py_ssize_t i)
+{
+    if (capi_check(op) == NULL)
+        return NULL;
+    if (i < 0 || i >= Py_SIZE(op)) {
+        PyErr_SetString(PyExc_IndexError, "index out of range");
+        return NULL;
+    }
+    return ((PyTupleObject *)op)->ob_item[i];
 }
 
-static void itemgetset_dealloc(PyObject *o) {
-    PyObject_Del(o);
+static int
+capi_set_item(PyObject *op, Py_ssize_t i, PyObject *value)
+{
+    if (capi_check(op) == NULL)
+        return -1;
+    if (value == NULL) {
+        PyErr_BadInternalCall();
+        return -1;
+    }
+    return memoryslots_ass_item(op, i, value);
 }
 
-static PyObject* itemgetset_get(PyObject *self, PyObject *obj, PyObject *type) {
-    Py_ssize_t i;
-    PyObject *v;
+static PyObject *
+capi_fields(PyTypeObject *type)
+{
+    memoryslots_state *state = capi_check_type(type);
+    PyObject *fields;
 
-    if (obj == NULL || obj == Py_None) {
-        Py_INCREF(self);
-        return self;
+    if (state == NULL)
+        return NULL;
+    fields = PyObject_GetAttr((PyObject *)type, state->str_fields);
+    if (fields != NULL && !PyTuple_Check(fields)) {
+        PyErr_Format(PyExc_TypeError, "%.200s._fields must be a tuple",
+                     type->tp_name);
+        Py_CLEAR(fields);
     }
-    i = ((struct itemgetset_object*)self)->i;
-    v = PyTuple_GET_ITEM(obj, i);
-    Py_INCREF(v);
-    return v;
+    return fields;
 }
 
-static int itemgetset_set(PyObject *self, PyObject *obj, PyObject *value) {
-    Py_ssize_t i;
-    PyObject *v;
+static Py_ssize_t
+capi_field_count(PyTypeObject *type)
+{
+    PyObject *fields = capi_fields(type);
+    Py_ssize_t n;
 
-    if (value == NULL) {
-        PyErr_SetString(PyExc_NotImplementedError, "__delete__");
+    if (fields == NULL)
+        return -1;
+    n = PyTuple_GET_SIZE(fields);
+    Py_DECREF(fields);
+    return n;
+}
+
+static Py_ssize_t
+capi_field_index(PyTypeObject *type, const char *name)
+{
+    PyObject *fields = capi_fields(type);
+    Py_ssize_t i, n;
+
+    if (fields == NULL)
         return -1;
+    n = PyTuple_GET_SIZE(fields);
+    for (i = 0; i < n; i++) {
+        const char *field = PyUnicode_AsUTF8(PyTuple_GET_ITEM(fields, i));
+
+        if (field == NULL) {
+            Py_DECREF(fields);
+            return -1;
+        }
+        if (strcmp(field, name) == 0) {
+            Py_DECREF(fields);
+            return i;
+        }
     }
-    if (obj == NULL || obj == Py_None)
-        return 0;
+    Py_DECREF(fields);
+    PyErr_Format(PyExc_ValueError, "%.200s has no field '%.200s'",
+                 type->tp_name, name);
+    return -1;
+}
 
-    i = ((struct itemgetset_object*)self)->i;
-    v = PyTuple_GET_ITEM(obj, i);
-    Py_XDECREF(v);
-    PyTuple_SET_ITEM(obj, i, value);
-    Py_INCREF(value);
-    return 0;
+static void
+capi_capsule_destructor(PyObject *capsule)
+{
+    PyMem_Free(PyCapsule_GetPointer(capsule, PyMemorySlots_CAPSULE_NAME));
 }
 
-static PyTypeObject ItemGetSet_Type = {
-    PyVarObject_HEAD_INIT(DEFERRED_ADDRESS(&PyType_Type), 0)
-    "trafaretrecord.memoryslots.itemgetset", /*tp_name*/
-    sizeof(struct itemgetset_object), /*tp_basicsize*/
-    0, /*tp_itemsize*/
-    itemgetset_dealloc, /*tp_dealloc*/
-    0, /*tp_print*/
-    0, /*tp_getattr*/
-    0, /*tp_setattr*/
-    0, /*reserved*/
-    0, /*tp_repr*/
-    0, /*tp_as_number*/
-    0, /*tp_as_sequence*/
-    0, /*tp_as_mapping*/
-    0, /*tp_hash*/
-    0, /*tp_call*/
-    0, /*tp_str*/
-    0, /*tp_getattro*/
-    0, /*tp_setattro*/
-    0, /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT|Py_TPFLAGS_BASETYPE, /*tp_flags*/
-    0, /*tp_doc*/
-    0, /*tp_traverse*/
-    0, /*tp_clear*/
-    0, /*tp_richcompare*/
-    0, /*tp_weaklistoffset*/
-    0, /*tp_iter*/
-    0, /*tp_iternext*/
-    itemgetset_methods, /*tp_methods*/
-    0, /*tp_members*/
-    0, /*tp_getset*/
-    0, /*tp_base*/
-    0, /*tp_dict*/
-    itemgetset_get, /*tp_descr_get*/
-    itemgetset_set, /*tp_descr_set*/
-    0, /*tp_dictoffset*/
-    0, /*tp_init*/
-    0, /*tp_alloc*/
-    itemgetset_new, /*tp_new*/
-    0, /*tp_free*/
-    0, /*tp_is_gc*/
-};
+/* The _C_API capsule of the module.  It does not own the memoryslots
+ * type: the type refers to the module, which holds the capsule, and the
+ * cycle would be invisible to the GC.  The type lives as long as the
+ * module state. */
+static PyObject *
+capi_capsule(PyTypeObject *memoryslots_type)
+{
+    PyMemorySlots_CAPI *api = PyMem_Malloc(sizeof(PyMemorySlots_CAPI));
+    PyObject *capsule;
+
+    if (api == NULL)
+        return PyErr_NoMemory();
+    api->version = PyMemorySlots_API_VERSION;
+    api->MemorySlotsType = memoryslots_type;
+    api->New = capi_new;
+    api->FromArray = capi_from_array;
+    api->GetItem = capi_get_item;
+    api->SetItem = capi_set_item;
+    api->FieldCount = capi_field_count;
+    api->FieldIndex = capi_field_index;
+
+    capsule = PyCapsule_New(api, PyMemorySlots_CAPSULE_NAME,
+                            capi_capsule_destructor);
+    if (capsule == NULL) {
+        PyMem_Free(api);
+        return NULL;
+    }
+    return capsule;
+}
 
 /* List of functions defined in the module */
 
 PyDoc_STRVAR(memoryslotsmodule_doc,
 "MemorySlots module provide mutable tuple-like type `memoryslots` and descriptor type `itemgetset`.");
 
-#if PY_MAJOR_VERSION >= 3
 static PyMethodDef memoryslotsmodule_methods[] = {
+  {"_seqlock_write_begin", seqlock_write_begin, METH_VARARGS, seqlock_write_begin_doc},
+  {"_seqlock_write_end", seqlock_write_end, METH_VARARGS, seqlock_write_end_doc},
+  {"_seqlock_read_begin", seqlock_read_begin, METH_VARARGS, seqlock_read_begin_doc},
+  {"_seqlock_read_retry", seqlock_read_retry, METH_VARARGS, seqlock_read_retry_doc},
+  {"sort_by", (PyCFunction)(void(*)(void))memoryslots_sort_by, METH_VARARGS | METH_KEYWORDS, sort_by_doc},
+  {"top_k", memoryslots_top_k, METH_VARARGS, top_k_doc},
+  {"key_by", memoryslots_key_by, METH_VARARGS, key_by_doc},
+  {"_group_aggregate", memoryslots_group_aggregate, METH_VARARGS, group_aggregate_doc},
+  {"_factorize", memoryslots_factorize, METH_O, factorize_doc},
+  {"_extract_column", memoryslots_extract_column, METH_VARARGS, extract_column_doc},
+  {"_watch", memoryslots_watch, METH_VARARGS, watch_doc},
+  {"_arrow_schema", memoryslots_arrow_schema, METH_VARARGS, arrow_schema_doc},
+  {"_arrow_export", memoryslots_arrow_export, METH_VARARGS, arrow_export_doc},
+  {"_arrow_column", memoryslots_arrow_column, METH_VARARGS, arrow_column_doc},
+  {"_arrow_import", memoryslots_arrow_import, METH_VARARGS, arrow_import_doc},
+  {"_arrow_import_stream", memoryslots_arrow_import_stream, METH_VARARGS, arrow_import_stream_doc},
+  {"_decode_frames", memoryslots_decode_frames, METH_VARARGS, decode_frames_doc},
+  {"_encode_frames", memoryslots_encode_frames, METH_VARARGS, encode_frames_doc},
   {0, 0, 0, 0}
 };
 
-static struct PyModuleDef memoryslotsmodule = {
-  #if PY_VERSION_HEX < 0x03020000
-    { PyObject_HEAD_INIT(NULL) NULL, 0, NULL },
-  #else
-    PyModuleDef_HEAD_INIT,
-  #endif
-    "trafaretrecord.memoryslots",
-    memoryslotsmodule_doc,
-    -1,
-    memoryslotsmodule_methods,
-    NULL,
-    NULL,
-    NULL,
-    NULL
-};
-#endif
-
-#if PY_MAJOR_VERSION >= 3
-PyMODINIT_FUNC
-PyInit_memoryslots(void)
+static int
+memoryslots_add_type(PyObject *module, const char *name, PyTypeObject *type)
 {
-    PyObject *m;
-
-    m = PyState_FindModule(&memoryslotsmodule);
-    if (m) {
-        Py_INCREF(m);
-        return m;
+    Py_INCREF(type);
+    if (PyModule_AddObject(module, name, (PyObject *)type) < 0) {
+        Py_DECREF(type);
+        return -1;
     }
+    return 0;
+}
 
-    m = PyModule_Create(&memoryslotsmodule);
-    if (m == NULL)
-        return NULL;
+static int
+memoryslots_exec(PyObject *module)
+{
+    memoryslots_state *state = get_memoryslots_state(module);
+    PyObject *capsule;
+
+    state->memoryslots_type = (PyTypeObject *)PyType_FromModuleAndSpec(
+        module, &memoryslots_spec, NULL);
+    if (state->memoryslots_type == NULL)
+        return -1;
+    if (memoryslots_add_type(module, "memoryslots", state->memoryslots_type) < 0)
+        return -1;
 
-    if (PyType_Ready(&PyMemorySlots_Type) < 0)
-        Py_FatalError("Can't initialize memoryslots type");
+    state->itemgetset_type = (PyTypeObject *)PyType_FromModuleAndSpec(
+        module, &itemgetset_spec, NULL);
+    if (state->itemgetset_type == NULL)
+        return -1;
+    if (memoryslots_add_type(module, "itemgetset", state->itemgetset_type) < 0)
+        return -1;
 
-    Py_INCREF(&PyMemorySlots_Type);
-    PyModule_AddObject(m, "memoryslots", (PyObject *)&PyMemorySlots_Type);
+    state->memoryslotsiter_type = (PyTypeObject *)PyType_FromModuleAndSpec(
+        module, &memoryslotsiter_spec, NULL);
+    if (state->memoryslotsiter_type == NULL)
+        return -1;
+    if (memoryslots_add_type(module, "memoryslotsiter", state->memoryslotsiter_type) < 0)
+        return -1;
 
-    if (PyType_Ready(&ItemGetSet_Type) < 0)
-        Py_FatalError("Can't initialize itemgetset type");
+    state->slotlayout_type = (PyTypeObject *)PyType_FromModuleAndSpec(
+        module, &slotlayout_spec, NULL);
+    if (state->slotlayout_type == NULL)
+        return -1;
+    if (memoryslots_add_type(module, "slotlayout", state->slotlayout_type) < 0)
+        return -1;
 
-    Py_INCREF(&ItemGetSet_Type);
-    PyModule_AddObject(m, "itemgetset", (PyObject *)&ItemGetSet_Type);
+    state->cachedgetset_type = (PyTypeObject *)PyType_FromModuleAndSpec(
+        module, &cachedgetset_spec, NULL);
+    if (state->cachedgetset_type == NULL)
+        return -1;
+    if (memoryslots_add_type(module, "cachedgetset", state->cachedgetset_type) < 0)
+        return -1;
 
-    if (PyType_Ready(&PyMemorySlotsIter_Type) < 0)
-        Py_FatalError("Can't initialize memoryslots iter type");
+    state->predicate_type = (PyTypeObject *)PyType_FromModuleAndSpec(
+        module, &predicate_spec, NULL);
+    if (state->predicate_type == NULL)
+        return -1;
+    if (memoryslots_add_type(module, "predicate", state->predicate_type) < 0)
+        return -1;
 
-    Py_INCREF(&PyMemorySlotsIter_Type);
-    PyModule_AddObject(m, "memoryslotsiter", (PyObject *)&PyMemorySlotsIter_Type);
+    state->embeddedview_type = (PyTypeObject *)PyType_FromModuleAndSpec(
+        module, &embeddedview_spec, NULL);
+    if (state->embeddedview_type == NULL)
+        return -1;
+    if (memoryslots_add_type(module, "embeddedview", state->embeddedview_type) < 0)
+        return -1;
 
+    state->embeddedgetset_type = (PyTypeObject *)PyType_FromModuleAndSpec(
+        module, &embeddedgetset_spec, NULL);
+    if (state->embeddedgetset_type == NULL)
+        return -1;
+    if (memoryslots_add_type(module, "embeddedgetset", state->embeddedgetset_type) < 0)
+        return -1;
 
-    return m;
-}
-#else
-PyMODINIT_FUNC
-initmemoryslots(void)
-{
-    PyObject *m;
+    capsule = capi_capsule(state->memoryslots_type);
+    if (capsule == NULL)
+        return -1;
+    if (PyModule_AddObject(module, "_C_API", capsule) < 0) {
+        Py_DECREF(capsule);
+        return -1;
+    }
 
-    m = Py_InitModule3("recordclass.memoryslots", NULL, memoryslotsmodule_doc);
-    if (m == NULL)
-        return;
-    Py_XINCREF(m);
+    state->str_slotlayout = PyUnicode_InternFromString("__slotlayout__");
+    if (state->str_slotlayout == NULL)
+        return -1;
+    state->str_deepcopy = PyUnicode_InternFromString("__deepcopy__");
+    if (state->str_deepcopy == NULL)
+        return -1;
+    state->str_field_check = PyUnicode_InternFromString("_field_check");
+    if (state->str_field_check == NULL)
+        return -1;
+    state->str_field_changed = PyUnicode_InternFromString("_field_changed");
+    if (state->str_field_changed == NULL)
+        return -1;
+    state->str_json_keys = PyUnicode_InternFromString("_json_keys");
+    if (state->str_json_keys == NULL)
+        return -1;
+    state->str_fields = PyUnicode_InternFromString("_fields");
+    if (state->str_fields == NULL)
+        return -1;
+    state->str_field_types = PyUnicode_InternFromString("_field_types");
+    if (state->str_field_types == NULL)
+        return -1;
+    state->str_values = PyUnicode_InternFromString("_values");
+    if (state->str_values == NULL)
+        return -1;
+    state->str_embedded = PyUnicode_InternFromString("_embedded");
+    if (state->str_embedded == NULL)
+        return -1;
 
-    if (PyType_Ready(&PyMemorySlots_Type) < 0)
-         Py_FatalError("Can't initialize memoryslots type");
+    return 0;
+}
 
-    Py_INCREF(&PyMemorySlots_Type);
-    PyModule_AddObject(m, "memoryslots", (PyObject *)&PyMemorySlots_Type);
+static int
+memoryslotsmodule_traverse(PyObject *module, visitproc visit, void *arg)
+{
+    memoryslots_state *state = get_memoryslots_state(module);
+
+    Py_VISIT(state->memoryslots_type);
+    Py_VISIT(state->memoryslotsiter_type);
+    Py_VISIT(state->itemgetset_type);
+    Py_VISIT(state->slotlayout_type);
+    Py_VISIT(state->cachedgetset_type);
+    Py_VISIT(state->predicate_type);
+    Py_VISIT(state->embeddedview_type);
+    Py_VISIT(state->embeddedgetset_type);
+    Py_VISIT(state->copy_deepcopy);
+    return 0;
+}
 
-    if (PyType_Ready(&ItemGetSet_Type) < 0)
-        Py_FatalError("Can't initialize itemgetset type");
+static int
+memoryslotsmodule_clear(PyObject *module)
+{
+    memoryslots_state *state = get_memoryslots_state(module);
+
+    Py_CLEAR(state->memoryslots_type);
+    Py_CLEAR(state->memoryslotsiter_type);
+    Py_CLEAR(state->itemgetset_type);
+    Py_CLEAR(state->slotlayout_type);
+    Py_CLEAR(state->cachedgetset_type);
+    Py_CLEAR(state->predicate_type);
+    Py_CLEAR(state->embeddedview_type);
+    Py_CLEAR(state->embeddedgetset_type);
+    Py_CLEAR(state->str_slotlayout);
+    Py_CLEAR(state->str_deepcopy);
+    Py_CLEAR(state->str_field_check);
+    Py_CLEAR(state->str_field_changed);
+    Py_CLEAR(state->str_json_keys);
+    Py_CLEAR(state->str_fields);
+    Py_CLEAR(state->str_field_types);
+    Py_CLEAR(state->str_values);
+    Py_CLEAR(state->str_embedded);
+    Py_CLEAR(state->copy_deepcopy);
+    return 0;
+}
 
-    Py_INCREF(&ItemGetSet_Type);
-    PyModule_AddObject(m, "itemgetset", (PyObject *)&ItemGetSet_Type);
+static void
+memoryslotsmodule_free(void *module)
+{
+    memoryslotsmodule_clear((PyObject *)module);
+}
 
-    if (PyType_Ready(&PyMemorySlotsIter_Type) < 0)
-        Py_FatalError("Can't initialize memoryslots iter type");
+static PyModuleDef_Slot memoryslotsmodule_slots[] = {
+    {Py_mod_exec, memoryslots_exec},
+#if PY_VERSION_HEX >= 0x030C0000
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+    {0, NULL}
+};
 
-    Py_INCREF(&PyMemorySlotsIter_Type);
-    PyModule_AddObject(m, "memoryslotsiter", (PyObject *)&PyMemorySlotsIter_Type);
+static struct PyModuleDef memoryslotsmodule = {
+    PyModuleDef_HEAD_INIT,
+    "trafaretrecord.memoryslots",
+    memoryslotsmodule_doc,
+    sizeof(memoryslots_state),
+    memoryslotsmodule_methods,
+    memoryslotsmodule_slots,
+    memoryslotsmodule_traverse,
+    memoryslotsmodule_clear,
+    memoryslotsmodule_free
+};
 
-    return;
+PyMODINIT_FUNC
+PyInit_memoryslots(void)
+{
+    return PyModuleDef_Init(&memoryslotsmodule);
 }
-#endif
@@ -0,0 +1,115 @@
+/* C API of trafaretrecord.memoryslots **************************************
+ *
+ * Extensions that build or read records include this header, after
+ * Python.h, and call PyMemorySlots_ImportAPI() once from their module init:
+ *
+ *     if (PyMemorySlots_ImportAPI() < 0)
+ *         return NULL;
+ *
+ *     n = PyMemorySlots_FieldCount(type);
+ *     price = PyMemorySlots_FieldIndex(type, "price");
+ *     ...
+ *     record = PyMemorySlots_New(type, n);
+ *     PyMemorySlots_INIT_ITEM(record, price, PyFloat_FromDouble(p));
+ *
+ * The include directory is given by trafaretrecord.get_include().
+ *
+ * The API is a table of function pointers published as the capsule
+ * trafaretrecord._C_API.  New entries are only ever appended, with
+ * PyMemorySlots_API_VERSION incremented, so an extension built against this
+ * header works with any later version of the module.
+ */
+
+#ifndef TRAFARETRECORD_MEMORYSLOTS_API_H
+#define TRAFARETRECORD_MEMORYSLOTS_API_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PyMemorySlots_API_VERSION 1
+#define PyMemorySlots_CAPSULE_NAME "trafaretrecord._C_API"
+
+typedef struct {
+    int version;
+
+    /* The memoryslots base type of every record class, borrowed from the
+     * trafaretrecord.memoryslots module: it stays valid while the module
+     * is loaded, that is for the life of the interpreter unless the module
+     * is removed from sys.modules */
+    PyTypeObject *MemorySlotsType;
+
+    /* New record of the record class type with its size fields, all NULL:
+     * every field must be set with PyMemorySlots_INIT_ITEM() before the
+     * record is used.  TypeError if type is not a record class, ValueError
+     * if size is not its number of fields */
+    PyObject *(*New)(PyTypeObject *type, Py_ssize_t size);
+
+    /* New record of type with the size fields items, stealing the
+     * references to them, also on failure; checked as New() */
+    PyObject *(*FromArray)(PyTypeObject *type, PyObject *const *items,
+                           Py_ssize_t size);
+
+    /* Borrowed reference to field i of record op, or NULL with IndexError */
+    PyObject *(*GetItem)(PyObject *op, Py_ssize_t i);
+
+    /* Set field i of record op to value, as op[i] = value does: indexes,
+     * computed fields and dirty flags are updated */
+    int (*SetItem)(PyObject *op, Py_ssize_t i, PyObject *value);
+
+    /* Number of fields of a record class, or -1 with an exception */
+    Py_ssize_t (*FieldCount)(PyTypeObject *type);
+
+    /* Index of the field name of a record class, or -1 with ValueError */
+    Py_ssize_t (*FieldIndex)(PyTypeObject *type, const char *name);
+} PyMemorySlots_CAPI;
+
+/* Field access without checks, for records made by this extension or
+ * checked with PyMemorySlots_Check().  INIT_ITEM steals the reference to v
+ * and does not release the previous value, like PyTuple_SET_ITEM(). */
+#define PyMemorySlots_GET_ITEM(op, i) (((PyTupleObject *)(op))->ob_item[i])
+#define PyMemorySlots_INIT_ITEM(op, i, v) \
+    (((PyTupleObject *)(op))->ob_item[i] = (v))
+
+#ifndef MEMORYSLOTS_MODULE
+
+static PyMemorySlots_CAPI *PyMemorySlotsAPI = NULL;
+
+static inline int
+PyMemorySlots_ImportAPI(void)
+{
+    PyMemorySlots_CAPI *api;
+
+    api = (PyMemorySlots_CAPI *)PyCapsule_Import(PyMemorySlots_CAPSULE_NAME, 0);
+    if (api == NULL)
+        return -1;
+    if (api->version < PyMemorySlots_API_VERSION) {
+        PyErr_Format(PyExc_ImportError,
+                     "trafaretrecord.memoryslots C API version %d is older "
+                     "than version %d this extension was built with",
+                     api->version, PyMemorySlots_API_VERSION);
+        return -1;
+    }
+    PyMemorySlotsAPI = api;
+    return 0;
+}
+
+#define PyMemorySlots_Check(op) \
+    PyObject_TypeCheck(op, PyMemorySlotsAPI->MemorySlotsType)
+#define PyMemorySlots_New(type, size) PyMemorySlotsAPI->New(type, size)
+#define PyMemorySlots_FromArray(type, items, size) \
+    PyMemorySlotsAPI->FromArray(type, items, size)
+#define PyMemorySlots_GetItem(op, i) PyMemorySlotsAPI->GetItem(op, i)
+#define PyMemorySlots_SetItem(op, i, value) \
+    PyMemorySlotsAPI->SetItem(op, i, value)
+#define PyMemorySlots_FieldCount(type) PyMemorySlotsAPI->FieldCount(type)
+#define PyMemorySlots_FieldIndex(type, name) \
+    PyMemorySlotsAPI->FieldIndex(type, name)
+
+#endif  /* !MEMORYSLOTS_MODULE */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* !TRAFARETRECORD_MEMORYSLOTS_API_H */
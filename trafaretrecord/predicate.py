@@ -0,0 +1,63 @@
+from itertools import compress
+
+from .memoryslots import predicate
+
+
+class RecordFilter(object):
+    """
+    Predicate over the fields of ``record_type``, as returned by
+    ``record_type.where()``.
+
+    Calling the filter with a sequence of records, or with a
+    ``SharedRecordArray``, returns the matching records; ``mask()`` and
+    ``indices()`` return the selection itself. The predicate is evaluated
+    over the whole collection at once, one typed column per compared field.
+    """
+
+    __slots__ = ('record_type', 'predicate')
+
+    def __init__(self, record_type, predicate_):
+        if not isinstance(predicate_, predicate):
+            raise TypeError('where() expects a predicate built from fields '
+                            'of %s, like %s.%s > 0, not %r' % (
+                                record_type.__name__, record_type.__name__,
+                                record_type._fields[0] if record_type._fields
+                                else 'field', predicate_))
+        for index, descriptor in zip(predicate_.fields,
+                                     predicate_.descriptors):
+            if index >= len(record_type._fields) or getattr(
+                    record_type, record_type._fields[index]) is not descriptor:
+                raise TypeError('The predicate compares a field that is not '
+                                'a field of %s: %r' % (record_type.__name__,
+                                                       predicate_))
+        self.record_type = record_type
+        self.predicate = predicate_
+
+    def __repr__(self):
+        return '%s(%s, %r)' % (self.__class__.__name__,
+                               self.record_type.__name__, self.predicate)
+
+    def mask(self, source):
+        'Return a bytearray with 1 for every record that matches'
+        if hasattr(source, 'column') and hasattr(source, 'record_type'):
+            if not issubclass(source.record_type, self.record_type):
+                raise TypeError('Expected an array of %s, got %s' % (
+                    self.record_type.__name__, source.record_type.__name__))
+            fields = set(self.predicate.fields)
+            return self.predicate._mask_columns([
+                source.column(name) if index in fields else None
+                for index, name in enumerate(self.record_type._fields)
+            ])
+        return self.predicate._mask(source, self.record_type)
+
+    def indices(self, source):
+        'Return the positions of the matching records'
+        mask = self.mask(source)
+        return list(compress(range(len(mask)), mask))
+
+    def __call__(self, source):
+        'Return the list of the matching records'
+        if not isinstance(source, (list, tuple)) and not hasattr(
+                source, 'column'):
+            source = list(source)
+        return list(compress(source, self.mask(source)))
@@ -0,0 +1,104 @@
+from collections import namedtuple
+
+from .memoryslots import itemgetset
+
+FieldCounts = namedtuple('FieldCounts', 'name reads writes')
+
+
+def _descriptors(record_type):
+    'The itemgetset descriptor of every field of ``record_type``'
+    descriptors = []
+    for name in record_type._fields:
+        for klass in record_type.__mro__:
+            descriptor = klass.__dict__.get(name)
+            if descriptor is not None:
+                break
+        if not isinstance(descriptor, itemgetset):
+            raise TypeError('Field %r of %s is not an itemgetset' % (
+                name, record_type.__name__))
+        descriptors.append(descriptor)
+    return descriptors
+
+
+class FieldProfiler(object):
+    """
+    Count the reads and writes of every field of ``record_types`` made
+    through attribute access::
+
+        >>> with FieldProfiler(Trade) as profiler:
+        ...     run_workload()
+        >>> profiler.report()[Trade]
+        [FieldCounts(name='price', reads=90211, writes=0), ...]
+
+    With ``period`` above 1 only one in ``period`` accesses of a field is
+    counted, and the counts are estimated from the sample. The counts are
+    kept by the field descriptors, so they include the accesses through
+    subclasses that do not redeclare the fields. Indexing and iteration
+    are not counted.
+    """
+
+    def __init__(self, *record_types, period=1):
+        if period < 1:
+            raise ValueError('period must be >= 1')
+        self.record_types = record_types
+        self.period = period
+        self._descriptors = {record_type: _descriptors(record_type)
+                             for record_type in record_types}
+        self._counts = {record_type: [FieldCounts(name, 0, 0)
+                                      for name in record_type._fields]
+                        for record_type in record_types}
+
+    def start(self):
+        'Reset the counts and start counting'
+        for descriptors in self._descriptors.values():
+            for descriptor in descriptors:
+                descriptor.profile(self.period)
+
+    def stop(self):
+        'Stop counting, the counts stay available until the next start()'
+        self._counts = {record_type: self.counts(record_type)
+                        for record_type in self.record_types}
+        for descriptors in self._descriptors.values():
+            for descriptor in descriptors:
+                descriptor.profile(0)
+
+    def __enter__(self):
+        self.start()
+        return self
+
+    def __exit__(self, *exc_info):
+        self.stop()
+
+    def counts(self, record_type):
+        'Return the counts of the fields of ``record_type`` in field order'
+        if not any(d.profiled for d in self._descriptors[record_type]):
+            return self._counts[record_type]
+        return [FieldCounts(name, *descriptor.counts)
+                for name, descriptor in zip(record_type._fields,
+                                            self._descriptors[record_type])]
+
+    def report(self):
+        """
+        Return a dict mapping every record type to the counts of its
+        fields, the most accessed fields first
+        """
+        return {record_type: sorted(self.counts(record_type),
+                                    key=lambda c: c.reads + c.writes,
+                                    reverse=True)
+                for record_type in self.record_types}
+
+    def hot_fields(self, record_type, share=0.9):
+        """
+        Return the names of the fewest fields of ``record_type`` that take
+        ``share`` of its field accesses, the most accessed first
+        """
+        counts = self.report()[record_type]
+        total = sum(c.reads + c.writes for c in counts)
+        hot = []
+        seen = 0
+        for c in counts:
+            if seen >= share * total:
+                break
+            hot.append(c.name)
+            seen += c.reads + c.writes
+        return tuple(hot)
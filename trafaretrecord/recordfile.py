@@ -0,0 +1,257 @@
+import mmap
+import struct
+import zlib
+
+from .schema import FIXED_WIDTH_CODES, RecordSchema
+
+_MAGIC = b'TRRECFIL'
+_FORMAT_VERSION = 1
+# magic, format version, schema size, row size, then the state that
+# changes on append: row count, row capacity, heap offset, heap size,
+# rows crc32, heap crc32
+_HEADER = struct.Struct('<8sIII4xQQQQII')
+_STATE = struct.Struct('<QQQQII')
+_STATE_OFFSET = _HEADER.size - _STATE.size
+_ALIGNMENT = 64
+
+# str and bytes values live in the string heap, rows hold their offsets
+_HEAP_TYPES = (str, bytes)
+FILE_CODES = dict(FIXED_WIDTH_CODES)
+FILE_CODES.update((heap_type, 'Q') for heap_type in _HEAP_TYPES)
+
+_HEAP_LENGTH = struct.Struct('<I')
+
+
+def _align(size):
+    return (size + _ALIGNMENT - 1) // _ALIGNMENT * _ALIGNMENT
+
+
+class RecordFile(object):
+    """
+    Memory-mapped file of typed records.
+
+    The file holds a header, the record schema, a region of fixed-width
+    rows and a heap with the ``str``/``bytes`` field values. Opening a file
+    only maps it and reads the header, so it takes the same time for any
+    table size; rows are decoded into record instances when they are
+    accessed.
+
+    The header keeps CRC-32 checksums of the rows and of the heap, updated
+    on every append and checked on demand by ``verify()``.
+    """
+
+    def __init__(self, fileobj, record_type, writable):
+        self.record_type = record_type
+        self.schema = schema = RecordSchema(record_type, FILE_CODES)
+        self._file = fileobj
+        self._writable = writable
+        self._struct = struct.Struct('<' + schema.codes)
+        self._heap_columns = tuple(
+            index for index, column in enumerate(schema.columns)
+            if column.type in _HEAP_TYPES
+        )
+        self._map()
+
+        header = _HEADER.unpack_from(self._mmap, 0)
+        magic, version, schema_size, row_size = header[:4]
+        if magic != _MAGIC:
+            raise ValueError('%r is not a record file' % fileobj.name)
+        if version != _FORMAT_VERSION:
+            raise ValueError('Unsupported record file version %d' % version)
+        if row_size != self._struct.size:
+            raise ValueError('Row size %d does not match %s' % (
+                row_size, record_type.__name__))
+        schema.check(self._mmap[_HEADER.size:_HEADER.size + schema_size])
+
+        (self._length, self._capacity, self._heap_offset, self._heap_size,
+         self._rows_crc, self._heap_crc) = header[4:]
+        self._rows_offset = _align(_HEADER.size + schema_size)
+
+    @classmethod
+    def create(cls, path, record_type, capacity=1024):
+        'Create an empty record file with room for ``capacity`` rows'
+        schema = RecordSchema(record_type, FILE_CODES)
+        schema_data = schema.dumps()
+        row_size = struct.calcsize('<' + schema.codes)
+        heap_offset = _align(_align(_HEADER.size + len(schema_data)) +
+                             row_size * capacity)
+
+        with open(path, 'xb') as f:
+            f.write(_HEADER.pack(_MAGIC, _FORMAT_VERSION, len(schema_data),
+                                 row_size, 0, capacity, heap_offset, 0,
+                                 0, 0))
+            f.write(schema_data)
+            f.truncate(heap_offset)
+        return cls.open(path, record_type, writable=True)
+
+    @classmethod
+    def open(cls, path, record_type, writable=False):
+        'Map an existing record file'
+        fileobj = open(path, 'r+b' if writable else 'rb')
+        try:
+            return cls(fileobj, record_type, writable)
+        except BaseException:
+            fileobj.close()
+            raise
+
+    def _map(self):
+        access = mmap.ACCESS_WRITE if self._writable else mmap.ACCESS_READ
+        self._mmap = mmap.mmap(self._file.fileno(), 0, access=access)
+
+    def _write_state(self):
+        _STATE.pack_into(self._mmap, _STATE_OFFSET, self._length,
+                         self._capacity, self._heap_offset, self._heap_size,
+                         self._rows_crc, self._heap_crc)
+
+    def __len__(self):
+        return self._length
+
+    def _decode(self, index):
+        values = self._struct.unpack_from(
+            self._mmap, self._rows_offset + index * self._struct.size)
+        if not self._heap_columns:
+            return self.record_type._make(values)
+
+        values = list(values)
+        mm = self._mmap
+        for column in self._heap_columns:
+            offset = self._heap_offset + values[column]
+            size, = _HEAP_LENGTH.unpack_from(mm, offset)
+            value = mm[offset + _HEAP_LENGTH.size:
+                       offset + _HEAP_LENGTH.size + size]
+            if self.schema.columns[column].type is str:
+                value = value.decode('utf-8')
+            values[column] = value
+        return self.record_type._make(values)
+
+    def __getitem__(self, index):
+        if index < 0:
+            index += self._length
+        if not 0 <= index < self._length:
+            raise IndexError('record file index out of range')
+        return self._decode(index)
+
+    def __iter__(self):
+        for index in range(self._length):
+            yield self._decode(index)
+
+    def _remap(self, size):
+        'Resize the file to at least ``size`` bytes and map it again'
+        if size <= len(self._mmap):
+            return
+        # raises BufferError while views of the map are exported, before
+        # anything changed
+        self._mmap.close()
+        try:
+            self._file.truncate(size)
+        finally:
+            self._map()
+
+    def _grow(self, length, heap_size):
+        """
+        Make room for ``length`` rows and a heap of ``heap_size`` bytes.
+
+        When the rows outgrow their capacity the heap moves past its current
+        end, so that the header keeps describing a complete file at every
+        step: the heap is copied and flushed, then the header is switched to
+        the copy and flushed, and only then may new rows overwrite the old
+        heap.
+        """
+        if length <= self._capacity:
+            # leave room for the heap to grow as much again
+            if self._heap_offset + heap_size > len(self._mmap):
+                self._remap(self._heap_offset + 2 * heap_size)
+            return
+
+        capacity = max(length, 2 * self._capacity)
+        heap_offset = _align(max(self._rows_offset +
+                                 self._struct.size * capacity,
+                                 self._heap_offset + self._heap_size))
+        if heap_offset + heap_size > len(self._mmap):
+            self._remap(heap_offset + 2 * heap_size)
+
+        self._mmap[heap_offset:heap_offset + self._heap_size] = \
+            self._mmap[self._heap_offset:self._heap_offset + self._heap_size]
+        self._mmap.flush()
+        self._capacity = capacity
+        self._heap_offset = heap_offset
+        self._write_state()
+        self._mmap.flush()
+
+    def extend(self, records):
+        'Append ``records`` and update the header and checksums'
+        if not self._writable:
+            raise OSError('record file is opened read-only')
+
+        rows = []
+        heap = []
+        heap_size = self._heap_size
+        for record in records:
+            values = list(record)
+            for column in self._heap_columns:
+                value = values[column]
+                if isinstance(value, str):
+                    value = value.encode('utf-8')
+                heap.append(_HEAP_LENGTH.pack(len(value)))
+                heap.append(value)
+                values[column] = heap_size
+                heap_size += _HEAP_LENGTH.size + len(value)
+            rows.append(self._struct.pack(*values))
+        if not rows:
+            return
+
+        rows = b''.join(rows)
+        heap = b''.join(heap)
+        length = self._length + len(rows) // self._struct.size
+        self._grow(length, heap_size)
+
+        # rows and heap first, past the end the header describes, then the
+        # header that makes them part of the file
+        start = self._rows_offset + self._length * self._struct.size
+        self._mmap[start:start + len(rows)] = rows
+        start = self._heap_offset + self._heap_size
+        self._mmap[start:start + len(heap)] = heap
+
+        self._rows_crc = zlib.crc32(rows, self._rows_crc)
+        self._heap_crc = zlib.crc32(heap, self._heap_crc)
+        self._length = length
+        self._heap_size = heap_size
+        self._write_state()
+
+    def append(self, record):
+        'Append a single record'
+        self.extend((record,))
+
+    def verify(self):
+        'Recompute the checksums of rows and heap, raise ValueError if wrong'
+        mm = self._mmap
+        rows = mm[self._rows_offset:
+                  self._rows_offset + self._length * self._struct.size]
+        heap = mm[self._heap_offset:self._heap_offset + self._heap_size]
+        if zlib.crc32(rows) != self._rows_crc:
+            raise ValueError('record file rows are corrupted')
+        if zlib.crc32(heap) != self._heap_crc:
+            raise ValueError('record file heap is corrupted')
+
+    def flush(self):
+        'Write changes through to the file'
+        if self._writable:
+            self._mmap.flush()
+
+    def __repr__(self):
+        return '%s(%r, %s, length=%d)' % (
+            self.__class__.__name__, self._file.name,
+            self.record_type.__name__, self._length)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc_info):
+        self.close()
+
+    def close(self):
+        if self._file.closed:
+            return
+        self.flush()
+        self._mmap.close()
+        self._file.close()
@@ -0,0 +1,76 @@
+import json
+import struct
+from collections import namedtuple
+
+# array/struct type codes of field types with a fixed-width binary form
+FIXED_WIDTH_CODES = {
+    bool: '?',
+    int: 'q',
+    float: 'd',
+}
+
+ColumnSpec = namedtuple('ColumnSpec', 'name type code itemsize')
+
+
+class RecordSchema(object):
+    """Column layout of a typed record class.
+
+    Every field of ``record_type`` becomes one column; the column type is
+    taken from ``_field_types``, so only classes declared with
+    ``TrafaretRecord`` (or with ``_field_types`` set by hand) have a schema.
+    """
+
+    __slots__ = ('record_type', 'columns', 'codes')
+
+    def __init__(self, record_type, codes=FIXED_WIDTH_CODES):
+        field_types = getattr(record_type, '_field_types', None)
+        if field_types is None:
+            raise TypeError('%s has no _field_types, declare it as '
+                            'a TrafaretRecord' % record_type.__name__)
+
+        columns = []
+        for name in record_type._fields:
+            field_type = field_types[name]
+            code = codes.get(field_type)
+            if code is None:
+                raise TypeError(
+                    'Field %r of %s has no fixed-width layout: %r' % (
+                        name, record_type.__name__, field_type)
+                )
+            columns.append(ColumnSpec(name, field_type, code,
+                                      struct.calcsize(code)))
+
+        self.record_type = record_type
+        self.columns = tuple(columns)
+        self.codes = ''.join(column.code for column in columns)
+
+    def __len__(self):
+        return len(self.columns)
+
+    def __iter__(self):
+        return iter(self.columns)
+
+    def __repr__(self):
+        return '%s(%s)' % (self.__class__.__name__,
+                           self.record_type.__name__)
+
+    def describe(self):
+        'Return the schema as a list of (field name, type, type code)'
+        return [[column.name, column.type.__name__, column.code]
+                for column in self.columns]
+
+    def dumps(self):
+        'Serialize the schema description to UTF-8 JSON bytes'
+        return json.dumps(self.describe()).encode('utf-8')
+
+    def check(self, data):
+        """
+        Raise ValueError unless the serialized schema ``data`` (as returned
+        by ``dumps()``) describes the same columns as this schema
+        """
+        described = json.loads(bytes(data).decode('utf-8'))
+        if described != self.describe():
+            raise ValueError(
+                'Stored schema %r does not match %s %r' % (
+                    described, self.record_type.__name__, self.describe())
+            )
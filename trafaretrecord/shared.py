@@ -0,0 +1,243 @@
+import struct
+from multiprocessing import shared_memory
+
+from .memoryslots import (_seqlock_read_begin, _seqlock_read_retry,
+                          _seqlock_write_begin, _seqlock_write_end)
+from .schema import RecordSchema
+
+_MAGIC = b'TRRECARR'
+# magic, flags, schema size, number of records
+_HEADER = struct.Struct('<8sIIQ')
+_VERSIONED = 1
+_ALIGNMENT = 64
+# seconds to wait for a row held by a writer before giving up on it
+_LOCK_TIMEOUT = 10.0
+
+
+def _align(size):
+    return (size + _ALIGNMENT - 1) // _ALIGNMENT * _ALIGNMENT
+
+
+def _layout(schema_size, columns, length, versioned):
+    """
+    Return (versions offset, column offsets, total size) of an array block.
+    Every column starts on a cache line boundary.
+    """
+    offset = _align(_HEADER.size + schema_size)
+    versions_offset = None
+    if versioned:
+        versions_offset = offset
+        offset = _align(offset + 8 * length)
+    offsets = []
+    for column in columns:
+        offsets.append(offset)
+        offset = _align(offset + column.itemsize * length)
+    return versions_offset, offsets, max(offset, 1)
+
+
+def _open_shared_memory(name):
+    try:
+        # attached blocks belong to their creator, do not unlink them at exit
+        return shared_memory.SharedMemory(name=name, track=False)
+    except TypeError:  # Python < 3.13
+        return shared_memory.SharedMemory(name=name)
+
+
+class SharedRecordArray(object):
+    """
+    Fixed-length array of typed records stored column by column in a
+    ``multiprocessing.shared_memory`` block.
+
+    The block starts with a header describing the record schema, so other
+    processes can attach to it by name, or simply unpickle the array, and
+    read the same memory without copying. Columns are exposed as typed
+    memoryviews by ``column()``.
+
+    With ``versioned=True`` every row gets a seqlock counter: writers of a
+    row are serialized, and readers retry until they see a row that was not
+    modified while they were reading it. A row that stays locked for more
+    than ``lock_timeout`` seconds, as when its writer process died in the
+    middle of a write, raises ``TimeoutError``; ``None`` waits forever.
+    """
+
+    def __init__(self, shm, record_type, lock_timeout=_LOCK_TIMEOUT):
+        self.record_type = record_type
+        self.lock_timeout = lock_timeout
+        self.schema = schema = RecordSchema(record_type)
+        self._shm = shm
+        self._closed = False
+
+        buf = shm.buf
+        magic, flags, schema_size, length = _HEADER.unpack_from(buf, 0)
+        if magic != _MAGIC:
+            raise ValueError('Shared memory block %r does not hold '
+                             'a record array' % shm.name)
+        schema.check(bytes(buf[_HEADER.size:_HEADER.size + schema_size]))
+
+        self._length = length
+        versions_offset, offsets, size = _layout(
+            schema_size, schema.columns, length, flags & _VERSIONED)
+        if size > shm.size:
+            raise ValueError('Shared memory block %r is truncated' % shm.name)
+
+        self._versions = None
+        if versions_offset is not None:
+            self._versions = buf[versions_offset:
+                                 versions_offset + 8 * length].cast('Q')
+        self._columns = tuple(
+            buf[offset:offset + column.itemsize * length].cast(column.code)
+            for column, offset in zip(schema.columns, offsets)
+        )
+
+    @classmethod
+    def create(cls, record_type, length, name=None, versioned=False,
+               lock_timeout=_LOCK_TIMEOUT):
+        'Allocate a new shared block for ``length`` zero-filled records'
+        schema = RecordSchema(record_type)
+        schema_data = schema.dumps()
+        size = _layout(len(schema_data), schema.columns, length,
+                       versioned)[2]
+
+        shm = shared_memory.SharedMemory(name=name, create=True, size=size)
+        try:
+            flags = _VERSIONED if versioned else 0
+            _HEADER.pack_into(shm.buf, 0, _MAGIC, flags, len(schema_data),
+                              length)
+            shm.buf[_HEADER.size:_HEADER.size + len(schema_data)] = \
+                schema_data
+            return cls(shm, record_type, lock_timeout)
+        except BaseException:
+            shm.close()
+            shm.unlink()
+            raise
+
+    @classmethod
+    def from_records(cls, record_type, records, name=None, versioned=False,
+                     lock_timeout=_LOCK_TIMEOUT):
+        'Allocate a new shared block and copy ``records`` into it'
+        records = list(records)
+        result = cls.create(record_type, len(records), name=name,
+                            versioned=versioned, lock_timeout=lock_timeout)
+        for column, values in zip(result._columns, zip(*records)):
+            for index, value in enumerate(values):
+                column[index] = value
+        return result
+
+    @classmethod
+    def attach(cls, name, record_type, lock_timeout=_LOCK_TIMEOUT):
+        'Attach to the array created in another process under ``name``'
+        shm = _open_shared_memory(name)
+        try:
+            return cls(shm, record_type, lock_timeout)
+        except BaseException:
+            shm.close()
+            raise
+
+    @property
+    def name(self):
+        return self._shm.name
+
+    @property
+    def versioned(self):
+        return self._versions is not None
+
+    def column(self, name):
+        'Return a zero-copy typed memoryview over the values of field ``name``'
+        return self._columns[self.record_type._fields.index(name)]
+
+    def _check_index(self, index):
+        if index < 0:
+            index += self._length
+        if not 0 <= index < self._length:
+            raise IndexError('record array index out of range')
+        return index
+
+    def _timeout(self):
+        return -1.0 if self.lock_timeout is None else self.lock_timeout
+
+    def __len__(self):
+        return self._length
+
+    def __getitem__(self, index):
+        index = self._check_index(index)
+        columns = self._columns
+        versions = self._versions
+        if versions is None:
+            return self.record_type._make([column[index]
+                                           for column in columns])
+        timeout = self._timeout()
+        while True:
+            version = _seqlock_read_begin(versions, index, timeout)
+            values = [column[index] for column in columns]
+            if not _seqlock_read_retry(versions, index, version):
+                return self.record_type._make(values)
+
+    def _convert(self, values):
+        """
+        Return ``values`` converted to the column types, raising the errors
+        of the column memoryviews, so that a row is written whole or not
+        at all.
+        """
+        converted = []
+        for column, value in zip(self.schema.columns, values):
+            scratch = memoryview(bytearray(column.itemsize)).cast(column.code)
+            scratch[0] = value
+            converted.append(scratch[0])
+        return converted
+
+    def __setitem__(self, index, record):
+        index = self._check_index(index)
+        values = tuple(record)
+        if len(values) != len(self._columns):
+            raise TypeError('Expected %d values, got %d' % (
+                len(self._columns), len(values)))
+        values = self._convert(values)
+        versions = self._versions
+        if versions is not None:
+            _seqlock_write_begin(versions, index, self._timeout())
+        try:
+            for column, value in zip(self._columns, values):
+                column[index] = value
+        finally:
+            if versions is not None:
+                _seqlock_write_end(versions, index)
+
+    def __iter__(self):
+        for index in range(self._length):
+            yield self[index]
+
+    def __reduce__(self):
+        'Pickle as a reference to the shared block, not as a copy'
+        return self.__class__.attach, (self.name, self.record_type,
+                                       self.lock_timeout)
+
+    def __repr__(self):
+        return '%s(%s, name=%r, length=%d)' % (
+            self.__class__.__name__, self.record_type.__name__,
+            self.name, self._length)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc_info):
+        self.close()
+
+    def close(self):
+        """
+        Release the views over the block and detach from it. Memoryviews
+        returned by ``column()`` are invalidated.
+        """
+        if self._closed:
+            return
+        for column in self._columns:
+            column.release()
+        if self._versions is not None:
+            self._versions.release()
+        self._columns = ()
+        self._versions = None
+        self._shm.close()
+        self._closed = True
+
+    def unlink(self):
+        'Destroy the underlying block once every process has closed it'
+        self._shm.unlink()
@@ -0,0 +1,327 @@
+import weakref
+from bisect import bisect_left, bisect_right
+from collections.abc import Mapping
+from types import MappingProxyType
+
+from .memoryslots import _watch
+
+
+class _UniqueIndex(object):
+    'Hash index mapping every key to the single record that has it'
+
+    __slots__ = ('name', 'position', 'entries')
+
+    def __init__(self, name, position):
+        self.name = name
+        self.position = position
+        self.entries = {}
+
+    def check(self, record, key):
+        other = self.entries.get(key, record)
+        if other is not record:
+            raise ValueError('Duplicate %s=%r, already held by %r' % (
+                self.name, key, other))
+
+    def add(self, record, key):
+        self.entries[key] = record
+
+    def remove(self, record, key):
+        del self.entries[key]
+
+    def find(self, key):
+        record = self.entries.get(key)
+        return [] if record is None else [record]
+
+
+class _HashIndex(object):
+    'Hash index mapping every key to the list of records that have it'
+
+    __slots__ = ('name', 'position', 'entries')
+
+    def __init__(self, name, position):
+        self.name = name
+        self.position = position
+        self.entries = {}
+
+    def check(self, record, key):
+        hash(key)
+
+    def add(self, record, key):
+        records = self.entries.get(key)
+        if records is None:
+            self.entries[key] = [record]
+        else:
+            records.append(record)
+
+    def remove(self, record, key):
+        records = self.entries[key]
+        if len(records) == 1:
+            del self.entries[key]
+            return
+        for i, other in enumerate(records):
+            if other is record:
+                del records[i]
+                break
+
+    def find(self, key):
+        return list(self.entries.get(key, ()))
+
+
+class _HashIndexView(Mapping):
+    'Read-only view of a hash index, giving copies of its lists of records'
+
+    __slots__ = ('_entries',)
+
+    def __init__(self, entries):
+        self._entries = entries
+
+    def __getitem__(self, key):
+        return list(self._entries[key])
+
+    def __contains__(self, key):
+        return key in self._entries
+
+    def __iter__(self):
+        return iter(self._entries)
+
+    def __len__(self):
+        return len(self._entries)
+
+
+class _SortedIndex(object):
+    """
+    Keys in sorted order, with the records in the same order; records with
+    equal keys stay in the order they were added. Keys that are not equal
+    to themselves, such as NaN, cannot be ordered: their records are kept
+    apart and come after all the others
+    """
+
+    __slots__ = ('name', 'position', 'keys', 'records', 'unordered')
+
+    def __init__(self, name, position):
+        self.name = name
+        self.position = position
+        self.keys = []
+        self.records = []
+        self.unordered = []
+
+    def check(self, record, key):
+        # fails early on keys that do not compare with the indexed ones
+        if key == key:
+            bisect_right(self.keys, key)
+
+    def add(self, record, key):
+        if key != key:
+            self.unordered.append(record)
+            return
+        i = bisect_right(self.keys, key)
+        self.keys.insert(i, key)
+        self.records.insert(i, record)
+
+    def remove(self, record, key):
+        if key != key:
+            for i, other in enumerate(self.unordered):
+                if other is record:
+                    del self.unordered[i]
+                    return
+        i = bisect_left(self.keys, key)
+        while self.records[i] is not record:
+            i += 1
+        del self.keys[i]
+        del self.records[i]
+
+    def find(self, key):
+        if key != key:
+            return []
+        return self.records[bisect_left(self.keys, key):
+                            bisect_right(self.keys, key)]
+
+    def range(self, low, high, inclusive):
+        keys = self.keys
+        if low is None:
+            start = 0
+        else:
+            start = (bisect_left if inclusive[0] else bisect_right)(keys, low)
+        if high is None:
+            return self.records[start:] + self.unordered
+        stop = (bisect_right if inclusive[1] else bisect_left)(keys, high)
+        return self.records[start:stop]
+
+
+class RecordTable(object):
+    """
+    Set of records of ``record_type`` with indexes on their fields.
+
+    ``unique`` and ``index`` name the fields with a unique and a non-unique
+    hash index, ``ordered`` the fields with a sorted index::
+
+        >>> trades = RecordTable(Trade, unique='id', index='symbol',
+        ...                      ordered='price')
+        >>> trades.extend(records)
+        >>> trades.get('id', 42)
+        >>> trades.find('symbol', 'ACME')
+        >>> trades.range('price', 10.0, 20.0)
+
+    Records stay mutable: setting a field of a record held by the table
+    updates its indexes, and setting a duplicate key of a unique index
+    raises ValueError and leaves the record, and every table holding it,
+    unchanged. ``lookup()`` gives read-only access to the dict behind a hash
+    index for O(1) lookups.
+    """
+
+    def __init__(self, record_type, records=(), unique=(), index=(),
+                 ordered=()):
+        layout = getattr(record_type, '__slotlayout__', None)
+        if layout is None:
+            raise TypeError('%s has no __slotlayout__, declare it with '
+                            'trafaretrecord() or as a TrafaretRecord' %
+                            record_type.__name__)
+
+        self.record_type = record_type
+        self._rows = {}
+        self._indexes = {}
+        self._by_position = {}
+        for kind, names in ((_UniqueIndex, unique), (_HashIndex, index),
+                            (_SortedIndex, ordered)):
+            if isinstance(names, str):
+                names = names.replace(',', ' ').split()
+            for name in names:
+                if name not in record_type._fields:
+                    raise ValueError('%s has no field %r' % (
+                        record_type.__name__, name))
+                if name in self._indexes:
+                    raise ValueError('Field %r is indexed twice' % name)
+                position = record_type._fields.index(name)
+                self._indexes[name] = kind(name, position)
+                self._by_position.setdefault(position, []).append(
+                    self._indexes[name])
+
+        self._layout = layout
+        self._observer = weakref.ref(self, layout.observers.remove)
+        layout.observers.append(self._observer)
+        self.extend(records)
+
+    def __len__(self):
+        return len(self._rows)
+
+    def __iter__(self):
+        return iter(list(self._rows.values()))
+
+    def __contains__(self, record):
+        return self._rows.get(id(record)) is record
+
+    def __repr__(self):
+        return '%s(%s, %d records, indexes=%r)' % (
+            self.__class__.__name__, self.record_type.__name__,
+            len(self._rows), list(self._indexes))
+
+    def add(self, record):
+        'Add ``record``, raise ValueError if it breaks a unique index'
+        if not isinstance(record, self.record_type):
+            raise TypeError('Expected %s, got %s' % (
+                self.record_type.__name__, type(record).__name__))
+        if record in self:
+            return
+        indexes = list(self._indexes.values())
+        for index in indexes:
+            index.check(record, record[index.position])
+        for index in indexes:
+            index.add(record, record[index.position])
+        self._rows[id(record)] = record
+        _watch(record, True)
+
+    def extend(self, records):
+        for record in records:
+            self.add(record)
+
+    def remove(self, record):
+        'Remove ``record``, raise KeyError if it is not in the table'
+        if record not in self:
+            raise KeyError(record)
+        for index in self._indexes.values():
+            index.remove(record, record[index.position])
+        del self._rows[id(record)]
+        if not self._held_elsewhere(record):
+            _watch(record, False)
+
+    def discard(self, record):
+        if record in self:
+            self.remove(record)
+
+    def clear(self):
+        for record in list(self._rows.values()):
+            self.remove(record)
+
+    def _held_elsewhere(self, record):
+        for observer in self._layout.observers:
+            table = observer() if isinstance(observer, weakref.ref) \
+                else observer
+            if table is not None and table is not self and record in table:
+                return True
+        return False
+
+    def _field_check(self, record, position, value):
+        """
+        Called before field ``position`` of a watched record is set, raises
+        if ``value`` breaks an index
+        """
+        indexes = self._by_position.get(position)
+        if indexes is None or record not in self:
+            return
+        for index in indexes:
+            index.check(record, value)
+
+    def _field_changed(self, record, position, value):
+        """
+        Called once every table accepted ``value``, before field
+        ``position`` of a watched record is set
+        """
+        indexes = self._by_position.get(position)
+        if indexes is None or record not in self:
+            return
+        old = record[position]
+        for index in indexes:
+            index.remove(record, old)
+            index.add(record, value)
+
+    def _index(self, name):
+        index = self._indexes.get(name)
+        if index is None:
+            raise KeyError('Field %r of %s is not indexed' % (
+                name, self.record_type.__name__))
+        return index
+
+    def get(self, name, key, default=None):
+        'Return the record with ``key`` in the unique index ``name``'
+        index = self._index(name)
+        if not isinstance(index, _UniqueIndex):
+            raise TypeError('Index on %r is not unique' % name)
+        return index.entries.get(key, default)
+
+    def find(self, name, key):
+        'Return the list of records with ``key`` in the index ``name``'
+        return self._index(name).find(key)
+
+    def range(self, name, low=None, high=None, inclusive=(True, False)):
+        """
+        Return the records whose sorted index ``name`` has keys between
+        ``low`` and ``high``, in key order. A bound of None leaves the range
+        open on that side; ``inclusive`` tells whether each bound is part of
+        the range
+        """
+        index = self._index(name)
+        if not isinstance(index, _SortedIndex):
+            raise TypeError('Index on %r is not sorted' % name)
+        return index.range(low, high, inclusive)
+
+    def lookup(self, name):
+        """
+        Return a read-only mapping view of the hash index ``name``: keys map
+        to records for a unique index, to lists of records otherwise
+        """
+        index = self._index(name)
+        if isinstance(index, _SortedIndex):
+            raise TypeError('Index on %r is sorted, use range()' % name)
+        if isinstance(index, _HashIndex):
+            return _HashIndexView(index.entries)
+        return MappingProxyType(index.entries)